@@ -0,0 +1,926 @@
+//
+//  bench.c
+//  mobileDeviceManager
+//
+//  The benchmark of -o bench for machines with no Xcode and no device: the same
+//  scenarios over the same simulated USB link, but driven straight through the
+//  C pieces under the tool - afc_client against afc_standin for the file
+//  scenarios, and binary plist requests and replies (bplist) over a
+//  service_standin playing installation_proxy for browse.  It needs nothing but
+//  a C compiler and pthreads, so CI can check it against a committed baseline:
+//
+//      make bench              run it against Bench/baseline.json
+//      build/bench [-scenarios storm,stream,tree,browse] [-latency MS] [-bandwidth MB/s]
+//                  [-scale N] [-connections N] [-window N] [-blocksize N]
+//                  [-save FILE] [-baseline FILE] [-tolerance PCT] [-work DIR] [-keep YES]
+//
+//  The options mean what they do to -o bench, and the results are saved and
+//  compared the same way (see bench_results.h).  The exit status is 1 if a
+//  scenario failed or a case regressed, 1001 for bad arguments.
+//
+
+#include "afc_client.h"
+#include "afc_protocol.h"
+#include "afc_standin.h"
+#include "bench_results.h"
+#include "bplist.h"
+#include "service_standin.h"
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define COPY_BUFFER		(4*1024*1024)
+#define BROWSE_SLAB		20			// applications per reply, as the device sends
+
+#pragma mark arguments
+
+static int nargs;
+static const char **args;
+
+// The value given with -name, or NULL
+static const char *arg(const char *name)
+{
+	int i;
+	for (i = 1; i + 1 < nargs; i += 2) {
+		if (args[i][0] == '-' && strcmp(args[i] + 1, name) == 0) return args[i + 1];
+	}
+	return NULL;
+}
+
+static double arg_double(const char *name, double otherwise)
+{
+	const char *v = arg(name);
+	return v ? atof(v) : otherwise;
+}
+
+static int arg_bool(const char *name)
+{
+	const char *v = arg(name);
+	return v && (strcmp(v, "YES") == 0 || strcmp(v, "yes") == 0 || strcmp(v, "1") == 0);
+}
+
+#pragma mark files
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// the same sequence as -o bench, so both move the same bytes
+static uint32_t bench_random(uint32_t *state)
+{
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+static int write_file(const char *path, uint64_t size, uint32_t *seed)
+{
+	FILE *f = fopen(path, "wb");
+	if (!f) return 0;
+	uint32_t block[16384];
+	int ok = 1;
+	while (size && ok) {
+		size_t n = size < sizeof(block) ? (size_t)size : sizeof(block), i;
+		for (i = 0; i < (n + 3) / 4; i++) block[i] = bench_random(seed);
+		ok = (fwrite(block, 1, n, f) == n);
+		size -= n;
+	}
+	if (fclose(f) != 0) ok = 0;
+	return ok;
+}
+
+// As bench_make_tree() in main.m: depth levels of fanout subdirectories, with
+// files files of up to size bytes in every one.  Returns the entries made, or -1.
+static long make_tree(const char *dir, unsigned depth, unsigned fanout, unsigned files, uint64_t size, uint32_t *seed)
+{
+	char path[PATH_MAX];
+	long entries = 0;
+	unsigned i;
+	if (mkdir(dir, 0755) != 0 && errno != EEXIST) return -1;
+	for (i = 0; i < files; i++) {
+		uint64_t n = size ? bench_random(seed) % size + 1 : 0;
+		snprintf(path, sizeof(path), "%s/file%03u.dat", dir, i);
+		if (!write_file(path, n, seed)) return -1;
+		entries++;
+	}
+	if (depth == 0) return entries;
+	for (i = 0; i < fanout; i++) {
+		snprintf(path, sizeof(path), "%s/dir%02u", dir, i);
+		long n = make_tree(path, depth - 1, fanout, files, size, seed);
+		if (n < 0) return -1;
+		entries += n + 1;
+	}
+	return entries;
+}
+
+static int same_file(const char *a, const char *b)
+{
+	FILE *fa = fopen(a, "rb"), *fb = fopen(b, "rb");
+	int same = fa && fb;
+	char ba[65536], bb[65536];
+	while (same) {
+		size_t na = fread(ba, 1, sizeof(ba), fa), nb = fread(bb, 1, sizeof(bb), fb);
+		if (na != nb || memcmp(ba, bb, na) != 0) same = 0;
+		if (na == 0) break;
+	}
+	if (fa) fclose(fa);
+	if (fb) fclose(fb);
+	return same;
+}
+
+// Every entry of a is in b, with the same contents, and b has no more of them
+static int same_tree(const char *a, const char *b)
+{
+	char pa[PATH_MAX], pb[PATH_MAX];
+	struct dirent *e;
+	struct stat sa, sb;
+	long count = 0, others = 0;
+	int same = 1;
+	DIR *d = opendir(a);
+	if (!d) return 0;
+	while (same && (e = readdir(d))) {
+		if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) continue;
+		snprintf(pa, sizeof(pa), "%s/%s", a, e->d_name);
+		snprintf(pb, sizeof(pb), "%s/%s", b, e->d_name);
+		if (stat(pa, &sa) != 0 || stat(pb, &sb) != 0 || S_ISDIR(sa.st_mode) != S_ISDIR(sb.st_mode)) same = 0;
+		else if (S_ISDIR(sa.st_mode)) same = same_tree(pa, pb);
+		else same = sa.st_size == sb.st_size && same_file(pa, pb);
+		count++;
+	}
+	closedir(d);
+	if (!same || !(d = opendir(b))) return 0;
+	while ((e = readdir(d))) {
+		if (strcmp(e->d_name, ".") != 0 && strcmp(e->d_name, "..") != 0) others++;
+	}
+	closedir(d);
+	return count == others;
+}
+
+static void remove_tree(const char *path)
+{
+	char sub[PATH_MAX];
+	struct dirent *e;
+	struct stat st;
+	DIR *d;
+	if (lstat(path, &st) != 0) return;
+	if (S_ISDIR(st.st_mode) && (d = opendir(path))) {
+		while ((e = readdir(d))) {
+			if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) continue;
+			snprintf(sub, sizeof(sub), "%s/%s", path, e->d_name);
+			remove_tree(sub);
+		}
+		closedir(d);
+	}
+	remove(path);
+}
+
+#pragma mark AFC
+
+typedef struct link {
+	afc_standin		*server;
+	afc_client		*client;
+} link_t;
+
+static unsigned latency_us, bandwidth;
+static uint32_t blocksize;
+static unsigned window;
+
+// A connection to a stand-in serving root over the simulated link
+static int open_link(const char *root, link_t *l)
+{
+	int fd;
+	if (afc_standin_start(root, latency_us, &l->server, &fd) != 0) return 0;
+	afc_standin_set_bandwidth(l->server, bandwidth);
+	if (afc_client_open(fd, &l->client) != 0) {
+		afc_standin_stop(l->server);
+		return 0;
+	}
+	if (blocksize || window) afc_client_set_pipeline(l->client, blocksize, window);
+	return 1;
+}
+
+static uint64_t close_link(link_t *l)
+{
+	uint64_t requests = afc_standin_requests(l->server);
+	afc_client_close(l->client);
+	afc_standin_stop(l->server);
+	return requests;
+}
+
+// Whether the alternating keys and values of an info list describe a
+// directory, and the size they give
+static void read_info(afc_client_list *list, int *isdir, uint64_t *size)
+{
+	const char *k, *v;
+	*isdir = 0;
+	*size = 0;
+	while ((k = afc_client_list_next(list)) && (v = afc_client_list_next(list))) {
+		if (strcmp(k, "st_ifmt") == 0) *isdir = strcmp(v, "S_IFDIR") == 0;
+		else if (strcmp(k, "st_size") == 0) *size = strtoull(v, NULL, 10);
+	}
+}
+
+// What a copy works through: the files, relative to both roots, and the
+// directories which have to exist first
+typedef struct entries {
+	char		**paths;
+	int			*isdir;
+	uint64_t	*sizes;
+	size_t		count, cap;
+} entries;
+
+static int add_entry(entries *e, const char *path, int isdir, uint64_t size)
+{
+	if (e->count == e->cap) {
+		size_t cap = e->cap ? e->cap * 2 : 256;
+		char **paths = realloc(e->paths, cap * sizeof(*paths));
+		if (paths) e->paths = paths;
+		int *dirs = realloc(e->isdir, cap * sizeof(*dirs));
+		if (dirs) e->isdir = dirs;
+		uint64_t *sizes = realloc(e->sizes, cap * sizeof(*sizes));
+		if (sizes) e->sizes = sizes;
+		if (!paths || !dirs || !sizes) return 0;
+		e->cap = cap;
+	}
+	if (!(e->paths[e->count] = strdup(path))) return 0;
+	e->isdir[e->count] = isdir;
+	e->sizes[e->count++] = size;
+	return 1;
+}
+
+static void free_entries(entries *e)
+{
+	size_t i;
+	for (i = 0; i < e->count; i++) free(e->paths[i]);
+	free(e->paths);
+	free(e->isdir);
+	free(e->sizes);
+}
+
+// The entries under local/rel, parents before children
+static int list_local(const char *local, const char *rel, entries *e)
+{
+	char path[PATH_MAX], sub[PATH_MAX];
+	struct dirent *d;
+	struct stat st;
+	int ok = 1;
+	snprintf(path, sizeof(path), "%s%s", local, rel);
+	DIR *dir = opendir(path);
+	if (!dir) return 0;
+	while (ok && (d = readdir(dir))) {
+		if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0) continue;
+		snprintf(sub, sizeof(sub), "%s/%s", rel, d->d_name);
+		snprintf(path, sizeof(path), "%s%s", local, sub);
+		if (stat(path, &st) != 0) ok = 0;
+		else if (!add_entry(e, sub, S_ISDIR(st.st_mode), (uint64_t)st.st_size)) ok = 0;
+		else if (S_ISDIR(st.st_mode)) ok = list_local(local, sub, e);
+	}
+	closedir(dir);
+	return ok;
+}
+
+// The entries under remote/rel on the device, as the tool's pull finds them
+static int list_remote(afc_client *c, const char *remote, const char *rel, entries *e)
+{
+	char path[PATH_MAX], sub[PATH_MAX];
+	afc_client_list *list, *info;
+	const char *name;
+	int ok = 1;
+	snprintf(path, sizeof(path), "%s%s", remote, rel);
+	if (afc_client_read_dir(c, path, &list) != 0) return 0;
+	while (ok && (name = afc_client_list_next(list))) {
+		if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+		snprintf(sub, sizeof(sub), "%s/%s", rel, name);
+		snprintf(path, sizeof(path), "%s%s", remote, sub);
+		if (afc_client_file_info(c, path, &info) != 0) {
+			ok = 0;
+			break;
+		}
+		int isdir;
+		uint64_t size;
+		read_info(info, &isdir, &size);
+		afc_client_list_free(info);
+		ok = add_entry(e, sub, isdir, size) && (!isdir || list_remote(c, remote, sub, e));
+	}
+	afc_client_list_free(list);
+	return ok;
+}
+
+typedef struct copy {
+	int				pull;
+	const char		*local, *remote;
+	entries			*work;
+	size_t			next;				// the next entry to take, shared by the threads
+	pthread_mutex_t	lock;
+	uint64_t		bytes, files;
+	int				failed;
+} copy_t;
+
+typedef struct copier {
+	copy_t			*copy;
+	link_t			link;
+	pthread_t		thread;
+} copier;
+
+static int push_file(afc_client *c, const char *from, const char *to, char *buf, uint64_t *bytes)
+{
+	uint64_t ref;
+	FILE *f = fopen(from, "rb");
+	int ok = f && afc_client_file_open(c, to, AFC_FOPEN_WRONLY, &ref) == 0;
+	if (!ok) {
+		if (f) fclose(f);
+		return 0;
+	}
+	size_t n;
+	while (ok && (n = fread(buf, 1, COPY_BUFFER, f)) > 0) {
+		ok = afc_client_file_write(c, ref, buf, n) == 0;
+		*bytes += n;
+	}
+	if (ferror(f)) ok = 0;
+	fclose(f);
+	if (afc_client_file_close(c, ref) != 0) ok = 0;
+	return ok;
+}
+
+// Reads ask for no more than the listing said is left, rather than for a whole
+// buffer, so a small file isn't answered with a window full of empty reads
+static int pull_file(afc_client *c, const char *from, const char *to, uint64_t size, char *buf, uint64_t *bytes)
+{
+	uint64_t ref;
+	if (afc_client_file_open(c, from, AFC_FOPEN_RDONLY, &ref) != 0) return 0;
+	FILE *f = fopen(to, "wb");
+	int ok = (f != NULL);
+	while (ok && size) {
+		uint64_t n = size < COPY_BUFFER ? size : COPY_BUFFER;
+		if (afc_client_file_read(c, ref, buf, &n) != 0) ok = 0;
+		else if (n == 0) break;
+		else ok = fwrite(buf, 1, (size_t)n, f) == n;
+		*bytes += n;
+		size -= n;
+	}
+	if (f && fclose(f) != 0) ok = 0;
+	if (afc_client_file_close(c, ref) != 0) ok = 0;
+	return ok;
+}
+
+// Take files off the shared list until it is empty
+static void *copy_files(void *arg)
+{
+	copier *me = arg;
+	copy_t *copy = me->copy;
+	char from[PATH_MAX], to[PATH_MAX];
+	uint64_t bytes = 0, files = 0;
+	int ok = 1;
+	char *buf = malloc(COPY_BUFFER);
+	if (!buf) ok = 0;
+	while (ok) {
+		pthread_mutex_lock(&copy->lock);
+		while (copy->next < copy->work->count && copy->work->isdir[copy->next]) copy->next++;
+		size_t i = copy->next < copy->work->count && !copy->failed ? copy->next++ : copy->work->count;
+		pthread_mutex_unlock(&copy->lock);
+		if (i == copy->work->count) break;
+
+		const char *rel = copy->work->paths[i];
+		snprintf(from, sizeof(from), "%s%s", copy->pull ? copy->remote : copy->local, rel);
+		snprintf(to, sizeof(to), "%s%s", copy->pull ? copy->local : copy->remote, rel);
+		ok = copy->pull ? pull_file(me->link.client, from, to, copy->work->sizes[i], buf, &bytes)
+						: push_file(me->link.client, from, to, buf, &bytes);
+		if (!ok) fprintf(stderr, "Can't copy %s to %s\n", from, to);
+		files++;
+	}
+	free(buf);
+	pthread_mutex_lock(&copy->lock);
+	copy->bytes += bytes;
+	copy->files += files;
+	if (!ok) copy->failed = 1;
+	pthread_mutex_unlock(&copy->lock);
+	return NULL;
+}
+
+// Push local/name into remote "/" (or, with pull, remote /name into local) over
+// connections stand-ins serving root, as -o push/pull -connections N do - the
+// listing and directories on the first connection, then the files spread over
+// all of them.  Adds the case to results.
+static int transfer(int pull, const char *root, const char *local, const char *name, unsigned connections,
+					const char *label, bench_results *results)
+{
+	char remote[PATH_MAX], path[PATH_MAX];
+	entries work;
+	copy_t copy;
+	copier *copiers = calloc(connections, sizeof(copier));
+	unsigned i, opened = 0;
+	uint64_t requests = 0;
+	size_t k;
+	int ok = (copiers != NULL);
+
+	memset(&work, 0, sizeof(work));
+	memset(&copy, 0, sizeof(copy));
+	snprintf(remote, sizeof(remote), "/%s", name);
+	pthread_mutex_init(&copy.lock, NULL);
+	copy.pull = pull;
+	copy.local = local;
+	copy.remote = remote;
+	copy.work = &work;
+
+	double started = now();
+	for (i = 0; ok && i < connections; i++) {
+		copiers[i].copy = &copy;
+		ok = open_link(root, &copiers[i].link);
+		if (ok) opened++;
+	}
+	if (ok) {
+		afc_client *first = copiers[0].link.client;
+		if (pull) {
+			ok = list_remote(first, remote, "", &work) && (mkdir(local, 0755) == 0 || errno == EEXIST);
+			for (k = 0; ok && k < work.count; k++) {
+				if (!work.isdir[k]) continue;
+				snprintf(path, sizeof(path), "%s%s", local, work.paths[k]);
+				ok = mkdir(path, 0755) == 0 || errno == EEXIST;
+			}
+		} else {
+			int rc = afc_client_make_dir(first, remote);
+			ok = (rc == 0 || rc == AFC_E_OBJECT_EXISTS) && list_local(local, "", &work);
+			for (k = 0; ok && k < work.count; k++) {
+				if (!work.isdir[k]) continue;
+				snprintf(path, sizeof(path), "%s%s", remote, work.paths[k]);
+				rc = afc_client_make_dir(first, path);
+				ok = rc == 0 || rc == AFC_E_OBJECT_EXISTS;
+			}
+		}
+	}
+	if (ok) {
+		unsigned started_threads = 0;
+		for (i = 0; i < connections; i++) {
+			if (pthread_create(&copiers[i].thread, NULL, copy_files, &copiers[i]) != 0) break;
+			started_threads++;
+		}
+		if (started_threads == 0) copy_files(&copiers[0]);
+		for (i = 0; i < started_threads; i++) pthread_join(copiers[i].thread, NULL);
+		ok = !copy.failed;
+	}
+	double elapsed = now() - started;
+	for (i = 0; i < opened; i++) requests += close_link(&copiers[i].link);
+
+	if (ok) bench_results_add(results, label, elapsed, requests, copy.bytes, copy.files);
+	else fprintf(stderr, "%s failed\n", label);
+	pthread_mutex_destroy(&copy.lock);
+	free_entries(&work);
+	free(copiers);
+	return ok;
+}
+
+// Every entry under path with its info, as -o listFiles -recursive -stat does
+static int walk(afc_client *c, const char *path, uint64_t *seen)
+{
+	char sub[PATH_MAX];
+	afc_client_list *list, *info;
+	const char *name;
+	int ok = 1;
+	if (afc_client_read_dir(c, path, &list) != 0) return 0;
+	while (ok && (name = afc_client_list_next(list))) {
+		int isdir;
+		uint64_t size;
+		if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+		snprintf(sub, sizeof(sub), "%s/%s", path, name);
+		if (afc_client_file_info(c, sub, &info) != 0) {
+			ok = 0;
+			break;
+		}
+		read_info(info, &isdir, &size);
+		afc_client_list_free(info);
+		(*seen)++;
+		if (isdir) ok = walk(c, sub, seen);
+	}
+	afc_client_list_free(list);
+	return ok;
+}
+
+#pragma mark installation_proxy
+
+static bplist_node *string(bplist_arena *a, const char *format, ...)
+{
+	char buf[256];
+	va_list ap;
+	va_start(ap, format);
+	int n = vsnprintf(buf, sizeof(buf), format, ap);
+	va_end(ap);
+	if (n < 0) return NULL;
+	return bplist_new_string(a, buf, (size_t)n < sizeof(buf) ? (size_t)n : sizeof(buf) - 1);
+}
+
+static void set(bplist_node *dict, size_t i, bplist_arena *a, const char *key, bplist_node *value)
+{
+	dict->v.items[i] = bplist_new_string(a, key, strlen(key));
+	dict->v.items[dict->count + i] = value;
+}
+
+static bplist_node *strings(bplist_arena *a, size_t n, const char **values)
+{
+	bplist_node *array = bplist_new_container(a, BPLIST_ARRAY, n);
+	size_t i;
+	for (i = 0; array && i < n; i++) array->v.items[i] = bplist_new_string(a, values[i], strlen(values[i]));
+	return array;
+}
+
+// The Info.plists of bench_applications() in main.m: about the size and shape a
+// device sends, a quarter of them System applications
+static bplist_node **make_applications(bplist_arena *a, size_t count)
+{
+	static const char *orientations[] = { "UIInterfaceOrientationPortrait", "UIInterfaceOrientationLandscapeLeft",
+										  "UIInterfaceOrientationLandscapeRight" };
+	static const char *armv7[] = { "armv7" };
+	bplist_node **apps = bplist_alloc(a, count * sizeof(*apps));
+	size_t i, k;
+	if (!apps) return NULL;
+	for (i = 0; i < count; i++) {
+		char bundle[64], container[128];
+		snprintf(bundle, sizeof(bundle), "com.example.bench%04zu", i);
+		snprintf(container, sizeof(container), "/private/var/mobile/Applications/%08lX-BE9C-4E1A-8D3F-%012lX",
+				 (unsigned long)(i * 2654435761u), (unsigned long)i);
+
+		bplist_node *icons = bplist_new_container(a, BPLIST_ARRAY, 8);
+		bplist_node *groups = bplist_new_container(a, BPLIST_ARRAY, 8);
+		for (k = 0; k < 8; k++) {
+			icons->v.items[k] = string(a, "Icon-%zu@2x.png", k * 16 + 29);
+			groups->v.items[k] = string(a, "ABCDE12345.%s.group%zu", bundle, k);
+		}
+		bplist_node *no = bplist_new(a, BPLIST_BOOL);
+		bplist_node *entitlements = bplist_new_container(a, BPLIST_DICT, 3);
+		set(entitlements, 0, a, "application-identifier", string(a, "ABCDE12345.%s", bundle));
+		set(entitlements, 1, a, "keychain-access-groups", groups);
+		set(entitlements, 2, a, "get-task-allow", no);
+		bplist_node *scheme = string(a, "bench%zu", i);
+		bplist_node *urlType = bplist_new_container(a, BPLIST_DICT, 2);
+		set(urlType, 0, a, "CFBundleURLName", string(a, "%s", bundle));
+		set(urlType, 1, a, "CFBundleURLSchemes", strings(a, 1, &scheme->v.string));
+		bplist_node *urlTypes = bplist_new_container(a, BPLIST_ARRAY, 1);
+		urlTypes->v.items[0] = urlType;
+		bplist_node *families = bplist_new_container(a, BPLIST_ARRAY, 2);
+		families->v.items[0] = bplist_new_int(a, 1);
+		families->v.items[1] = bplist_new_int(a, 2);
+
+		bplist_node *app = bplist_new_container(a, BPLIST_DICT, 20);
+		set(app, 0, a, "CFBundleIdentifier", string(a, "%s", bundle));
+		set(app, 1, a, "CFBundleDisplayName", string(a, "Bench %zu", i));
+		set(app, 2, a, "CFBundleName", string(a, "Bench %zu", i));
+		set(app, 3, a, "CFBundleExecutable", string(a, "Bench"));
+		set(app, 4, a, "CFBundleVersion", string(a, "1.%zu", i));
+		set(app, 5, a, "CFBundleShortVersionString", string(a, "1.0"));
+		set(app, 6, a, "ApplicationType", string(a, i % 4 == 0 ? "System" : "User"));
+		set(app, 7, a, "Container", string(a, "%s", container));
+		set(app, 8, a, "Path", string(a, "%s/Bench.app", container));
+		set(app, 9, a, "CFBundleIconFiles", icons);
+		set(app, 10, a, "Entitlements", entitlements);
+		set(app, 11, a, "CFBundleURLTypes", urlTypes);
+		set(app, 12, a, "UIDeviceFamily", families);
+		set(app, 13, a, "UIRequiredDeviceCapabilities", strings(a, 1, armv7));
+		set(app, 14, a, "UISupportedInterfaceOrientations", strings(a, 3, orientations));
+		set(app, 15, a, "NSMainNibFile", string(a, "MainWindow"));
+		set(app, 16, a, "CFBundleDevelopmentRegion", string(a, "en"));
+		set(app, 17, a, "CFBundlePackageType", string(a, "APPL"));
+		set(app, 18, a, "DTPlatformName", string(a, "iPhoneOS"));
+		set(app, 19, a, "MinimumOSVersion", string(a, "4.3"));
+		apps[i] = app;
+	}
+	return apps;
+}
+
+typedef struct proxy {
+	bplist_node		**apps;
+	size_t			count;
+} proxy_t;
+
+static int reply(service_standin *server, const bplist_node *plist)
+{
+	uint8_t *out;
+	size_t len;
+	if (!plist || bplist_encode(plist, &out, &len) != 0) return 0;
+	int ok = service_standin_reply(server, out, len);
+	free(out);
+	return ok;
+}
+
+// service_standin handler answering Browse as AMInstallationProxyStandIn does:
+// the applications of the type asked for, cut down to ReturnAttributes, in
+// slabs of 20 and then a Status of Complete
+static int proxy_handler(void *ctx, service_standin *server, const void *msg, size_t len)
+{
+	proxy_t *proxy = ctx;
+	bplist_arena a = { NULL };
+	int ok = 0;
+	const bplist_node *request = bplist_decode(msg, len, &a);
+	const bplist_node *command = bplist_dict_get(request, "Command");
+	if (!command || command->type != BPLIST_STRING || strcmp(command->v.string, "Browse") != 0) {
+		bplist_node *error = bplist_new_container(&a, BPLIST_DICT, 1);
+		set(error, 0, &a, "Error", string(&a, "UnknownCommand"));
+		ok = request && reply(server, error);
+		bplist_arena_free(&a);
+		return ok;
+	}
+	const bplist_node *options = bplist_dict_get(request, "ClientOptions");
+	const bplist_node *type = bplist_dict_get(options, "ApplicationType");
+	const bplist_node *keys = bplist_dict_get(options, "ReturnAttributes");
+	if (type && (type->type != BPLIST_STRING || strcmp(type->v.string, "Any") == 0)) type = NULL;
+	if (keys && keys->type != BPLIST_ARRAY) keys = NULL;
+
+	bplist_node **matches = bplist_alloc(&a, (proxy->count + 1) * sizeof(*matches));
+	size_t total = 0, i, k;
+	ok = (matches != NULL);
+	for (i = 0; ok && i < proxy->count; i++) {
+		bplist_node *app = proxy->apps[i];
+		const bplist_node *t = bplist_dict_get(app, "ApplicationType");
+		if (type && (!t || strcmp(t->v.string, type->v.string) != 0)) continue;
+		if (keys) {
+			bplist_node *projected = bplist_new_container(&a, BPLIST_DICT, keys->count);
+			size_t n = 0;
+			if (!projected) {
+				ok = 0;
+				break;
+			}
+			for (k = 0; k < keys->count; k++) {
+				const bplist_node *key = keys->v.items[k];
+				const bplist_node *value = key->type == BPLIST_STRING ? bplist_dict_get(app, key->v.string) : NULL;
+				if (!value) continue;
+				projected->v.items[n] = (bplist_node*)key;
+				projected->v.items[keys->count + n] = (bplist_node*)value;
+				n++;
+			}
+			// close up the values behind the keys actually found
+			memmove(projected->v.items + n, projected->v.items + keys->count, n * sizeof(bplist_node*));
+			projected->count = n;
+			app = projected;
+		}
+		matches[total++] = app;
+	}
+	for (i = 0; ok && i < total; i += BROWSE_SLAB) {
+		size_t n = total - i < BROWSE_SLAB ? total - i : BROWSE_SLAB;
+		bplist_node *list = bplist_new_container(&a, BPLIST_ARRAY, n);
+		bplist_node *slab = bplist_new_container(&a, BPLIST_DICT, 5);
+		if (!list || !slab) {
+			ok = 0;
+			break;
+		}
+		memcpy(list->v.items, matches + i, n * sizeof(*matches));
+		set(slab, 0, &a, "Status", string(&a, "BrowsingApplications"));
+		set(slab, 1, &a, "CurrentList", list);
+		set(slab, 2, &a, "CurrentIndex", bplist_new_int(&a, (int64_t)i));
+		set(slab, 3, &a, "CurrentAmount", bplist_new_int(&a, (int64_t)n));
+		set(slab, 4, &a, "Total", bplist_new_int(&a, (int64_t)total));
+		ok = reply(server, slab);
+	}
+	if (ok) {
+		bplist_node *done = bplist_new_container(&a, BPLIST_DICT, 1);
+		set(done, 0, &a, "Status", string(&a, "Complete"));
+		ok = reply(server, done);
+	}
+	bplist_arena_free(&a);
+	return ok;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	while (len) {
+		ssize_t n = write(fd, p, len);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return 0;
+		p += n;
+		len -= n;
+	}
+	return 1;
+}
+
+static int read_all(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	while (len) {
+		ssize_t n = read(fd, p, len);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return 0;
+		p += n;
+		len -= n;
+	}
+	return 1;
+}
+
+// Browse every application (or with attributes, just those keys), counting
+// what arrives as AMInstallationProxy's browse does
+static int browse(const proxy_t *apps, const char **attributes, size_t nattributes, const char *label,
+				  bench_results *results)
+{
+	service_standin *server;
+	bplist_arena a = { NULL };
+	uint8_t *msg = NULL;
+	size_t len;
+	uint64_t seen = 0;
+	int fd, ok, complete = 0;
+
+	if (service_standin_start(proxy_handler, (void*)apps, latency_us, &server, &fd) != 0) return 0;
+	service_standin_set_bandwidth(server, bandwidth);
+
+	bplist_node *options = bplist_new_container(&a, BPLIST_DICT, attributes ? 2 : 1);
+	set(options, 0, &a, "ApplicationType", string(&a, "Any"));
+	if (attributes) set(options, 1, &a, "ReturnAttributes", strings(&a, nattributes, attributes));
+	bplist_node *request = bplist_new_container(&a, BPLIST_DICT, 2);
+	set(request, 0, &a, "Command", string(&a, "Browse"));
+	set(request, 1, &a, "ClientOptions", options);
+
+	double started = now();
+	ok = bplist_encode(request, &msg, &len) == 0;
+	uint32_t size = htonl((uint32_t)len);
+	ok = ok && write_all(fd, &size, sizeof(size)) && write_all(fd, msg, len);
+	while (ok && !complete) {
+		bplist_arena r = { NULL };
+		if (!read_all(fd, &size, sizeof(size))) {
+			ok = 0;
+			break;
+		}
+		size = ntohl(size);
+		uint8_t *body = malloc(size ? size : 1);
+		ok = body && read_all(fd, body, size);
+		const bplist_node *slab = ok ? bplist_decode(body, size, &r) : NULL;
+		const bplist_node *status = bplist_dict_get(slab, "Status");
+		const bplist_node *list = bplist_dict_get(slab, "CurrentList");
+		if (!status || status->type != BPLIST_STRING) ok = 0;
+		else if (strcmp(status->v.string, "Complete") == 0) complete = 1;
+		else if (strcmp(status->v.string, "BrowsingApplications") != 0) ok = 0;
+		if (ok && list && list->type == BPLIST_ARRAY) seen += list->count;
+		bplist_arena_free(&r);
+		free(body);
+	}
+	double elapsed = now() - started;
+	free(msg);
+	bplist_arena_free(&a);
+	close(fd);
+	uint64_t requests = service_standin_requests(server);
+	service_standin_stop(server);
+
+	if (ok && seen != apps->count) {
+		fprintf(stderr, "%s saw %llu applications, not %zu\n", label, (unsigned long long)seen, apps->count);
+		ok = 0;
+	}
+	if (ok) bench_results_add(results, label, elapsed, requests, 0, seen);
+	else fprintf(stderr, "%s failed\n", label);
+	return ok;
+}
+
+#pragma mark main
+
+int main(int argc, const char *argv[])
+{
+	nargs = argc;
+	args = argv;
+	double latency = arg_double("latency", 1.0) / 1000.0;
+	double mbs = arg_double("bandwidth", 30.0);
+	double scale = arg_double("scale", 1.0);
+	double tolerance = arg_double("tolerance", 10.0) / 100.0;
+	int connections = (int)arg_double("connections", 1);
+	const char *scenarioList = arg("scenarios");
+	const char *baselineFile = arg("baseline");
+	const char *save = arg("save");
+	bench_results results, baseline;
+	// sized so that every path made from work fits
+	char list[256], work[PATH_MAX / 2], device[PATH_MAX / 2 + 16], local[PATH_MAX / 2 + 16], pulled[PATH_MAX / 2 + 16];
+	char path[PATH_MAX];
+	int status = 0;
+	uint32_t seed = 2463534242u;
+
+	if (argc % 2 == 0) {
+		fprintf(stderr, "usage: %s [-scenarios storm,stream,tree,browse] [-latency MS] [-bandwidth MB/s] [-scale N]\n"
+				"       [-connections N] [-window N] [-blocksize N] [-save FILE] [-baseline FILE] [-tolerance PCT]\n"
+				"       [-work DIR] [-keep YES]\n", argv[0]);
+		return 1001;
+	}
+	if (scale <= 0) {
+		fprintf(stderr, "-scale must be more than 0\n");
+		return 1001;
+	}
+	if (connections < 1) connections = 1;
+	latency_us = (unsigned)(latency * 1e6);
+	bandwidth = (unsigned)(mbs * 1e6);
+	window = (unsigned)arg_double("window", 0);
+	blocksize = (uint32_t)arg_double("blocksize", 0);
+
+	if (baselineFile) {
+		int rc = bench_results_load(baselineFile, &baseline);
+		if (rc != 0) {
+			fprintf(stderr, "Can't read the baseline %s: %s\n", baselineFile,
+					rc == EINVAL ? "not a bench results file" : strerror(rc));
+			return 1001;
+		}
+	}
+	memset(&results, 0, sizeof(results));
+	strcpy(results.driver, "bench");
+	results.latency_ms = latency * 1000.0;
+	results.bandwidth_mbs = mbs;
+	results.scale = scale;
+	results.connections = (unsigned)connections;
+	if (baselineFile && !bench_results_comparable(&baseline, &results)) {
+		fprintf(stderr, "The baseline was run by %s with %gms latency, %gMB/s, scale %g and %u connections, not by %s "
+				"with %gms, %gMB/s, scale %g and %u - the comparison means little\n", baseline.driver,
+				baseline.latency_ms, baseline.bandwidth_mbs, baseline.scale, baseline.connections, results.driver,
+				results.latency_ms, results.bandwidth_mbs, results.scale, results.connections);
+	}
+
+	// device/ is what the stand-ins serve, local/ this end
+	const char *tmp = arg("work") ? arg("work") : getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+	snprintf(work, sizeof(work), "%s/mobileDeviceManager-bench-%d", tmp, (int)getpid());
+	snprintf(device, sizeof(device), "%s/device", work);
+	snprintf(local, sizeof(local), "%s/local", work);
+	snprintf(pulled, sizeof(pulled), "%s/pulled", work);
+	remove_tree(work);
+	if (mkdir(work, 0755) != 0 || mkdir(device, 0755) != 0 || mkdir(local, 0755) != 0) {
+		fprintf(stderr, "Can't create %s: %s\n", work, strerror(errno));
+		return 1;
+	}
+
+	snprintf(list, sizeof(list), "%s", scenarioList ? scenarioList : "storm,stream,tree,browse");
+	char *save_ptr = NULL, *scenario;
+	for (scenario = strtok_r(list, ",", &save_ptr); scenario; scenario = strtok_r(NULL, ",", &save_ptr)) {
+		int ok;
+		char from[PATH_MAX / 2 + 32], to[PATH_MAX / 2 + 32];
+		if (strcmp(scenario, "storm") == 0) {
+			// lots of small files, where the time goes on round trips
+			snprintf(from, sizeof(from), "%s/storm", local);
+			snprintf(to, sizeof(to), "%s/storm", device);
+			ok = make_tree(from, 1, 20, (unsigned)(50 * scale) + 1, 8192, &seed) >= 0 &&
+				 transfer(0, device, from, "storm", connections, "storm.push", &results) &&
+				 transfer(1, device, pulled, "storm", connections, "storm.pull", &results) &&
+				 same_tree(from, to) && same_tree(from, pulled);
+		} else if (strcmp(scenario, "stream") == 0) {
+			// one big file, where the time goes on the bandwidth
+			snprintf(from, sizeof(from), "%s/stream", local);
+			snprintf(path, sizeof(path), "%s/stream.dat", from);
+			ok = mkdir(from, 0755) == 0 && write_file(path, (uint64_t)(64 * 1024 * 1024 * scale), &seed) &&
+				 transfer(0, device, from, "stream", connections, "stream.push", &results) &&
+				 transfer(1, device, pulled, "stream", connections, "stream.pull", &results) &&
+				 same_tree(from, pulled);
+		} else if (strcmp(scenario, "tree") == 0) {
+			// a deep tree of empty files, listed with their sizes
+			unsigned depth = scale >= 1 ? 5 + (unsigned)log2(scale) : 4;
+			snprintf(path, sizeof(path), "%s/tree", device);
+			long entries = make_tree(path, depth, 3, 4, 0, &seed);
+			link_t l;
+			uint64_t seen = 0;
+			ok = entries >= 0 && open_link(device, &l);
+			if (ok) {
+				double started = now();
+				ok = walk(l.client, "/tree", &seen);
+				double elapsed = now() - started;
+				uint64_t requests = close_link(&l);
+				if (ok) bench_results_add(&results, "tree.walk", elapsed, requests, 0, seen);
+			}
+			if (ok && seen != (uint64_t)entries) {
+				fprintf(stderr, "tree.walk saw %llu entries, not %ld\n", (unsigned long long)seen, entries);
+				ok = 0;
+			}
+		} else if (strcmp(scenario, "browse") == 0) {
+			// every application, then just the versions, as -o list [-attributes] does
+			static const char *attributes[] = { "CFBundleIdentifier", "CFBundleDisplayName", "CFBundleName",
+												"CFBundleExecutable", "CFBundleVersion" };
+			bplist_arena a = { NULL };
+			proxy_t apps;
+			apps.count = (size_t)(300 * scale) + 1;
+			apps.apps = make_applications(&a, apps.count);
+			ok = apps.apps && browse(&apps, NULL, 0, "browse.full", &results) &&
+				 browse(&apps, attributes, sizeof(attributes) / sizeof(attributes[0]), "browse.projected", &results);
+			bplist_arena_free(&a);
+		} else {
+			fprintf(stderr, "Unknown scenario %s - use storm, stream, tree or browse\n", scenario);
+			status = 1001;
+			break;
+		}
+		if (!ok) {
+			fprintf(stderr, "%s failed\n", scenario);
+			status = 1;
+		}
+		remove_tree(pulled);
+	}
+
+	if (bench_results_report(stdout, &results, baselineFile ? &baseline : NULL, tolerance) && status == 0) status = 1;
+	if (save && status != 1001) {
+		int rc = bench_results_save(&results, save);
+		if (rc != 0) {
+			fprintf(stderr, "Can't write %s: %s\n", save, strerror(rc));
+			status = 1;
+		}
+	}
+	if (!arg_bool("keep")) remove_tree(work);
+	return status;
+}
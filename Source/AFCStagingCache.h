@@ -0,0 +1,70 @@
+//
+//  AFCStagingCache.h
+//  mobileDeviceManager
+//
+//  Keeps packages staged on the device up to date without sending what is
+//  already there.
+//
+
+#import <Foundation/Foundation.h>
+#import "MobileDeviceAccess.h"
+
+/// This class copies packages into a staging directory on the device (normally
+/// \p /PublicStaging on an AFCMediaDirectory, where AMInstallationProxy installs
+/// from), sending only what has changed since the last time.
+///
+/// Alongside the staged files it keeps a manifest, \p .staging-manifest.plist,
+/// recording the SHA-1 of each file and of each \p chunkSize piece of it, along
+/// with the size and modification time the device reported once it had been
+/// written.  When a file is staged again it is hashed locally and compared with
+/// the manifest:
+/// - if the whole-file hash matches, nothing is sent
+/// - otherwise only the pieces whose hashes differ are written over the old copy,
+///   and it is truncated to the new size
+///
+/// The manifest is only trusted for a file whose size and modification time on
+/// the device are still what it recorded, so a file changed or removed behind
+/// its back (by installd, say) is sent in full.  Staging a directory (an
+/// expanded .app) also removes staged files which are no longer in it.
+///
+/// Local hashes are remembered for the life of the process, keyed by path, size
+/// and modification time, so installing one build on many devices hashes it once.
+@interface AFCStagingCache : NSObject {
+@private
+	AFCDirectoryAccess *_dir;
+	NSString *_root;
+	NSMutableDictionary *_files;	// manifest: path relative to _root -> entry
+	BOOL _loaded;
+	uint32_t _chunkSize;
+	char *_buffer;
+	uint64_t _bytesSent, _bytesSkipped;
+	NSUInteger _filesSent, _filesPatched, _filesSkipped;
+	NSString *_lasterror;
+}
+
+/// Bytes hashed and compared per piece.  Defaults to 1M.  Changing it means
+/// the next staging of each file can't be partial.
+@property (assign) uint32_t chunkSize;
+
+/// Bytes written to the device, and bytes which didn't need to be, by the last
+/// \p -stageLocalPath:.
+@property (readonly) uint64_t bytesSent, bytesSkipped;
+
+/// Files written in full, written in part, and left alone by the last
+/// \p -stageLocalPath:.
+@property (readonly) NSUInteger filesSent, filesPatched, filesSkipped;
+
+/// Why the last \p -stageLocalPath: failed.
+@property (readonly) NSString *lasterror;
+
+/// @param dir The connection to stage through.
+/// @param root The staging directory on \p dir, eg \p "/PublicStaging".  It is
+/// created if need be.
+- (id)initWithDirectory:(AFCDirectoryAccess*)dir root:(NSString*)root;
+
+/// Make \p root/<last component of \p local> a copy of the local file or
+/// directory \p local.  Returns NO, with the reason in \p lasterror, if
+/// anything couldn't be written; the manifest still records what was.
+- (BOOL)stageLocalPath:(NSString*)local;
+
+@end
@@ -0,0 +1,390 @@
+//
+//  AFCStagingCache.m
+//  mobileDeviceManager
+//
+
+#import "AFCStagingCache.h"
+#ifdef __APPLE__
+#include <CommonCrypto/CommonDigest.h>
+#else
+// the SHA1_ calls are CommonCrypto's, and are only deprecated in favour of EVP
+#define OPENSSL_SUPPRESS_DEPRECATED
+#include <openssl/sha.h>
+#define CC_SHA1_DIGEST_LENGTH	SHA_DIGEST_LENGTH
+#define CC_SHA1_CTX				SHA_CTX
+#define CC_SHA1_Init			SHA1_Init
+#define CC_SHA1_Update			SHA1_Update
+#define CC_SHA1_Final			SHA1_Final
+#define CC_SHA1(data, len, md)	SHA1((const unsigned char*)(data), (len), (md))
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define MANIFEST_NAME		@".staging-manifest.plist"
+#define MANIFEST_VERSION	1
+
+// local path|size|mtime|chunk size -> { SHA1, Chunks }, shared by every cache
+static NSMutableDictionary *local_hashes = nil;
+
+@interface AFCStagingCache(Private)
+- (void)setLastError:(NSString*)msg;
+- (void)loadManifest;
+- (BOOL)saveManifest;
+- (NSDictionary*)hashesOf:(NSString*)local size:(uint64_t)size mtime:(int64_t)mtime;
+- (BOOL)stageFile:(NSString*)local as:(NSString*)rel remoteInfo:(NSDictionary*)info;
+- (BOOL)stageDirectory:(NSString*)local as:(NSString*)rel;
+@end
+
+static bool read_all(int fd, char *p, size_t n, off_t at)
+{
+	while (n) {
+		ssize_t r = pread(fd, p, n, at);
+		if (r < 0 && errno == EINTR) continue;
+		if (r <= 0) return NO;
+		p += r;
+		n -= r;
+		at += r;
+	}
+	return YES;
+}
+
+@implementation AFCStagingCache
+
+@synthesize bytesSent = _bytesSent, bytesSkipped = _bytesSkipped;
+@synthesize filesSent = _filesSent, filesPatched = _filesPatched, filesSkipped = _filesSkipped;
+@synthesize lasterror = _lasterror;
+
+- (id)initWithDirectory:(AFCDirectoryAccess*)dir root:(NSString*)root
+{
+	if ((self = [super init])) {
+		_dir = [dir retain];
+		_root = [root copy];
+		_files = [NSMutableDictionary new];
+		_chunkSize = 1024*1024;
+	}
+	return self;
+}
+
+- (void)dealloc
+{
+	[_dir release];
+	[_root release];
+	[_files release];
+	[_lasterror release];
+	free(_buffer);
+	[super dealloc];
+}
+
+- (void)setLastError:(NSString*)msg
+{
+	[_lasterror release];
+	_lasterror = [msg copy];
+}
+
+#pragma mark manifest
+
+- (void)loadManifest
+{
+	if (_loaded) return;
+	_loaded = YES;
+
+	NSString *path = [_root stringByAppendingPathComponent:MANIFEST_NAME];
+	if (![_dir fileExistsAtPath:path]) return;
+	AFCFileReference *in = [_dir openForRead:path];
+	if (!in) return;
+	NSMutableData *data = [NSMutableData data];
+	char buf[64*1024];
+	uint32_t n;
+	while ((n = [in readN:sizeof(buf) bytes:buf]) > 0) [data appendBytes:buf length:n];
+	[in closeFile];
+
+	// anything unreadable just means everything is sent again
+	NSDictionary *manifest = [NSPropertyListSerialization propertyListWithData:data options:0 format:NULL error:NULL];
+	if (![manifest isKindOfClass:[NSDictionary class]]) return;
+	if ([[manifest objectForKey:@"Version"] intValue] != MANIFEST_VERSION) return;
+	NSDictionary *files = [manifest objectForKey:@"Files"];
+	if ([files isKindOfClass:[NSDictionary class]]) [_files setDictionary:files];
+}
+
+// Written beside the old one and renamed over it, so it is never half there.
+- (BOOL)saveManifest
+{
+	NSDictionary *manifest = [NSDictionary dictionaryWithObjectsAndKeys:
+								[NSNumber numberWithInt:MANIFEST_VERSION], @"Version",
+								_files, @"Files",
+								nil];
+	NSData *data = [NSPropertyListSerialization dataWithPropertyList:manifest format:NSPropertyListBinaryFormat_v1_0
+															 options:0 error:NULL];
+	NSString *path = [_root stringByAppendingPathComponent:MANIFEST_NAME];
+	NSString *temp = [path stringByAppendingString:@".new"];
+	// openForReadWrite truncates
+	AFCFileReference *out = data ? [_dir openForReadWrite:temp] : nil;
+	BOOL ok = out && [out writeNSData:data];
+	if (out) ok = [out closeFile] && ok;
+	if (ok) ok = [_dir rename:temp to:path];
+	if (!ok) [self setLastError:[NSString stringWithFormat:@"Can't write %@: %@", path, _dir.lasterror]];
+	return ok;
+}
+
+#pragma mark hashing
+
+// The SHA-1 of the whole file, and the concatenated SHA-1s of each chunk.
+// mtime is in nanoseconds, so a file rewritten within the second isn't taken
+// for the one already hashed.
+- (NSDictionary*)hashesOf:(NSString*)local size:(uint64_t)size mtime:(int64_t)mtime
+{
+	NSString *key = [NSString stringWithFormat:@"%@|%llu|%lld|%u", local, size, (long long)mtime, _chunkSize];
+	@synchronized ([AFCStagingCache class]) {
+		if (!local_hashes) local_hashes = [NSMutableDictionary new];
+		NSDictionary *known = [local_hashes objectForKey:key];
+		if (known) return [[known retain] autorelease];
+	}
+
+	int fd = open([local fileSystemRepresentation], O_RDONLY);
+	if (fd < 0) return nil;
+	NSMutableData *chunks = [NSMutableData dataWithCapacity:(size / _chunkSize + 1) * CC_SHA1_DIGEST_LENGTH];
+	unsigned char digest[CC_SHA1_DIGEST_LENGTH];
+	CC_SHA1_CTX whole;
+	CC_SHA1_Init(&whole);
+	BOOL ok = YES;
+	for (uint64_t offset = 0; offset < size; offset += _chunkSize) {
+		uint32_t n = (size - offset < _chunkSize) ? (uint32_t)(size - offset) : _chunkSize;
+		if (!read_all(fd, _buffer, n, offset)) {
+			ok = NO;
+			break;
+		}
+		CC_SHA1_Update(&whole, _buffer, n);
+		CC_SHA1(_buffer, n, digest);
+		[chunks appendBytes:digest length:sizeof(digest)];
+	}
+	close(fd);
+	if (!ok) return nil;
+	CC_SHA1_Final(digest, &whole);
+
+	NSDictionary *result = [NSDictionary dictionaryWithObjectsAndKeys:
+								[NSData dataWithBytes:digest length:sizeof(digest)], @"SHA1",
+								chunks, @"Chunks",
+								nil];
+	@synchronized ([AFCStagingCache class]) {
+		[local_hashes setObject:result forKey:key];
+	}
+	return result;
+}
+
+#pragma mark staging
+
+// info is what the device says about the staged copy, or nil if there isn't one.
+- (BOOL)stageFile:(NSString*)local as:(NSString*)rel remoteInfo:(NSDictionary*)info
+{
+	NSString *remote = [_root stringByAppendingPathComponent:rel];
+	struct stat s;
+	if (stat([local fileSystemRepresentation], &s) != 0) {
+		[self setLastError:[NSString stringWithFormat:@"Can't read %@: %s", local, strerror(errno)]];
+		return NO;
+	}
+	uint64_t size = s.st_size;
+#ifdef __APPLE__
+	int64_t mtime = (int64_t)s.st_mtimespec.tv_sec * 1000000000LL + s.st_mtimespec.tv_nsec;
+#else
+	int64_t mtime = (int64_t)s.st_mtim.tv_sec * 1000000000LL + s.st_mtim.tv_nsec;
+#endif
+	NSDictionary *hashes = [self hashesOf:local size:size mtime:mtime];
+	if (!hashes) {
+		[self setLastError:[NSString stringWithFormat:@"Can't read %@: %s", local, strerror(errno)]];
+		return NO;
+	}
+
+	// the manifest only speaks for the copy it saw written
+	NSDictionary *entry = [_files objectForKey:rel];
+	BOOL known = entry && info &&
+		[[info objectForKey:@"st_ifmt"] isEqualToString:@"S_IFREG"] &&
+		[[info objectForKey:@"st_size"] unsignedLongLongValue] == [[entry objectForKey:@"Size"] unsignedLongLongValue] &&
+		[[info objectForKey:@"st_mtime"] longLongValue] == [[entry objectForKey:@"MTime"] longLongValue];
+	if (known && [[entry objectForKey:@"SHA1"] isEqual:[hashes objectForKey:@"SHA1"]]) {
+		_filesSkipped++;
+		_bytesSkipped += size;
+		return YES;
+	}
+	NSData *old = (known && [[entry objectForKey:@"ChunkSize"] unsignedIntValue] == _chunkSize) ? [entry objectForKey:@"Chunks"] : nil;
+	NSData *now = [hashes objectForKey:@"Chunks"];
+	[_files removeObjectForKey:rel];
+
+	// anything else in the way goes
+	if (info && ![[info objectForKey:@"st_ifmt"] isEqualToString:@"S_IFREG"]) [_dir unlink:remote];
+
+	int fd = open([local fileSystemRepresentation], O_RDONLY);
+	// openForWrite creates the file if need be, but doesn't truncate it
+	AFCFileReference *out = (fd >= 0) ? [_dir openForWrite:remote] : nil;
+	BOOL ok = (out != nil);
+	uint64_t sent = 0;
+	NSUInteger i = 0;
+	for (uint64_t offset = 0; ok && offset < size; offset += _chunkSize, i++) {
+		uint32_t n = (size - offset < _chunkSize) ? (uint32_t)(size - offset) : _chunkSize;
+		NSUInteger at = i * CC_SHA1_DIGEST_LENGTH;
+		if (old && at + CC_SHA1_DIGEST_LENGTH <= [old length] &&
+			memcmp((const char*)[old bytes] + at, (const char*)[now bytes] + at, CC_SHA1_DIGEST_LENGTH) == 0) {
+			continue;
+		}
+		ok = read_all(fd, _buffer, n, offset) && [out seek:offset mode:SEEK_SET] && [out writeN:n bytes:_buffer];
+		sent += n;
+	}
+	if (ok) ok = [out setFileSize:size];
+	if (out) ok = [out closeFile] && ok;
+	if (fd >= 0) close(fd);
+	if (!ok) {
+		NSString *why = (fd < 0) ? [NSString stringWithUTF8String:strerror(errno)] : (out ? out.lasterror : _dir.lasterror);
+		[self setLastError:[NSString stringWithFormat:@"Can't stage %@ as %@: %@", local, remote, why]];
+		return NO;
+	}
+
+	_bytesSent += sent;
+	_bytesSkipped += size - sent;
+	if (sent < size) _filesPatched++;
+	else _filesSent++;
+
+	info = [_dir getFileInfo:remote];
+	if (info) {
+		[_files setObject:[NSDictionary dictionaryWithObjectsAndKeys:
+							[NSNumber numberWithUnsignedLongLong:size], @"Size",
+							[NSNumber numberWithLongLong:[[info objectForKey:@"st_mtime"] longLongValue]], @"MTime",
+							[hashes objectForKey:@"SHA1"], @"SHA1",
+							[NSNumber numberWithUnsignedInt:_chunkSize], @"ChunkSize",
+							now, @"Chunks",
+							nil]
+				   forKey:rel];
+	}
+	return YES;
+}
+
+- (BOOL)stageDirectory:(NSString*)local as:(NSString*)rel
+{
+	NSString *remote = [_root stringByAppendingPathComponent:rel];
+	NSUInteger skip = [_root length] + 1;
+
+	// what's there already, keyed relative to the root like the manifest
+	NSMutableDictionary *there = [NSMutableDictionary dictionary];
+	if ([_dir fileExistsAtPath:remote] &&
+		![_dir walkDirectory:remote depth:0 matching:nil withInfo:YES usingBlock:^BOOL(NSString *path, BOOL isdir, NSDictionary *info) {
+			if ([path length] > skip) [there setObject:info forKey:[path substringFromIndex:skip]];
+			return YES;
+		}]) {
+		// anything missing from the listing would be sent again, or left behind
+		[self setLastError:[NSString stringWithFormat:@"Can't list %@: %@", remote, _dir.lasterror]];
+		return NO;
+	}
+	NSDictionary *top = [there objectForKey:rel];
+	if (top && ![[top objectForKey:@"st_ifmt"] isEqualToString:@"S_IFDIR"]) {
+		[_dir unlink:remote];
+		top = nil;
+	}
+	if (!top && ![_dir mkdir:remote]) {
+		[self setLastError:[NSString stringWithFormat:@"Can't create %@: %@", remote, _dir.lasterror]];
+		return NO;
+	}
+	[there removeObjectForKey:rel];
+
+	NSFileManager *fm = [NSFileManager defaultManager];
+	NSDirectoryEnumerator *e = [fm enumeratorAtPath:local];
+	BOOL ok = YES;
+	for (NSString *sub in e) {
+		NSAutoreleasePool *pool = [NSAutoreleasePool new];
+		NSString *from = [local stringByAppendingPathComponent:sub];
+		NSString *name = [rel stringByAppendingPathComponent:sub];
+		NSString *to = [_root stringByAppendingPathComponent:name];
+		NSString *type = [[e fileAttributes] fileType];
+		NSDictionary *info = [there objectForKey:name];
+		NSString *ifmt = [info objectForKey:@"st_ifmt"];
+		[there removeObjectForKey:name];
+
+		if ([type isEqualToString:NSFileTypeDirectory]) {
+			if (info && ![ifmt isEqualToString:@"S_IFDIR"]) [_dir unlink:to];
+			if ((!info || ![ifmt isEqualToString:@"S_IFDIR"]) && ![_dir mkdir:to]) {
+				[self setLastError:[NSString stringWithFormat:@"Can't create %@: %@", to, _dir.lasterror]];
+				ok = NO;
+			}
+		} else if ([type isEqualToString:NSFileTypeSymbolicLink]) {
+			NSString *target = [fm destinationOfSymbolicLinkAtPath:from error:NULL];
+			if (![ifmt isEqualToString:@"S_IFLNK"] || ![[info objectForKey:@"LinkTarget"] isEqualToString:target]) {
+				if (info) [_dir unlink:to];
+				if (!target || ![_dir symlink:to to:target]) {
+					[self setLastError:[NSString stringWithFormat:@"Can't link %@: %@", to, _dir.lasterror]];
+					ok = NO;
+				}
+			}
+		} else if ([type isEqualToString:NSFileTypeRegular]) {
+			if (![self stageFile:from as:name remoteInfo:info]) ok = NO;
+		}
+		[pool drain];
+		if (!ok) break;
+	}
+	if (!ok) return NO;
+
+	// a stray file in a bundle breaks its signature, so whatever wasn't in the
+	// local copy goes - deepest first, so directories are empty by then
+	for (NSString *name in [[[there allKeys] sortedArrayUsingSelector:@selector(compare:)] reverseObjectEnumerator]) {
+		[_dir unlink:[_root stringByAppendingPathComponent:name]];
+	}
+	NSString *prefix = [rel stringByAppendingString:@"/"];
+	for (NSString *name in [_files allKeys]) {
+		if ([name hasPrefix:prefix] && ![fm fileExistsAtPath:[local stringByAppendingPathComponent:[name substringFromIndex:[prefix length]]]]) {
+			[_files removeObjectForKey:name];
+		}
+	}
+	return YES;
+}
+
+- (BOOL)stageLocalPath:(NSString*)local
+{
+	_bytesSent = _bytesSkipped = 0;
+	_filesSent = _filesPatched = _filesSkipped = 0;
+	[self setLastError:nil];
+
+	BOOL isdir = NO;
+	if (![[NSFileManager defaultManager] fileExistsAtPath:local isDirectory:&isdir]) {
+		[self setLastError:[NSString stringWithFormat:@"%@ doesn't exist", local]];
+		return NO;
+	}
+	if (!_buffer && !(_buffer = malloc(_chunkSize))) {
+		[self setLastError:@"Can't allocate staging buffer"];
+		return NO;
+	}
+	if (![_dir fileExistsAtPath:_root] && ![_dir mkdir:_root]) {
+		[self setLastError:[NSString stringWithFormat:@"Can't create %@: %@", _root, _dir.lasterror]];
+		return NO;
+	}
+	[self loadManifest];
+
+	NSString *rel = [local lastPathComponent];
+	BOOL ok;
+	if (isdir) {
+		ok = [self stageDirectory:local as:rel];
+	} else {
+		NSString *remote = [_root stringByAppendingPathComponent:rel];
+		NSDictionary *info = [_dir fileExistsAtPath:remote] ? [_dir getFileInfo:remote] : nil;
+		ok = [self stageFile:local as:rel remoteInfo:info];
+	}
+	// the manifest is written even after a failure, for what did get there
+	NSString *error = [[_lasterror retain] autorelease];
+	if (![self saveManifest] || !ok) {
+		if (!ok) [self setLastError:error];
+		return NO;
+	}
+	return YES;
+}
+
+- (uint32_t)chunkSize
+{
+	return _chunkSize;
+}
+
+- (void)setChunkSize:(uint32_t)chunkSize
+{
+	if (chunkSize == 0 || chunkSize == _chunkSize) return;
+	_chunkSize = chunkSize;
+	free(_buffer);
+	_buffer = NULL;
+}
+
+@end
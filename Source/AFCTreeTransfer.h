@@ -0,0 +1,88 @@
+//
+//  AFCTreeTransfer.h
+//  mobileDeviceManager
+//
+//  Copies whole directory trees to or from the device over several AFC
+//  connections at once.
+//
+
+#import <Foundation/Foundation.h>
+#import "MobileDeviceAccess.h"
+
+/// This class copies a directory tree between the Mac and the device using
+/// several AFC connections in parallel, one worker thread per connection.
+///
+/// Work is divided into jobs which are dealt out to per-worker queues.  A worker
+/// takes jobs from the back of its own queue and, once that is empty, steals from
+/// the front of the others, so a worker that drew a few slow files doesn't hold
+/// up the rest.  Small files are batched several to a job, which keeps queueing
+/// cheap when a tree holds thousands of them.  Files larger than
+/// \p splitThreshold are split into ranges of \p rangeSize bytes which are copied
+/// independently, so one big file can keep every connection busy.
+///
+/// Every connection must be rooted at the same place on the device - typically
+/// they are all \p -newAFCApplicationDirectory: for the same bundle id:
+/// <PRE>
+///    NSMutableArray *conns = [NSMutableArray array];
+///    for (int i=0; i<4; i++) {
+///        AFCApplicationDirectory *d = [device newAFCApplicationDirectory:bundleId];
+///        [conns addObject:d];
+///        [d release];
+///    }
+///    AFCTreeTransfer *t = [[AFCTreeTransfer alloc] initWithConnections:conns];
+///    [t pullRemotePath:@"/Documents" toLocalDir:@"./Documents"];
+/// </PRE>
+@interface AFCTreeTransfer : NSObject {
+@private
+	NSArray *_connections;
+	NSMutableArray *_queues;		// one NSMutableArray of jobs per worker
+	NSCondition *_cond;				// guards _queues, _pending, _running, _errors
+	NSUInteger _pending;			// jobs queued or being worked on
+	NSUInteger _running;			// worker threads still alive
+	NSMutableArray *_errors;
+	uint64_t _splitThreshold;
+	uint64_t _rangeSize;
+	NSUInteger _batchSize;
+	uint64_t _bytes;
+	NSUInteger _files;
+	NSTimeInterval _elapsed;
+}
+
+/// Files bigger than this are split into ranges.  Defaults to 8M.
+@property (assign) uint64_t splitThreshold;
+
+/// The size of each range of a split file.  Defaults to 4M.
+@property (assign) uint64_t rangeSize;
+
+/// The number of small files handed out per job.  Defaults to 16.
+@property (assign) NSUInteger batchSize;
+
+/// Errors encountered by the last transfer, as strings.
+@property (readonly) NSArray *errors;
+
+/// Bytes copied by the last transfer.
+@property (readonly) uint64_t bytesTransferred;
+
+/// Files copied by the last transfer.
+@property (readonly) NSUInteger filesTransferred;
+
+/// Wall-clock time taken by the last transfer, in seconds.
+@property (readonly) NSTimeInterval elapsed;
+
+/// @param connections An array of AFCDirectoryAccess objects, all rooted at the
+/// same place.  One worker thread is started per connection.
+- (id)initWithConnections:(NSArray*)connections;
+
+/// Copy the contents of the device directory \p remote into the local directory
+/// \p local (which is created if necessary).  Existing local files are not
+/// overwritten, and a file which couldn't be copied in full (including one split
+/// into ranges, any of which failed) is removed rather than left half written.
+/// Returns NO if anything failed - see \p errors.
+- (BOOL)pullRemotePath:(NSString*)remote toLocalDir:(NSString*)local;
+
+/// Copy the local file or directory \p local into the device directory
+/// \p remote, in the same way as \p -copyLocalFile:toRemoteDir:.  Returns NO if
+/// anything failed - see \p errors.
+- (BOOL)pushLocalPath:(NSString*)local toRemoteDir:(NSString*)remote;
+
+@end
@@ -0,0 +1,605 @@
+//
+//  AFCTreeTransfer.m
+//  mobileDeviceManager
+//
+
+#import "AFCTreeTransfer.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// size of the per-worker copy buffer
+#define TRANSFER_BUFSZ		(256*1024)
+
+typedef enum {
+	AFCJobPullFiles,
+	AFCJobPullRange,
+	AFCJobPushFiles,
+	AFCJobPushRange
+} AFCJobKind;
+
+// A file being pulled in ranges, shared by their jobs so that whichever
+// finishes last knows whether the whole file made it.  Guarded by _cond.
+@interface AFCSplitFile : NSObject {
+@public
+	NSUInteger remaining;			// ranges not finished yet
+	BOOL failed;
+}
+@end
+
+@implementation AFCSplitFile
+@end
+
+// A unit of work.  Batches use sources/targets, ranges use
+// source/target/offset/length (and split, when pulling).
+@interface AFCTransferJob : NSObject {
+@public
+	AFCJobKind kind;
+	NSMutableArray *sources;
+	NSMutableArray *targets;
+	NSString *source;
+	NSString *target;
+	uint64_t offset;
+	uint64_t length;
+	AFCSplitFile *split;
+}
+@end
+
+@implementation AFCTransferJob
+
+- (void)dealloc
+{
+	[sources release];
+	[targets release];
+	[source release];
+	[target release];
+	[split release];
+	[super dealloc];
+}
+
+@end
+
+static bool write_all(int fd, const char *p, size_t n, off_t at, bool positioned)
+{
+	while (n) {
+		ssize_t w = positioned ? pwrite(fd, p, n, at) : write(fd, p, n);
+		if (w < 0 && errno == EINTR) continue;
+		if (w <= 0) return NO;
+		p += w;
+		n -= w;
+		at += w;
+	}
+	return YES;
+}
+
+@implementation AFCTreeTransfer
+
+@synthesize splitThreshold = _splitThreshold;
+@synthesize rangeSize = _rangeSize;
+@synthesize batchSize = _batchSize;
+@synthesize elapsed = _elapsed;
+
+- (id)initWithConnections:(NSArray*)connections
+{
+	if ((self = [super init])) {
+		if ([connections count] == 0) {
+			[self release];
+			return nil;
+		}
+		_connections = [connections copy];
+		_cond = [NSCondition new];
+		_errors = [NSMutableArray new];
+		_queues = [NSMutableArray new];
+		_splitThreshold = 8*1024*1024;
+		_rangeSize = 4*1024*1024;
+		_batchSize = 16;
+	}
+	return self;
+}
+
+- (void)dealloc
+{
+	[_connections release];
+	[_cond release];
+	[_errors release];
+	[_queues release];
+	[super dealloc];
+}
+
+- (NSArray*)errors
+{
+	[_cond lock];
+	NSArray *result = [NSArray arrayWithArray:_errors];
+	[_cond unlock];
+	return result;
+}
+
+- (uint64_t)bytesTransferred
+{
+	return _bytes;
+}
+
+- (NSUInteger)filesTransferred
+{
+	return _files;
+}
+
+#pragma mark queueing
+
+- (void)recordError:(NSString*)msg
+{
+	NSLog(@"%@", msg);
+	[_cond lock];
+	[_errors addObject:msg];
+	[_cond unlock];
+}
+
+- (void)addJob:(AFCTransferJob*)job toQueue:(NSUInteger)q
+{
+	[_cond lock];
+	[[_queues objectAtIndex:q % [_queues count]] addObject:job];
+	_pending++;
+	[_cond signal];
+	[_cond unlock];
+}
+
+- (void)countBytes:(uint64_t)bytes files:(NSUInteger)files
+{
+	[_cond lock];
+	_bytes += bytes;
+	_files += files;
+	[_cond unlock];
+}
+
+// Returns a retained job, or nil once there is nothing left to do anywhere.
+// We take from the back of our own queue (most recently added - usually the
+// ranges of a file we just split, which are warm) and steal from the front
+// of everybody else's.
+- (AFCTransferJob*)nextJobFor:(NSUInteger)me
+{
+	AFCTransferJob *job = nil;
+	[_cond lock];
+	for (;;) {
+		NSUInteger n = [_queues count];
+		NSMutableArray *mine = [_queues objectAtIndex:me];
+		if ([mine count]) {
+			job = [[mine lastObject] retain];
+			[mine removeLastObject];
+			break;
+		}
+		NSUInteger i;
+		for (i=1; i<n; i++) {
+			NSMutableArray *victim = [_queues objectAtIndex:(me+i) % n];
+			if ([victim count]) {
+				job = [[victim objectAtIndex:0] retain];
+				[victim removeObjectAtIndex:0];
+				break;
+			}
+		}
+		if (job) break;
+		// nothing queued - if nobody is still working on something that might
+		// split into more jobs, we're finished
+		if (_pending == 0) break;
+		[_cond wait];
+	}
+	[_cond unlock];
+	return job;
+}
+
+- (void)finishedJob
+{
+	[_cond lock];
+	_pending--;
+	if (_pending == 0) [_cond broadcast];
+	[_cond unlock];
+}
+
+#pragma mark pulling
+
+// Returns NO if the range couldn't be copied in full.
+- (BOOL)pullRangeOf:(NSString*)src into:(NSString*)dst
+			   from:(uint64_t)offset length:(uint64_t)length
+			  using:(AFCDirectoryAccess*)afc buffer:(char*)buff
+{
+	int fd = open([dst fileSystemRepresentation], O_WRONLY);
+	if (fd < 0) {
+		[self recordError:[NSString stringWithFormat:@"%@: can't open for range write", dst]];
+		return NO;
+	}
+	AFCFileReference *in = [afc openForRead:src];
+	if (!in || ![in seek:offset mode:SEEK_SET]) {
+		[self recordError:[NSString stringWithFormat:@"%@: %@", src, in ? in.lasterror : afc.lasterror]];
+		[in closeFile];
+		close(fd);
+		return NO;
+	}
+	uint64_t done = 0;
+	while (done < length) {
+		uint32_t want = (length - done < TRANSFER_BUFSZ) ? (uint32_t)(length - done) : TRANSFER_BUFSZ;
+		uint32_t n = [in readN:want bytes:buff];
+		if (n == 0) {
+			[self recordError:[NSString stringWithFormat:@"%@: short read at %llu%@%@", src,
+								offset + done, in.lasterror ? @" - " : @"", in.lasterror ? in.lasterror : @""]];
+			break;
+		}
+		if (!write_all(fd, buff, n, (off_t)(offset + done), YES)) {
+			[self recordError:[NSString stringWithFormat:@"%@: write failed: %s", dst, strerror(errno)]];
+			break;
+		}
+		done += n;
+	}
+	[in closeFile];
+	close(fd);
+	[self countBytes:done files:0];
+	return done == length;
+}
+
+// A range of a split file is done.  Once they all are, the file counts as
+// copied - or, if any range failed, the partial copy is removed.
+- (void)finishedRangeOf:(AFCTransferJob*)job ok:(BOOL)ok
+{
+	AFCSplitFile *split = job->split;
+	[_cond lock];
+	if (!ok) split->failed = YES;
+	BOOL last = (--split->remaining == 0);
+	BOOL failed = split->failed;
+	[_cond unlock];
+	if (!last) return;
+	if (failed) {
+		unlink([job->target fileSystemRepresentation]);
+		[self recordError:[NSString stringWithFormat:@"%@: incomplete, removed", job->target]];
+	} else {
+		[self countBytes:0 files:1];
+	}
+}
+
+// Copy a device file.  We don't know how big it is (asking would cost a round
+// trip per file, and most files in the trees we care about are tiny) so we just
+// start reading.  Only if the first read fills the buffer do we ask for the
+// size, and if it's big enough the rest is handed out as ranges.
+- (void)pullFile:(NSString*)src into:(NSString*)dst
+		   using:(AFCDirectoryAccess*)afc buffer:(char*)buff queue:(NSUInteger)me
+{
+	int fd = open([dst fileSystemRepresentation], O_WRONLY|O_CREAT|O_EXCL, 0644);
+	if (fd < 0) {
+		[self recordError:[NSString stringWithFormat:@"%@: %s", dst,
+							errno == EEXIST ? "won't overwrite existing file" : strerror(errno)]];
+		return;
+	}
+	AFCFileReference *in = [afc openForRead:src];
+	if (!in) {
+		[self recordError:[NSString stringWithFormat:@"%@: %@", src, afc.lasterror]];
+		close(fd);
+		unlink([dst fileSystemRepresentation]);
+		return;
+	}
+	uint64_t done = 0;
+	bool failed = NO, split = NO;
+	for (;;) {
+		uint32_t n = [in readN:TRANSFER_BUFSZ bytes:buff];
+		if (n == 0) {
+			if (in.lasterror) {
+				[self recordError:[NSString stringWithFormat:@"%@: %@", src, in.lasterror]];
+				failed = YES;
+			}
+			break;
+		}
+		if (!write_all(fd, buff, n, 0, NO)) {
+			[self recordError:[NSString stringWithFormat:@"%@: write failed: %s", dst, strerror(errno)]];
+			failed = YES;
+			break;
+		}
+		done += n;
+		if (done == TRANSFER_BUFSZ) {
+			uint64_t size = [[[afc getFileInfo:src] objectForKey:@"st_size"] unsignedLongLongValue];
+			if (size > _splitThreshold) {
+				// size the local file up front so the ranges can be written
+				// in any order, then queue them up for whoever is free
+				if (ftruncate(fd, (off_t)size) != 0) {
+					[self recordError:[NSString stringWithFormat:@"%@: can't extend: %s", dst, strerror(errno)]];
+					failed = YES;
+					break;
+				}
+				// the file is counted (or removed) once its last range is done
+				AFCSplitFile *file = [AFCSplitFile new];
+				file->remaining = (NSUInteger)((size - done + _rangeSize - 1) / _rangeSize);
+				uint64_t off;
+				for (off = done; off < size; off += _rangeSize) {
+					AFCTransferJob *job = [AFCTransferJob new];
+					job->kind = AFCJobPullRange;
+					job->source = [src retain];
+					job->target = [dst retain];
+					job->offset = off;
+					job->length = (size - off < _rangeSize) ? size - off : _rangeSize;
+					job->split = [file retain];
+					[self addJob:job toQueue:me];
+					[job release];
+				}
+				[file release];
+				split = YES;
+				break;
+			}
+		}
+	}
+	[in closeFile];
+	close(fd);
+	if (failed) unlink([dst fileSystemRepresentation]);
+	else [self countBytes:done files:(split ? 0 : 1)];
+}
+
+#pragma mark pushing
+
+- (void)pushRangeOf:(NSString*)src into:(NSString*)dst
+			   from:(uint64_t)offset length:(uint64_t)length
+			  using:(AFCDirectoryAccess*)afc buffer:(char*)buff
+{
+	int fd = open([src fileSystemRepresentation], O_RDONLY);
+	if (fd < 0) {
+		[self recordError:[NSString stringWithFormat:@"%@: %s", src, strerror(errno)]];
+		return;
+	}
+	// openForWrite opens the device file "r+" - it does not truncate, which is
+	// exactly what we need with several connections writing different ranges
+	AFCFileReference *out = [afc openForWrite:dst];
+	if (!out || ![out seek:offset mode:SEEK_SET]) {
+		[self recordError:[NSString stringWithFormat:@"%@: %@", dst, out ? out.lasterror : afc.lasterror]];
+		close(fd);
+		return;
+	}
+	uint64_t done = 0;
+	while (done < length) {
+		size_t want = (length - done < TRANSFER_BUFSZ) ? (size_t)(length - done) : TRANSFER_BUFSZ;
+		ssize_t n = pread(fd, buff, want, (off_t)(offset + done));
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) {
+			[self recordError:[NSString stringWithFormat:@"%@: short read at %llu", src, offset + done]];
+			break;
+		}
+		if (![out writeN:(uint32_t)n bytes:buff]) {
+			[self recordError:[NSString stringWithFormat:@"%@: %@", dst, out.lasterror]];
+			break;
+		}
+		done += n;
+	}
+	[out closeFile];
+	close(fd);
+	[self countBytes:done files:0];
+}
+
+#pragma mark workers
+
+- (void)worker:(NSNumber*)index
+{
+	NSAutoreleasePool *outer = [NSAutoreleasePool new];
+	NSUInteger me = [index unsignedIntegerValue];
+	AFCDirectoryAccess *afc = [_connections objectAtIndex:me];
+	char *buff = malloc(TRANSFER_BUFSZ);
+
+	for (;;) {
+		AFCTransferJob *job = [self nextJobFor:me];
+		if (!job) break;
+
+		NSAutoreleasePool *pool = [NSAutoreleasePool new];
+		NSUInteger i;
+		switch (job->kind) {
+		case AFCJobPullFiles:
+			for (i=0; i<[job->sources count]; i++) {
+				[self pullFile:[job->sources objectAtIndex:i] into:[job->targets objectAtIndex:i]
+						 using:afc buffer:buff queue:me];
+			}
+			break;
+		case AFCJobPullRange:
+			[self finishedRangeOf:job ok:[self pullRangeOf:job->source into:job->target
+													  from:job->offset length:job->length
+													 using:afc buffer:buff]];
+			break;
+		case AFCJobPushFiles:
+			for (i=0; i<[job->sources count]; i++) {
+				NSString *src = [job->sources objectAtIndex:i];
+				NSString *dst = [job->targets objectAtIndex:i];
+				if ([afc copyLocalFile:src toRemoteFile:dst]) {
+					struct stat s;
+					[self countBytes:(stat([src fileSystemRepresentation], &s) == 0 ? s.st_size : 0) files:1];
+				} else {
+					[self recordError:[NSString stringWithFormat:@"%@: %@", dst, afc.lasterror]];
+				}
+			}
+			break;
+		case AFCJobPushRange:
+			[self pushRangeOf:job->source into:job->target from:job->offset length:job->length
+						using:afc buffer:buff];
+			break;
+		}
+		[pool drain];
+		[job release];
+		[self finishedJob];
+	}
+
+	free(buff);
+	[_cond lock];
+	_running--;
+	[_cond broadcast];
+	[_cond unlock];
+	[outer drain];
+}
+
+// deal a batch of files out to the queues, round-robin
+- (void)queueBatch:(AFCTransferJob**)batch kind:(AFCJobKind)kind
+			source:(NSString*)src target:(NSString*)dst next:(NSUInteger*)next
+{
+	if (!*batch) {
+		*batch = [AFCTransferJob new];
+		(*batch)->kind = kind;
+		(*batch)->sources = [NSMutableArray new];
+		(*batch)->targets = [NSMutableArray new];
+	}
+	[(*batch)->sources addObject:src];
+	[(*batch)->targets addObject:dst];
+	if ([(*batch)->sources count] >= _batchSize) {
+		[self addJob:*batch toQueue:(*next)++];
+		[*batch release];
+		*batch = nil;
+	}
+}
+
+- (void)resetForTransfer
+{
+	NSUInteger i;
+	[_queues removeAllObjects];
+	for (i=0; i<[_connections count]; i++) [_queues addObject:[NSMutableArray array]];
+	[_errors removeAllObjects];
+	_pending = 0;
+	_bytes = 0;
+	_files = 0;
+	_elapsed = 0;
+}
+
+// start one worker per connection and wait for them all to run dry
+- (BOOL)runWorkers:(CFAbsoluteTime)started
+{
+	NSUInteger i, n = [_connections count];
+	[_cond lock];
+	_running = n;
+	[_cond unlock];
+	for (i=0; i<n; i++) {
+		[NSThread detachNewThreadSelector:@selector(worker:) toTarget:self withObject:[NSNumber numberWithUnsignedInteger:i]];
+	}
+	[_cond lock];
+	while (_running) [_cond wait];
+	[_cond unlock];
+	_elapsed = CFAbsoluteTimeGetCurrent() - started;
+	NSLog(@"Transferred %lu files, %llu bytes in %.3fs over %lu connections",
+		  (unsigned long)_files, _bytes, _elapsed, (unsigned long)n);
+	return [_errors count] == 0;
+}
+
+- (BOOL)pullRemotePath:(NSString*)remote toLocalDir:(NSString*)local
+{
+	NSFileManager *fm = [NSFileManager defaultManager];
+	AFCDirectoryAccess *afc = [_connections objectAtIndex:0];
+	CFAbsoluteTime started = CFAbsoluteTimeGetCurrent();
+	[self resetForTransfer];
+
+	if (![fm createDirectoryAtPath:local withIntermediateDirectories:YES attributes:nil error:nil]) {
+		[self recordError:[NSString stringWithFormat:@"Can't create %@", local]];
+		return NO;
+	}
+
+	// list the tree over every connection at once.  Directories are reported
+	// before their contents, so they can be created as they turn up; files are
+	// batched out to the workers
+	NSString *prefix = [remote hasSuffix:@"/"] ? remote : [remote stringByAppendingString:@"/"];
+	NSArray *helpers = [_connections subarrayWithRange:NSMakeRange(1, [_connections count] - 1)];
+	__block AFCTransferJob *batch = nil;
+	__block NSUInteger next = 0;
+	BOOL listed = [afc walkDirectory:remote depth:0 matching:nil withInfo:NO helpers:helpers
+						  usingBlock:^BOOL(NSString *entry, BOOL isdir, NSDictionary *info) {
+		if (![entry hasPrefix:prefix]) return YES;			// the root itself
+		NSString *rel = [entry substringFromIndex:[prefix length]];
+		if (isdir) {
+			NSString *dir = [local stringByAppendingPathComponent:rel];
+			if (![fm createDirectoryAtPath:dir withIntermediateDirectories:YES attributes:nil error:nil]) {
+				[self recordError:[NSString stringWithFormat:@"Can't create %@", dir]];
+			}
+		} else if ([rel length]) {
+			[self queueBatch:&batch kind:AFCJobPullFiles source:entry
+					  target:[local stringByAppendingPathComponent:rel] next:&next];
+		}
+		return YES;
+	}];
+	if (!listed) {
+		[self recordError:[NSString stringWithFormat:@"%@: %@", remote, afc.lasterror]];
+		[batch release];
+		return NO;
+	}
+	if (batch) {
+		[self addJob:batch toQueue:next];
+		[batch release];
+	}
+	return [self runWorkers:started];
+}
+
+- (BOOL)pushLocalPath:(NSString*)local toRemoteDir:(NSString*)remote
+{
+	NSFileManager *fm = [NSFileManager defaultManager];
+	AFCDirectoryAccess *afc = [_connections objectAtIndex:0];
+	CFAbsoluteTime started = CFAbsoluteTimeGetCurrent();
+	[self resetForTransfer];
+
+	BOOL isdir = NO;
+	if (![fm fileExistsAtPath:local isDirectory:&isdir]) {
+		[self recordError:[NSString stringWithFormat:@"%@ does not exist", local]];
+		return NO;
+	}
+
+	// build a list of (local, remote) pairs - for a directory, that's the
+	// directory itself followed by everything in it, parents first
+	NSString *base = [remote stringByAppendingPathComponent:[local lastPathComponent]];
+	NSMutableArray *pairs = [NSMutableArray arrayWithObject:[NSArray arrayWithObjects:local, base, nil]];
+	if (isdir) {
+		for (NSString *rel in [fm enumeratorAtPath:local]) {
+			[pairs addObject:[NSArray arrayWithObjects:
+							  [local stringByAppendingPathComponent:rel],
+							  [base stringByAppendingPathComponent:rel], nil]];
+		}
+	}
+
+	AFCTransferJob *batch = nil;
+	NSUInteger next = 0;
+	for (NSArray *pair in pairs) {
+		NSString *src = [pair objectAtIndex:0];
+		NSString *dst = [pair objectAtIndex:1];
+		struct stat s;
+		if (lstat([src fileSystemRepresentation], &s) != 0) {
+			[self recordError:[NSString stringWithFormat:@"%@: %s", src, strerror(errno)]];
+			continue;
+		}
+		if (S_ISDIR(s.st_mode)) {
+			if (![afc mkdir:dst]) [self recordError:[NSString stringWithFormat:@"%@: %@", dst, afc.lasterror]];
+		} else if (S_ISLNK(s.st_mode)) {
+			char buff[PATH_MAX+1];
+			ssize_t buflen = readlink([src fileSystemRepresentation], buff, PATH_MAX);
+			if (buflen > 0) {
+				buff[buflen] = 0;
+				if (![afc symlink:dst to:[NSString stringWithUTF8String:buff]]) {
+					[self recordError:[NSString stringWithFormat:@"%@: %@", dst, afc.lasterror]];
+				}
+			}
+		} else if ((uint64_t)s.st_size > _splitThreshold) {
+			// create and size the device file here, then let the workers
+			// fill in the ranges
+			if ([afc fileExistsAtPath:dst]) {
+				[self recordError:[NSString stringWithFormat:@"%@: Won't overwrite existing file", dst]];
+				continue;
+			}
+			AFCFileReference *out = [afc openForWrite:dst];
+			if (!out || ![out setFileSize:s.st_size]) {
+				[self recordError:[NSString stringWithFormat:@"%@: %@", dst, out ? out.lasterror : afc.lasterror]];
+				continue;
+			}
+			[out closeFile];
+			uint64_t off;
+			for (off = 0; off < (uint64_t)s.st_size; off += _rangeSize) {
+				AFCTransferJob *job = [AFCTransferJob new];
+				job->kind = AFCJobPushRange;
+				job->source = [src retain];
+				job->target = [dst retain];
+				job->offset = off;
+				job->length = ((uint64_t)s.st_size - off < _rangeSize) ? s.st_size - off : _rangeSize;
+				[self addJob:job toQueue:next++];
+				[job release];
+			}
+			[self countBytes:0 files:1];
+		} else {
+			[self queueBatch:&batch kind:AFCJobPushFiles source:src target:dst next:&next];
+		}
+	}
+	if (batch) {
+		[self addJob:batch toQueue:next];
+		[batch release];
+	}
+	return [self runWorkers:started];
+}
+
+@end
@@ -0,0 +1,60 @@
+//
+//  AMIconCache.h
+//  mobileDeviceManager
+//
+//  Keeps the springboard icons fetched from devices on disk, so an icon which
+//  hasn't changed is never fetched again.
+//
+
+#import <Foundation/Foundation.h>
+#import "MobileDeviceAccess.h"
+
+/// This class fetches application icons from devices through
+/// AMSpringboardServices, keeping a copy of each in a local directory.
+///
+/// The icons are filed under the bundle identifier and the \p iconModDate that
+/// \p -getIconState reports for it, as \p <dir>/<bundle id>/<seconds>.png.  An
+/// icon is only fetched if the device reports a date there is no file for, so
+/// once one device has supplied an application's icon, every other device with
+/// the same build of it is answered from disk.  Devices with different builds
+/// of an application each have theirs kept, up to a few per application, after
+/// which the least recently used is dropped.  Icons the icon state has no date
+/// for (because the application isn't on the springboard) are always fetched.
+///
+/// The fetches which are needed are pipelined, \p window at a time, over
+/// \p connections springboardservices connections.
+@interface AMIconCache : NSObject {
+@private
+	NSString *_dir;
+	NSUInteger _connections, _window;
+	NSUInteger _fetched, _cached;
+	NSString *_lasterror;
+}
+
+/// The number of springboardservices connections to fetch over.  Defaults to 1.
+@property (assign) NSUInteger connections;
+
+/// The number of requests kept in flight on each connection.  Defaults to 8.
+@property (assign) NSUInteger window;
+
+/// Icons fetched from the device, and answered from disk, by the last
+/// \p -iconsForIds:onDevice:.
+@property (readonly) NSUInteger fetched, cached;
+
+/// Why the last \p -iconsForIds:onDevice: failed.
+@property (readonly) NSString *lasterror;
+
+/// @param dir Where the icons are kept.  It is created if need be.
+- (id)initWithDirectory:(NSString*)dir;
+
+/// Return a dictionary of bundle identifier -> .png NSData for each of \p ids
+/// (or, if \p ids is nil, each application in \p device's icon state) that has
+/// an icon.  Returns nil, with the reason in \p lasterror, if the device
+/// couldn't be asked; icons fetched before a failure are still kept.
+- (NSDictionary*)iconsForIds:(NSArray*)ids onDevice:(AMDevice*)device;
+
+/// The file \p -iconsForIds:onDevice: last used for \p bundleId's icon, if it
+/// has one.
+- (NSString*)pathForId:(NSString*)bundleId;
+
+@end
@@ -0,0 +1,219 @@
+//
+//  AMIconCache.m
+//  mobileDeviceManager
+//
+
+#import "AMIconCache.h"
+#import "AMServiceIO.h"
+#include <sys/stat.h>
+#include <sys/time.h>
+
+// The icons kept for each application.  Each device only ever wants one, but
+// a fleet can have a few builds of an application installed at once, and they
+// shouldn't keep evicting each other.
+#define AMICONCACHE_STAMPS		4
+
+@interface AMIconCache(Private)
+- (void)setLastError:(NSString*)msg;
+- (NSString*)directoryForId:(NSString*)bundleId;
+- (void)store:(NSData*)png forId:(NSString*)bundleId stamp:(NSString*)stamp;
+- (NSArray*)iconsForId:(NSString*)bundleId;
+@end
+
+// Most recently used first - using an icon touches its file
+static NSInteger compare_mtime(id a, id b, void *context)
+{
+	struct stat sa, sb;
+	if (stat([a fileSystemRepresentation], &sa) != 0) return NSOrderedDescending;
+	if (stat([b fileSystemRepresentation], &sb) != 0) return NSOrderedAscending;
+	if (sa.st_mtime != sb.st_mtime) return sa.st_mtime > sb.st_mtime ? NSOrderedAscending : NSOrderedDescending;
+	return NSOrderedSame;
+}
+
+// Walk the icon state, noting the iconModDate of every application in it.  The
+// pages are arrays of icons, each a dictionary, or a 0 for an empty slot; a
+// folder is a dictionary whose iconLists are more pages.  Each icon is recorded
+// under both its bundle and display identifiers, as either may be asked for.
+static void collect_icons(id node, NSMutableDictionary *dates, NSMutableArray *order)
+{
+	if ([node isKindOfClass:[NSArray class]]) {
+		for (id child in node) collect_icons(child, dates, order);
+	} else if ([node isKindOfClass:[NSDictionary class]]) {
+		NSString *bundleId = [node objectForKey:@"bundleIdentifier"];
+		NSString *displayId = [node objectForKey:@"displayIdentifier"];
+		id date = [node objectForKey:@"iconModDate"];
+		if (![date isKindOfClass:[NSDate class]]) date = [NSNull null];
+		if ([bundleId isKindOfClass:[NSString class]]) {
+			if (![dates objectForKey:bundleId]) [order addObject:bundleId];
+			[dates setObject:date forKey:bundleId];
+		}
+		if ([displayId isKindOfClass:[NSString class]]) {
+			[dates setObject:date forKey:displayId];
+		}
+		collect_icons([node objectForKey:@"iconLists"], dates, order);
+	}
+}
+
+@implementation AMIconCache
+
+@synthesize connections = _connections, window = _window;
+@synthesize fetched = _fetched, cached = _cached;
+@synthesize lasterror = _lasterror;
+
+- (id)initWithDirectory:(NSString*)dir
+{
+	if ((self = [super init])) {
+		_dir = [dir copy];
+		_connections = 1;
+		_window = 8;
+	}
+	return self;
+}
+
+- (void)dealloc
+{
+	[_dir release];
+	[_lasterror release];
+	[super dealloc];
+}
+
+- (void)setLastError:(NSString*)msg
+{
+	[_lasterror release];
+	_lasterror = [msg copy];
+}
+
+- (NSString*)directoryForId:(NSString*)bundleId
+{
+	// bundle identifiers are reverse-DNS, but don't let one escape the cache
+	NSString *name = [bundleId stringByReplacingOccurrencesOfString:@"/" withString:@"_"];
+	if ([name hasPrefix:@"."]) name = [@"_" stringByAppendingString:name];
+	return [_dir stringByAppendingPathComponent:name];
+}
+
+// The icon files kept for bundleId, most recently used first
+- (NSArray*)iconsForId:(NSString*)bundleId
+{
+	NSString *dir = [self directoryForId:bundleId];
+	NSMutableArray *paths = [NSMutableArray array];
+	for (NSString *name in [[NSFileManager defaultManager] contentsOfDirectoryAtPath:dir error:nil]) {
+		if ([[name pathExtension] isEqualToString:@"png"]) [paths addObject:[dir stringByAppendingPathComponent:name]];
+	}
+	return [paths sortedArrayUsingFunction:compare_mtime context:NULL];
+}
+
+- (NSString*)pathForId:(NSString*)bundleId
+{
+	NSArray *paths = [self iconsForId:bundleId];
+	return [paths count] ? [paths objectAtIndex:0] : nil;
+}
+
+// Keep png as bundleId's icon as of stamp, dropping the least recently used
+// if there are too many
+- (void)store:(NSData*)png forId:(NSString*)bundleId stamp:(NSString*)stamp
+{
+	NSFileManager *fm = [NSFileManager defaultManager];
+	NSString *dir = [self directoryForId:bundleId];
+	NSString *path = [dir stringByAppendingPathComponent:[stamp stringByAppendingPathExtension:@"png"]];
+
+	if (![fm createDirectoryAtPath:dir withIntermediateDirectories:YES attributes:nil error:nil]) return;
+	if (![png writeToFile:path atomically:YES]) return;
+	NSArray *paths = [self iconsForId:bundleId];
+	NSUInteger i;
+	for (i = AMICONCACHE_STAMPS; i < [paths count]; i++) {
+		NSString *old = [paths objectAtIndex:i];
+		if (![old isEqualToString:path]) [fm removeItemAtPath:old error:nil];
+	}
+}
+
+- (NSDictionary*)iconsForIds:(NSArray*)ids onDevice:(AMDevice*)device
+{
+	NSMutableDictionary *result = [NSMutableDictionary dictionary];
+	NSMutableDictionary *dates = [NSMutableDictionary dictionary];
+	NSMutableArray *order = [NSMutableArray array];
+	NSMutableArray *services = [NSMutableArray array];
+	NSMutableArray *misses = [NSMutableArray array];
+	NSMutableArray *stamps = [NSMutableArray array];
+	NSUInteger n = _connections ? _connections : 1;
+	NSUInteger i, k;
+	BOOL ok = YES;
+
+	_fetched = _cached = 0;
+	for (i = 0; i < n; i++) {
+		AMSpringboardServices *sbs = [device newAMSpringboardServices];
+		if (!sbs) break;
+		[services addObject:sbs];
+		[sbs release];
+	}
+	if ([services count] == 0) {
+		[self setLastError:[NSString stringWithFormat:@"Can't start springboardservices: %@", device.lasterror]];
+		return nil;
+	}
+
+	id state = [[services objectAtIndex:0] getIconState];
+	if (!state) {
+		[self setLastError:[NSString stringWithFormat:@"Can't read the icon state: %@",
+							[[services objectAtIndex:0] lasterror]]];
+		return nil;
+	}
+	collect_icons(state, dates, order);
+	if (!ids) ids = order;
+
+	// answer what we can from disk
+	for (NSString *bundleId in ids) {
+		id date = [dates objectForKey:bundleId];
+		NSString *stamp = nil;
+		if ([date isKindOfClass:[NSDate class]]) {
+			stamp = [NSString stringWithFormat:@"%lld", (long long)[date timeIntervalSince1970]];
+			NSString *path = [[self directoryForId:bundleId] stringByAppendingPathComponent:
+							  [stamp stringByAppendingPathExtension:@"png"]];
+			NSData *png = [NSData dataWithContentsOfFile:path];
+			if ([png length]) {
+				utimes([path fileSystemRepresentation], NULL);
+				[result setObject:png forKey:bundleId];
+				_cached++;
+				continue;
+			}
+		}
+		[misses addObject:bundleId];
+		[stamps addObject:stamp ? (id)stamp : (id)[NSNull null]];
+	}
+
+	// deal the rest out between the connections, queue them all, then collect
+	// the replies in order
+	n = [services count];
+	NSMutableArray *slices = [NSMutableArray arrayWithCapacity:n];
+	NSMutableArray *pending = [NSMutableArray arrayWithCapacity:n];
+	for (k = 0; k < n; k++) [slices addObject:[NSMutableArray array]];
+	for (i = 0; i < [misses count]; i++) {
+		[[slices objectAtIndex:i % n] addObject:[misses objectAtIndex:i]];
+	}
+	for (k = 0; k < n; k++) {
+		AMSpringboardServices *sbs = [services objectAtIndex:k];
+		[pending addObject:[sbs getIconPNGDataAsync:[slices objectAtIndex:k] window:_window]];
+	}
+	for (i = 0; i < [misses count]; i++) {
+		AMServiceFuture *f = [[pending objectAtIndex:i % n] objectAtIndex:i / n];
+		NSString *bundleId = [misses objectAtIndex:i];
+		id reply = [f wait];
+		if (f.error) {
+			if (ok) [self setLastError:[NSString stringWithFormat:@"Can't fetch the icon for %@: %@", bundleId, f.error]];
+			ok = NO;
+			continue;
+		}
+		NSData *png = [reply isKindOfClass:[NSDictionary class]] ? [reply objectForKey:@"pngData"] : nil;
+		if (![png length]) continue;
+		[result setObject:png forKey:bundleId];
+		_fetched++;
+		id stamp = [stamps objectAtIndex:i];
+		if (stamp != [NSNull null]) [self store:png forId:bundleId stamp:stamp];
+	}
+	if (!ok) return nil;
+	// every reply has been read, so the connections can go back to the pool
+	for (AMSpringboardServices *sbs in services) [device recycleService:[sbs retain]];
+	[_lasterror release];
+	_lasterror = nil;
+	return result;
+}
+
+@end
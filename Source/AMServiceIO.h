@@ -0,0 +1,88 @@
+//
+//  AMServiceIO.h
+//  mobileDeviceManager
+//
+//  Asynchronous requests on AMService connections.  The sends and receives for
+//  every service on every device are multiplexed over a few shared I/O threads
+//  (see service_io.h), so a process can talk to many devices at once without a
+//  thread blocked on each socket, and a device which stops answering costs a
+//  timeout rather than a stuck thread.
+//
+
+#import <Foundation/Foundation.h>
+
+/// The shared I/O threads used for asynchronous requests.
+@interface AMServiceIO : NSObject
+
+/// The number of I/O threads to start.  Defaults to 2; only has an effect if
+/// set before the first asynchronous request.
++ (void)setThreadCount:(NSUInteger)count;
+
+/// Cancel anything outstanding on \p sock.  AMService calls this when it goes
+/// away.
++ (void)forgetSocket:(int)sock;
+
+@end
+
+/// The result of an asynchronous request made with
+/// \p -[AMService sendXMLRequestAsync:timeout:], \p -readXMLReplyAsync: or
+/// \p -requestAsync:timeout:.  It can be waited for, or given blocks to run
+/// when it finishes:
+/// <PRE>
+///    AMServiceFuture *f = [proxy requestAsync:message timeout:10];
+///    [f whenDone:^(AMServiceFuture *done) {
+///        if (done.error) NSLog(@"%@", done.error);
+///        else NSLog(@"%@", done.reply);
+///    }];
+/// </PRE>
+///
+/// Requests on the same service are carried out in the order they were made.
+/// If a request times out or is cancelled part way through, the service's
+/// message stream is out of step and every later request on it fails - the
+/// service should be discarded.
+@interface AMServiceFuture : NSObject {
+@private
+	NSCondition *_cond;				// guards everything below
+	BOOL _done;
+	id _reply;
+	NSString *_error;
+	NSData *_message;
+	uint64_t _request;
+	NSMutableArray *_whenDone;
+	int _sock;
+	uint64_t _started;				// for op_stats, 0 if it's off
+}
+
+/// YES once the request has finished, one way or another.
+@property (readonly) BOOL isDone;
+
+/// The decoded reply, if one was asked for and it arrived.
+@property (readonly) id reply;
+
+/// nil if the request succeeded, otherwise what went wrong.
+@property (readonly) NSString *error;
+
+/// Start a request on socket \p sock: send \p message (already encoded, may be
+/// nil), then if \p reply is YES read one reply.  \p timeout is in seconds, 0
+/// for none.  AMService uses this; you probably want its methods instead.
+- (id)initWithSocket:(int)sock message:(NSData*)message reply:(BOOL)reply timeout:(NSTimeInterval)timeout;
+
+/// A future which has already failed with \p error.
+- (id)initWithError:(NSString*)error;
+
+/// Block until the request finishes or \p date passes.  Returns YES if it has
+/// finished.
+- (BOOL)waitUntilDate:(NSDate*)date;
+
+/// Block until the request finishes, and return the reply (nil on failure).
+- (id)wait;
+
+/// Give up on the request.  If it hasn't finished already, it fails shortly
+/// afterwards.
+- (void)cancel;
+
+/// Call \p block when the request finishes, on one of the I/O threads - or
+/// straight away, on this thread, if it already has.
+- (void)whenDone:(void (^)(AMServiceFuture *future))block;
+
+@end
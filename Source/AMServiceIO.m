@@ -0,0 +1,215 @@
+//
+//  AMServiceIO.m
+//  mobileDeviceManager
+//
+
+#import "AMServiceIO.h"
+#import "MobileDeviceAccess.h"
+#include <errno.h>
+#include <string.h>
+#include "bplist.h"
+#include "op_stats.h"
+#include "service_io.h"
+
+static sio_loop *shared_loop = NULL;
+static NSUInteger thread_count = 2;
+
+@implementation AMServiceIO
+
++ (void)setThreadCount:(NSUInteger)count
+{
+	@synchronized (self) {
+		thread_count = count ? count : 1;
+	}
+}
+
+// the loop is started the first time it's needed, and lasts for the life of
+// the process
++ (sio_loop*)loop
+{
+	@synchronized (self) {
+		if (!shared_loop) shared_loop = sio_loop_create((unsigned)thread_count);
+		return shared_loop;
+	}
+}
+
++ (void)forgetSocket:(int)sock
+{
+	sio_loop *loop;
+	@synchronized (self) {
+		loop = shared_loop;
+	}
+	if (loop) sio_forget(loop, sock);
+}
+
+@end
+
+@interface AMServiceFuture(Private)
+- (void)finishWithStatus:(int)status reply:(uint8_t*)buf length:(uint32_t)len;
+@end
+
+// service_io callback - ctx is the future, retained for the duration
+static void future_done(void *ctx, int status, uint8_t *reply, uint32_t len)
+{
+	NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+	AMServiceFuture *future = (AMServiceFuture*)ctx;
+	[future finishWithStatus:status reply:reply length:len];
+	[future release];
+	[pool drain];
+}
+
+@implementation AMServiceFuture
+
+- (id)initWithSocket:(int)sock message:(NSData*)message reply:(BOOL)reply timeout:(NSTimeInterval)timeout
+{
+	if ((self = [super init])) {
+		sio_loop *loop = [AMServiceIO loop];
+		_cond = [[NSCondition alloc] init];
+		_whenDone = [[NSMutableArray alloc] init];
+		_message = [message retain];
+		_sock = sock;
+		_started = op_stats_start();
+		if (!loop) {
+			_done = YES;
+			_error = [@"Can't start the I/O threads" retain];
+		} else {
+			// the request may finish before sio_submit() even returns
+			uint64_t request = sio_submit(loop, sock, [_message bytes], (uint32_t)[_message length], reply,
+										  timeout, future_done, [self retain]);
+			[_cond lock];
+			_request = request;
+			[_cond unlock];
+		}
+	}
+	return self;
+}
+
+- (id)initWithError:(NSString*)error
+{
+	if ((self = [super init])) {
+		_cond = [[NSCondition alloc] init];
+		_whenDone = [[NSMutableArray alloc] init];
+		_done = YES;
+		_error = [error copy];
+	}
+	return self;
+}
+
+- (void)dealloc
+{
+	[_cond release];
+	[_reply release];
+	[_error release];
+	[_message release];
+	[_whenDone release];
+	[super dealloc];
+}
+
+- (void)finishWithStatus:(int)status reply:(uint8_t*)buf length:(uint32_t)len
+{
+	id reply = nil;
+	NSString *error = nil;
+
+	// timed from being queued, so it includes waiting behind earlier requests
+	op_stats_record((void*)(intptr_t)_sock, OP_PLIST_ASYNC, _started, status != 0,
+					buf ? len + 4 : 0, status == 0 && _message ? [_message length] + 4 : 0);
+
+	if (status == ETIMEDOUT) {
+		error = @"Timed out";
+	} else if (status == ECANCELED) {
+		error = @"Cancelled";
+	} else if (status == EPIPE) {
+		error = @"The device closed the connection";
+	} else if (status) {
+		error = [NSString stringWithFormat:@"I/O error: %s", strerror(status)];
+	} else if (buf) {
+		NSData *data = [NSData dataWithBytesNoCopy:buf length:len freeWhenDone:YES];
+		buf = NULL;
+		if (bplist_is_binary([data bytes], [data length])) {
+			reply = [AMService objectWithBinaryPlist:data];
+		} else {
+			reply = [NSPropertyListSerialization propertyListWithData:data options:NSPropertyListImmutable
+															   format:NULL error:NULL];
+		}
+		if (!reply) error = @"Can't parse reply";
+	}
+	free(buf);
+
+	[_cond lock];
+	_reply = [reply retain];
+	_error = [error retain];
+	_done = YES;
+	NSArray *blocks = [_whenDone autorelease];
+	_whenDone = nil;
+	[_message release];
+	_message = nil;
+	[_cond broadcast];
+	[_cond unlock];
+
+	for (void (^block)(AMServiceFuture*) in blocks) block(self);
+}
+
+- (BOOL)isDone
+{
+	[_cond lock];
+	BOOL done = _done;
+	[_cond unlock];
+	return done;
+}
+
+- (id)reply
+{
+	[_cond lock];
+	id reply = [[_reply retain] autorelease];
+	[_cond unlock];
+	return reply;
+}
+
+- (NSString*)error
+{
+	[_cond lock];
+	NSString *error = [[_error retain] autorelease];
+	[_cond unlock];
+	return error;
+}
+
+- (BOOL)waitUntilDate:(NSDate*)date
+{
+	[_cond lock];
+	while (!_done && [_cond waitUntilDate:date]) ;
+	BOOL done = _done;
+	[_cond unlock];
+	return done;
+}
+
+- (id)wait
+{
+	[_cond lock];
+	while (!_done) [_cond wait];
+	[_cond unlock];
+	return self.reply;
+}
+
+- (void)cancel
+{
+	[_cond lock];
+	BOOL done = _done;
+	uint64_t request = _request;
+	[_cond unlock];
+	if (!done && request) sio_cancel([AMServiceIO loop], request);
+}
+
+- (void)whenDone:(void (^)(AMServiceFuture *future))block
+{
+	[_cond lock];
+	BOOL done = _done;
+	if (!done) {
+		void (^copy)(AMServiceFuture*) = [block copy];
+		[_whenDone addObject:copy];
+		[copy release];
+	}
+	[_cond unlock];
+	if (done) block(self);
+}
+
+@end
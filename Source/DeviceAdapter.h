@@ -22,12 +22,22 @@
 <MobileDeviceAccessListener>
 {
     AMDevice *iosDevice;
+    NSMutableArray *devices;
 }
 
+/// The first device attached (or the one attached longest, if it has since gone).
 @property (nonatomic, retain) AMDevice *iosDevice;
 
+/// Every attached device, in the order they turned up.
+@property (nonatomic, readonly) NSArray *devices;
+
 - (BOOL)isDeviceConnected;
 
+/// The attached devices whose udids are listed in \p udids, in that order.  If
+/// \p udids is nil, every attached device.
+- (NSArray *)devicesWithUdids:(NSArray *)udids;
+
 - (NSString *)getAppIdForName:(NSString *)appName;
+- (NSString *)getAppIdForName:(NSString *)appName onDevice:(AMDevice *)device;
 
 @end
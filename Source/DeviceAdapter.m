@@ -12,11 +12,17 @@
 @implementation DeviceAdapter
 
 @synthesize iosDevice;
+@synthesize devices;
 
 - (id)init {
     if ((self = [super init])) {
         // Initialization code here.
+        devices = [[NSMutableArray alloc] init];
         [[MobileDeviceAccess singleton] setListener:self];
+        [[NSNotificationCenter defaultCenter] addObserver:self
+                                                 selector:@selector(fileCopyDone:)
+                                                     name:@"AFCFileCopyDone"
+                                                   object:nil];
     }
     
     return self;
@@ -24,19 +30,35 @@
 
 - (void)dealloc {
     // Clean-up code here.
+    [[NSNotificationCenter defaultCenter] removeObserver:self];
     
     self.iosDevice = nil;
+    [devices release];
     
     [super dealloc];
 }
 
+#pragma mark -
+#pragma mark AFC copy notifications
+
+- (void)fileCopyDone:(NSNotification *)notification
+{
+    NSDictionary *info = [notification userInfo];
+    NSNumber *rate = [info objectForKey:@"BytesPerSecond"];
+    if (rate) {
+        NSLog(@"Copied %@ (%@ bytes) in %.3fs, %.1f KB/s",
+              [info objectForKey:@"Source"], [info objectForKey:@"Done"],
+              [[info objectForKey:@"Elapsed"] doubleValue], [rate doubleValue] / 1024.0);
+    }
+}
+
 #pragma mark -
 #pragma mark MobileDeviceAccessListener
 
 - (void)deviceConnected:(AMDevice*)device
 {
-	
-    self.iosDevice = device;
+    [devices addObject:device];
+    if (!self.iosDevice) self.iosDevice = device;
     
     /*
 	AFCApplicationDirectory *appDir = [device newAFCApplicationDirectory:@"com.lexcycle.stanza"];
@@ -54,7 +76,24 @@
 
 - (void)deviceDisconnected:(AMDevice*)device
 {
-    self.iosDevice = nil;
+    [devices removeObject:device];
+    if (self.iosDevice == device) self.iosDevice = [devices count] ? [devices objectAtIndex:0] : nil;
+}
+
+- (NSArray *)devicesWithUdids:(NSArray *)udids
+{
+    if (!udids) return [NSArray arrayWithArray:devices];
+    
+    NSMutableArray *result = [NSMutableArray array];
+    for (NSString *udid in udids) {
+        for (AMDevice *device in devices) {
+            if ([device.udid caseInsensitiveCompare:udid] == NSOrderedSame) {
+                [result addObject:device];
+                break;
+            }
+        }
+    }
+    return result;
 }
 
 
@@ -67,14 +106,13 @@
 
 - (NSString *)getAppIdForName:(NSString *)appName
 {
-    NSArray *appList = [self.iosDevice installedApplications];
-    for (AMApplication *app in appList) {
-        if ([[app appname] isEqualToString:appName]) {
-            return [app bundleid];
-        }
-        
-    }
-    return nil;
+    return [self getAppIdForName:appName onDevice:self.iosDevice];
+}
+
+- (NSString *)getAppIdForName:(NSString *)appName onDevice:(AMDevice *)device
+{
+    // the catalog only goes to the device the first time, or once it has changed
+    return [[[device applicationCatalog] applicationNamed:appName ofType:@"User"] bundleid];
 }
 
 @end
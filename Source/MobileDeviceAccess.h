@@ -37,8 +37,11 @@
 #pragma once
 
 #import <Foundation/Foundation.h>
-//#import <CoreGraphics/CoreGraphics.h>
-#import <Cocoa/Cocoa.h>
+#include <CoreFoundation/CoreFoundation.h>
+
+#ifdef __APPLE__
+@class NSImage;
+#endif
 
 #ifdef __cplusplus
 extern "C" {
@@ -58,6 +61,16 @@ typedef struct _am_device_notification	*am_device_notification;
 //typedef struct _am_service				*am_service;
 typedef int								am_service;
 
+/// How AMService encodes the property lists it exchanges with a service.
+/// Lockdown services answer in whichever format they were sent.
+enum {
+	AMServiceCodecXML		= 0,	///< XML, as iTunes uses
+	AMServiceCodecBinary	= 1		///< bplist00 - a fraction of the size, and much quicker to parse
+};
+typedef NSUInteger AMServiceCodec;
+
+@class AMServiceFuture;
+
 /// This class represents a service running on the mobile device.  To create
 /// an instance of this class, send the \p -startService: message to an instance
 /// of AMDevice.
@@ -124,6 +137,15 @@ typedef int								am_service;
 	am_service _service;
 	NSString *_lasterror;
 	id _delegate;
+	NSString *_poolKey;							///< which AMDevice pool this can be recycled into
+	CFAbsoluteTime _pooledAt;					///< when it was last put back in the pool
+	NSString *_serviceName;
+	AMServiceCodec _codec;
+	unsigned char *_rxbuf;						///< receive buffer, reused for each reply
+	uint32_t _rxcap;
+	NSTimeInterval _timeout;
+	NSString *_codecKey;						///< device and service, for remembering a codec rejected
+	BOOL _binaryAnswered;						///< a binary request has had a reply
 }
 
 /// The last error that occurred on this service
@@ -139,6 +161,62 @@ typedef int								am_service;
 /// valid for the life of the service.
 @property (assign) id delegate;
 
+/// The encoding used for requests sent to this service.  Replies are decoded
+/// in whatever format they arrive.
+///
+/// New services start with the codec chosen for their name by
+/// \p +setCodec:forService: - binary for the services known to accept it
+/// (installation_proxy, springboardservices and house_arrest), XML for everything
+/// else.  If a device drops the connection rather than answer the first binary
+/// request, later connections to that service on that device use XML.
+///
+/// Requests whose replies are streamed (installation_proxy's Browse) are always
+/// sent as XML, since a binary reply can't be used until all of it has arrived.
+@property (assign) AMServiceCodec codec;
+
+/// Set the codec that new services called \p name start with.  If \p name is nil,
+/// every service uses \p codec.
++ (void)setCodec:(AMServiceCodec)codec forService:(NSString*)name;
+
+/// Save the raw bytes of every plist reply received from any service in \p dir,
+/// as \p <service>-<n>.plist.  Pass nil to stop.
++ (void)recordRepliesToDirectory:(NSString*)dir;
+
+/// Encode \p plist (made of NSDictionary, NSArray, NSString, NSNumber, NSData,
+/// NSDate and NSNull) as a binary property list.  Returns nil if it contains
+/// anything else.
++ (NSData*)binaryPlistWithObject:(id)plist;
+
+/// Decode a binary property list.  Returns nil if \p data isn't one.
++ (id)objectWithBinaryPlist:(NSData*)data;
+
+/// How long, in seconds, each send and receive made by the blocking request
+/// methods may wait for the device before giving up with an error.  0 waits
+/// forever.  New services start with \p +defaultTimeout.  After a timeout the
+/// connection is out of step with the device and the service should be
+/// discarded.
+@property (assign) NSTimeInterval timeout;
+
+/// The \p timeout services of this class start with: 60 seconds, except for
+/// those which wait for the device to have something to say (the syslog relay
+/// and notification proxy, which have no timeout, and the file relay, which
+/// allows longer for the archive to be gathered).
++ (NSTimeInterval)defaultTimeout;
+
+/// Send \p message without waiting.  The future finishes once it has gone.
+/// Like all the asynchronous methods, this is carried out in turn with the
+/// others on this service, on the shared I/O threads (see AMServiceIO), and fails
+/// if it hasn't finished within \p timeout seconds (0 for the service's
+/// \p timeout).
+- (AMServiceFuture*)sendXMLRequestAsync:(id)message timeout:(NSTimeInterval)timeout;
+
+/// Read the next reply without waiting.  The future's \p reply is the reply.
+- (AMServiceFuture*)readXMLReplyAsync:(NSTimeInterval)timeout;
+
+/// Send \p message and read the reply, without waiting.  The future's \p reply is
+/// the reply.
+- (AMServiceFuture*)requestAsync:(id)message timeout:(NSTimeInterval)timeout;
+
 @end
 
 /// This class represents an installed application on the device.  To retrieve
@@ -220,6 +298,88 @@ typedef int								am_service;
 
 @end
 
+@class AMDevice, AMNotificationProxy;
+
+/// This class keeps an index of the applications installed on a device, so
+/// looking one up by bundle id, name or directory costs a dictionary lookup
+/// rather than an \p AMDeviceLookupApplications round trip and a scan.  Each
+/// AMDevice has one - see \p -applicationCatalog.
+///
+/// The applications are fetched on first use.  After that the catalog is
+/// refreshed (in one round trip, with only the applications which changed
+/// being re-indexed) when:
+/// - the device reports \p com.apple.mobile.application_installed or
+///   \p com.apple.mobile.application_uninstalled (see \p -startWatching), or
+/// - \p -invalidate is called - AMDevice does this after installing something
+/// - a lookup misses in a catalog which was read from disk, and hasn't been
+///   checked against the device since
+///
+/// If \p persistInDirectory: is used, the catalog is saved in that directory
+/// as \p <udid>.plist after every refresh and read from there on first use.
+/// Before it is used, a catalog read from disk is checked with a Browse for
+/// just the bundle ids, versions and directories of the applications, and only
+/// refreshed if those have changed - which is much cheaper than fetching
+/// everything again.
+///
+/// All the methods may be called from any thread.
+@interface AMApplicationCatalog : NSObject {
+@private
+	AMDevice *_device;					///< not retained - the device owns us
+	NSRecursiveLock *_lock;
+	NSMutableDictionary *_byId;			///< bundle id -> AMApplication
+	NSMutableDictionary *_byName;		///< lower case name -> NSMutableArray of AMApplication
+	NSMutableDictionary *_byDir;		///< Container (or Path) -> AMApplication
+	BOOL _loaded;						///< something is in the indexes
+	BOOL _verified;						///< they have been fetched from the device
+	BOOL _stale;						///< the device says they have changed since
+	BOOL _checked;						///< read from disk, and found to match the device
+	NSString *_directory;
+	AMNotificationProxy *_watcher;
+	NSUInteger _refreshes;
+}
+
+/// The number of times the applications have been fetched from the device.
+@property (readonly) NSUInteger refreshes;
+
+/// Used by AMDevice.
+- (id)initWithDevice:(AMDevice*)device;
+
+/// The application with bundle id \p bundleId, or nil.
+- (AMApplication*)applicationWithId:(NSString*)bundleId;
+
+/// The application whose \p appname is \p name, ignoring case, or nil.  If
+/// several match, one whose name matches exactly is preferred.  \p type is
+/// the \p ApplicationType wanted ("User", "System"...), or nil for any.
+- (AMApplication*)applicationNamed:(NSString*)name ofType:(NSString*)type;
+
+/// The application installed in \p dir (its \p appdir), or nil.
+- (AMApplication*)applicationInDirectory:(NSString*)dir;
+
+/// Every application of \p type ("User", "System"...), or of any type if nil.
+- (NSArray*)applicationsOfType:(NSString*)type;
+
+/// Fetch the applications from the device now, and re-index those which have
+/// changed.  Returns NO, with the reason in the device's \p lasterror, if they
+/// couldn't be fetched.
+- (BOOL)refresh;
+
+/// Refresh before the next lookup.
+- (void)invalidate;
+
+/// Save the catalog in \p dir after every refresh, and read it from there if
+/// it hasn't been fetched yet.  Pass nil to stop.
+- (void)persistInDirectory:(NSString*)dir;
+
+/// Listen (through an AMNotificationProxy) for applications being installed
+/// and uninstalled, and refresh before the next lookup after one is.  As with
+/// AMNotificationProxy, notifications are delivered on the main run loop.
+- (BOOL)startWatching;
+
+/// Stop listening.
+- (void)stopWatching;
+
+@end
+
 
 /// This class represents the com.apple.mobile.notification_proxy service
 /// running on the device.  It allows programs on the Mac to send simple
@@ -351,12 +511,29 @@ com.apple.mobile.application_uninstalled
 /// the bundleIdentifier.
 - (id)getIconPNGData:(NSString*)displayIdentifier;
 
+#ifdef __APPLE__
 /// This method returns an NSImage holding the icon .png data
 /// for the requested application.
 ///
 /// The key required appears to be the displayIdentifier rather than
 /// the bundleIdentifier.
 - (NSImage*)getIcon:(NSString*)displayIdentifier;
+#endif
+
+/// Queue a getIconPNGData request for every identifier in \p ids without
+/// waiting for any of the replies.  Up to \p window requests (at least 1) are
+/// sent ahead of the reply being read, so the device always has the next one
+/// to hand rather than waiting a round trip for it.
+///
+/// Returns one AMServiceFuture per identifier, in the same order, whose
+/// \p reply is what \p -getIconPNGData: would have returned.  The requests are
+/// carried out with the service's \p timeout.
+- (NSArray*)getIconPNGDataAsync:(NSArray*)ids window:(NSUInteger)window;
+
+/// Fetch the icons for all of \p ids, pipelined as above.  Returns a dictionary
+/// of identifier -> .png NSData, leaving out any the device had no icon for, or
+/// nil (with the reason in \p lasterror) if the connection failed.
+- (NSDictionary*)getIconPNGDataForIds:(NSArray*)ids;
 
 @end
 
@@ -406,6 +583,23 @@ com.apple.mobile.application_uninstalled
 /// @param filter defines the conditions for accepting an application.
 - (NSArray *)browseFiltered:(NSPredicate*)filter;
 
+/// Browse the installed applications, calling \p block with each one as it
+/// arrives rather than collecting them all first - the request goes as XML
+/// whatever the service's codec, so that each reply can be parsed as it comes
+/// in.  Return NO from \p block to stop being called.  Returns YES once the
+/// device says the list is complete, else NO with the device's error (or why
+/// the replies stopped) in \p lasterror.
+/// @param type may be "User", "System" or "Internal", or "Any" or nil for every
+/// type.  The device does the filtering.
+/// @param bundleIds if not nil, only these applications are returned, again
+/// filtered by the device.
+/// @param attributes if not nil, only these Info.plist keys (plus those needed
+/// for \p bundleid and \p appname) are sent by the device.  On a device with
+/// hundreds of applications this shrinks the replies from megabytes to a few
+/// kilobytes.
+- (BOOL)browseType:(NSString*)type bundleIds:(NSArray*)bundleIds attributes:(NSArray*)attributes
+		usingBlock:(BOOL (^)(AMApplication *app))block;
+
 /// Return a dictionary (indexed by bundleid) of all installed applications (see AMApplication) matching the input type,
 /// and optionally filtering those that have a specific attribute in their Info.plist.
 /// @param type may be "User", "System", "Internal" or "Any"
@@ -453,15 +647,65 @@ com.apple.mobile.application_uninstalled
 - (BOOL)removeArchive:(NSString*)bundleid;
 
 /// Ask the installation daemon on the device to install an application.  pathname
-/// must be the name of a directory located in /var/mobile/Media and must contain
-/// a pre-expanded .app which must not already exist on the device
+/// must be the name of an .ipa, or of a directory containing a pre-expanded .app,
+/// located in /var/mobile/Media, and the application must not already exist on
+/// the device.  Returns YES once the device reports the installation complete;
+/// otherwise NO, with the device's error (eg "BundleVerificationFailed") in
+/// lasterror.
 - (BOOL)install:(NSString*)pathname;
 
 /// Ask the installation daemon on the device to upgrade an application.  pathname
-/// must be the name of a directory located in /var/mobile/Media and must contain
-/// a pre-expanded .app which already exists on the device
+/// is as for \p -install:, but the application already exists on the device.
+/// Returns as \p -install: does.
 - (BOOL)upgrade:(NSString*)bundleId from:(NSString*)pathname;
 
+/// Ask the installation daemon on the device to install the package at pathname
+/// (as for \p -install:), or with \p upgrade, to install it over any copy
+/// already there.  \p progress (which may be nil) is called with each status the
+/// device reports on the way, eg "VerifyingApplication", and its PercentComplete.
+/// Returns as \p -install: does.
+- (BOOL)installPackage:(NSString*)pathname upgrade:(BOOL)upgrade progress:(void (^)(NSString *status, NSInteger percent))progress;
+
+@end
+
+struct service_standin;
+
+/// This class is an AMInstallationProxy talking to an in-process stand-in for the
+/// installation daemon (see service_standin.h) over a socketpair, instead of to
+/// a device.  The stand-in knows a fixed list of applications, and answers
+/// \p Browse requests for them as a device does - honouring \p ApplicationType,
+/// \p BundleIDs and \p ReturnAttributes, sending 20 applications per reply, and
+/// replying in the encoding the request came in.  Every other command fails.
+///
+/// It is intended for timing the plist transport and the browse code without a
+/// device attached.
+@interface AMInstallationProxyStandIn : AMInstallationProxy {
+@private
+	struct service_standin *_server;
+	NSArray *_applications;
+	volatile BOOL _mute;
+	NSString *_browseError;
+}
+
+/// @param applications Info.plist style dictionaries, each with at least a
+/// \p CFBundleIdentifier and an \p ApplicationType.
+/// @param latency Delay (in seconds) added to every request.
+- (id)initWithApplications:(NSArray*)applications latency:(NSTimeInterval)latency;
+
+/// Limit the bytes carried each way to \p bytesPerSecond (0 for no limit).
+- (void)setBandwidth:(double)bytesPerSecond;
+
+/// Number of requests the stand-in has received.
+- (uint64_t)requests;
+
+/// If YES, requests are read but never answered, as by a device which has hung.
+@property (assign) BOOL mute;
+
+/// If set, a Browse lists the applications as usual but then ends with this
+/// \p Error rather than a \p Status of "Complete", as when installd gives up
+/// part way through.
+@property (copy) NSString *browseError;
+
 @end
 
 /// This class communicates with the MobileSync service.  There is a fairly complicated protocol
@@ -477,6 +721,41 @@ com.apple.mobile.application_uninstalled
 @end
 
 
+/// One record from the syslog relay, taken apart.  A relay delivers these instead
+/// of strings if its \p structured property is YES.  A record like
+/// <PRE>
+/// Oct 17 12:34:56 Johns-iPhone MobileMail[123] <Warning>: some message
+/// </PRE>
+/// has a \p host of "Johns-iPhone", \p process "MobileMail", \p pid 123,
+/// \p level LOG_WARNING and \p message "some message".  A record which isn't in
+/// that form has only a \p message.
+@interface AMSyslogMessage : NSObject {
+@private
+	NSData *_bytes;
+	uint32_t _when;
+	int _pid, _level;
+	NSRange _host, _process, _text;
+}
+
+/// The whole record.
+@property (readonly) NSString *line;
+
+/// When it was logged, by the device's clock, or nil if the record has no timestamp.
+@property (readonly) NSDate *date;
+
+@property (readonly) NSString *host;
+@property (readonly) NSString *process;
+
+/// -1 if the record has no pid.
+@property (readonly) int pid;
+
+/// LOG_EMERG (0) to LOG_DEBUG (7), as in <syslog.h>, or -1 if the record has no level.
+@property (readonly) int level;
+
+@property (readonly) NSString *message;
+
+@end
+
 /// This class communicates with the syslog_relay.
 ///
 /// To create one, send \p -newAMSyslogRelay:\p message: to an instance of AMDevice.
@@ -486,6 +765,23 @@ com.apple.mobile.application_uninstalled
 /// -(void)syslogMessageRead:(NSString*)line
 /// </PRE>
 ///
+/// When the device is busy it can log tens of thousands of lines a second, more
+/// than a listener called once per line on the main thread can keep up with.
+/// A relay created with \p -newAMSyslogRelay:\p batchMessage: instead reads
+/// the socket on a thread of its own, queues the records in a fixed size ring
+/// buffer, and hands them to the listener on the main thread as many at a time
+/// as have arrived since the last call, with a message conforming to
+/// <PRE>
+/// -(void)syslogMessagesRead:(NSArray*)lines
+/// </PRE>
+/// If the listener falls so far behind that the ring fills up, new records are
+/// counted in \p dropped and thrown away (or, if \p dropWhenFull is NO, the
+/// reading thread waits, and the device does the dropping instead).
+///
+/// Either kind of relay can be given a filter, which it applies to each record
+/// before making an NSString (or AMSyslogMessage) of it.  When only a few lines
+/// in the stream are of interest, this saves nearly all of the work.
+///
 /// Under the covers, it is implemented as a service called \p "com.apple.syslog_relay" which
 /// executes the following command on the device:
 /// <PRE>
@@ -495,9 +791,75 @@ com.apple.mobile.application_uninstalled
 	CFReadStreamRef _readstream;
 	id _listener;
 	SEL _message;
+	struct syslog_splitter *_splitter;		///< holds a record split across reads
+	struct syslog_ring *_ring;				///< batch mode: reader thread to main thread
+	CFRunLoopSourceRef _deliver;
+	pthread_t _reader;
+	BOOL _readerStarted;
+	volatile BOOL _stopping;
+	BOOL _dropWhenFull;
+	NSUInteger _batchSize;
+	NSUInteger _received, _dropped, _delivered, _maxBacklog, _filtered;
+	NSLock *_filterLock;					///< guards _nextFilter
+	struct syslog_filter *_filter;			///< used by whichever thread reads the socket
+	struct syslog_filter *_nextFilter;		///< replaces _filter before the next read
+	BOOL _structured;
+	struct syslog_store *_store;			///< like _filter, used by the reading thread
+	struct syslog_store *_nextStore;
+	struct syslog_clock *_clock;
+	time_t _readAt;
+	NSUInteger _recorded;
+	CFRunLoopTimerRef _idleTimer;			///< unbatched mode: flushes the store when quiet
 }
+
+/// The number of records read from the device / thrown away because the ring
+/// was full / passed to the listener.
+@property (readonly) NSUInteger received, dropped, delivered;
+
+/// The number of records read but not yet passed to the listener, and the most
+/// there have ever been.  Always 0 for a relay which isn't batched.
+@property (readonly) NSUInteger backlog, maxBacklog;
+
+/// Whether records arriving while the ring is full are dropped (the default)
+/// or wait for room.
+@property (assign) BOOL dropWhenFull;
+
+/// The most records passed to the listener in one call.  Defaults to 4096.
+@property (assign) NSUInteger batchSize;
+
+/// The number of records the filter has thrown away.
+@property (readonly) NSUInteger filtered;
+
+/// Pass the listener AMSyslogMessage objects instead of NSStrings.  Defaults to NO.
+@property (assign) BOOL structured;
+
+/// Only pass on records which meet all of these conditions: from one of
+/// \p processes (nil for any), at least as severe as \p level (LOG_ERR lets
+/// through errors and worse; -1 for any), and with a message containing \p text
+/// and matching the extended regular expression \p pattern (nil for either, for
+/// any).  Records without a level are never thrown away for their level.  Call
+/// with nils and -1 to pass everything again.
+///
+/// Returns NO, with the reason in \p lasterror, if \p pattern is invalid; the
+/// filter is unchanged.
+- (BOOL)filterProcesses:(NSArray*)processes level:(int)level containing:(NSString*)text matching:(NSString*)pattern;
+
+/// Also write every record which passes the filter to the syslog store in
+/// \p dir (see syslog_store.h), compressed, with an index by time and process.
+/// A new segment is started whenever the current one reaches \p segmentSize
+/// bytes (0 for 64MB).  The writing is done by the thread reading the socket,
+/// without making any objects; a batched relay with a nil listener does nothing
+/// else.  Pass nil to stop.  Returns NO, with the reason in \p lasterror, if
+/// the store can't be opened.
+- (BOOL)recordToDirectory:(NSString*)dir segmentSize:(unsigned long long)segmentSize;
+
+/// The number of records written to the store.
+@property (readonly) NSUInteger recorded;
+
 @end
 
+struct cpio_callbacks;
+
 /// This class copies back specific files or sets of files from
 /// the device, in CPIO file format.  The file format is non-negotiable and individual files
 /// cannot be requested.  Instead, the caller specifies one or more "fileset names" from the
@@ -544,8 +906,17 @@ com.apple.mobile.application_uninstalled
 /// </PRE>
 @interface AMFileRelay : AMService {
 	bool _used;
+	unsigned long long _received, _extractedFiles, _extractedBytes;
 }
 
+/// Bytes of archive (as sent, so usually compressed) read from the device by
+/// the last request.
+@property (readonly) unsigned long long received;
+
+/// The number of files and symbolic links, and bytes of file contents, written
+/// by \p -getFileSets:extractTo:.
+@property (readonly) unsigned long long extractedFiles, extractedBytes;
+
 /// Gets one or more filesets and writes the results to the nominated stream.
 /// If a problem occurs during the request, the method returns NO and
 /// lasterror will be set to an appropriate
@@ -561,6 +932,19 @@ com.apple.mobile.application_uninstalled
 /// Gets a single fileset and writes the result to the nominated stream.  This is
 /// a convenience wrapper around \p -getFileSets:
 - (bool)getFileSet:(NSString*)name into:(NSOutputStream*)output;
+
+/// Gets one or more filesets and unpacks them into \p dir as the archive
+/// arrives, rather than saving the archive and unpacking it afterward.  Paths
+/// are kept as they are on the device, relative to \p dir, and anything which
+/// would end up outside \p dir is skipped.  Fails as \p -getFileSets:into:
+/// does, and also if a file can't be written.
+- (bool)getFileSets:(NSArray*)set extractTo:(NSString*)dir;
+
+/// Gets one or more filesets and hands each entry of the archive to \p handler
+/// (see cpio_stream.h) as it arrives, along with \p ctx.  Fails as
+/// \p -getFileSets:into: does, and also if the archive is damaged or a callback
+/// returns non-zero.
+- (bool)getFileSets:(NSArray*)set handler:(const struct cpio_callbacks*)handler context:(void*)ctx;
 @end
 
 /// This class represents an open file on the device.
@@ -617,6 +1001,20 @@ com.apple.mobile.application_uninstalled
 
 @end
 
+/// Flags controlling \p -syncLocalPath:toRemoteDir:options: and
+/// \p -syncRemotePath:toLocalDir:options:
+enum {
+	AFCSyncDelete		= 1 << 0,	///< remove files from the destination which aren't in the source
+	AFCSyncChecksum		= 1 << 1,	///< compare the contents of same-sized files whose times differ
+	AFCSyncDryRun		= 1 << 2	///< report what would be done, but don't do it
+};
+typedef NSUInteger AFCSyncOptions;
+
+/// Called by \p -walkDirectory: for each entry found.  \p path is the full pathname
+/// of the entry, \p info its file info (or nil if it wasn't asked for).  Return NO
+/// to stop the walk.
+typedef BOOL (^AFCWalkBlock)(NSString *path, BOOL isdir, NSDictionary *info);
+
 /// This object manages a single file server connection to the connected device.
 /// Using it, you can open files for reading or writing.  It also provides higher-order
 /// functions such as directory scanning, directory creation and file copying.
@@ -627,8 +1025,38 @@ com.apple.mobile.application_uninstalled
 {
 @protected
 	afc_connection _afc;						///< the low-level connection
+	uint32_t _readBlockSize;					///< bytes requested per read when pulling
+	uint32_t _readWindow;						///< read requests allowed in flight when pulling
+	uint32_t _writeBlockSize;					///< bytes sent per write when pushing
 }
 
+/// The number of bytes requested from the device by each read when copying
+/// a device file to the Mac.  If zero (the default), 100K is used.
+@property (assign) uint32_t readBlockSize;
+
+/// The number of reads that may be in flight when copying a device file to the
+/// Mac.  With a window of 0 or 1 (the default) each block is read and then
+/// written before the next one is requested.  With a larger window, filled
+/// buffers are handed to a writer thread so that writes to the local disk
+/// overlap the next reads from the device.
+///
+/// Where the backend can pipeline (the native one), up to \p readWindow requests
+/// of \p readBlockSize bytes are also sent before the first reply is waited for,
+/// so the device isn't left idle for a round trip per block; at most 64 are.
+/// MobileDevice.framework waits for each reply before sending the next request,
+/// so with the framework backend the window only lets that many buffers queue
+/// for the disk.
+///
+/// Each copy posts \p "AFCFileCopyDone" with \p "Elapsed" (seconds) and
+/// \p "BytesPerSecond" in its userInfo so callers can see the throughput achieved.
+@property (assign) uint32_t readWindow;
+
+/// The number of bytes sent to the device by each write when copying a Mac file
+/// to the device.  If zero (the default), the size is chosen from the size of the
+/// file: small files go across in a single write, larger ones in chunks of
+/// 256K to 4M.
+@property (assign) uint32_t writeBlockSize;
+
 /**
  * Return a dictionary containing information about the connected device.
  *
@@ -685,6 +1113,37 @@ com.apple.mobile.application_uninstalled
  */
 - (NSArray*)recursiveDirectoryContents:(NSString*)path;
 
+/**
+ * Walk the specified directory and all subordinate directories, calling
+ * \p block for each entry as soon as it is read rather than collecting the
+ * whole tree first.  The directory itself is reported too.  Entries are not
+ * sorted.  Return NO from \p block to stop the walk early.
+ * @param path Full pathname to the directory to walk
+ * @param depth How many levels below \p path to list; 0 means no limit, 1 means
+ *		just the contents of \p path
+ * @param pattern If not nil, only entries whose names match this fnmatch()
+ *		pattern (eg. \p "*.sqlite") are reported.  Every directory is still walked.
+ * @param withInfo If YES, each entry is stat'ed as it is read and its
+ *		\p -getFileInfo: dictionary passed to \p block.  This costs no more round
+ *		trips than a plain walk, which has to probe every entry to find out whether
+ *		it is a directory.  An entry which can't be stat'ed (nor, if it is a
+ *		directory, anything in it) isn't passed to \p block; the rest of the walk
+ *		carries on, then it returns NO with the number of such entries in
+ *		\p lasterror.
+ * @param helpers Other connections, rooted at the same place, which will list
+ *		directories in parallel on their own threads.  \p block is never called
+ *		by more than one thread at a time.  May be nil.
+ */
+- (BOOL)walkDirectory:(NSString*)path depth:(NSUInteger)depth matching:(NSString*)pattern
+			 withInfo:(BOOL)withInfo helpers:(NSArray*)helpers usingBlock:(AFCWalkBlock)block;
+
+/**
+ * Walk a directory on this connection alone.  See
+ * \p -walkDirectory:depth:matching:withInfo:helpers:usingBlock:
+ */
+- (BOOL)walkDirectory:(NSString*)path depth:(NSUInteger)depth matching:(NSString*)pattern
+			 withInfo:(BOOL)withInfo usingBlock:(AFCWalkBlock)block;
+
 /**
  * Open a file for reading.
  * @param path Full pathname to the file to open
@@ -767,6 +1226,29 @@ com.apple.mobile.application_uninstalled
  */
 - (BOOL)copyRemoteFile:(NSString*)path1 toLocalDir:(NSString*)path2;
 
+/**
+ * Make the device directory \p topath contain an up-to-date copy of the local
+ * file or directory \p frompath, copying only what has changed.  A file is
+ * considered unchanged if the device copy has the same size and is no older
+ * than the local one.  Changed files are written to a temporary name and then
+ * renamed over the original, so a failed sync never leaves a half-written file.
+ * @param frompath Full pathname of the local file/directory
+ * @param topath Full pathname of the device directory to sync into
+ * @param options A combination of AFCSyncOptions flags
+ */
+- (BOOL)syncLocalPath:(NSString*)frompath toRemoteDir:(NSString*)topath options:(AFCSyncOptions)options;
+
+/**
+ * Make the local directory \p topath contain an up-to-date copy of the device
+ * file or directory \p frompath, copying only what has changed.  Pulled files
+ * are given the device's modification time, so a file is considered unchanged
+ * if its size and modification time match the device copy.
+ * @param frompath Full pathname of the device file/directory
+ * @param topath Full pathname of the local directory to sync into
+ * @param options A combination of AFCSyncOptions flags
+ */
+- (BOOL)syncRemotePath:(NSString*)frompath toLocalDir:(NSString*)topath options:(AFCSyncOptions)options;
+
 /**
  * Close this connection.  From this point on, none of the other functions
  * will run correctly.
@@ -850,6 +1332,42 @@ com.apple.mobile.application_uninstalled
 }
 @end
 
+struct afc_standin;
+
+/// This class represents an AFC connection to a directory on the Mac, served by
+/// an in-process stand-in for afcd (see afc_standin.h) over a socketpair.  It
+/// behaves exactly like the other AFCDirectoryAccess subclasses, since it goes
+/// through the same MobileDevice.framework calls, and is intended for exercising
+/// and timing the copy code without a device attached.
+///
+/// To create one, use \p -initWithRoot:latency: - no AMDevice is required.
+@interface AFCStandInDirectory : AFCDirectoryAccess {
+@private
+	struct afc_standin *_server;
+}
+
+/// Serve the local directory \p root.
+/// @param root Full pathname of the local directory which will appear as "/"
+/// @param latency Delay (in seconds) injected before every reply, to approximate
+/// the round-trip to a real device.
+- (id)initWithRoot:(NSString*)root latency:(NSTimeInterval)latency;
+
+/// Change the injected latency (in seconds).
+- (void)setLatency:(NSTimeInterval)latency;
+
+/// Limit the bytes carried each way to \p bytesPerSecond (0 for no limit), to
+/// approximate the USB link.
+- (void)setBandwidth:(double)bytesPerSecond;
+
+/// Fail every read which would go past byte \p offset of a file (0 for never),
+/// to exercise error handling part way through a copy.
+- (void)failReadsFrom:(uint64_t)offset;
+
+/// Number of AFC requests the stand-in has served.
+- (uint64_t)requests;
+
+@end
+
 /// This class represents a connected device
 /// (iPhone or iPod Touch).
 @interface AMDevice : NSObject {
@@ -860,6 +1378,23 @@ com.apple.mobile.application_uninstalled
 	NSString *_udid;
 	
 	bool _connected, _insession;
+
+	NSRecursiveLock *_sessionLock;				///< guards the session and the service pool
+	NSUInteger _sessionUsers;					///< callers currently inside the session
+	CFAbsoluteTime _sessionLastUsed;
+	NSTimeInterval _sessionIdleTimeout;
+	NSTimeInterval _keepAliveInterval;
+	NSMutableDictionary *_servicePool;			///< pool key -> NSMutableArray of idle services
+	CFRunLoopTimerRef _idleTimer;				///< checks on the idle session, on the main run loop
+	NSUInteger _sessionHits, _sessionMisses;
+	NSUInteger _poolHits, _poolMisses;
+
+	NSMutableDictionary *_valueCache;			///< "domain\tkey" -> value (or NSNull)
+	NSMutableDictionary *_valueCacheTimes;		///< "domain\tkey" -> NSNumber fetch time
+	NSTimeInterval _valueCacheTTL;
+	AMNotificationProxy *_valueWatcher;
+	AMApplicationCatalog *_catalog;
+	NSTimeInterval _attachLatency;
 }
 
 /// The last error that occurred on this device
@@ -899,6 +1434,54 @@ com.apple.mobile.application_uninstalled
 /// The same value may be retrieved by passing \p "SerialNumber" to \p -deviceValueForKey:
 @property (readonly) NSString *serialNumber;	// "5984999T14P"
 
+/// How long, in seconds, the lockdown session is kept open after the last caller
+/// has finished with it.  Every factory method below, \p -deviceValueForKey: and
+/// \p -installedApplications need a session; keeping one warm saves a full
+/// connect/handshake for each of them.  Idle sessions are closed by a timer on the
+/// main run loop, whichever thread used them, and when the device is released.  Set to 0 to close the session as soon as it is idle, which is how
+/// things used to work.  Defaults to 30 seconds.
+@property (assign) NSTimeInterval sessionIdleTimeout;
+
+/// The device drops sessions (and service connections) which sit idle for too
+/// long.  A session or pooled service which has been idle for longer than this
+/// is checked with a cheap request before it is reused, and replaced if it has
+/// gone away.  While a session is idle it is also pinged this often.  Defaults
+/// to 10 seconds.
+@property (assign) NSTimeInterval keepAliveInterval;
+
+/// The number of times a warm session was reused / a new session had to be started.
+@property (readonly) NSUInteger sessionHits, sessionMisses;
+
+/// The number of times a service connection was handed out from the pool /
+/// had to be started from scratch.  See \p -recycleService:
+@property (readonly) NSUInteger poolHits, poolMisses;
+
+/// How long after MobileDeviceAccess started listening for devices this one was
+/// announced and ready to use, in seconds.  For a device which was already
+/// plugged in, that is how long it took to be enumerated and opened.
+@property (readonly) NSTimeInterval attachLatency;
+
+/// Start (or reuse) a lockdown session.  Each successful call must be balanced by
+/// a call to \p -releaseSession.  Calls may be nested.
+- (bool)acquireSession;
+
+/// Finish with a session obtained with \p -acquireSession.
+- (void)releaseSession;
+
+/// Hand a service connection obtained from one of the \p -newAFC... methods,
+/// \p -newAMInstallationProxyWithDelegate: or \p -newAMSpringboardServices back
+/// to the device instead of releasing it.  The next request for the same
+/// service (and for \p -newAFCApplicationDirectory:, the same application) will
+/// get it back without having to start the service again.  Any files opened on
+/// the connection must have been closed, and no requests may be outstanding.
+/// Services which stream (syslog_relay, file_relay, notification_proxy) or hold
+/// state between requests (mobilesync) aren't pooled; they are just released.
+/// The caller's reference is consumed.
+- (void)recycleService:(AMService*)service;
+
+/// Close every pooled service connection and the session, if it isn't in use.
+- (void)drainPool;
+
 /// Create a file service connection which can access the media directory.
 /// This uses the service \p "com.apple.afc" which is present on all devices
 /// and only allows access to the \p "/var/mobile/Media" directory structure
@@ -950,6 +1533,13 @@ com.apple.mobile.application_uninstalled
 /// @param message This is the message sent to the \p listener object.
 - (AMSyslogRelay*)newAMSyslogRelay:(id)listener message:(SEL)message;
 
+/// Create an instance of AMSyslogRelay which reads on a thread of its own
+/// and passes messages on in batches.
+/// @param listener This object will be sent an array of the messages
+/// recieved since it was last notified, on the main thread
+/// @param message This is the message sent to the \p listener object.
+- (AMSyslogRelay*)newAMSyslogRelay:(id)listener batchMessage:(SEL)message;
+
 /// Create a mobile sync relay.  Allows synchronisation of information
 /// with the device. For more information, see AMMobileSync.
 - (AMMobileSync*)newAMMobileSync;
@@ -1448,16 +2038,57 @@ com.apple.mobile.application_uninstalled
 /// that it doesn't always return *all* values.
 - (id)allDeviceValuesForDomain:(NSString*)domain;
 
+/// Returns a dictionary containing the values for each of \p keys in \p domain
+/// (which may be nil for the root domain), fetched in a single lockdown session.
+/// Keys which the device doesn't have a value for are left out of the result.
+/// If \p keys is nil, every value in the domain is returned.
+///
+/// Values are remembered for \p valueCacheTTL seconds, so asking for the same
+/// keys again (through this or any of the other value methods) doesn't go near
+/// the device.
+- (NSDictionary*)deviceValuesForKeys:(NSArray*)keys inDomain:(NSString*)domain;
+
+/// How long, in seconds, device values are cached for.  0 disables the cache.
+/// Defaults to 60 seconds.
+@property (assign) NSTimeInterval valueCacheTTL;
+
+/// Forget every cached device value.
+- (void)invalidateDeviceValues;
+
+/// Listen (via AMNotificationProxy) for the lockdown notifications that say a
+/// value has changed - \p "com.apple.mobile.lockdown.device_name_changed" and
+/// friends - and drop the affected values from the cache when they arrive.  As
+/// with AMNotificationProxy, notifications are delivered on the main run loop.
+- (bool)startWatchingDeviceValues;
+
+/// Stop listening for value change notifications.
+- (void)stopWatchingDeviceValues;
+
 /// Return a array of applications, each of which is represented by an instance
 /// of AMApplication.  Note that this only returns details for applications installed
 /// by iTunes.  For other (system) applications, use NSInstallationProxy to browse.
+/// This always asks the device, and brings \p -applicationCatalog up to date
+/// while it's at it.
 - (NSArray*)installedApplications;
 
 /// Check whether the specified bundleId corresponds to an application
 /// installed on the device.  If so, return an appropriate AMApplication.
-/// Otherwise return nil.
+/// Otherwise return nil.  This is answered by \p -applicationCatalog.
 - (AMApplication*)installedApplicationWithId:(NSString*)bundleId;
 
+/// The index of the applications installed on the device, created on first use.
+/// See AMApplicationCatalog.
+- (AMApplicationCatalog*)applicationCatalog;
+
+/// Copy the .ipa, or directory containing an expanded .app, at \p path into
+/// PublicStaging on the device over AFC, and install it from there as soon as
+/// it has arrived, replacing any copy already installed.  Only what has changed
+/// since the package was last staged is sent (see AFCStagingCache).  \p progress (which
+/// may be nil) is called with "Uploading" and then as for
+/// AMInstallationProxy's \p -installPackage:upgrade:progress:.  Returns NO, with
+/// the reason in lasterror, if either step fails.
+- (BOOL)installPackageAtPath:(NSString*)path progress:(void (^)(NSString *status, NSInteger percent))progress;
+
 @end
 
 /// An object must implement this protocol if it is to be passed as a listener
@@ -1480,6 +2111,7 @@ com.apple.mobile.application_uninstalled
 	am_device_notification _notification;
 	NSMutableArray *_devices;
 	BOOL _waitingInRunLoop;
+	CFAbsoluteTime _subscribedAt;
 }
 
 /// Returns an array of AMDevice objects representing the currently
@@ -1489,18 +2121,55 @@ com.apple.mobile.application_uninstalled
 /// Returns the one true instance of \c MobileDeviceAccess
 + (MobileDeviceAccess*)singleton;
 
+/// Choose what talks to devices: \p "framework", MobileDevice.framework (the
+/// default, where it is installed), or \p "native", which speaks the usbmuxd,
+/// lockdown and AFC protocols itself and needs only a usbmuxd to connect to.
+/// The native backend has no TLS, and every paired device insists on it, so in
+/// practice it only works against AMUsbmuxdStandIn.  Call this before anything
+/// else - devices and services already opened belong to the backend that
+/// opened them.  Returns NO if there is no such backend, or MobileDevice isn't
+/// installed.
++ (BOOL)useBackend:(NSString*)name;
+
+/// The name of the backend in use.
++ (NSString*)backendName;
+
+/// Where the native backend finds usbmuxd: a socket path, or "host:port".  nil
+/// means $USBMUXD_SOCKET_ADDRESS, or failing that /var/run/usbmuxd.
++ (void)setUsbmuxAddress:(NSString*)address;
+
 /// Nominate the entity that will recieve notifications about device
 /// connections and disconnections.  The listener object must implement
 /// the MobileDeviceAccessListener protocol.
 - (bool)setListener:(id<MobileDeviceAccessListener>)listener;
 
-/// \deprecated
+/// \deprecated Use \p -waitForDevice:timeout:
 ///
 /// This method allows the caller to wait till a connection has been
 /// made.  It sits in a run loop and does not return till a device
 /// connects.
 - (bool)waitForConnection;
 
+/// Wait for the device whose udid is \p udid (or, if \p udid is nil, any
+/// device) to be attached, running the current run loop so the attach
+/// notifications can arrive.  Returns as soon as it is, or straight away if it
+/// already is.  Returns nil if it hasn't turned up within \p timeout seconds
+/// (0 waits forever).
+///
+/// Devices are announced on the run loop of the thread which first asked for
+/// them, so call this from that thread - normally the main one.
+- (AMDevice*)waitForDevice:(NSString*)udid timeout:(NSTimeInterval)timeout;
+
+/// Wait, as above, until every device in \p udids is attached.  Returns those
+/// of them which are by then, in the order of \p udids, so a short array means
+/// the time ran out.
+- (NSArray*)waitForDevicesWithUdids:(NSArray*)udids timeout:(NSTimeInterval)timeout;
+
+/// Wait, as above, until at least \p count devices are attached.  Returns the
+/// attached devices, in the order they turned up, so fewer than \p count means
+/// the time ran out.
+- (NSArray*)waitForDevices:(NSUInteger)count timeout:(NSTimeInterval)timeout;
+
 /// Call this method to treat the nominated device as "disconnected".  Note,
 /// this does not disconnect the device from Mac OS X - only from the
 /// MobileDeviceAccess singleton
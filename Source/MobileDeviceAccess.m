@@ -6,35 +6,38 @@
 //  Copyright 2009 Tristero Computer Systems. All rights reserved.
 //
 #import "MobileDeviceAccess.h"
+#import "AMServiceIO.h"
+#import "AFCStagingCache.h"
+#import "MobileDeviceBackend.h"
 #include <unistd.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <syslog.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
-#include <mach/error.h>
-#include <AppKit/NSApplication.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <poll.h>
+#include <pthread.h>
+#ifdef __APPLE__
+#import <AppKit/AppKit.h>
+#endif
+#include "afc_standin.h"
+#include "bplist.h"
+#include "cpio_stream.h"
+#include "op_stats.h"
+#include "plist_stream.h"
+#include "service_standin.h"
+#include "syslog_ingest.h"
+#include "syslog_record.h"
+#include "syslog_store.h"
 
 #pragma mark MobileDevice.framework internals
 
-// opaque structures
-typedef struct _afc_directory			*afc_directory;
-typedef struct _afc_dictionary			*afc_dictionary;
-
-// Messages passed to device notification callbacks: passed as part of
-// am_device_notification_callback_info.
-typedef enum {
-	ADNCI_MSG_CONNECTED		= 1,
-	ADNCI_MSG_DISCONNECTED	= 2,
-	ADNCI_MSG_UNSUBSCRIBED	= 3
-} adnci_msg;
-
-struct am_device_notification_callback_info {
-	am_device	dev;				// 0    device
-	uint32_t	msg;				// 4    one of adnci_msg
-} __attribute__ ((packed));
-
-// The type of the device notification callback function.
-typedef void (*am_device_notification_callback)(struct am_device_notification_callback_info *,void* callback_data);
+// The structures and callback types are in MobileDeviceBackend.h, which the
+// native backend shares.
 
 // notification related functions
 mach_error_t AMDeviceNotificationSubscribe(
@@ -171,17 +174,577 @@ afc_error_t AFCKeyValueClose(afc_dictionary dict);
 mach_error_t AMDPostNotification(am_service socket, CFStringRef notification, CFStringRef userinfo);
 mach_error_t AMDShutdownNotificationProxy(am_service socket);
 mach_error_t AMDObserveNotification(am_service socket, CFStringRef notification);
-typedef void (*NOTIFY_CALLBACK)(CFStringRef notification, void* data);
 mach_error_t AMDListenForNotifications(am_service socket, NOTIFY_CALLBACK cb, void* data);
 
+#pragma mark backends
+
+// The framework only exists on OSX; elsewhere the native backend is all there is.
+#ifndef MD_FRAMEWORK_BACKEND
+#ifdef __APPLE__
+#define MD_FRAMEWORK_BACKEND	1
+#else
+#define MD_FRAMEWORK_BACKEND	0
+#endif
+#endif
+
+#if MD_FRAMEWORK_BACKEND
+static const md_backend framework_backend = {
+	.name							= "framework",
+	.AMDeviceNotificationSubscribe	= AMDeviceNotificationSubscribe,
+	.AMDeviceConnect				= AMDeviceConnect,
+	.AMDeviceDisconnect				= AMDeviceDisconnect,
+	.AMDeviceCopyValue				= AMDeviceCopyValue,
+	.AMDeviceStartSession			= AMDeviceStartSession,
+	.AMDeviceStopSession			= AMDeviceStopSession,
+	.AMDeviceStartService			= AMDeviceStartService,
+	.AMDeviceLookupApplications		= AMDeviceLookupApplications,
+	.AMDPostNotification			= AMDPostNotification,
+	.AMDShutdownNotificationProxy	= AMDShutdownNotificationProxy,
+	.AMDObserveNotification			= AMDObserveNotification,
+	.AMDListenForNotifications		= AMDListenForNotifications,
+	.AFCConnectionOpen				= AFCConnectionOpen,
+	.AFCConnectionClose				= AFCConnectionClose,
+	.AFCGetClientVersionString		= AFCGetClientVersionString,
+	.AFCDirectoryOpen				= AFCDirectoryOpen,
+	.AFCDirectoryRead				= AFCDirectoryRead,
+	.AFCDirectoryClose				= AFCDirectoryClose,
+	.AFCDirectoryCreate				= AFCDirectoryCreate,
+	.AFCRemovePath					= AFCRemovePath,
+	.AFCRenamePath					= AFCRenamePath,
+	.AFCLinkPath					= AFCLinkPath,
+	.AFCFileRefOpen					= AFCFileRefOpen,
+	.AFCFileRefClose				= AFCFileRefClose,
+	.AFCFileRefSeek					= AFCFileRefSeek,
+	.AFCFileRefTell					= AFCFileRefTell,
+	.AFCFileRefRead					= AFCFileRefRead,
+	.AFCFileRefSetFileSize			= AFCFileRefSetFileSize,
+	.AFCFileRefWrite				= AFCFileRefWrite,
+	.AFCDeviceInfoOpen				= AFCDeviceInfoOpen,
+	.AFCFileInfoOpen				= AFCFileInfoOpen,
+	.AFCKeyValueRead				= AFCKeyValueRead,
+	.AFCKeyValueClose				= AFCKeyValueClose,
+};
+
+static const md_backend *backend = &framework_backend;
+
+// MobileDevice is weak-linked, since it only comes with iTunes: where it isn't
+// installed its functions are all NULL, and the native backend is used instead
+extern mach_error_t AMDeviceNotificationSubscribe(am_device_notification_callback callback, uint32_t unused0,
+												  uint32_t unused1, void *callback_data,
+												  am_device_notification *notification) __attribute__((weak_import));
+
+static BOOL framework_installed(void)
+{
+	return AMDeviceNotificationSubscribe != NULL;
+}
+#else
+static const md_backend *backend = &md_native_backend;
+#endif
+
+#pragma mark instrumentation
+
+// The calls worth timing (see op_stats.h) go through these wrappers, which the
+// #defines below substitute for the framework functions in the rest of this
+// file; the rest go straight to the backend.  Service sockets and AFC
+// connections are bound to the device they were opened on as they are created.
+static mach_error_t timed_AMDeviceConnect(am_device device)
+{
+	uint64_t t = op_stats_start();
+	mach_error_t ret = backend->AMDeviceConnect(device);
+	op_stats_record(device, OP_DEVICE_CONNECT, t, ret != 0, 0, 0);
+	return ret;
+}
+
+static mach_error_t timed_AMDeviceStartSession(am_device device)
+{
+	uint64_t t = op_stats_start();
+	mach_error_t ret = backend->AMDeviceStartSession(device);
+	op_stats_record(device, OP_START_SESSION, t, ret != 0, 0, 0);
+	return ret;
+}
+
+static mach_error_t timed_AMDeviceStartService(am_device device, CFStringRef service_name, am_service *handle, uint32_t *unknown)
+{
+	uint64_t t = op_stats_start();
+	mach_error_t ret = backend->AMDeviceStartService(device, service_name, handle, unknown);
+	op_stats_record(device, OP_START_SERVICE, t, ret != 0, 0, 0);
+	if (ret == 0) op_stats_bind((void*)(intptr_t)*handle, device);
+	return ret;
+}
+
+static afc_error_t timed_AFCConnectionOpen(am_service handle, uint32_t io_timeout, afc_connection *conn)
+{
+	afc_error_t ret = backend->AFCConnectionOpen(handle, io_timeout, conn);
+	if (ret == 0) op_stats_bind(*conn, (void*)(intptr_t)handle);
+	return ret;
+}
+
+static afc_error_t timed_AFCConnectionClose(afc_connection conn)
+{
+	op_stats_unbind(conn);
+	return backend->AFCConnectionClose(conn);
+}
+
+static afc_error_t timed_AFCFileRefOpen(afc_connection conn, const char *path, uint64_t mode, afc_file_ref *ref)
+{
+	uint64_t t = op_stats_start();
+	afc_error_t ret = backend->AFCFileRefOpen(conn, path, mode, ref);
+	op_stats_record(conn, OP_AFC_OPEN, t, ret != 0, 0, 0);
+	return ret;
+}
+
+static afc_error_t timed_AFCFileRefRead(afc_connection conn, afc_file_ref ref, void *buf, uint64_t *len)
+{
+	uint64_t t = op_stats_start();
+	afc_error_t ret = backend->AFCFileRefRead(conn, ref, buf, len);
+	op_stats_record(conn, OP_AFC_READ, t, ret != 0, ret == 0 ? *len : 0, 0);
+	return ret;
+}
+
+static afc_error_t timed_AFCFileRefWrite(afc_connection conn, afc_file_ref ref, const void *buf, uint32_t len)
+{
+	uint64_t t = op_stats_start();
+	afc_error_t ret = backend->AFCFileRefWrite(conn, ref, buf, len);
+	op_stats_record(conn, OP_AFC_WRITE, t, ret != 0, 0, ret == 0 ? len : 0);
+	return ret;
+}
+
+static afc_error_t timed_AFCDirectoryOpen(afc_connection conn, const char *path, afc_directory *dir)
+{
+	uint64_t t = op_stats_start();
+	afc_error_t ret = backend->AFCDirectoryOpen(conn, path, dir);
+	// 4 just means it's a file
+	op_stats_record(conn, OP_AFC_DIR_OPEN, t, ret != 0 && ret != 4, 0, 0);
+	return ret;
+}
+
+static afc_error_t timed_AFCDirectoryRead(afc_connection conn, afc_directory dir, char **dirent)
+{
+	uint64_t t = op_stats_start();
+	afc_error_t ret = backend->AFCDirectoryRead(conn, dir, dirent);
+	op_stats_record(conn, OP_AFC_DIR_READ, t, ret != 0, 0, 0);
+	return ret;
+}
+
+static afc_error_t timed_AFCFileInfoOpen(afc_connection conn, const char *path, afc_dictionary *info)
+{
+	uint64_t t = op_stats_start();
+	afc_error_t ret = backend->AFCFileInfoOpen(conn, path, info);
+	op_stats_record(conn, OP_AFC_FILE_INFO, t, ret != 0, 0, 0);
+	return ret;
+}
+
+#define AMDeviceConnect			timed_AMDeviceConnect
+#define AMDeviceStartSession	timed_AMDeviceStartSession
+#define AMDeviceStartService	timed_AMDeviceStartService
+#define AFCConnectionOpen		timed_AFCConnectionOpen
+#define AFCConnectionClose		timed_AFCConnectionClose
+#define AFCFileRefOpen			timed_AFCFileRefOpen
+#define AFCFileRefRead			timed_AFCFileRefRead
+#define AFCFileRefWrite			timed_AFCFileRefWrite
+#define AFCDirectoryOpen		timed_AFCDirectoryOpen
+#define AFCDirectoryRead		timed_AFCDirectoryRead
+#define AFCFileInfoOpen			timed_AFCFileInfoOpen
+
+#define AMDeviceNotificationSubscribe	backend->AMDeviceNotificationSubscribe
+#define AMDeviceDisconnect				backend->AMDeviceDisconnect
+#define AMDeviceCopyValue				backend->AMDeviceCopyValue
+#define AMDeviceStopSession				backend->AMDeviceStopSession
+#define AMDeviceLookupApplications		backend->AMDeviceLookupApplications
+#define AMDPostNotification				backend->AMDPostNotification
+#define AMDShutdownNotificationProxy	backend->AMDShutdownNotificationProxy
+#define AMDObserveNotification			backend->AMDObserveNotification
+#define AMDListenForNotifications		backend->AMDListenForNotifications
+#define AFCGetClientVersionString		backend->AFCGetClientVersionString
+#define AFCDirectoryClose				backend->AFCDirectoryClose
+#define AFCDirectoryCreate				backend->AFCDirectoryCreate
+#define AFCRemovePath					backend->AFCRemovePath
+#define AFCRenamePath					backend->AFCRenamePath
+#define AFCLinkPath						backend->AFCLinkPath
+#define AFCFileRefClose					backend->AFCFileRefClose
+#define AFCFileRefSeek					backend->AFCFileRefSeek
+#define AFCFileRefTell					backend->AFCFileRefTell
+#define AFCFileRefSetFileSize			backend->AFCFileRefSetFileSize
+#define AFCDeviceInfoOpen				backend->AFCDeviceInfoOpen
+#define AFCKeyValueRead					backend->AFCKeyValueRead
+#define AFCKeyValueClose				backend->AFCKeyValueClose
+
+// Have reads and writes on conn go out chunk bytes at a time, window of them
+// in flight.  NO if the backend can't - the framework waits for each reply.
+static BOOL afc_set_pipeline(afc_connection conn, uint32_t chunk, uint32_t window)
+{
+	if (!backend->AFCConnectionSetPipeline) return NO;
+	backend->AFCConnectionSetPipeline(conn, chunk, window);
+	return YES;
+}
+
 @interface AMDevice(Private)
 - (am_service)_startService:(NSString*)name;
+- (void)sessionIdleCheck;
+- (NSDictionary*)lookupApplications;
+- (void)setAttachLatency:(NSTimeInterval)latency;
+@end
+
+@interface MobileDeviceAccess(Private)
+- (BOOL)subscribe;
+- (BOOL)waitUntil:(BOOL (^)(void))done timeout:(NSTimeInterval)timeout;
+- (AMDevice*)attachedDevice:(NSString*)udid;
+@end
+
+@interface AMApplicationCatalog(Private)
+- (void)takeApplications:(NSDictionary*)apps verified:(BOOL)verified;
+- (void)load;
+- (void)save;
+@end
+
+// bookkeeping for AMDevice's service pool
+@interface AMService(Pool)
+- (NSString*)poolKey;
+- (void)setPoolKey:(NSString*)key;
+- (CFAbsoluteTime)pooledAt;
+- (void)setPooledAt:(CFAbsoluteTime)when;
+- (BOOL)pooledConnectionIsAlive;
+@end
+
+@interface AMService(Codec)
++ (AMServiceCodec)codecForService:(NSString*)name;
++ (AMServiceCodec)codecForService:(NSString*)name key:(NSString*)key;
+- (void)recordReply:(const void*)buf length:(uint32_t)len;
+- (void)binaryRequestRejected;
+- (NSData*)encodeRequest:(id)message;
+- (bool)sendRequest:(id)message codec:(AMServiceCodec)codec;
+- (id)readXMLReplyStreaming:(NSString*)key toBlock:(void (^)(id entry))block;
+@end
+
+@interface AMInstallationProxyStandIn(Private)
+- (NSArray*)repliesTo:(id)request;
+@end
+
+@interface AMSyslogRelay(Batch)
+- (void)deliverBatch;
+- (id)objectForRecord:(const char*)rec length:(size_t)len parsed:(const syslog_record*)parsed;
+@end
+
+@interface AMSyslogMessage(Private)
+- (id)initWithRecord:(const char*)rec length:(size_t)len parsed:(const syslog_record*)parsed;
 @end
 
+@interface AMInstallationProxy(Command)
+- (BOOL)performCommand:(NSDictionary*)message progress:(void (^)(NSString *status, NSInteger percent))progress;
+@end
+
+@interface AMFileRelay(Archive)
+- (bool)requestFileSets:(NSArray*)set;
+- (bool)receiveArchive:(BOOL (^)(const void *buf, size_t len))block;
+@end
+
+#pragma mark property list codec
+
+// service name -> NSNumber(AMServiceCodec), see +setCodec:forService:
+static NSMutableDictionary *service_codecs = nil;
+static AMServiceCodec default_codec = AMServiceCodecXML;
+// "<udid> <service name>" of each service a device wouldn't take binary requests for
+static NSMutableSet *binary_rejected = nil;
+
+// see +recordRepliesToDirectory:
+static NSString *reply_directory = nil;
+static unsigned reply_count = 0;
+
+// Convert a Foundation property list into a bplist tree allocated from arena.
+// Data nodes point at the bytes of the NSData objects, so the plist must outlive
+// the tree.  Returns NULL if it holds something a property list can't.
+static bplist_node *plist_node_from_object(id obj, bplist_arena *arena)
+{
+	bplist_node *n = NULL;
+
+	if ([obj isKindOfClass:[NSString class]]) {
+		CFStringRef str = (CFStringRef)obj;
+		const char *fast = CFStringGetCStringPtr(str, kCFStringEncodingUTF8);
+		if (fast) return bplist_new_string(arena, fast, strlen(fast));
+		CFIndex len = CFStringGetLength(str), used = 0;
+		CFIndex max = CFStringGetMaximumSizeForEncoding(len, kCFStringEncodingUTF8);
+		char *buf = bplist_alloc(arena, max + 1);
+		if (!buf || !(n = bplist_new(arena, BPLIST_STRING))) return NULL;
+		CFStringGetBytes(str, CFRangeMake(0, len), kCFStringEncodingUTF8, 0, false, (UInt8*)buf, max, &used);
+		buf[used] = 0;
+		n->v.string = buf;
+		n->count = used;
+	} else if ([obj isKindOfClass:[NSNumber class]]) {
+		if (CFGetTypeID((CFTypeRef)obj) == CFBooleanGetTypeID()) {
+			if ((n = bplist_new(arena, BPLIST_BOOL))) n->v.integer = [obj boolValue];
+		} else if (CFNumberIsFloatType((CFNumberRef)obj)) {
+			if ((n = bplist_new(arena, BPLIST_REAL))) n->v.real = [obj doubleValue];
+		} else {
+			n = bplist_new_int(arena, [obj longLongValue]);
+		}
+	} else if ([obj isKindOfClass:[NSData class]]) {
+		if ((n = bplist_new(arena, BPLIST_DATA))) {
+			n->v.data = [obj bytes];
+			n->count = [obj length];
+		}
+	} else if ([obj isKindOfClass:[NSDate class]]) {
+		if ((n = bplist_new(arena, BPLIST_DATE))) n->v.real = [obj timeIntervalSinceReferenceDate];
+	} else if ([obj isKindOfClass:[NSNull class]]) {
+		n = bplist_new(arena, BPLIST_NULL);
+	} else if ([obj isKindOfClass:[NSArray class]]) {
+		NSUInteger i = 0;
+		if (!(n = bplist_new_container(arena, BPLIST_ARRAY, [obj count]))) return NULL;
+		for (id item in obj) {
+			if (!(n->v.items[i++] = plist_node_from_object(item, arena))) return NULL;
+		}
+	} else if ([obj isKindOfClass:[NSDictionary class]]) {
+		NSUInteger i = 0, count = [obj count];
+		if (!(n = bplist_new_container(arena, BPLIST_DICT, count))) return NULL;
+		for (id key in obj) {
+			if (![key isKindOfClass:[NSString class]]) return NULL;
+			if (!(n->v.items[i] = plist_node_from_object(key, arena))) return NULL;
+			if (!(n->v.items[count + i] = plist_node_from_object([obj objectForKey:key], arena))) return NULL;
+			i++;
+		}
+	}
+	return n;
+}
+
+// Convert a decoded bplist tree back into Foundation objects.  Strings which
+// the plist shares (dictionary keys, mostly) are only created once; strings maps
+// nodes to the NSStrings made for them.  Returns a retained object, or nil.
+static id object_from_plist_node(const bplist_node *n, CFMutableDictionaryRef strings)
+{
+	id obj = nil;
+	id *items;
+	size_t i, slots;
+
+	switch (n->type) {
+		case BPLIST_NULL:
+			return [[NSNull null] retain];
+		case BPLIST_BOOL:
+			return [[NSNumber alloc] initWithBool:n->v.integer != 0];
+		case BPLIST_INT:
+			return [[NSNumber alloc] initWithLongLong:n->v.integer];
+		case BPLIST_REAL:
+			return [[NSNumber alloc] initWithDouble:n->v.real];
+		case BPLIST_DATE:
+			return [[NSDate alloc] initWithTimeIntervalSinceReferenceDate:n->v.real];
+		case BPLIST_DATA:
+			return [[NSData alloc] initWithBytes:n->v.data length:n->count];
+		case BPLIST_UID:
+			// the same form CoreFoundation gives them in XML
+			return [[NSDictionary alloc] initWithObjectsAndKeys:
+						[NSNumber numberWithLongLong:n->v.integer], @"CF$UID", nil];
+		case BPLIST_STRING:
+			if ((obj = (id)CFDictionaryGetValue(strings, n))) return [obj retain];
+			obj = (id)CFStringCreateWithBytes(NULL, (const UInt8*)n->v.string, n->count, kCFStringEncodingUTF8, false);
+			if (obj) CFDictionarySetValue(strings, n, obj);
+			return obj;
+		case BPLIST_ARRAY:
+		case BPLIST_DICT:
+			slots = n->type == BPLIST_DICT ? n->count * 2 : n->count;
+			items = malloc((slots ? slots : 1) * sizeof(id));
+			for (i = 0; i < slots; i++) {
+				if (!(items[i] = object_from_plist_node(n->v.items[i], strings))) break;
+			}
+			if (i == slots) {
+				if (n->type == BPLIST_ARRAY) {
+					obj = [[NSArray alloc] initWithObjects:items count:n->count];
+				} else {
+					obj = [[NSDictionary alloc] initWithObjects:items + n->count forKeys:items count:n->count];
+				}
+			}
+			while (i--) [items[i] release];
+			free(items);
+			return obj;
+	}
+	return nil;
+}
+
+// Decode a bplist00 buffer into Foundation objects.  Returns a retained object,
+// or nil if the buffer isn't a valid binary plist.
+static id decode_binary_plist(const void *buf, size_t len)
+{
+	bplist_arena arena = { NULL };
+	bplist_node *root = bplist_decode(buf, len, &arena);
+	id result = nil;
+
+	if (root) {
+		CFMutableDictionaryRef strings = CFDictionaryCreateMutable(NULL, 0, NULL, &kCFTypeDictionaryValueCallBacks);
+		result = object_from_plist_node(root, strings);
+		CFRelease(strings);
+	}
+	bplist_arena_free(&arena);
+	return result;
+}
+
+// The receive buffer is kept from one reply to the next, unless a reply needed
+// more than this.
+#define AMSERVICE_RXBUF_KEEP	(4*1024*1024)
+
+// How long a request may wait on the device, unless the service says otherwise
+// (see +defaultTimeout).  Long enough for an installation step, which can go a
+// while between progress reports.
+#define AMSERVICE_TIMEOUT		60.0
+
+// recv() exactly len bytes.  Returns NO if the connection closed, failed or
+// timed out (errno is EAGAIN) first.
+static BOOL recv_all(int sock, void *buf, size_t len)
+{
+	unsigned char *p = buf;
+	while (len) {
+		ssize_t rc = recv(sock, p, len, 0);
+		if (rc < 0 && errno == EINTR) continue;
+		if (rc == 0) errno = EPIPE;
+		if (rc <= 0) return NO;
+		p += rc;
+		len -= rc;
+	}
+	return YES;
+}
+
+// send() all of buf, the same way.
+static BOOL send_all(int sock, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	while (len) {
+		ssize_t rc = send(sock, p, len, 0);
+		if (rc < 0 && errno == EINTR) continue;
+		if (rc <= 0) return NO;
+		p += rc;
+		len -= rc;
+	}
+	return YES;
+}
+
+// context for reply_stream_entry
+struct reply_stream {
+	const unsigned char	*buf;
+	NSMutableData		*scratch;
+	void				(^block)(id entry);
+};
+
+// plist_stream callback: parse one array entry of a reply which is still
+// arriving, and pass it on.
+static void reply_stream_entry(void *ctx, size_t start, size_t end)
+{
+	static const char head[] = "<plist version=\"1.0\">", tail[] = "</plist>";
+	struct reply_stream *rs = ctx;
+
+	[rs->scratch setLength:0];
+	[rs->scratch appendBytes:head length:sizeof(head) - 1];
+	[rs->scratch appendBytes:rs->buf + start length:end - start];
+	[rs->scratch appendBytes:tail length:sizeof(tail) - 1];
+	CFPropertyListRef entry = CFPropertyListCreateFromXMLData(0, (CFDataRef)rs->scratch, kCFPropertyListImmutable, 0);
+	if (entry) {
+		NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+		rs->block((id)entry);
+		[pool drain];
+		CFRelease(entry);
+	}
+}
+
 @implementation AMService
 
 @synthesize lasterror = _lasterror;
 @synthesize delegate = _delegate;
+@synthesize codec = _codec;
+
++ (void)initialize
+{
+	if (self == [AMService class]) {
+		NSNumber *binary = [NSNumber numberWithUnsignedInteger:AMServiceCodecBinary];
+		service_codecs = [[NSMutableDictionary alloc] initWithObjectsAndKeys:
+							binary, @"com.apple.mobile.installation_proxy",
+							binary, @"com.apple.springboardservices",
+							binary, @"com.apple.mobile.house_arrest",
+							nil];
+		binary_rejected = [[NSMutableSet alloc] init];
+	}
+}
+
++ (void)setCodec:(AMServiceCodec)codec forService:(NSString*)name
+{
+	@synchronized (self) {
+		if (name) {
+			[service_codecs setObject:[NSNumber numberWithUnsignedInteger:codec] forKey:name];
+		} else {
+			[service_codecs removeAllObjects];
+			default_codec = codec;
+		}
+	}
+}
+
++ (AMServiceCodec)codecForService:(NSString*)name
+{
+	@synchronized (self) {
+		NSNumber *codec = name ? [service_codecs objectForKey:name] : nil;
+		return codec ? [codec unsignedIntegerValue] : default_codec;
+	}
+}
+
+// As +codecForService:, unless the device and service in key have turned down
+// binary requests before
++ (AMServiceCodec)codecForService:(NSString*)name key:(NSString*)key
+{
+	@synchronized (self) {
+		if ([binary_rejected containsObject:key]) return AMServiceCodecXML;
+		return [self codecForService:name];
+	}
+}
+
++ (void)recordRepliesToDirectory:(NSString*)dir
+{
+	@synchronized (self) {
+		[reply_directory release];
+		reply_directory = [dir copy];
+	}
+}
+
++ (NSData*)binaryPlistWithObject:(id)plist
+{
+	bplist_arena arena = { NULL };
+	bplist_node *root = plist_node_from_object(plist, &arena);
+	NSData *result = nil;
+	uint8_t *buf;
+	size_t len;
+
+	if (root && bplist_encode(root, &buf, &len) == 0) {
+		result = [NSData dataWithBytesNoCopy:buf length:len freeWhenDone:YES];
+	}
+	bplist_arena_free(&arena);
+	return result;
+}
+
++ (id)objectWithBinaryPlist:(NSData*)data
+{
+	return [decode_binary_plist([data bytes], [data length]) autorelease];
+}
+
+- (void)recordReply:(const void*)buf length:(uint32_t)len
+{
+	NSString *path = nil;
+	@synchronized ([AMService class]) {
+		if (reply_directory) {
+			NSString *name = [NSString stringWithFormat:@"%@-%u.plist",
+								_serviceName ? _serviceName : @"service", ++reply_count];
+			path = [reply_directory stringByAppendingPathComponent:name];
+		}
+	}
+	if (path) {
+		[[NSData dataWithBytesNoCopy:(void*)buf length:len freeWhenDone:NO] writeToFile:path atomically:NO];
+	}
+}
+
+// A service which doesn't understand binary requests drops the connection
+// instead of replying to the first one.  That connection is gone, but later ones
+// to the service on this device use XML.  Other devices, which may well have
+// firmware that understands binary, are left alone.
+- (void)binaryRequestRejected
+{
+	if (_codec == AMServiceCodecBinary && !_binaryAnswered && _codecKey) {
+		NSLog(@"%@ dropped the connection instead of answering a binary request, using XML from now on", _codecKey);
+		@synchronized ([AMService class]) {
+			[binary_rejected addObject:_codecKey];
+		}
+	}
+}
 
 - (void)clearLastError
 {
@@ -208,19 +771,59 @@ mach_error_t AMDListenForNotifications(am_service socket, NOTIFY_CALLBACK cb, vo
 - (void)dealloc
 {
 	[_lasterror release];
+	[_poolKey release];
+	[_serviceName release];
+	[_codecKey release];
+	free(_rxbuf);
+	if (_service) {
+		[AMServiceIO forgetSocket:(int)_service];
+		op_stats_unbind((void*)(intptr_t)_service);
+	}
 	[super dealloc];
 }
 
+- (NSString*)poolKey
+{
+	return _poolKey;
+}
+
+- (void)setPoolKey:(NSString*)key
+{
+	[_poolKey release];
+	_poolKey = [key copy];
+}
+
+- (CFAbsoluteTime)pooledAt
+{
+	return _pooledAt;
+}
+
+- (void)setPooledAt:(CFAbsoluteTime)when
+{
+	_pooledAt = when;
+}
+
+// Nothing should arrive on an idle request/reply connection, so anything
+// waiting to be read is the device closing it.
+- (BOOL)pooledConnectionIsAlive
+{
+	struct pollfd pfd = { (int)_service, POLLIN, 0 };
+	return _service && poll(&pfd, 1, 0) == 0;
+}
+
 - (id)initWithName:(NSString*)name onDevice:(AMDevice*)device
 {
 	if ((self = [super init])) {
 		_delegate = nil;
+		_serviceName = [name copy];
+		_codecKey = [[NSString alloc] initWithFormat:@"%@ %@", device.udid, name];
+		_codec = [AMService codecForService:name key:_codecKey];
 		_service = [device _startService:name];
 		if (_service == 0) {
 			[self release];
 			return nil;
 		}
-		
+		[self setTimeout:[[self class] defaultTimeout]];
 	}
 	return self;
 }
@@ -230,73 +833,206 @@ mach_error_t AMDListenForNotifications(am_service socket, NOTIFY_CALLBACK cb, vo
 	return [[[AMService alloc] initWithName:name onDevice:device] autorelease];
 }
 
+- (NSData*)encodeRequest:(id)message codec:(AMServiceCodec)codec
+{
+	if (codec == AMServiceCodecBinary) return [AMService binaryPlistWithObject:message];
+	return [(id)CFPropertyListCreateXMLData(NULL, message) autorelease];
+}
+
+- (NSData*)encodeRequest:(id)message
+{
+	return [self encodeRequest:message codec:_codec];
+}
+
 - (bool)sendXMLRequest:(id)message
+{
+	return [self sendRequest:message codec:_codec];
+}
+
+// Send message in codec rather than the service's own, for a request whose
+// reply needs to come back in a particular format
+- (bool)sendRequest:(id)message codec:(AMServiceCodec)codec
 {
 	bool result = NO;
-	CFPropertyListRef messageAsXML = CFPropertyListCreateXMLData(NULL, message);
-	if (messageAsXML) {
-		CFIndex xmlLength = CFDataGetLength(messageAsXML);
+	NSData *messageData = [self encodeRequest:message codec:codec];
+	if (messageData) {
 		uint32_t sz;
 		int sock = (int)_service;
-		sz = htonl(xmlLength);
-		if (send(sock, &sz, sizeof(sz), 0) != sizeof(sz)) {
-			[self setLastError:@"Can't send message size"];
+		uint64_t t = op_stats_start();
+		sz = htonl([messageData length]);
+		if (!send_all(sock, &sz, sizeof(sz))) {
+			[self setLastError:(errno == EAGAIN ? @"Timed out sending message size" : @"Can't send message size")];
 		} else {
-			if (send(sock, CFDataGetBytePtr(messageAsXML), xmlLength,0) != xmlLength) {
-				[self setLastError:@"Can't send message text"];
+			if (!send_all(sock, [messageData bytes], [messageData length])) {
+				[self setLastError:(errno == EAGAIN ? @"Timed out sending message text" : @"Can't send message text")];
 			} else {
 				[self clearLastError];
 				result = YES;
 			}
 		}
-		CFRelease(messageAsXML);
+		op_stats_record((void*)(intptr_t)sock, OP_PLIST_REQUEST, t, !result, 0, result ? sizeof(sz) + [messageData length] : 0);
 	} else {
-		[self setLastError:@"Can't convert request to XML"];
+		[self setLastError:@"Can't convert request to a property list"];
 	}
 	return(result);
 }
 
+- (NSTimeInterval)timeout
+{
+	return _timeout;
+}
+
++ (NSTimeInterval)defaultTimeout
+{
+	return AMSERVICE_TIMEOUT;
+}
+
+- (void)setTimeout:(NSTimeInterval)timeout
+{
+	struct timeval tv;
+	tv.tv_sec = (time_t)timeout;
+	tv.tv_usec = (suseconds_t)((timeout - tv.tv_sec) * 1e6);
+	_timeout = timeout;
+	setsockopt((int)_service, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt((int)_service, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+- (AMServiceFuture*)sendXMLRequestAsync:(id)message timeout:(NSTimeInterval)timeout
+{
+	NSData *messageData = [self encodeRequest:message];
+	if (!messageData) {
+		return [[[AMServiceFuture alloc] initWithError:@"Can't convert request to a property list"] autorelease];
+	}
+	return [[[AMServiceFuture alloc] initWithSocket:(int)_service message:messageData reply:NO
+											 timeout:(timeout > 0 ? timeout : _timeout)] autorelease];
+}
+
+- (AMServiceFuture*)readXMLReplyAsync:(NSTimeInterval)timeout
+{
+	return [[[AMServiceFuture alloc] initWithSocket:(int)_service message:nil reply:YES
+											 timeout:(timeout > 0 ? timeout : _timeout)] autorelease];
+}
+
+- (AMServiceFuture*)requestAsync:(id)message timeout:(NSTimeInterval)timeout
+{
+	NSData *messageData = [self encodeRequest:message];
+	if (!messageData) {
+		return [[[AMServiceFuture alloc] initWithError:@"Can't convert request to a property list"] autorelease];
+	}
+	return [[[AMServiceFuture alloc] initWithSocket:(int)_service message:messageData reply:YES
+											 timeout:(timeout > 0 ? timeout : _timeout)] autorelease];
+}
+
 - (id)readXMLReply
+{
+	return [self readXMLReplyStreaming:nil toBlock:nil];
+}
+
+// Read a reply, handing each entry of the array under key (if any) to block
+// rather than returning it in the reply.  For XML replies the entries are parsed
+// as they arrive; binary ones can't be split up until they are complete, since
+// their offset table comes last.
+- (id)readXMLReplyStreaming:(NSString*)key toBlock:(void (^)(id entry))block
 {
 	id result = nil;
 	int sock = (int)((uint32_t)_service);
-	uint32_t sz;
+	uint32_t sz, got;
+	plist_stream scan;
+	struct reply_stream rs;
+	BOOL scanning = (key && block);
+	uint64_t t = op_stats_start();
 
 	/* now wait for the reply */
 
-	if (sizeof(uint32_t) != recv(sock, &sz, sizeof(sz), 0)) {
-		[self setLastError:@"Can't receive reply size"];
+	if (!recv_all(sock, &sz, sizeof(sz))) {
+		if (errno == EAGAIN) {
+			[self setLastError:@"Timed out waiting for reply"];
+		} else {
+			[self setLastError:@"Can't receive reply size"];
+			// a clean close (or reset) before any reply is how a rejection looks
+			if (errno == EPIPE || errno == ECONNRESET) [self binaryRequestRejected];
+		}
+		op_stats_record((void*)(intptr_t)sock, OP_PLIST_REPLY, t, 1, 0, 0);
+		return nil;
+	}
+	sz = ntohl(sz);
+	if (sz == 0) return nil;
+
+	// the socket buffer may be smaller than the message we are going to receive,
+	// so make sure our buffer is big enough for the whole reply, then loop calling
+	// recv() until it has all arrived.
+	if (sz > _rxcap) {
+		free(_rxbuf);
+		_rxbuf = malloc(sz);
+		_rxcap = _rxbuf ? sz : 0;
+		if (!_rxbuf) {
+			[self setLastError:[NSString stringWithFormat:@"Can't allocate %u bytes for reply", sz]];
+			op_stats_record((void*)(intptr_t)sock, OP_PLIST_REPLY, t, 1, sizeof(sz), 0);
+			return nil;
+		}
+	}
+	if (scanning) {
+		plist_stream_init(&scan, [key UTF8String]);
+		rs.buf = _rxbuf;
+		rs.scratch = [NSMutableData data];
+		rs.block = block;
+	}
+	for (got = 0; got < sz; ) {
+		ssize_t rc = recv(sock, _rxbuf + got, sz - got, 0);
+		if (rc < 0 && errno == EINTR) continue;
+		if (rc < 0 && errno == EAGAIN) {
+			[self setLastError:[NSString stringWithFormat:@"Timed out with %u bytes of the reply still to come", sz - got]];
+			op_stats_record((void*)(intptr_t)sock, OP_PLIST_REPLY, t, 1, got + sizeof(sz), 0);
+			return nil;
+		}
+		if (rc <= 0) {
+			[self setLastError:[NSString stringWithFormat:@"Reply was truncated, expected %u more bytes", sz - got]];
+			op_stats_record((void*)(intptr_t)sock, OP_PLIST_REPLY, t, 1, got + sizeof(sz), 0);
+			return nil;
+		}
+		got += rc;
+		if (scanning && got >= 8 && !bplist_is_binary(_rxbuf, got)) {
+			// if the scan goes wrong, the full parse below will say why
+			scanning = plist_stream_scan(&scan, (const char*)_rxbuf, got, reply_stream_entry, &rs);
+		}
+	}
+	[self recordReply:_rxbuf length:sz];
+	op_stats_record((void*)(intptr_t)sock, OP_PLIST_REPLY, t, 0, sz + sizeof(sz), 0);
+
+	// the reply comes back in the format the request went in, but there's no harm
+	// in checking
+	if (bplist_is_binary(_rxbuf, sz)) {
+		_binaryAnswered = YES;
+		result = [decode_binary_plist(_rxbuf, sz) autorelease];
 	} else {
-		sz = ntohl(sz);
-		if (sz) {
-			// we need to be careful in here, because there is a fixed buffer size in the
-			// socket, and it may be smaller than the message we are going to recieve.  we
-			// need to allocate a buffer big enough for the final result, but loop calling
-			// recv() until we recieve the complete reply.
-			unsigned char *buff = malloc(sz);
-			unsigned char *p = buff;
-			uint32_t left = sz;
-			while (left) {
-				uint32_t rc =recv(sock, p, left,0);
-				if (rc==0) {
-					[self setLastError:[NSString stringWithFormat:@"Reply was truncated, expected %d more bytes",left]];
-					free(buff);
-					return(nil);
-				}
-				left -= rc;
-				p += rc;
-			}
-			CFDataRef r = CFDataCreateWithBytesNoCopy(0,buff,sz,kCFAllocatorNull);
-			CFPropertyListRef reply = CFPropertyListCreateFromXMLData(0,r,0,0);
-//			CFPropertyListRef reply = CFPropertyListCreateWithData(0,(CFDataRef)plistdata, kCFPropertyListImmutable, NULL, NULL);
-			CFRelease(r);
-			free(buff);
-			result = [[(id)reply copy] autorelease];
-			CFRelease(reply);
-			[self clearLastError];
+		// if the array was streamed, parse only what's left
+		CFIndex len = scanning ? plist_stream_remove_list(&scan, (char*)_rxbuf, sz) : sz;
+		CFDataRef r = CFDataCreateWithBytesNoCopy(0, _rxbuf, len, kCFAllocatorNull);
+		CFPropertyListRef reply = CFPropertyListCreateFromXMLData(0, r, kCFPropertyListImmutable, 0);
+		CFRelease(r);
+		if (reply) result = [(id)reply autorelease];
+	}
+	if (_rxcap > AMSERVICE_RXBUF_KEEP) {
+		free(_rxbuf);
+		_rxbuf = NULL;
+		_rxcap = 0;
+	}
+
+	// anything not streamed already - a binary reply, or one we couldn't scan
+	if (key && block && [result isKindOfClass:[NSDictionary class]] && [result objectForKey:key]) {
+		id entries = [result objectForKey:key];
+		if ([entries isKindOfClass:[NSArray class]]) {
+			for (id entry in entries) block(entry);
 		}
+		result = [[result mutableCopy] autorelease];
+		[result removeObjectForKey:key];
 	}
 
+	if (result) {
+		[self clearLastError];
+	} else {
+		[self setLastError:@"Can't parse reply"];
+	}
 	return(result);
 }
 
@@ -391,9 +1127,11 @@ AMDShutdownNotificationProxy(socket);
 - (uint32_t)readN:(uint32_t)n bytes:(char *)buff
 {
 	if (![self ensureFileIsOpen]) return NO;
-	uint32_t afcSize = n;
+	// AFCFileRefRead() takes a 64-bit length - passing the address of a 32-bit
+	// one lets it scribble over whatever lives next to it on the stack
+	uint64_t afcSize = n;
 	if (![self checkStatus:AFCFileRefRead(_afc, _ref, buff, &afcSize) from:"AFCFileRefRead"]) return 0;
-	return afcSize;
+	return (uint32_t)afcSize;
 }
 
 - (bool)writeN:(uint32_t)n bytes:(const char *)buff
@@ -420,6 +1158,10 @@ AMDShutdownNotificationProxy(socket);
 
 @implementation AFCDirectoryAccess
 
+@synthesize readBlockSize = _readBlockSize;
+@synthesize readWindow = _readWindow;
+@synthesize writeBlockSize = _writeBlockSize;
+
 - (void)dealloc
 {
 	NSLog(@"deallocating %@",self);
@@ -485,6 +1227,12 @@ AMDShutdownNotificationProxy(socket);
 //		FSTotalBytes = 524288000
 //		Model = iPod1,1
 // }
+// AFC will answer this quickly, and won't if the connection has gone away
+- (BOOL)pooledConnectionIsAlive
+{
+	return [self deviceInfo] != nil;
+}
+
 - (NSDictionary*)deviceInfo
 {
 	if (![self ensureConnectionIsOpen]) return nil;
@@ -602,74 +1350,289 @@ AMDShutdownNotificationProxy(socket);
 	return nil;
 }
 
-static BOOL read_dir( AFCDirectoryAccess *self, afc_connection afc, NSString *path, NSMutableArray *files )
+// Directory walking.  Directories still to be listed live on a stack shared by
+// every connection taking part in the walk; each connection pops a directory,
+// lists it and pushes whatever subdirectories it finds.  Entries are handed to
+// the caller's block as they are read, one call at a time, so nothing is held
+// beyond the stack of unvisited directories.
+//
+// Without stat info we can't tell a file from a directory when we read its name,
+// so every entry goes onto the stack and AFCDirectoryOpen() tells us what it is
+// (it returns 4 for a file) - one round trip per entry, the same as a stat.
+typedef struct afc_walk_item {
+	char			*path;
+	NSUInteger		depth;
+	bool			probe;			// type unknown - report it when we open it
+} afc_walk_item;
+
+typedef struct afc_walk {
+	NSCondition		*cond;			// guards stack, count, busy, helpers
+	NSLock			*emit;			// serialises calls to block
+	afc_walk_item	*stack;
+	size_t			count;
+	size_t			cap;
+	NSUInteger		busy;			// connections currently listing a directory
+	NSUInteger		helpers;		// helper threads still running
+	NSUInteger		maxDepth;		// 0 for no limit
+	char			*pattern;		// fnmatch() pattern for entry names, or NULL
+	bool			withInfo;
+	volatile bool	stop;
+	NSString		*error;			// first failure, retained
+	NSUInteger		unstated;		// entries withInfo couldn't stat
+	NSString		*firstUnstated;	// retained
+	AFCWalkBlock	block;
+} afc_walk;
+
+static void afc_walk_fail(afc_walk *w, NSString *msg)
+{
+	[w->cond lock];
+	if (!w->error) w->error = [msg retain];
+	w->stop = YES;
+	[w->cond broadcast];
+	[w->cond unlock];
+}
+
+// An entry which couldn't be stat'ed can't be reported, but the rest of the walk
+// carries on - it fails once it's over, rather than quietly leaving entries out.
+static void afc_walk_unstated(afc_walk *w, const char *path)
+{
+	[w->cond lock];
+	if (w->unstated++ == 0) w->firstUnstated = [[NSString alloc] initWithUTF8String:path];
+	[w->cond unlock];
+}
+
+static bool afc_walk_emit(afc_walk *w, const char *path, bool isdir, NSDictionary *info)
+{
+	if (w->pattern) {
+		const char *name = strrchr(path, '/');
+		name = (name && name[1]) ? name+1 : path;
+		if (fnmatch(w->pattern, name, 0) != 0) return YES;
+	}
+	NSString *p = [NSString stringWithUTF8String:path];
+	[w->emit lock];
+	if (!w->stop && !w->block(p, isdir, info)) w->stop = YES;
+	[w->emit unlock];
+	return !w->stop;
+}
+
+static char *afc_walk_join(const char *dir, const char *name)
+{
+	size_t dlen = strlen(dir);
+	bool slash = (dlen > 0 && dir[dlen-1] == '/');
+	char *path = malloc(dlen + strlen(name) + 2);
+	if (path) sprintf(path, slash ? "%s%s" : "%s/%s", dir, name);
+	return path;
+}
+
+static NSDictionary *afc_walk_stat(AFCDirectoryAccess *conn, afc_connection afc, const char *path)
 {
-	BOOL result;
+	afc_dictionary dict;
+	if (AFCFileInfoOpen(afc, path, &dict) != 0) return nil;
+	NSDictionary *info = [conn readAfcDictionary:dict];
+	AFCKeyValueClose(dict);
+	return info;
+}
 
+// list one directory (or discover that it's a file)
+static void afc_walk_visit(afc_walk *w, AFCDirectoryAccess *conn, afc_connection afc, afc_walk_item item)
+{
 	afc_directory dir;
-	int ret = AFCDirectoryOpen(afc,[path UTF8String],&dir);
+	int ret = AFCDirectoryOpen(afc, item.path, &dir);
 
 	if (ret == 4) {
-		// its a file, so add it in and return
-		[files addObject:path];
-		return YES;
+		// its a file
+		if (item.probe) {
+			NSDictionary *info = w->withInfo ? afc_walk_stat(conn, afc, item.path) : nil;
+			if (!w->withInfo || info) afc_walk_emit(w, item.path, NO, info);
+			else afc_walk_unstated(w, item.path);
+		}
+		return;
 	}
-
 	if (ret != 0) {
-		// something other than a file causes us to fail
-		return [self checkStatus:ret from:"AFCDirectoryOpen"];
-	}
-
-	// collect us, with a trailing slash, since we are a directory
-	[files addObject:[NSString stringWithFormat:@"%@/",path]];
-
-	// build a list of all the files located here.
-	NSMutableArray *here = [NSMutableArray new];
-	while (1) {
-		char *d = NULL;
-		AFCDirectoryRead(afc,dir,&d);
-		if (!d) break;
-		if (*d=='.') {
-			if (d[1]=='\000') continue;			// skip '.'
-			if (d[1]=='.') {
-				if (d[2]=='\000'); continue;	// skip '..'
+		afc_walk_fail(w, [NSString stringWithFormat:@"AFCDirectoryOpen failed on %s: Return code = 0x%04X", item.path, ret]);
+		return;
+	}
+
+	if (item.probe) {
+		NSDictionary *info = w->withInfo ? afc_walk_stat(conn, afc, item.path) : nil;
+		if (!w->withInfo || info) afc_walk_emit(w, item.path, YES, info);
+		else afc_walk_unstated(w, item.path);
+	}
+
+	// children, in the order read - pushed in reverse at the end so that they
+	// come off the stack in directory order
+	afc_walk_item *found = NULL;
+	size_t nfound = 0, capfound = 0;
+
+	if (w->maxDepth == 0 || item.depth < w->maxDepth) {
+		while (!w->stop) {
+			char *d = NULL;
+			AFCDirectoryRead(afc, dir, &d);
+			if (!d) break;
+			if (d[0] == '.' && (d[1] == '\000' || (d[1] == '.' && d[2] == '\000'))) continue;
+
+			char *child = afc_walk_join(item.path, d);
+			if (!child) break;
+			bool isdir = YES;
+			if (w->withInfo) {
+				NSAutoreleasePool *pool = [NSAutoreleasePool new];
+				NSDictionary *info = afc_walk_stat(conn, afc, child);
+				if (info) {
+					isdir = [[info objectForKey:@"st_ifmt"] isEqualToString:@"S_IFDIR"];
+					afc_walk_emit(w, child, isdir, info);
+				} else {
+					afc_walk_unstated(w, child);
+				}
+				[pool drain];
+				// already reported - only worth stacking if we'll list it
+				if (!info || !isdir || (w->maxDepth && item.depth + 1 >= w->maxDepth)) {
+					free(child);
+					continue;
+				}
+			}
+			if (nfound == capfound) {
+				capfound = capfound ? capfound * 2 : 32;
+				found = realloc(found, capfound * sizeof(*found));
 			}
+			found[nfound].path = child;
+			found[nfound].depth = item.depth + 1;
+			found[nfound].probe = !w->withInfo;
+			nfound++;
 		}
-		[here addObject:[NSString stringWithFormat:@"%@/%s",path,d]];
 	}
-	AFCDirectoryClose(afc,dir);
+	AFCDirectoryClose(afc, dir);
 
-	// step through everything we found and add to the array
-	result = YES;
-	for (NSString *f in here) {
-		if (!read_dir(self, afc, f, files)) {
-			result = NO;
-			break;
+	if (nfound) {
+		[w->cond lock];
+		if (w->count + nfound > w->cap) {
+			while (w->count + nfound > w->cap) w->cap = w->cap ? w->cap * 2 : 64;
+			w->stack = realloc(w->stack, w->cap * sizeof(*w->stack));
 		}
+		while (nfound) w->stack[w->count++] = found[--nfound];
+		[w->cond broadcast];
+		[w->cond unlock];
 	}
-	[here release];
-
-	return result;
+	free(found);
 }
 
-- (NSArray*)recursiveDirectoryContents:(NSString*)path
+// pop directories until there are none left and nobody is listing one that
+// might produce more
+static void afc_walk_run(afc_walk *w, AFCDirectoryAccess *conn, afc_connection afc)
 {
-	if (!path) {
-		[self setLastError:@"Input path is nil"];
-		return nil;
-	}
+	for (;;) {
+		afc_walk_item item;
+		[w->cond lock];
+		while (w->count == 0 && w->busy && !w->stop) [w->cond wait];
+		if (w->count == 0 || w->stop) {
+			[w->cond unlock];
+			break;
+		}
+		item = w->stack[--w->count];
+		w->busy++;
+		[w->cond unlock];
+
+		NSAutoreleasePool *pool = [NSAutoreleasePool new];
+		afc_walk_visit(w, conn, afc, item);
+		[pool drain];
+		free(item.path);
+
+		[w->cond lock];
+		w->busy--;
+		[w->cond broadcast];
+		[w->cond unlock];
+	}
+}
 
-	if (![self ensureConnectionIsOpen]) return nil;
+- (void)walkHelper:(NSArray*)args
+{
+	NSAutoreleasePool *pool = [NSAutoreleasePool new];
+	afc_walk *w = [[args objectAtIndex:0] pointerValue];
+	AFCDirectoryAccess *conn = [args objectAtIndex:1];
+	if (conn->_afc) afc_walk_run(w, conn, conn->_afc);
+	[w->cond lock];
+	w->helpers--;
+	[w->cond broadcast];
+	[w->cond unlock];
+	[pool drain];
+}
 
-	NSMutableArray *unsorted = [NSMutableArray new];
-	if (read_dir(self, _afc, path, unsorted)) {
-		[unsorted sortUsingSelector:@selector(compare:)];
-		NSArray *result = [NSArray arrayWithArray:unsorted];
-		[unsorted release];
-		return result;
+- (BOOL)walkDirectory:(NSString*)path depth:(NSUInteger)depth matching:(NSString*)pattern
+			 withInfo:(BOOL)withInfo helpers:(NSArray*)helpers usingBlock:(AFCWalkBlock)block
+{
+	if (!path) {
+		[self setLastError:@"Input path is nil"];
+		return NO;
 	}
-	[unsorted release];
-	return nil;
+	if (![self ensureConnectionIsOpen]) return NO;
+
+	afc_walk w;
+	memset(&w, 0, sizeof(w));
+	w.cond = [NSCondition new];
+	w.emit = [NSLock new];
+	w.maxDepth = depth;
+	w.pattern = pattern ? strdup([pattern UTF8String]) : NULL;
+	w.withInfo = withInfo;
+	w.block = block;
+	w.cap = 64;
+	w.stack = malloc(w.cap * sizeof(*w.stack));
+	w.stack[0].path = strdup([path UTF8String]);
+	w.stack[0].depth = 0;
+	w.stack[0].probe = YES;
+	w.count = 1;
+
+	NSValue *wp = [NSValue valueWithPointer:&w];
+	for (AFCDirectoryAccess *conn in helpers) {
+		if (conn == self) continue;
+		[w.cond lock];
+		w.helpers++;
+		[w.cond unlock];
+		[NSThread detachNewThreadSelector:@selector(walkHelper:) toTarget:self
+							   withObject:[NSArray arrayWithObjects:wp, conn, nil]];
+	}
+	afc_walk_run(&w, self, _afc);
+
+	// the stack is empty, but helpers may still be running
+	[w.cond lock];
+	while (w.helpers) [w.cond wait];
+	[w.cond unlock];
+
+	while (w.count) free(w.stack[--w.count].path);
+	free(w.stack);
+	free(w.pattern);
+	[w.cond release];
+	[w.emit release];
+
+	if (!w.error && w.unstated) {
+		w.error = [[NSString alloc] initWithFormat:@"AFCFileInfoOpen failed on %lu %@, starting with %@",
+				   (unsigned long)w.unstated, w.unstated == 1 ? @"entry" : @"entries", w.firstUnstated];
+	}
+	[w.firstUnstated release];
+	if (w.error) {
+		[self setLastError:w.error];
+		[w.error release];
+		return NO;
+	}
+	[self clearLastError];
+	return YES;
+}
+
+- (BOOL)walkDirectory:(NSString*)path depth:(NSUInteger)depth matching:(NSString*)pattern
+			 withInfo:(BOOL)withInfo usingBlock:(AFCWalkBlock)block
+{
+	return [self walkDirectory:path depth:depth matching:pattern withInfo:withInfo helpers:nil usingBlock:block];
+}
+
+- (NSArray*)recursiveDirectoryContents:(NSString*)path
+{
+	NSMutableArray *unsorted = [NSMutableArray array];
+	BOOL ok = [self walkDirectory:path depth:0 matching:nil withInfo:NO usingBlock:^BOOL(NSString *p, BOOL isdir, NSDictionary *info) {
+		// directories are collected with a trailing slash
+		[unsorted addObject:(isdir ? [p stringByAppendingString:@"/"] : p)];
+		return YES;
+	}];
+	if (!ok) return nil;
+	[unsorted sortUsingSelector:@selector(compare:)];
+	return [NSArray arrayWithArray:unsorted];
 }
 
 - (BOOL)mkdir:(NSString*)path
@@ -771,6 +1734,17 @@ static BOOL read_dir( AFCDirectoryAccess *self, afc_connection afc, NSString *pa
 	return nil;
 }
 
+// Pick the size of each AFCFileRefWrite when pushing a file of the given size.
+// Every write is a round-trip to the device, so small files go in one and
+// bigger files get bigger chunks - but not so big that progress stops flowing.
+static uint32_t afc_write_chunk_for_size(uint64_t size)
+{
+	if (size <= 256*1024) return size ? (uint32_t)size : 1;
+	if (size <= 8*1024*1024) return 256*1024;
+	if (size <= 128*1024*1024) return 1024*1024;
+	return 4*1024*1024;
+}
+
 - (BOOL)copyLocalFile:(NSString*)path1 toRemoteFile:(NSString*)path2
 {
 	NSNotificationCenter *nc = [NSNotificationCenter defaultCenter];
@@ -782,40 +1756,90 @@ static BOOL read_dir( AFCDirectoryAccess *self, afc_connection afc, NSString *pa
 		} else {
 			// ok, make sure the input file opens before creating the
 			// output file
-			NSFileHandle *in = [NSFileHandle fileHandleForReadingAtPath:path1];
-			if (in) {
+			int in = open([path1 fileSystemRepresentation], O_RDONLY);
+			struct stat s;
+			if (in >= 0 && fstat(in, &s) == 0) {
 				NSMutableDictionary *info = [[NSMutableDictionary new] autorelease];
-				struct stat s;
-				stat([path1 fileSystemRepresentation],&s);
+				uint64_t size = s.st_size;
 				[info setObject:path1 forKey:@"Source"];
 				[info setObject:path2 forKey:@"Target"];
-				[info setObject:[NSNumber numberWithInt:s.st_size] forKey:@"Size"];
+				[info setObject:[NSNumber numberWithUnsignedLongLong:size] forKey:@"Size"];
 				[nc postNotificationName:@"AFCFileCopyBegin" object:self userInfo:info];
 				// open remote file for write
 				AFCFileReference *out = [self openForWrite:path2];
 				if (out) {
-					// copy all content across 10K at a time
-					const uint32_t bufsz = 10240;
-					uint32_t done = 0;
-					while (1) {
-						[info setObject:[NSNumber numberWithInt:done] forKey:@"Done"];
+					const uint32_t chunk = _writeBlockSize ? _writeBlockSize : afc_write_chunk_for_size(size);
+
+					// map the whole file and hand slices of the mapping straight to
+					// AFCFileRefWrite.  If it can't be mapped (empty, or not a regular
+					// file) fall back to read() into a single page-aligned buffer
+					// which is reused for every chunk.
+					const char *map = NULL;
+					char *buff = NULL;
+					if (size > 0 && S_ISREG(s.st_mode)) {
+						void *m = mmap(NULL, (size_t)size, PROT_READ, MAP_PRIVATE, in, 0);
+						if (m != MAP_FAILED) {
+							madvise(m, (size_t)size, MADV_SEQUENTIAL);
+							map = m;
+						}
+					}
+					if (!map && posix_memalign((void**)&buff, getpagesize(), chunk) != 0) buff = NULL;
+
+					CFAbsoluteTime started = CFAbsoluteTimeGetCurrent();
+					uint64_t done = 0;
+					bool failed = (!map && !buff);
+					if (failed) [self setLastError:@"Can't allocate copy buffer"];
+					while (!failed) {
+						NSAutoreleasePool *pool = [NSAutoreleasePool new];
+						[info setObject:[NSNumber numberWithUnsignedLongLong:done] forKey:@"Done"];
 						[nc postNotificationName:@"AFCFileCopyProgress" object:self userInfo:info];
-						NSData *nextblock = [in readDataOfLength:bufsz];
-						uint32_t n = [nextblock length];
-						if (n==0) break;
-						[out writeNSData:nextblock];
+						[pool drain];
+
+						const char *p;
+						uint32_t n;
+						if (map) {
+							if (done >= size) break;
+							n = (size - done < chunk) ? (uint32_t)(size - done) : chunk;
+							p = map + done;
+						} else {
+							ssize_t r = read(in, buff, chunk);
+							if (r < 0 && errno == EINTR) continue;
+							if (r < 0) {
+								[self setLastError:@"Can't read input file"];
+								failed = YES;
+								break;
+							}
+							if (r == 0) break;
+							n = (uint32_t)r;
+							p = buff;
+						}
+						if (![out writeN:n bytes:p]) {
+							[self setLastError:out.lasterror];
+							failed = YES;
+							break;
+						}
 						done += n;
 					}
+
+					if (map) munmap((void*)map, (size_t)size);
+					free(buff);
 					[out closeFile];
-					result = YES;
-					[nc postNotificationName:@"AFCFileCopyDone" object:self userInfo:info];
+					if (!failed) {
+						CFAbsoluteTime elapsed = CFAbsoluteTimeGetCurrent() - started;
+						[info setObject:[NSNumber numberWithUnsignedLongLong:done] forKey:@"Done"];
+						[info setObject:[NSNumber numberWithDouble:elapsed] forKey:@"Elapsed"];
+						[info setObject:[NSNumber numberWithDouble:(elapsed > 0 ? done / elapsed : 0)] forKey:@"BytesPerSecond"];
+						[nc postNotificationName:@"AFCFileCopyDone" object:self userInfo:info];
+						[self clearLastError];
+						result = YES;
+					}
 				}
-				// close input file regardless
-				[in closeFile];
 			} else {
 				// hmmm, failed to open
 				[self setLastError:@"Can't open input file"];
 			}
+			// close input file regardless
+			if (in >= 0) close(in);
 		}
 	}
 	return result;
@@ -859,42 +1883,197 @@ static BOOL read_dir( AFCDirectoryAccess *self, afc_connection afc, NSString *pa
 	return NO;
 }
 
+// afc_client's limit on requests in flight, and a cap on what one pipelined
+// read asks for
+#define AFC_MAX_READ_WINDOW		64
+#define AFC_MAX_READ_SPAN		(64*1024*1024)
+
+// When pulling with a readWindow > 1, the calling thread reads from the device
+// into a ring of buffers and a second thread drains them to the local file.  The
+// reader only ever touches slots outside [head,head+count) and the writer only
+// touches slots inside it, so the buffers themselves need no locking.
+typedef struct afc_read_pipe {
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	uint32_t		window;			// number of slots
+	char			**buf;			// one buffer per slot
+	uint32_t		*len;			// bytes held by each filled slot
+	uint32_t		head;			// next slot the writer will drain
+	uint32_t		count;			// number of filled slots
+	bool			eof;			// reader has nothing more to add
+	bool			failed;			// writer couldn't write
+	int				fd;				// local output file
+} afc_read_pipe;
+
+static bool write_fully(int fd, const char *p, size_t n)
+{
+	while (n) {
+		ssize_t w = write(fd, p, n);
+		if (w < 0 && errno == EINTR) continue;
+		if (w <= 0) return NO;
+		p += w;
+		n -= w;
+	}
+	return YES;
+}
+
+static void *afc_read_pipe_writer(void *arg)
+{
+	afc_read_pipe *pipe = arg;
+	pthread_mutex_lock(&pipe->lock);
+	for (;;) {
+		while (pipe->count == 0 && !pipe->eof) pthread_cond_wait(&pipe->cond, &pipe->lock);
+		if (pipe->count == 0) break;
+		uint32_t slot = pipe->head;
+		pthread_mutex_unlock(&pipe->lock);
+
+		bool ok = write_fully(pipe->fd, pipe->buf[slot], pipe->len[slot]);
+
+		pthread_mutex_lock(&pipe->lock);
+		pipe->head = (pipe->head + 1) % pipe->window;
+		pipe->count--;
+		if (!ok) pipe->failed = YES;
+		pthread_cond_broadcast(&pipe->cond);
+		if (!ok) break;
+	}
+	pthread_mutex_unlock(&pipe->lock);
+	return NULL;
+}
+
 - (BOOL)copyRemoteFile:(NSString*)path1 toLocalFile:(NSString*)path2
 {
+	NSNotificationCenter *nc = [NSNotificationCenter defaultCenter];
 	BOOL result = NO;
 	if ([self ensureConnectionIsOpen]) {
-		NSFileManager *fm = [NSFileManager defaultManager];
-		// make sure local file doesn't exist
-		if ([fm fileExistsAtPath:path2]) {
-			[self setLastError:@"Won't overwrite existing file"];
-		} else {
-			// open remote file for read
-			AFCFileReference *in = [self openForRead:path1];
-			if (in) {
-				// open local file for write - stupidly we need to create it before
-				// we can make an NSFileHandle
-				[fm createFileAtPath:path2 contents:nil attributes:nil];
-				NSFileHandle *out = [NSFileHandle fileHandleForWritingAtPath:path2];
-				if (!out) {
-					[self setLastError:@"Can't open output file"];
-				} else {
-					// copy all content across 100K at a time...
-					const uint32_t bufsz = 102400;
-					NSMutableData *buff = [[NSMutableData alloc] initWithLength:bufsz];
-					while (1) {
-						uint32_t n = [in readN:bufsz bytes:[buff mutableBytes]]; // FIXME: reads whole file even if it is more then bufsz
-						if (n==0) break;
-						[out writeData:[NSData dataWithBytesNoCopy:[buff mutableBytes] length:n freeWhenDone:NO]];
-					}
-					[buff release];
-					[out closeFile];
-					[self clearLastError];
-					result = YES;
+		// open local file for write - O_EXCL makes sure it doesn't already exist
+		int fd = open([path2 fileSystemRepresentation], O_WRONLY|O_CREAT|O_EXCL, 0644);
+		if (fd < 0) {
+			if (errno == EEXIST) {
+				[self setLastError:@"Won't overwrite existing file"];
+			} else {
+				[self setLastError:@"Can't open output file"];
+			}
+			return NO;
+		}
+
+		// open remote file for read
+		AFCFileReference *in = [self openForRead:path1];
+		if (!in) {
+			close(fd);
+			unlink([path2 fileSystemRepresentation]);
+			return NO;
+		}
+
+		NSMutableDictionary *info = [[NSMutableDictionary new] autorelease];
+		NSDictionary *finfo = [self getFileInfo:path1];
+		[info setObject:path1 forKey:@"Source"];
+		[info setObject:path2 forKey:@"Target"];
+		if ([finfo objectForKey:@"st_size"]) [info setObject:[finfo objectForKey:@"st_size"] forKey:@"Size"];
+		[nc postNotificationName:@"AFCFileCopyBegin" object:self userInfo:info];
+
+		const uint32_t blocksz = _readBlockSize ? _readBlockSize : 102400;
+		const uint32_t window = _readWindow > 1 ? (_readWindow < AFC_MAX_READ_WINDOW ? _readWindow : AFC_MAX_READ_WINDOW) : 1;
+		// Where the backend can pipeline, each read asks for window blocks, which
+		// go out as requests of a block each with all of them in flight, so the
+		// device is never waiting on a round trip; two buffers then keep the disk
+		// out of the way.  The framework only ever has one request out, so all
+		// the window can do there is let window filled buffers queue for the disk.
+		const BOOL pipelined = window > 1 && afc_set_pipeline(_afc, blocksz, window);
+		const uint64_t span = (uint64_t)blocksz * window;
+		const uint32_t bufsz = !pipelined ? blocksz : span < AFC_MAX_READ_SPAN ? (uint32_t)span : AFC_MAX_READ_SPAN;
+		const uint32_t slots = pipelined ? 2 : window;
+		afc_read_pipe pipe;
+		memset(&pipe, 0, sizeof(pipe));
+		pipe.window = slots;
+		pipe.fd = fd;
+		pipe.buf = calloc(slots, sizeof(char*));
+		pipe.len = calloc(slots, sizeof(uint32_t));
+		uint32_t i;
+		for (i=0; i<slots; i++) pipe.buf[i] = malloc(bufsz);
+
+		pthread_t writer;
+		bool threaded = NO;
+		if (slots > 1) {
+			pthread_mutex_init(&pipe.lock, NULL);
+			pthread_cond_init(&pipe.cond, NULL);
+			threaded = (pthread_create(&writer, NULL, afc_read_pipe_writer, &pipe) == 0);
+		}
+
+		CFAbsoluteTime started = CFAbsoluteTimeGetCurrent();
+		uint64_t done = 0;
+		bool failed = NO;
+		while (1) {
+			NSAutoreleasePool *pool = [NSAutoreleasePool new];
+			[info setObject:[NSNumber numberWithUnsignedLongLong:done] forKey:@"Done"];
+			[nc postNotificationName:@"AFCFileCopyProgress" object:self userInfo:info];
+			[pool drain];
+
+			// find a free slot - in the unthreaded case there's only ever one
+			uint32_t slot = 0;
+			if (threaded) {
+				pthread_mutex_lock(&pipe.lock);
+				while (pipe.count == slots && !pipe.failed) pthread_cond_wait(&pipe.cond, &pipe.lock);
+				failed = pipe.failed;
+				slot = (pipe.head + pipe.count) % slots;
+				pthread_mutex_unlock(&pipe.lock);
+				if (failed) break;
+			}
+
+			uint32_t n = [in readN:bufsz bytes:pipe.buf[slot]];
+			if (n == 0) {
+				// zero means end-of-file, unless the read itself complained
+				if (in.lasterror) {
+					[self setLastError:in.lasterror];
+					failed = YES;
 				}
-				// close output file
-				[in closeFile];
+				break;
+			}
+			done += n;
+
+			if (threaded) {
+				pthread_mutex_lock(&pipe.lock);
+				pipe.len[slot] = n;
+				pipe.count++;
+				pthread_cond_broadcast(&pipe.cond);
+				pthread_mutex_unlock(&pipe.lock);
+			} else if (!write_fully(fd, pipe.buf[slot], n)) {
+				failed = YES;
+				break;
 			}
 		}
+
+		if (threaded) {
+			// let the writer drain whatever is left, then wait for it
+			pthread_mutex_lock(&pipe.lock);
+			pipe.eof = YES;
+			pthread_cond_broadcast(&pipe.cond);
+			pthread_mutex_unlock(&pipe.lock);
+			pthread_join(writer, NULL);
+			if (pipe.failed) failed = YES;
+		}
+		if (slots > 1) {
+			pthread_cond_destroy(&pipe.cond);
+			pthread_mutex_destroy(&pipe.lock);
+		}
+		for (i=0; i<slots; i++) free(pipe.buf[i]);
+		free(pipe.buf);
+		free(pipe.len);
+
+		if (close(fd) != 0) failed = YES;
+		[in closeFile];
+
+		if (failed) {
+			if (!self.lasterror) [self setLastError:@"Can't write output file"];
+			unlink([path2 fileSystemRepresentation]);
+		} else {
+			CFAbsoluteTime elapsed = CFAbsoluteTimeGetCurrent() - started;
+			[info setObject:[NSNumber numberWithUnsignedLongLong:done] forKey:@"Done"];
+			[info setObject:[NSNumber numberWithDouble:elapsed] forKey:@"Elapsed"];
+			[info setObject:[NSNumber numberWithDouble:(elapsed > 0 ? done / elapsed : 0)] forKey:@"BytesPerSecond"];
+			[nc postNotificationName:@"AFCFileCopyDone" object:self userInfo:info];
+			[self clearLastError];
+			result = YES;
+		}
 	}
 	return result;
 }
@@ -913,6 +2092,414 @@ static BOOL read_dir( AFCDirectoryAccess *self, afc_connection afc, NSString *pa
     return [self copyRemoteFile:path1 toLocalFile:dest];
 }
 
+#pragma mark sync
+
+// Both sides of a sync are described by an "inventory" - a dictionary mapping
+// the path of every entry, relative to the directory being synced into, onto a
+// getFileInfo-style dictionary (st_ifmt, st_size, st_mtime in nanoseconds and
+// LinkTarget).  Directory keys end in "/", just like recursiveDirectoryContents.
+
+#define SYNC_BUFSZ	(256*1024)
+
+// strip trailing slashes (but leave "/" alone)
+static NSString *sync_trim(NSString *path)
+{
+	while ([path length] > 1 && [path hasSuffix:@"/"]) path = [path substringToIndex:[path length]-1];
+	return path;
+}
+
+static int64_t sync_mtime(NSDictionary *info)
+{
+	return [[info objectForKey:@"st_mtime"] longLongValue];
+}
+
+static uint64_t sync_size(NSDictionary *info)
+{
+	return [[info objectForKey:@"st_size"] unsignedLongLongValue];
+}
+
+static BOOL sync_is(NSDictionary *info, NSString *type)
+{
+	return [[info objectForKey:@"st_ifmt"] isEqualToString:type];
+}
+
+// drop an entry and everything beneath it from an inventory once it has been
+// removed from disk
+static void sync_forget(NSMutableDictionary *inventory, NSString *rel)
+{
+	NSString *dir = [rel stringByAppendingString:@"/"];
+	for (NSString *key in [inventory allKeys]) {
+		if ([key isEqualToString:rel] || [key hasPrefix:dir]) [inventory removeObjectForKey:key];
+	}
+}
+
+// the inventory of a local file or directory, keyed relative to its parent
+static NSMutableDictionary *sync_local_inventory(NSString *root)
+{
+	NSMutableDictionary *result = [NSMutableDictionary dictionary];
+	NSString *parent = [root stringByDeletingLastPathComponent];
+	NSString *base = [root lastPathComponent];
+	struct stat s;
+
+	if (lstat([root fileSystemRepresentation], &s) != 0) return result;
+	NSMutableArray *paths = [NSMutableArray arrayWithObject:base];
+	if (S_ISDIR(s.st_mode)) {
+		for (NSString *rel in [[NSFileManager defaultManager] enumeratorAtPath:root]) {
+			[paths addObject:[base stringByAppendingPathComponent:rel]];
+		}
+	}
+
+	for (NSString *rel in paths) {
+		NSString *path = [parent stringByAppendingPathComponent:rel];
+		if (lstat([path fileSystemRepresentation], &s) != 0) continue;
+		NSMutableDictionary *info = [NSMutableDictionary dictionary];
+#ifdef __APPLE__
+		int64_t mtime = (int64_t)s.st_mtimespec.tv_sec * 1000000000LL + s.st_mtimespec.tv_nsec;
+#else
+		int64_t mtime = (int64_t)s.st_mtim.tv_sec * 1000000000LL + s.st_mtim.tv_nsec;
+#endif
+		[info setObject:[NSNumber numberWithUnsignedLongLong:s.st_size] forKey:@"st_size"];
+		[info setObject:[NSNumber numberWithLongLong:mtime] forKey:@"st_mtime"];
+		if (S_ISDIR(s.st_mode)) {
+			[info setObject:@"S_IFDIR" forKey:@"st_ifmt"];
+			rel = [rel stringByAppendingString:@"/"];
+		} else if (S_ISLNK(s.st_mode)) {
+			char buff[PATH_MAX+1];
+			ssize_t buflen = readlink([path fileSystemRepresentation], buff, PATH_MAX);
+			if (buflen <= 0) continue;
+			buff[buflen] = 0;
+			[info setObject:@"S_IFLNK" forKey:@"st_ifmt"];
+			[info setObject:[NSString stringWithUTF8String:buff] forKey:@"LinkTarget"];
+		} else if (S_ISREG(s.st_mode)) {
+			[info setObject:@"S_IFREG" forKey:@"st_ifmt"];
+		} else {
+			continue;
+		}
+		[result setObject:info forKey:rel];
+	}
+	return result;
+}
+
+static void sync_set_local_mtime(NSString *path, int64_t mtime)
+{
+	struct timeval tv[2];
+	tv[0].tv_sec = tv[1].tv_sec = (time_t)(mtime / 1000000000LL);
+	tv[0].tv_usec = tv[1].tv_usec = (suseconds_t)((mtime % 1000000000LL) / 1000);
+	utimes([path fileSystemRepresentation], tv);
+}
+
+// changed files are written alongside the original under this name, then
+// renamed into place
+static NSString *sync_temp_name(NSString *path)
+{
+	NSString *name = [NSString stringWithFormat:@".%@.sync", [path lastPathComponent]];
+	return [[path stringByDeletingLastPathComponent] stringByAppendingPathComponent:name];
+}
+
+// the inventory of a device file or directory, keyed relative to its parent.
+// Returns an empty inventory if it doesn't exist, nil if it can't be read.
+- (NSMutableDictionary*)syncInventory:(NSString*)root
+{
+	NSMutableDictionary *result = [NSMutableDictionary dictionary];
+	if (![self fileExistsAtPath:root]) return result;
+
+	NSString *parent = [root stringByDeletingLastPathComponent];
+	NSString *prefix = [parent hasSuffix:@"/"] ? parent : [parent stringByAppendingString:@"/"];
+	BOOL ok = [self walkDirectory:root depth:0 matching:nil withInfo:YES usingBlock:^BOOL(NSString *path, BOOL isdir, NSDictionary *info) {
+		if ([path hasPrefix:prefix]) {
+			NSString *rel = [path substringFromIndex:[prefix length]];
+			[result setObject:info forKey:(isdir ? [rel stringByAppendingString:@"/"] : rel)];
+		}
+		return YES;
+	}];
+	return ok ? result : nil;
+}
+
+// remove a device file, or a directory and everything in it
+- (BOOL)removeRemoteTree:(NSString*)path
+{
+	NSArray *entries = [self recursiveDirectoryContents:path];
+	if (!entries) return NO;
+	for (NSString *entry in [entries reverseObjectEnumerator]) {
+		if (![self unlink:sync_trim(entry)]) return NO;
+	}
+	return YES;
+}
+
+// compare a device file with a local one, byte for byte
+- (BOOL)remoteFile:(NSString*)path1 matchesLocalFile:(NSString*)path2
+{
+	int fd = open([path2 fileSystemRepresentation], O_RDONLY);
+	if (fd < 0) return NO;
+	AFCFileReference *in = [self openForRead:path1];
+	char *rbuf = malloc(SYNC_BUFSZ);
+	char *lbuf = malloc(SYNC_BUFSZ);
+	BOOL same = (in && rbuf && lbuf);
+	off_t done = 0;
+	while (same) {
+		uint32_t n = [in readN:SYNC_BUFSZ bytes:rbuf];
+		if (n == 0) {
+			// the device file has ended - so should the local one
+			same = (in.lasterror == nil && pread(fd, lbuf, 1, done) == 0);
+			break;
+		}
+		if (pread(fd, lbuf, n, done) != (ssize_t)n || memcmp(rbuf, lbuf, n) != 0) same = NO;
+		done += n;
+	}
+	free(rbuf);
+	free(lbuf);
+	[in closeFile];
+	close(fd);
+	return same;
+}
+
+- (BOOL)syncLocalPath:(NSString*)path1 toRemoteDir:(NSString*)path2 options:(AFCSyncOptions)options
+{
+	if (![self ensureConnectionIsOpen]) return NO;
+	path1 = sync_trim(path1);
+	path2 = sync_trim(path2);
+	BOOL dryrun = (options & AFCSyncDryRun) != 0;
+
+	NSDictionary *src = sync_local_inventory(path1);
+	if ([src count] == 0) {
+		[self setLastError:[NSString stringWithFormat:@"Can't read %@", path1]];
+		return NO;
+	}
+	NSMutableDictionary *dst = [self syncInventory:[path2 stringByAppendingPathComponent:[path1 lastPathComponent]]];
+	if (!dst) return NO;
+
+	NSString *parent = [path1 stringByDeletingLastPathComponent];
+	NSUInteger copied = 0, deleted = 0, unchanged = 0, failed = 0;
+	uint64_t bytes = 0;
+	NSString *error = nil;
+
+	// sorted, so directories are created before their contents
+	for (NSString *key in [[src allKeys] sortedArrayUsingSelector:@selector(compare:)]) {
+		NSAutoreleasePool *pool = [NSAutoreleasePool new];
+		NSDictionary *s = [src objectForKey:key];
+		NSString *rel = sync_trim(key);
+		NSString *from = [parent stringByAppendingPathComponent:rel];
+		NSString *to = [path2 stringByAppendingPathComponent:rel];
+		NSDictionary *d = [dst objectForKey:rel];			// file or link in the way
+		BOOL ok = YES;
+
+		if (sync_is(s, @"S_IFDIR")) {
+			if ([dst objectForKey:key]) {
+				unchanged++;
+			} else {
+				NSLog(@"sync: mkdir %@", to);
+				if (!dryrun) {
+					if (d) ok = [self removeRemoteTree:to];
+					ok = ok && [self mkdir:to];
+				}
+			}
+		} else {
+			BOOL isdir = ([dst objectForKey:[rel stringByAppendingString:@"/"]] != nil);
+			if (sync_is(s, @"S_IFLNK")) {
+				if (d && sync_is(d, @"S_IFLNK") && [[d objectForKey:@"LinkTarget"] isEqualToString:[s objectForKey:@"LinkTarget"]]) {
+					unchanged++;
+				} else {
+					NSLog(@"sync: link %@ -> %@", to, [s objectForKey:@"LinkTarget"]);
+					if (!dryrun) {
+						if (d || isdir) ok = [self removeRemoteTree:to];
+						ok = ok && [self symlink:to to:[s objectForKey:@"LinkTarget"]];
+					}
+				}
+			} else if (d && sync_is(d, @"S_IFREG") && sync_size(d) == sync_size(s) &&
+					   (sync_mtime(d) >= sync_mtime(s) ||
+						((options & AFCSyncChecksum) && [self remoteFile:to matchesLocalFile:from]))) {
+				// we can't set the time of a device file, so a device copy that
+				// is at least as new as ours is as good as it gets
+				unchanged++;
+			} else {
+				NSLog(@"sync: copy %@ -> %@", from, to);
+				if (!dryrun) {
+					NSString *temp = sync_temp_name(to);
+					if (isdir) ok = [self removeRemoteTree:to];
+					if (ok && [self fileExistsAtPath:temp]) [self unlink:temp];
+					ok = ok && [self copyLocalFile:from toRemoteFile:temp];
+					ok = ok && [self rename:temp to:to];
+				}
+				if (ok) {
+					copied++;
+					bytes += sync_size(s);
+				}
+			}
+		}
+		if (!ok) {
+			failed++;
+			[error release];
+			error = [[NSString stringWithFormat:@"%@: %@", to, self.lasterror] retain];
+			NSLog(@"sync: %@", error);
+		}
+		// whatever was at this path has been dealt with
+		[dst removeObjectForKey:key];
+		if (sync_is(s, @"S_IFDIR")) {
+			[dst removeObjectForKey:rel];
+		} else if ([dst objectForKey:[rel stringByAppendingString:@"/"]]) {
+			sync_forget(dst, rel);
+		}
+		[pool drain];
+	}
+
+	if (options & AFCSyncDelete) {
+		// deepest first, so directories are empty by the time we get to them
+		for (NSString *key in [[[dst allKeys] sortedArrayUsingSelector:@selector(compare:)] reverseObjectEnumerator]) {
+			NSString *to = [path2 stringByAppendingPathComponent:sync_trim(key)];
+			NSLog(@"sync: delete %@", to);
+			if (dryrun || [self unlink:to]) {
+				deleted++;
+			} else {
+				failed++;
+				[error release];
+				error = [[NSString stringWithFormat:@"%@: %@", to, self.lasterror] retain];
+				NSLog(@"sync: %@", error);
+			}
+		}
+	}
+
+	NSLog(@"sync %@ -> %@: %lu copied (%llu bytes), %lu deleted, %lu unchanged, %lu failed%@",
+		  path1, path2, (unsigned long)copied, bytes, (unsigned long)deleted,
+		  (unsigned long)unchanged, (unsigned long)failed, dryrun ? @" (dry run)" : @"");
+	if (failed) {
+		[self setLastError:error];
+	} else {
+		[self clearLastError];
+	}
+	[error release];
+	return failed == 0;
+}
+
+- (BOOL)syncRemotePath:(NSString*)path1 toLocalDir:(NSString*)path2 options:(AFCSyncOptions)options
+{
+	if (![self ensureConnectionIsOpen]) return NO;
+	path1 = sync_trim(path1);
+	path2 = sync_trim(path2);
+	BOOL dryrun = (options & AFCSyncDryRun) != 0;
+	NSFileManager *fm = [NSFileManager defaultManager];
+
+	NSDictionary *src = [self syncInventory:path1];
+	if (!src) return NO;
+	if ([src count] == 0) {
+		[self setLastError:[NSString stringWithFormat:@"%@ does not exist", path1]];
+		return NO;
+	}
+	if (!dryrun && ![fm createDirectoryAtPath:path2 withIntermediateDirectories:YES attributes:nil error:nil]) {
+		[self setLastError:[NSString stringWithFormat:@"Can't create %@", path2]];
+		return NO;
+	}
+	NSMutableDictionary *dst = sync_local_inventory([path2 stringByAppendingPathComponent:[path1 lastPathComponent]]);
+
+	NSString *parent = [path1 stringByDeletingLastPathComponent];
+	NSUInteger copied = 0, deleted = 0, unchanged = 0, failed = 0;
+	uint64_t bytes = 0;
+	NSString *error = nil;
+
+	for (NSString *key in [[src allKeys] sortedArrayUsingSelector:@selector(compare:)]) {
+		NSAutoreleasePool *pool = [NSAutoreleasePool new];
+		NSDictionary *s = [src objectForKey:key];
+		NSString *rel = sync_trim(key);
+		NSString *from = [parent stringByAppendingPathComponent:rel];
+		NSString *to = [path2 stringByAppendingPathComponent:rel];
+		NSDictionary *d = [dst objectForKey:rel];
+		BOOL isdir = ([dst objectForKey:[rel stringByAppendingString:@"/"]] != nil);
+		BOOL ok = YES;
+		NSString *why = nil;
+
+		if (sync_is(s, @"S_IFDIR")) {
+			if (isdir) {
+				unchanged++;
+			} else {
+				NSLog(@"sync: mkdir %@", to);
+				if (!dryrun) {
+					if (d) ok = [fm removeItemAtPath:to error:nil];
+					ok = ok && mkdir([to fileSystemRepresentation], 0755) == 0;
+					if (!ok) why = [NSString stringWithUTF8String:strerror(errno)];
+				}
+			}
+		} else if (sync_is(s, @"S_IFLNK")) {
+			if (d && sync_is(d, @"S_IFLNK") && [[d objectForKey:@"LinkTarget"] isEqualToString:[s objectForKey:@"LinkTarget"]]) {
+				unchanged++;
+			} else {
+				NSLog(@"sync: link %@ -> %@", to, [s objectForKey:@"LinkTarget"]);
+				if (!dryrun) {
+					if (d || isdir) ok = [fm removeItemAtPath:to error:nil];
+					ok = ok && symlink([[s objectForKey:@"LinkTarget"] fileSystemRepresentation], [to fileSystemRepresentation]) == 0;
+					if (!ok) why = [NSString stringWithUTF8String:strerror(errno)];
+				}
+			}
+		} else {
+			int64_t mtime = sync_mtime(s);
+			BOOL samesize = (d && sync_is(d, @"S_IFREG") && sync_size(d) == sync_size(s));
+			if (samesize && mtime && sync_mtime(d) / 1000 == mtime / 1000) {
+				// we stamped it with the device's time last time round
+				unchanged++;
+			} else if (samesize && (options & AFCSyncChecksum) && [self remoteFile:from matchesLocalFile:to]) {
+				// same contents - fix the time so we don't have to look next time
+				if (!dryrun && mtime) sync_set_local_mtime(to, mtime);
+				unchanged++;
+			} else {
+				NSLog(@"sync: copy %@ -> %@", from, to);
+				if (!dryrun) {
+					NSString *temp = sync_temp_name(to);
+					if (isdir) ok = [fm removeItemAtPath:to error:nil];
+					unlink([temp fileSystemRepresentation]);
+					ok = ok && [self copyRemoteFile:from toLocalFile:temp];
+					if (ok && rename([temp fileSystemRepresentation], [to fileSystemRepresentation]) != 0) {
+						why = [NSString stringWithUTF8String:strerror(errno)];
+						unlink([temp fileSystemRepresentation]);
+						ok = NO;
+					}
+					if (ok && mtime) sync_set_local_mtime(to, mtime);
+				}
+				if (ok) {
+					copied++;
+					bytes += sync_size(s);
+				}
+			}
+		}
+		if (!ok) {
+			failed++;
+			[error release];
+			error = [[NSString stringWithFormat:@"%@: %@", to, why ? why : self.lasterror] retain];
+			NSLog(@"sync: %@", error);
+		}
+		[dst removeObjectForKey:key];
+		if (sync_is(s, @"S_IFDIR")) {
+			[dst removeObjectForKey:rel];
+		} else if ([dst objectForKey:[rel stringByAppendingString:@"/"]]) {
+			sync_forget(dst, rel);
+		}
+		[pool drain];
+	}
+
+	if (options & AFCSyncDelete) {
+		for (NSString *key in [[[dst allKeys] sortedArrayUsingSelector:@selector(compare:)] reverseObjectEnumerator]) {
+			NSString *to = [path2 stringByAppendingPathComponent:sync_trim(key)];
+			NSLog(@"sync: delete %@", to);
+			if (dryrun || [fm removeItemAtPath:to error:nil]) {
+				deleted++;
+			} else {
+				failed++;
+				[error release];
+				error = [[NSString stringWithFormat:@"%@: can't delete", to] retain];
+				NSLog(@"sync: %@", error);
+			}
+		}
+	}
+
+	NSLog(@"sync %@ -> %@: %lu copied (%llu bytes), %lu deleted, %lu unchanged, %lu failed%@",
+		  path1, path2, (unsigned long)copied, bytes, (unsigned long)deleted,
+		  (unsigned long)unchanged, (unsigned long)failed, dryrun ? @" (dry run)" : @"");
+	if (failed) {
+		[self setLastError:error];
+	} else {
+		[self clearLastError];
+	}
+	[error release];
+	return failed == 0;
+}
+
 @end
 
 @implementation AFCMediaDirectory
@@ -1012,6 +2599,61 @@ static BOOL read_dir( AFCDirectoryAccess *self, afc_connection afc, NSString *pa
 }
 @end
 
+@implementation AFCStandInDirectory
+
+- (id)initWithRoot:(NSString*)root latency:(NSTimeInterval)latency
+{
+	if ((self = [super init])) {
+		int sock;
+		int ret = afc_standin_start([root fileSystemRepresentation], (unsigned)(latency * 1000000), &_server, &sock);
+		if (ret != 0) {
+			NSLog(@"afc_standin_start failed: %s", strerror(ret));
+			[self release];
+			return nil;
+		}
+		_service = (am_service)sock;
+		op_stats_name((void*)(intptr_t)sock, "standin");
+		[self setTimeout:[[self class] defaultTimeout]];
+		ret = AFCConnectionOpen(_service, 0/*timeout*/, &_afc);
+		if (ret != 0) {
+			NSLog(@"AFCConnectionOpen failed: %lx", (unsigned long)ret);
+			[self release];
+			self = nil;
+		}
+	}
+	return self;
+}
+
+- (void)setLatency:(NSTimeInterval)latency
+{
+	if (_server) afc_standin_set_latency(_server, (unsigned)(latency * 1000000));
+}
+
+- (void)setBandwidth:(double)bytesPerSecond
+{
+	if (_server) afc_standin_set_bandwidth(_server, (unsigned)bytesPerSecond);
+}
+
+- (void)failReadsFrom:(uint64_t)offset
+{
+	if (_server) afc_standin_fail_reads_from(_server, offset);
+}
+
+- (uint64_t)requests
+{
+	return _server ? afc_standin_requests(_server) : 0;
+}
+
+- (void)dealloc
+{
+	// the server can only exit once the client end of the socket has gone
+	if (_afc) [self close];
+	if (_server) afc_standin_stop(_server);
+	[super dealloc];
+}
+
+@end
+
 @implementation AMApplication
 
 - (void)dealloc
@@ -1101,20 +2743,302 @@ static BOOL read_dir( AFCDirectoryAccess *self, afc_connection afc, NSString *pa
 
 @end
 
-@implementation AMInstallationProxy
-
-#if 0
-Yeah, I’ve just found out how to handle this and terminate sync when user slides cancel switch.
+@implementation AMApplicationCatalog
 
-We need following functions (meta-language):
+@synthesize refreshes=_refreshes;
 
-ERROR AMDObserveNotification(HANDLE proxy, CFSTR notification);
+#define CATALOG_VERSION		1
 
-ERROR AMDListenForNotifications(HANDLE proxy, NOTIFY_CALLBACK cb, USERDATA data);
+- (id)initWithDevice:(AMDevice*)device
+{
+	if ((self = [super init])) {
+		_device = device;
+		_lock = [NSRecursiveLock new];
+		_byId = [NSMutableDictionary new];
+		_byName = [NSMutableDictionary new];
+		_byDir = [NSMutableDictionary new];
+	}
+	return self;
+}
 
-and callback delegate:
+- (void)dealloc
+{
+	[self stopWatching];
+	[_lock release];
+	[_byId release];
+	[_byName release];
+	[_byDir release];
+	[_directory release];
+	[super dealloc];
+}
 
-typedef void (*NOTIFY_CALLBACK)(CFSTR notification, USERDATA data);
+#pragma mark indexes
+
+// Container for user applications, Path for the rest.
+static NSString *catalog_dir(AMApplication *app)
+{
+	NSString *dir = [app appdir];
+	return dir ? dir : [[app info] objectForKey:@"Path"];
+}
+
+- (void)indexApplication:(AMApplication*)app
+{
+	[_byId setObject:app forKey:[app bundleid]];
+	NSString *name = [[app appname] lowercaseString];
+	if (name) {
+		NSMutableArray *list = [_byName objectForKey:name];
+		if (!list) {
+			list = [NSMutableArray arrayWithCapacity:1];
+			[_byName setObject:list forKey:name];
+		}
+		[list addObject:app];
+	}
+	NSString *dir = catalog_dir(app);
+	if (dir) [_byDir setObject:app forKey:dir];
+}
+
+- (void)unindexApplication:(AMApplication*)app
+{
+	[[app retain] autorelease];
+	[_byId removeObjectForKey:[app bundleid]];
+	NSString *name = [[app appname] lowercaseString];
+	NSMutableArray *list = name ? [_byName objectForKey:name] : nil;
+	[list removeObjectIdenticalTo:app];
+	if (list && [list count] == 0) [_byName removeObjectForKey:name];
+	NSString *dir = catalog_dir(app);
+	if (dir && [_byDir objectForKey:dir] == app) [_byDir removeObjectForKey:dir];
+}
+
+// Bring the indexes into line with apps (bundle id -> info), touching only the
+// applications which have come, gone or changed.
+- (void)takeApplications:(NSDictionary*)apps verified:(BOOL)verified
+{
+	[_lock lock];
+	for (NSString *bundleId in [_byId allKeys]) {
+		if (![apps objectForKey:bundleId]) [self unindexApplication:[_byId objectForKey:bundleId]];
+	}
+	for (NSString *bundleId in apps) {
+		NSDictionary *info = [apps objectForKey:bundleId];
+		AMApplication *old = [_byId objectForKey:bundleId];
+		if (old && [[old info] isEqual:info]) continue;
+		if (old) [self unindexApplication:old];
+		AMApplication *app = [[AMApplication alloc] initWithDictionary:info];
+		if ([app bundleid]) [self indexApplication:app];
+		[app release];
+	}
+	_loaded = YES;
+	if (verified) {
+		_verified = YES;
+		_stale = NO;
+		_refreshes++;
+		[self save];
+	}
+	[_lock unlock];
+}
+
+#pragma mark persistence
+
+- (NSString*)path
+{
+	NSString *udid = [_device udid];
+	return (_directory && udid) ? [_directory stringByAppendingPathComponent:[udid stringByAppendingPathExtension:@"plist"]] : nil;
+}
+
+- (void)load
+{
+	NSString *path = [self path];
+	NSData *data = path ? [NSData dataWithContentsOfFile:path] : nil;
+	if (!data) return;
+	NSDictionary *saved = [NSPropertyListSerialization propertyListWithData:data options:0 format:NULL error:NULL];
+	if (![saved isKindOfClass:[NSDictionary class]] || [[saved objectForKey:@"Version"] intValue] != CATALOG_VERSION) return;
+	NSDictionary *apps = [saved objectForKey:@"Applications"];
+	if ([apps isKindOfClass:[NSDictionary class]]) [self takeApplications:apps verified:NO];
+}
+
+- (void)save
+{
+	NSString *path = [self path];
+	if (!path) return;
+	NSMutableDictionary *apps = [NSMutableDictionary dictionaryWithCapacity:[_byId count]];
+	for (NSString *bundleId in _byId) [apps setObject:[[_byId objectForKey:bundleId] info] forKey:bundleId];
+	NSDictionary *saved = [NSDictionary dictionaryWithObjectsAndKeys:
+								[NSNumber numberWithInt:CATALOG_VERSION], @"Version",
+								apps, @"Applications",
+								nil];
+	NSData *data = [NSPropertyListSerialization dataWithPropertyList:saved format:NSPropertyListBinaryFormat_v1_0 options:0 error:NULL];
+	[[NSFileManager defaultManager] createDirectoryAtPath:_directory withIntermediateDirectories:YES attributes:nil error:NULL];
+	if (!data || ![data writeToFile:path atomically:YES]) NSLog(@"Can't save the application catalog in %@", path);
+}
+
+- (void)persistInDirectory:(NSString*)dir
+{
+	[_lock lock];
+	[_directory release];
+	_directory = [dir copy];
+	[_lock unlock];
+}
+
+#pragma mark lookups
+
+- (BOOL)refresh
+{
+	[_lock lock];
+	NSDictionary *apps = [_device lookupApplications];
+	if (apps) [self takeApplications:apps verified:YES];
+	[_lock unlock];
+	return apps != nil;
+}
+
+- (void)invalidate
+{
+	_stale = YES;
+}
+
+// What a catalog read from disk is checked against - enough to notice an
+// application coming, going, being updated or being reinstalled
+static NSArray *catalog_check_attributes(void)
+{
+	return [NSArray arrayWithObjects:@"CFBundleIdentifier", @"CFBundleVersion", @"Container", @"Path", nil];
+}
+
+// Ask the device for the check attributes of every application, and mark the
+// indexes stale if they don't match.  Called with _lock held.
+- (void)revalidate
+{
+	NSArray *keys = catalog_check_attributes();
+	AMInstallationProxy *proxy = [_device newAMInstallationProxyWithDelegate:nil];
+	__block NSUInteger seen = 0;
+	__block BOOL same = YES;
+	BOOL ok = proxy && [proxy browseType:nil bundleIds:nil attributes:keys usingBlock:^BOOL(AMApplication *app) {
+		AMApplication *saved = [_byId objectForKey:[app bundleid]];
+		seen++;
+		for (NSString *key in keys) {
+			id now = [[app info] objectForKey:key], then = [[saved info] objectForKey:key];
+			if (!saved || (now != then && ![now isEqual:then])) same = NO;
+		}
+		return same;
+	}];
+	// a browse cut short leaves replies on the connection, so it isn't pooled
+	if (ok && same) [_device recycleService:proxy];
+	else [proxy release];
+	if (ok && same && seen == [_byId count]) {
+		_checked = YES;
+	} else {
+		_stale = YES;
+	}
+}
+
+// Load the indexes, and check or refresh them, as the next lookup needs
+- (void)prepare
+{
+	if (!_loaded) [self load];
+	if (_loaded && !_verified && !_checked && !_stale) [self revalidate];
+	if (!_loaded || _stale) [self refresh];
+}
+
+// Run lookup against the indexes, loading or refreshing them first if need be.
+// A miss in indexes which were read from disk is checked with the device.
+- (id)find:(id (^)(void))lookup
+{
+	id result;
+	[_lock lock];
+	[self prepare];
+	result = lookup();
+	if (!result && !_verified && [self refresh]) result = lookup();
+	[[result retain] autorelease];
+	[_lock unlock];
+	return result;
+}
+
+- (AMApplication*)applicationWithId:(NSString*)bundleId
+{
+	if (!bundleId) return nil;
+	return [self find:^id {
+		return [_byId objectForKey:bundleId];
+	}];
+}
+
+- (AMApplication*)applicationNamed:(NSString*)name ofType:(NSString*)type
+{
+	if (!name) return nil;
+	return [self find:^id {
+		AMApplication *best = nil;
+		for (AMApplication *app in [_byName objectForKey:[name lowercaseString]]) {
+			if (type && ![[[app info] objectForKey:@"ApplicationType"] isEqual:type]) continue;
+			if ([[app appname] isEqualToString:name]) return app;
+			if (!best) best = app;
+		}
+		return best;
+	}];
+}
+
+- (AMApplication*)applicationInDirectory:(NSString*)dir
+{
+	if (!dir) return nil;
+	return [self find:^id {
+		return [_byDir objectForKey:dir];
+	}];
+}
+
+- (NSArray*)applicationsOfType:(NSString*)type
+{
+	NSMutableArray *result = [NSMutableArray array];
+	[_lock lock];
+	[self prepare];
+	for (AMApplication *app in [_byId objectEnumerator]) {
+		if (!type || [[[app info] objectForKey:@"ApplicationType"] isEqual:type]) [result addObject:app];
+	}
+	[_lock unlock];
+	return result;
+}
+
+#pragma mark notifications
+
+- (void)applicationsChanged:(id)notification
+{
+	_stale = YES;
+}
+
+- (BOOL)startWatching
+{
+	[_lock lock];
+	if (!_watcher) {
+		_watcher = [_device newAMNotificationProxy];
+		[_watcher addObserver:self selector:@selector(applicationsChanged:) name:@"com.apple.mobile.application_installed"];
+		[_watcher addObserver:self selector:@selector(applicationsChanged:) name:@"com.apple.mobile.application_uninstalled"];
+	}
+	BOOL result = (_watcher != nil);
+	[_lock unlock];
+	return result;
+}
+
+- (void)stopWatching
+{
+	// the proxy holds on to its observers, so this also breaks the retain
+	// cycle between us and it
+	[_lock lock];
+	[_watcher removeObserver:self];
+	[_watcher release];
+	_watcher = nil;
+	[_lock unlock];
+}
+
+@end
+
+@implementation AMInstallationProxy
+
+#if 0
+Yeah, I’ve just found out how to handle this and terminate sync when user slides cancel switch.
+
+We need following functions (meta-language):
+
+ERROR AMDObserveNotification(HANDLE proxy, CFSTR notification);
+
+ERROR AMDListenForNotifications(HANDLE proxy, NOTIFY_CALLBACK cb, USERDATA data);
+
+and callback delegate:
+
+typedef void (*NOTIFY_CALLBACK)(CFSTR notification, USERDATA data);
 
 First, we need AMDObserveNotification to subscribe notifications about “com.apple.itunes-client.syncCancelRequest”. Then we should start listening for notifications (second function) until we get “AMDNotificationFaceplant”.
 That’s it. When notification got, you should unlock and close lock file handle (don’t sure if you need to post “syncDidFinish” to proxy, seems it doesn’t matter) and terminate sync gracefully.
@@ -1124,70 +3048,98 @@ P.S. The same notification is also got when you unplug your device, so you shoul
 
 - (NSArray *)browse:(NSString*)type
 {
-	return [self browseFiltered:nil];
+	NSMutableArray *thelist = [NSMutableArray array];
+	BOOL ok = [self browseType:type bundleIds:nil attributes:nil usingBlock:^BOOL(AMApplication *app) {
+		[thelist addObject:app];
+		return YES;
+	}];
+	return ok ? [NSArray arrayWithArray:thelist] : nil;
 }
 
 - (NSArray *)browseFiltered:(NSPredicate*)filter
 {
-	NSDictionary *message;
-	NSArray *result = nil;
+	NSMutableArray *thelist = [NSMutableArray array];
+	BOOL ok = [self browseType:nil bundleIds:nil attributes:nil usingBlock:^BOOL(AMApplication *app) {
+		if (filter==nil || [filter evaluateWithObject:app]) {
+			[thelist addObject:app];
+		}
+		return YES;
+	}];
+	return ok ? [NSArray arrayWithArray:thelist] : nil;
+}
 
+- (BOOL)browseType:(NSString*)type bundleIds:(NSArray*)bundleIds attributes:(NSArray*)attributes
+		usingBlock:(BOOL (^)(AMApplication *app))block
+{
+	NSDictionary *message;
+	if ([type isEqualToString:@"Any"]) type = nil;
+	NSMutableDictionary *options = [NSMutableDictionary dictionaryWithObject:(type ? type : @"Any") forKey:@"ApplicationType"];
+	NSSet *wanted = bundleIds ? [NSSet setWithArray:bundleIds] : nil;
+
+	if (bundleIds) [options setObject:bundleIds forKey:@"BundleIDs"];
+	if (attributes) {
+		// AMApplication needs these for bundleid and appname
+		NSMutableArray *keys = [NSMutableArray arrayWithObjects:@"CFBundleIdentifier", @"CFBundleDisplayName",
+								@"CFBundleName", @"CFBundleExecutable", nil];
+		for (NSString *key in attributes) {
+			if (![keys containsObject:key]) [keys addObject:key];
+		}
+		[options setObject:keys forKey:@"ReturnAttributes"];
+	}
 	message = [NSDictionary dictionaryWithObjectsAndKeys:
-					// value																key
-					@"Browse",																@"Command",
-					[NSDictionary dictionaryWithObject:@"Any" forKey:@"ApplicationType"],	@"ClientOptions",
+					// value				key
+					@"Browse",				@"Command",
+					options,				@"ClientOptions",
 					nil];
-	if ([self sendXMLRequest:message]) {
-		//
-		// we return all applications in a single array.  However,
-		// the protocol between ipod and mac does not - instead, the ipod only returns up to
-		// about 20 at a time, passing a Status field as well which tells us whether the
-		// transfer is finished or not.  This loop worries about gluing the responses
-		// back together for you.
-		//
-		NSMutableArray *thelist = nil;
-		for (;;) {
-			// read next slab of information
-			NSDictionary *reply = [self readXMLReply];
-			if (!reply) break;
-
-			// first time through, thelist will be nil so we'll allocate it.
-			if (nil == thelist) {
-				// each reply that comes back has a list size in the Total key, so we can 
-				// ask for an array of the correct size up front...  If we have a filter,
-				// then we'll be over-estimating but thats not that big a deal...
-				NSNumber *total = [reply objectForKey:@"Total"];
-				if (total && [total isKindOfClass:[NSNumber class]]) {
-					thelist = [[NSMutableArray alloc] initWithCapacity:[total intValue]];
-				} else {
-					// Hmmm, no Total, do it the hard way
-					thelist = [[NSMutableArray alloc] init];
-				}
-			}
-
-			// now, this reply might not have a current list in it so we need to be careful
-			NSArray *currentlist = [reply objectForKey:@"CurrentList"];
-			if (currentlist) {
-				for (NSDictionary *appinfo in currentlist) {
-					AMApplication *app = [[AMApplication alloc] initWithDictionary:appinfo];
-					if (filter==nil || [filter evaluateWithObject:app]) {
-						[thelist addObject:app];
-					}
-					[app release];
-				}
-			}
-
-			NSString *s = [reply objectForKey:@"Status"];
-			if (![s isEqual:@"BrowsingApplications"]) break;
-		}
-
-		// all finished, make it immutable and return
-		if (thelist) {
-			result = [NSArray arrayWithArray:thelist];
-			[thelist release];
+	// The reply comes back in the format the request went in, and only an XML
+	// one can be taken apart as it arrives - a binary plist's offset table comes
+	// last - so Browse is always asked for in XML.
+	if (![self sendRequest:message codec:AMServiceCodecXML]) return NO;
+
+	//
+	// the ipod only returns up to about 20 applications at a time, passing a
+	// Status field as well which tells us whether the transfer is finished or
+	// not.  Each entry of CurrentList is made into an AMApplication and handed
+	// over as soon as it has arrived, rather than once the whole slab is in.
+	//
+	// Firmware which doesn't understand BundleIDs sends everything, so the
+	// bundle ids are checked here as well.  Once the block has had enough the
+	// rest of the reply is still read, to leave the connection usable.
+	//
+	// Only a final Status of "Complete" means the list is all there; anything
+	// else - an Error, or the connection going - leaves it short.
+	//
+	__block BOOL more = YES;
+	BOOL complete = NO;
+	for (;;) {
+		NSAutoreleasePool *pool = [NSAutoreleasePool new];
+		// read next slab of information
+		NSDictionary *reply = [self readXMLReplyStreaming:@"CurrentList" toBlock:^(id appinfo) {
+			if (!more) return;
+			if (wanted && ![wanted containsObject:[appinfo objectForKey:@"CFBundleIdentifier"]]) return;
+			if (type && ![[appinfo objectForKey:@"ApplicationType"] isEqual:type] &&
+				[appinfo objectForKey:@"ApplicationType"]) return;
+			AMApplication *app = [[AMApplication alloc] initWithDictionary:appinfo];
+			more = block(app);
+			[app release];
+		}];
+		NSString *s = [reply objectForKey:@"Status"];
+		id err = [reply objectForKey:@"Error"];
+		if (!reply) {
+			if (!_lasterror) [self setLastError:@"Connection closed before the browse completed"];
+		} else if (err) {
+			id why = [reply objectForKey:@"ErrorDescription"];
+			[self setLastError:why ? [NSString stringWithFormat:@"%@: %@",err,why] : [NSString stringWithFormat:@"%@",err]];
+		} else if ([s isEqual:@"Complete"]) {
+			complete = YES;
+		} else if (![s isEqual:@"BrowsingApplications"]) {
+			[self setLastError:[NSString stringWithFormat:@"Browse ended with status %@", s]];
 		}
+		BOOL done = (!reply || err || ![s isEqual:@"BrowsingApplications"]);
+		[pool drain];
+		if (done) break;
 	}
-	return result;
+	return complete;
 }
 
 - (BOOL)archive:(NSString*)bundleid
@@ -1532,40 +3484,65 @@ http://libiphone.lighthouseapp.com/projects/27916/tickets/104/a/365185/0001-new-
 }
 #endif
 
-- (BOOL)install:(NSString*)pathname
+// Send a command which is answered by a run of { Status; PercentComplete }
+// replies ending in { Status = Complete }, passing each to the delegate and to
+// progress.  Returns YES only if the command completed.  If it fails, the device
+// replies { Error; ErrorDescription } instead - usually followed by
+// { Error = APIInternalError } if we keep reading, so we don't.
+- (BOOL)performCommand:(NSDictionary*)message progress:(void (^)(NSString *status, NSInteger percent))progress
 {
-	NSDictionary *message;
-	message = [NSDictionary dictionaryWithObjectsAndKeys:
-					// value					key
-					@"Install",				@"Command",
-					pathname,				@"PackagePath",
-					[NSDictionary dictionaryWithObjectsAndKeys:
-						@"Developer", @"PackageType",
-						nil],				@"ClientOptions",
-					nil];
+	BOOL result = NO;
 	[self performDelegateSelector:@selector(operationStarted:) withObject:message];
 	if ([self sendXMLRequest:message]) {
 		for (;;) {
-			// read next slab of information
-			// The reply will contain an entry for Status, a string from the following:
-			//	"RemovingArchive"
-			//	"Complete"
-			// All except "Complete" also include PercentageComplete, an integer between 0 and 100 (but it goes up and down)
-			//
-			// Looks like instead of Status, we can get:
-			// Error = APIEpicFail;
-			// (that happened if I passed in a missing bundle-id
-			// Error = APIInternalError
-			// (that happened if I kept reading?
 			NSDictionary *reply = [self readXMLReply];
-			if (!reply) break;
+			if (!reply) {
+				if (!_lasterror) [self setLastError:@"Connection closed before the command completed"];
+				break;
+			}
 			[self performDelegateSelector:@selector(operationContinues:) withObject:reply];
+			id err = [reply objectForKey:@"Error"];
+			if (err) {
+				id why = [reply objectForKey:@"ErrorDescription"];
+				[self setLastError:why ? [NSString stringWithFormat:@"%@: %@",err,why] : [NSString stringWithFormat:@"%@",err]];
+				break;
+			}
 			NSString *s = [reply objectForKey:@"Status"];
-			if ([s isEqual:@"Complete"]) break;
+			if ([s isEqual:@"Complete"]) {
+				[self clearLastError];
+				if (progress) progress(s, 100);
+				result = YES;
+				break;
+			}
+			if (progress && s) progress(s, [[reply objectForKey:@"PercentComplete"] integerValue]);
 		}
 	}
 	[self performDelegateSelector:@selector(operationCompleted:) withObject:message];
-	return NO;
+	return result;
+}
+
+// An .ipa is installed as it comes; anything else is taken to be a directory
+// holding an expanded .app, which needs PackageType = Developer.
+static NSDictionary *install_options(NSString *pathname)
+{
+	if ([[[pathname pathExtension] lowercaseString] isEqualToString:@"ipa"]) {
+		return [NSDictionary dictionary];
+	}
+	return [NSDictionary dictionaryWithObjectsAndKeys:
+				@"Developer", @"PackageType",
+				nil];
+}
+
+- (BOOL)install:(NSString*)pathname
+{
+	NSDictionary *message;
+	message = [NSDictionary dictionaryWithObjectsAndKeys:
+					// value					key
+					@"Install",				@"Command",
+					pathname,				@"PackagePath",
+					install_options(pathname),	@"ClientOptions",
+					nil];
+	return [self performCommand:message progress:nil];
 }
 
 - (BOOL)upgrade:(NSString*)bundleId from:(NSString*)pathname;
@@ -1576,39 +3553,322 @@ http://libiphone.lighthouseapp.com/projects/27916/tickets/104/a/365185/0001-new-
 					@"Upgrade",				@"Command",
 					pathname,				@"PackagePath",
 					bundleId,				@"ApplicationIdentifier",
-					[NSDictionary dictionaryWithObjectsAndKeys:
-						@"Developer", @"PackageType",
-						nil],				@"ClientOptions",
+					install_options(pathname),	@"ClientOptions",
 					nil];
-	[self performDelegateSelector:@selector(operationStarted:) withObject:message];
-	if ([self sendXMLRequest:message]) {
-		for (;;) {
-			// read next slab of information
-			// The reply will contain an entry for Status, a string from the following:
-			//	"RemovingArchive"
-			//	"Complete"
-			// All except "Complete" also include PercentageComplete, an integer between 0 and 100 (but it goes up and down)
-			//
-			// Looks like instead of Status, we can get:
-			// Error = APIEpicFail;
-			// (that happened if I passed in a missing bundle-id
-			// Error = APIInternalError
-			// (that happened if I kept reading?
-			NSDictionary *reply = [self readXMLReply];
-			if (!reply) break;
-			[self performDelegateSelector:@selector(operationContinues:) withObject:reply];
-			NSString *s = [reply objectForKey:@"Status"];
-			if ([s isEqual:@"Complete"]) break;
+	return [self performCommand:message progress:nil];
+}
+
+- (BOOL)installPackage:(NSString*)pathname upgrade:(BOOL)upgrade progress:(void (^)(NSString *status, NSInteger percent))progress
+{
+	NSDictionary *message;
+	message = [NSDictionary dictionaryWithObjectsAndKeys:
+					// value					key
+					upgrade ? @"Upgrade" : @"Install",	@"Command",
+					pathname,				@"PackagePath",
+					install_options(pathname),	@"ClientOptions",
+					nil];
+	return [self performCommand:message progress:progress];
+}
+
+@end
+
+// service_standin handler - ctx is the AMInstallationProxyStandIn.  Requests
+// are answered in the encoding they came in, and one that can't be decoded
+// drops the connection, as the device does.
+static int installation_standin_handler(void *ctx, service_standin *server, const void *msg, size_t len)
+{
+	AMInstallationProxyStandIn *proxy = ctx;
+	if (proxy.mute) return 1;
+	NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+	BOOL binary = bplist_is_binary(msg, len);
+	NSData *data = [NSData dataWithBytesNoCopy:(void*)msg length:len freeWhenDone:NO];
+	id request = binary ? [AMService objectWithBinaryPlist:data]
+						: [NSPropertyListSerialization propertyListWithData:data options:0 format:NULL error:NULL];
+	NSArray *replies = [proxy repliesTo:request];
+	int ok = (replies != nil);
+
+	for (id reply in replies) {
+		NSData *out = binary ? [AMService binaryPlistWithObject:reply]
+							 : [NSPropertyListSerialization dataWithPropertyList:reply format:NSPropertyListXMLFormat_v1_0
+																		 options:0 error:NULL];
+		if (!out || !service_standin_reply(server, [out bytes], [out length])) {
+			ok = 0;
+			break;
 		}
 	}
-	[self performDelegateSelector:@selector(operationCompleted:) withObject:message];
-	return NO;
+	[pool drain];
+	return ok;
+}
+
+@implementation AMInstallationProxyStandIn
+
+@synthesize mute=_mute;
+@synthesize browseError=_browseError;
+
+- (id)initWithApplications:(NSArray*)applications latency:(NSTimeInterval)latency
+{
+	if ((self = [super init])) {
+		int sock;
+		_applications = [applications copy];
+		_serviceName = [@"com.apple.mobile.installation_proxy" copy];
+		_codec = [AMService codecForService:_serviceName];
+		int ret = service_standin_start(installation_standin_handler, self, (unsigned)(latency * 1000000), &_server, &sock);
+		if (ret != 0) {
+			NSLog(@"service_standin_start failed: %s", strerror(ret));
+			[self release];
+			return nil;
+		}
+		_service = (am_service)sock;
+		op_stats_name((void*)(intptr_t)sock, "standin");
+		[self setTimeout:[[self class] defaultTimeout]];
+	}
+	return self;
+}
+
+- (void)setBandwidth:(double)bytesPerSecond
+{
+	if (_server) service_standin_set_bandwidth(_server, (unsigned)bytesPerSecond);
+}
+
+- (uint64_t)requests
+{
+	return _server ? service_standin_requests(_server) : 0;
+}
+
+// What the installation daemon would send back for request.  Nil if it isn't a
+// request at all.
+- (NSArray*)repliesTo:(id)request
+{
+	if (![request isKindOfClass:[NSDictionary class]]) return nil;
+	if (![[request objectForKey:@"Command"] isEqual:@"Browse"]) {
+		return [NSArray arrayWithObject:[NSDictionary dictionaryWithObject:@"UnknownCommand" forKey:@"Error"]];
+	}
+
+	NSDictionary *options = [request objectForKey:@"ClientOptions"];
+	NSString *type = [options objectForKey:@"ApplicationType"];
+	NSArray *bundleIds = [options objectForKey:@"BundleIDs"];
+	NSArray *keys = [options objectForKey:@"ReturnAttributes"];
+	NSSet *wanted = bundleIds ? [NSSet setWithArray:bundleIds] : nil;
+	NSMutableArray *matches = [NSMutableArray array];
+
+	for (NSDictionary *app in _applications) {
+		if (type && ![type isEqual:@"Any"] && ![[app objectForKey:@"ApplicationType"] isEqual:type]) continue;
+		if (wanted && ![wanted containsObject:[app objectForKey:@"CFBundleIdentifier"]]) continue;
+		if (keys) {
+			NSMutableDictionary *projected = [NSMutableDictionary dictionaryWithCapacity:[keys count]];
+			for (NSString *key in keys) {
+				id value = [app objectForKey:key];
+				if (value) [projected setObject:value forKey:key];
+			}
+			app = projected;
+		}
+		[matches addObject:app];
+	}
+
+	NSMutableArray *replies = [NSMutableArray array];
+	NSUInteger total = [matches count], i;
+	for (i = 0; i < total; i += 20) {
+		NSUInteger n = MIN(20, total - i);
+		[replies addObject:[NSDictionary dictionaryWithObjectsAndKeys:
+							@"BrowsingApplications",							@"Status",
+							[matches subarrayWithRange:NSMakeRange(i, n)],		@"CurrentList",
+							[NSNumber numberWithUnsignedInteger:i],				@"CurrentIndex",
+							[NSNumber numberWithUnsignedInteger:n],				@"CurrentAmount",
+							[NSNumber numberWithUnsignedInteger:total],			@"Total",
+							nil]];
+	}
+	NSString *error = self.browseError;
+	if (error) {
+		[replies addObject:[NSDictionary dictionaryWithObject:error forKey:@"Error"]];
+	} else {
+		[replies addObject:[NSDictionary dictionaryWithObject:@"Complete" forKey:@"Status"]];
+	}
+	return replies;
+}
+
+- (void)dealloc
+{
+	// the server can only exit once the client end of the socket has gone
+	if (_service) {
+		[AMServiceIO forgetSocket:(int)_service];
+		op_stats_unbind((void*)(intptr_t)_service);
+		close((int)_service);
+		_service = 0;
+	}
+	if (_server) service_standin_stop(_server);
+	[_applications release];
+	[_browseError release];
+	[super dealloc];
+}
+
+@end
+
+// Records should be UTF-8, but a process can log anything it likes.
+static NSString *relay_string(const char *rec, size_t len)
+{
+	NSString *s = [[NSString alloc] initWithBytes:rec length:len encoding:NSUTF8StringEncoding];
+	if (!s) s = [[NSString alloc] initWithBytes:rec length:len encoding:NSISOLatin1StringEncoding];
+	return s;
+}
+
+@implementation AMSyslogMessage
+
+@synthesize pid=_pid, level=_level;
+
+- (id)initWithRecord:(const char*)rec length:(size_t)len parsed:(const syslog_record*)parsed
+{
+	if ((self = [super init])) {
+		_bytes = [[NSData alloc] initWithBytes:rec length:len];
+		_when = parsed->when;
+		_pid = parsed->pid;
+		_level = parsed->level;
+		_host = NSMakeRange(parsed->host, parsed->host_len);
+		_process = NSMakeRange(parsed->process, parsed->process_len);
+		_text = NSMakeRange(parsed->message, len - parsed->message);
+	}
+	return self;
+}
+
+- (void)dealloc
+{
+	[_bytes release];
+	[super dealloc];
+}
+
+- (NSString*)stringWithRange:(NSRange)range
+{
+	return [relay_string((const char*)[_bytes bytes] + range.location, range.length) autorelease];
+}
+
+- (NSString*)line
+{
+	return [self stringWithRange:NSMakeRange(0, [_bytes length])];
+}
+
+- (NSDate*)date
+{
+	if (!_when) return nil;
+	return [NSDate dateWithTimeIntervalSince1970:syslog_record_time(_when, time(NULL))];
+}
+
+- (NSString*)host
+{
+	return [self stringWithRange:_host];
+}
+
+- (NSString*)process
+{
+	return [self stringWithRange:_process];
+}
+
+- (NSString*)message
+{
+	return [self stringWithRange:_text];
+}
+
+- (NSString*)description
+{
+	return [self line];
 }
 
 @end
 
 @implementation AMSyslogRelay
 
+@synthesize received=_received, dropped=_dropped, delivered=_delivered, maxBacklog=_maxBacklog;
+@synthesize dropWhenFull=_dropWhenFull, batchSize=_batchSize;
+@synthesize filtered=_filtered, structured=_structured, recorded=_recorded;
+
+// records come when something is logged, which may be never
++ (NSTimeInterval)defaultTimeout
+{
+	return 0;
+}
+
+// room for some tens of thousands of typical records
+#define AMSYSLOG_RING_SIZE		(4*1024*1024)
+
+// Take up any new filter or store before the records in the next read - called
+// by whichever thread reads the socket, which is the only one to touch _filter
+// and _store.
+static void relay_pickup(AMSyslogRelay *relay)
+{
+	[relay->_filterLock lock];
+	if (relay->_nextFilter != relay->_filter) {
+		syslog_filter_destroy(relay->_filter);
+		relay->_filter = relay->_nextFilter;
+	}
+	if (relay->_nextStore != relay->_store) {
+		syslog_store_close(relay->_store);
+		relay->_store = relay->_nextStore;
+	}
+	[relay->_filterLock unlock];
+	relay->_readAt = time(NULL);
+}
+
+static void relay_store_failed(AMSyslogRelay *relay)
+{
+	NSLog(@"Can't write to the syslog store, giving up: %s", strerror(errno));
+	[relay->_filterLock lock];
+	if (relay->_nextStore == relay->_store) relay->_nextStore = NULL;
+	[relay->_filterLock unlock];
+	syslog_store_close(relay->_store);
+	relay->_store = NULL;
+}
+
+// Returns NO if the record is filtered out.  Otherwise it goes in the store, if
+// there is one.
+static BOOL relay_accept(AMSyslogRelay *relay, const char *rec, size_t len, syslog_record *parsed)
+{
+	relay->_received++;
+	syslog_parse(rec, len, parsed);
+	if (relay->_filter && !syslog_filter_match(relay->_filter, rec, len, parsed)) {
+		relay->_filtered++;
+		return NO;
+	}
+	if (relay->_store) {
+		time_t when = syslog_clock_time(relay->_clock, parsed->when, relay->_readAt);
+		if (syslog_store_append(relay->_store, when, rec, len, parsed)) {
+			relay->_recorded++;
+		} else {
+			relay_store_failed(relay);
+		}
+	}
+	return YES;
+}
+
+// Nothing has come from the device for a while - make sure what has doesn't sit
+// in the store's block indefinitely.  Called by whichever thread reads the socket.
+static void relay_idle(AMSyslogRelay *relay)
+{
+	relay_pickup(relay);
+	if (relay->_store && !syslog_store_idle(relay->_store, time(NULL))) relay_store_failed(relay);
+}
+
+static void relay_idle_timer(CFRunLoopTimerRef timer, void *info)
+{
+	relay_idle((AMSyslogRelay*)info);
+}
+
+// syslog_split() callback for a relay which isn't batched - straight to the listener
+static void relay_line(void *ctx, const char *rec, size_t len)
+{
+	AMSyslogRelay *relay = (AMSyslogRelay*)ctx;
+	syslog_record parsed;
+
+	if (!relay_accept(relay, rec, len, &parsed) || !relay->_listener) return;
+	id object = [relay objectForRecord:rec length:len parsed:&parsed];
+	relay->_delivered++;
+	[relay->_listener performSelector:relay->_message withObject:object];
+	[object release];
+}
+
+- (id)objectForRecord:(const char*)rec length:(size_t)len parsed:(const syslog_record*)parsed
+{
+	if (_structured) return [[AMSyslogMessage alloc] initWithRecord:rec length:len parsed:parsed];
+	return relay_string(rec, len);
+}
+
 // This gets called back whenever there is data in the socket that we need
 // to read out of it.
 static
@@ -1632,48 +3892,184 @@ void AMSyslogRelayCallBack (
 			// The relay has a maximum buffer size of 0x4000, so we might as
 			// well match it.  The buffer consists of multiple syslog records
 			// which are \0 terminated - they may contain \n characters within
-			// a record, and they never seem to send us an unterminated message
-			// (again, the server code seems to preclude it)
+			// a record.  A busy relay fills the buffer without regard to record
+			// boundaries, so the last record may be continued in the next read.
 			//
 			// Control characters seem to be escaped with \ - ie, tab comes through as \ followed by t
 			UInt8 buffer[0x4000];
 			const CFIndex len = CFReadStreamRead(stream,buffer,sizeof(buffer));
-			if (len) {
-				UInt8 *p, *q;
-				CFIndex left = len;
-				p = buffer;
-				buffer[sizeof(buffer)-1] = '\000';
-				while (left>0) {
-					// remove leading newlines
-					while (*p == '\n') {
-						if (--left) p++;
-						else break;
-					}
-					q = p;
-					while (*q && left>0) {q++;left--;}
-					if (left) {
-						// occasionally we encounter a null record - no need
-						// to pass that on and confuse our listener.  Also, sometimes
-						// the relay seems to pass us lines of the form "> ".  It looks
-						// like thats the 'end' marker that the syslog daemon on the
-						// device uses to communicate with the relay to tell it "thats
-						// all for now".
-						if (q-p) {
-							NSString *s = [[NSString alloc] initWithBytesNoCopy:p length:q-p encoding:NSUTF8StringEncoding freeWhenDone:NO];
-							[relay->_listener performSelector:relay->_message withObject:s];
-							[s release];
-						}
-						p = q+1;
-						left--;
-					}
-				}
+			if (len > 0) {
+				relay_pickup(relay);
+				syslog_split(relay->_splitter, (const char*)buffer, len, relay_line, relay);
+			}
+		}
+	}
+}
+
+// syslog_split() callback for a batched relay, on the reading thread
+static void relay_enqueue(void *ctx, const char *rec, size_t len)
+{
+	AMSyslogRelay *relay = (AMSyslogRelay*)ctx;
+	syslog_record parsed;
+
+	if (!relay_accept(relay, rec, len, &parsed) || !relay->_listener) return;
+	while (!syslog_ring_push(relay->_ring, &parsed, sizeof(parsed), rec, (uint32_t)len)) {
+		if (relay->_dropWhenFull || relay->_stopping) {
+			relay->_dropped++;
+			return;
+		}
+		// make sure the main thread knows there's something to make room with
+		CFRunLoopSourceSignal(relay->_deliver);
+		CFRunLoopWakeUp(CFRunLoopGetMain());
+		usleep(1000);
+	}
+	NSUInteger backlog = syslog_ring_count(relay->_ring);
+	if (backlog > relay->_maxBacklog) relay->_maxBacklog = backlog;
+}
+
+// The reading thread of a batched relay.  It runs until the connection closes
+// or the relay goes away, and never touches anything but the socket, the splitter,
+// the filter, the store and the producer's end of the ring.
+static void *relay_reader(void *ctx)
+{
+	NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+	AMSyslogRelay *relay = (AMSyslogRelay*)ctx;
+	int sock = (int)((uint32_t)relay->_service);
+	char buffer[0x10000];
+
+	while (!relay->_stopping) {
+		// wake up now and then, so a quiet device's records still reach the store
+		struct pollfd pfd = { sock, POLLIN, 0 };
+		int ready = poll(&pfd, 1, 1000);
+		if (ready < 0 && errno != EINTR) break;
+		if (ready <= 0) {
+			relay_idle(relay);
+			continue;
+		}
+		ssize_t len = recv(sock, buffer, sizeof(buffer), 0);
+		if (len < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+		if (len <= 0) break;
+		relay_pickup(relay);
+		syslog_split(relay->_splitter, buffer, len, relay_enqueue, relay);
+		// several reads will usually have been queued by the time the main
+		// thread gets round to it - they all go in one batch
+		CFRunLoopSourceSignal(relay->_deliver);
+		CFRunLoopWakeUp(CFRunLoopGetMain());
+	}
+	[pool drain];
+	return NULL;
+}
+
+static void relay_deliver(void *info)
+{
+	[(AMSyslogRelay*)info deliverBatch];
+}
+
+- (void)deliverBatch
+{
+	// the listener may release us
+	[self retain];
+	NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+	NSUInteger limit = _batchSize ? _batchSize : 4096;
+	NSUInteger waiting = syslog_ring_count(_ring);
+	NSMutableArray *lines = [[NSMutableArray alloc] initWithCapacity:MIN(waiting, limit)];
+	const char *rec;
+	uint32_t len;
+
+	while ([lines count] < limit && syslog_ring_peek(_ring, &rec, &len)) {
+		// each record is preceded by what the reader made of it
+		syslog_record parsed;
+		memcpy(&parsed, rec, sizeof(parsed));
+		id object = [self objectForRecord:rec + sizeof(parsed) length:len - sizeof(parsed) parsed:&parsed];
+		syslog_ring_pop(_ring);
+		[lines addObject:object];
+		[object release];
+	}
+	if ([lines count]) {
+		_delivered += [lines count];
+		[_listener performSelector:_message withObject:lines];
+	}
+	[lines release];
+
+	// more than one batch waiting - let the run loop do something else first
+	if (syslog_ring_count(_ring)) {
+		CFRunLoopSourceSignal(_deliver);
+		CFRunLoopWakeUp(CFRunLoopGetMain());
+	}
+	[pool drain];
+	[self release];
+}
+
+- (NSUInteger)backlog
+{
+	return _ring ? syslog_ring_count(_ring) : 0;
+}
+
+- (BOOL)filterProcesses:(NSArray*)processes level:(int)level containing:(NSString*)text matching:(NSString*)pattern
+{
+	syslog_filter *filter = NULL;
+
+	if ([processes count] || level >= 0 || [text length] || [pattern length]) {
+		if (!(filter = syslog_filter_create())) {
+			[self setLastError:@"Out of memory"];
+			return NO;
+		}
+		for (NSString *process in processes) syslog_filter_add_process(filter, [process UTF8String]);
+		if (level >= 0) syslog_filter_set_level(filter, level);
+		if ([text length]) syslog_filter_add_substring(filter, [text UTF8String]);
+		if ([pattern length]) {
+			char err[256];
+			if (!syslog_filter_add_regex(filter, [pattern UTF8String], err, sizeof(err))) {
+				[self setLastError:[NSString stringWithFormat:@"Bad pattern: %s", err]];
+				syslog_filter_destroy(filter);
+				return NO;
 			}
 		}
 	}
+
+	// the reader picks it up before its next read
+	[_filterLock lock];
+	if (_nextFilter != _filter) syslog_filter_destroy(_nextFilter);
+	_nextFilter = filter;
+	[_filterLock unlock];
+	[self clearLastError];
+	return YES;
+}
+
+- (BOOL)recordToDirectory:(NSString*)dir segmentSize:(unsigned long long)segmentSize
+{
+	syslog_store *store = NULL;
+
+	if (dir && !(store = syslog_store_open([dir fileSystemRepresentation], segmentSize))) {
+		[self setLastError:[NSString stringWithFormat:@"Can't open syslog store %@: %s", dir, strerror(errno)]];
+		return NO;
+	}
+
+	// as for the filter
+	[_filterLock lock];
+	if (_nextStore != _store) syslog_store_close(_nextStore);
+	_nextStore = store;
+	[_filterLock unlock];
+	[self clearLastError];
+	return YES;
 }
 
 - (void)dealloc
 {
+	if (_readerStarted) {
+		// wake the reader out of recv(), and wait for it to finish
+		_stopping = YES;
+		shutdown((int)((uint32_t)_service), SHUT_RDWR);
+		pthread_join(_reader, NULL);
+	}
+	if (_deliver) {
+		CFRunLoopSourceInvalidate(_deliver);
+		CFRelease(_deliver);
+	}
+	if (_idleTimer) {
+		CFRunLoopTimerInvalidate(_idleTimer);
+		CFRelease(_idleTimer);
+	}
 	if (_service) {
 		if (_readstream) {
 			CFReadStreamUnscheduleFromRunLoop (_readstream,CFRunLoopGetMain(),kCFRunLoopCommonModes);
@@ -1681,6 +4077,17 @@ void AMSyslogRelayCallBack (
 			CFRelease(_readstream);
 		}
 	}
+	if (_splitter) {
+		syslog_splitter_free(_splitter);
+		free(_splitter);
+	}
+	syslog_ring_destroy(_ring);
+	if (_nextFilter != _filter) syslog_filter_destroy(_nextFilter);
+	syslog_filter_destroy(_filter);
+	if (_nextStore != _store) syslog_store_close(_nextStore);
+	syslog_store_close(_store);
+	free(_clock);
+	[_filterLock release];
 	[super dealloc];
 }
 
@@ -1689,6 +4096,9 @@ void AMSyslogRelayCallBack (
 	if (self = [super initWithName:@"com.apple.syslog_relay" onDevice:device]) {
 		_listener = listener;
 		_message = message;
+		_splitter = calloc(1, sizeof(syslog_splitter));
+		_filterLock = [[NSLock alloc] init];
+		_clock = calloc(1, sizeof(syslog_clock));
 		int sock = (int)((uint32_t)_service);
 		CFSocketNativeHandle s = (CFSocketNativeHandle)sock;
 		CFStreamCreatePairWithSocket ( 0, s, &_readstream, NULL);
@@ -1703,6 +4113,10 @@ void AMSyslogRelayCallBack (
 				} else {
 					NSLog(@"stream did not open");
 				}
+				// the stream callback, and so the store, is on the main run loop too
+				CFRunLoopTimerContext tctx = { 0, self, 0, 0, 0 };
+				_idleTimer = CFRunLoopTimerCreate(NULL, CFAbsoluteTimeGetCurrent() + 1.0, 1.0, 0, 0, relay_idle_timer, &tctx);
+				if (_idleTimer) CFRunLoopAddTimer(CFRunLoopGetMain(), _idleTimer, kCFRunLoopCommonModes);
 			} else {
 				NSLog(@"couldn't set client");
 			}
@@ -1713,15 +4127,81 @@ void AMSyslogRelayCallBack (
 	return self;
 }
 
+- (id)initWithAMDevice:(AMDevice*)device listener:(id)listener batchMessage:(SEL)message
+{
+	if (self = [super initWithName:@"com.apple.syslog_relay" onDevice:device]) {
+		_listener = listener;
+		_message = message;
+		_dropWhenFull = YES;
+		_batchSize = 4096;
+		_splitter = calloc(1, sizeof(syslog_splitter));
+		_filterLock = [[NSLock alloc] init];
+		_clock = calloc(1, sizeof(syslog_clock));
+		_ring = syslog_ring_create(AMSYSLOG_RING_SIZE);
+		CFRunLoopSourceContext ctx = { 0, self, 0, 0, 0, 0, 0, 0, 0, relay_deliver };
+		_deliver = CFRunLoopSourceCreate(NULL, 0, &ctx);
+		if (!_splitter || !_ring || !_deliver) {
+			NSLog(@"couldn't allocate the syslog ring");
+		} else {
+			CFRunLoopAddSource(CFRunLoopGetMain(), _deliver, kCFRunLoopCommonModes);
+			_readerStarted = (pthread_create(&_reader, NULL, relay_reader, self) == 0);
+			if (!_readerStarted) NSLog(@"couldn't start the syslog reader");
+		}
+	}
+	return self;
+}
+
 @end
 
 @implementation AMFileRelay
 
+@synthesize received=_received, extractedFiles=_extractedFiles, extractedBytes=_extractedBytes;
+
+// the device gathers everything asked for before it sends the first byte
++ (NSTimeInterval)defaultTimeout
+{
+	return 600;
+}
+
+// The archive is read this much at a time, into the service's receive buffer.
+#define FILE_RELAY_CHUNK	(256*1024)
+
+// recv() the archive until the device closes the connection, handing each piece
+// to block.  The block returns NO to give up, having set lasterror.
+- (bool)receiveArchive:(BOOL (^)(const void *buf, size_t len))block
+{
+	int sock = (int)((uint32_t)_service);
+
+	if (_rxcap < FILE_RELAY_CHUNK) {
+		free(_rxbuf);
+		_rxbuf = malloc(FILE_RELAY_CHUNK);
+		_rxcap = _rxbuf ? FILE_RELAY_CHUNK : 0;
+		if (!_rxbuf) {
+			[self setLastError:@"Can't allocate receive buffer"];
+			return NO;
+		}
+	}
+	_received = 0;
+	for (;;) {
+		ssize_t rc = recv(sock, _rxbuf, _rxcap, 0);
+		if (rc < 0 && errno == EINTR) continue;
+		if (rc < 0) {
+			[self setLastError:(errno == EAGAIN) ? @"Timed out waiting for archive" :
+								[NSString stringWithFormat:@"Can't receive archive: %s", strerror(errno)]];
+			return NO;
+		}
+		if (rc == 0) break;
+		_received += rc;
+		if (!block(_rxbuf, rc)) return NO;
+	}
+	[self clearLastError];
+	return YES;
+}
+
 - (bool)slurpInto:(NSOutputStream*)writestream
 {
 	NSAutoreleasePool *pool = [NSAutoreleasePool new];
-	bool result = NO;
-	UInt8 buf[1024];
+	bool result;
 
 	// make sure they remembered to open the stream
 	bool opened = NO;
@@ -1730,28 +4210,19 @@ void AMSyslogRelayCallBack (
 		opened = YES;
 	}
 
-	// create an input stream to read from the socket 
 	// loop around reading till its all done
-	NSInputStream *readstream = [self inputStreamFromSocket];
-	[readstream open];
-	for (;;) {
-		NSInteger nr = [readstream read:buf maxLength:sizeof(buf)];
-		if (nr > 0) {
-			NSInteger nw = [writestream write:buf maxLength:nr];
-			if (nw != nr) {
-				[self setLastError:[NSString stringWithFormat:@"File truncated on write, nr=%d nw=%d",nr,nw]];
-				break;
+	result = [self receiveArchive:^BOOL(const void *buf, size_t len) {
+		while (len) {
+			NSInteger nw = [writestream write:buf maxLength:len];
+			if (nw <= 0) {
+				[self setLastError:[NSString stringWithFormat:@"File truncated on write, nr=%lu nw=%ld",(unsigned long)len,(long)nw]];
+				return NO;
 			}
-		} else if (nr < 0) {
-			[self setLastError:[[readstream streamError] localizedDescription]];
-			break;
-		} else {
-			[self clearLastError];
-			result = YES;
-			break;
+			buf = (const char*)buf + nw;
+			len -= nw;
 		}
-	}
-	[readstream close];
+		return YES;
+	}];
 
 	// if we opened the stream, we close it as well
 	if (opened) [writestream close];
@@ -1768,7 +4239,8 @@ void AMSyslogRelayCallBack (
 	return self;
 }
 
-- (bool)getFileSets:(NSArray*)set into:(NSOutputStream*)output
+// Ask for the filesets.  The archive follows if this succeeds.
+- (bool)requestFileSets:(NSArray*)set
 {
 	if (_used) {
 		[self setLastError:@"AlreadyUsed"];
@@ -1788,21 +4260,79 @@ void AMSyslogRelayCallBack (
 				return NO;
 			}
 			// We could check for "Status = Acknowledged" but why bother
-			return [self slurpInto:output];
+			return YES;
 		}
 	}
 	return NO;
 }
 
-- (bool)getFileSet:(NSString*)name into:(NSOutputStream*)output
-{
-	return [self getFileSets:[NSArray arrayWithObject:name] into:output];
-} 
-
+- (bool)getFileSets:(NSArray*)set into:(NSOutputStream*)output
+{
+	return [self requestFileSets:set] && [self slurpInto:output];
+}
+
+- (bool)getFileSet:(NSString*)name into:(NSOutputStream*)output
+{
+	return [self getFileSets:[NSArray arrayWithObject:name] into:output];
+} 
+
+- (bool)getFileSets:(NSArray*)set handler:(const struct cpio_callbacks*)handler context:(void*)ctx
+{
+	if (![self requestFileSets:set]) return NO;
+
+	cpio_stream *cpio = cpio_stream_create(handler, ctx);
+	if (!cpio) {
+		[self setLastError:@"Can't allocate archive decoder"];
+		return NO;
+	}
+	__block int state = CPIO_MORE;
+	bool result = [self receiveArchive:^BOOL(const void *buf, size_t len) {
+		// once the trailer has been seen the rest is padding, but it is still
+		// read so the device sees the archive through
+		if (state == CPIO_MORE) state = cpio_stream_feed(cpio, buf, len);
+		if (state != CPIO_ERROR) return YES;
+		[self setLastError:[NSString stringWithFormat:@"Can't unpack archive: %s", cpio_stream_error(cpio)]];
+		return NO;
+	}];
+	if (result && state != CPIO_DONE) {
+		[self setLastError:@"Archive truncated"];
+		result = NO;
+	}
+	cpio_stream_destroy(cpio);
+	return result;
+}
+
+- (bool)getFileSets:(NSArray*)set extractTo:(NSString*)dir
+{
+	cpio_dir *out = cpio_dir_open([dir fileSystemRepresentation]);
+	if (!out) {
+		[self setLastError:@"Can't allocate archive decoder"];
+		return NO;
+	}
+	if (cpio_dir_error(out)) {
+		[self setLastError:[NSString stringWithUTF8String:cpio_dir_error(out)]];
+		cpio_dir_close(out, NULL, NULL);
+		return NO;
+	}
+	bool result = [self getFileSets:set handler:&cpio_dir_callbacks context:out];
+	// a failure writing a file is more use than "stopped by handler"
+	if (!result && cpio_dir_error(out)) {
+		[self setLastError:[NSString stringWithUTF8String:cpio_dir_error(out)]];
+	}
+	cpio_dir_close(out, &_extractedFiles, &_extractedBytes);
+	return result;
+}
+
 @end
 
 @implementation AMNotificationProxy
 
+// notifications come when they come
++ (NSTimeInterval)defaultTimeout
+{
+	return 0;
+}
+
 /*
 
 http://matt.colyer.name/projects/iphone-linux/index.php?title=Banana's_lockdownd_session
@@ -1981,6 +4511,7 @@ void AMNotificationProxy_callback(CFStringRef notification, void* data)
 	return nil;
 }
 
+#ifdef __APPLE__
 - (NSImage*)getIcon:(NSString*)displayIdentifier
 {
 	id reply = [self getIconPNGData:displayIdentifier];
@@ -1992,6 +4523,54 @@ void AMNotificationProxy_callback(CFStringRef notification, void* data)
 	}
 	return nil;
 }
+#endif
+
+- (NSArray*)getIconPNGDataAsync:(NSArray*)ids window:(NSUInteger)window
+{
+	NSMutableArray *replies = [NSMutableArray arrayWithCapacity:[ids count]];
+	NSUInteger count = [ids count], sent = 0, i;
+
+	if (window < 1) window = 1;
+	// every operation on the socket is carried out in the order it was queued,
+	// so interleaving the sends with the reads keeps window requests in flight
+	// without ever waiting here.  A send which fails breaks the connection, and
+	// the reads after it fail with it.
+	for (i = 0; i < count; i++) {
+		while (sent < count && sent < i + window) {
+			NSDictionary *message = [NSDictionary dictionaryWithObjectsAndKeys:
+										// value			key
+										@"getIconPNGData",	@"command",
+										[ids objectAtIndex:sent], @"bundleId",
+										nil];
+			[self sendXMLRequestAsync:message timeout:_timeout];
+			sent++;
+		}
+		[replies addObject:[self readXMLReplyAsync:_timeout]];
+	}
+	return replies;
+}
+
+- (NSDictionary*)getIconPNGDataForIds:(NSArray*)ids
+{
+	NSMutableDictionary *result = [NSMutableDictionary dictionaryWithCapacity:[ids count]];
+	NSArray *replies = [self getIconPNGDataAsync:ids window:8];
+	NSUInteger i;
+
+	for (i = 0; i < [replies count]; i++) {
+		AMServiceFuture *f = [replies objectAtIndex:i];
+		id reply = [f wait];
+		if (f.error) {
+			[self setLastError:f.error];
+			return nil;
+		}
+		if ([reply isKindOfClass:[NSDictionary class]]) {
+			NSData *pngdata = [reply objectForKey:@"pngData"];
+			if ([pngdata length]) [result setObject:pngdata forKey:[ids objectAtIndex:i]];
+		}
+	}
+	[self clearLastError];
+	return result;
+}
 
 - (id)initWithAMDevice:(AMDevice*)device
 {
@@ -2218,6 +4797,18 @@ plist_t build_contact_hello_msg(iphone_env *env)
 @synthesize udid=_udid;
 @synthesize deviceName=_deviceName;
 @synthesize lasterror=_lasterror;
+@synthesize sessionIdleTimeout=_sessionIdleTimeout;
+@synthesize keepAliveInterval=_keepAliveInterval;
+@synthesize sessionHits=_sessionHits;
+@synthesize sessionMisses=_sessionMisses;
+@synthesize poolHits=_poolHits;
+@synthesize poolMisses=_poolMisses;
+@synthesize attachLatency=_attachLatency;
+
+- (void)setAttachLatency:(NSTimeInterval)latency
+{
+	_attachLatency = latency;
+}
 
 - (void)clearLastError
 {
@@ -2233,6 +4824,10 @@ plist_t build_contact_hello_msg(iphone_env *env)
 
 - (bool)checkStatus:(int)ret from:(const char *)func
 {
+	if (ret == MD_E_SSL_REQUIRED) {
+		[self setLastError:[NSString stringWithFormat:@"%s failed: the device requires TLS, which the %s backend doesn't support",func,backend->name]];
+		return NO;
+	}
 	if (ret != 0) {
 		[self setLastError:[NSString stringWithFormat:@"%s failed: %x",func,ret]];
 		return NO;
@@ -2248,7 +4843,18 @@ plist_t build_contact_hello_msg(iphone_env *env)
 
 - (void)forgetDevice
 {
+	// the device has gone, so there's nobody to say goodbye to
+	[self stopWatchingDeviceValues];
+	[_catalog stopWatching];
+	[_sessionLock lock];
+	[self cancelIdleCheck];
+	[_servicePool removeAllObjects];
+	[_valueCache removeAllObjects];
+	[_valueCacheTimes removeAllObjects];
+	_connected = _insession = NO;
+	op_stats_unbind(_device);
 	_device = nil;
+	[_sessionLock unlock];
 }
 
 - (am_service)_startService:(NSString*)name
@@ -2296,12 +4902,203 @@ plist_t build_contact_hello_msg(iphone_env *env)
 	return NO;
 }
 
+#pragma mark session pool
+
+// the idle check's timer interval: it is only ever rescheduled by hand
+#define AMDEVICE_IDLE_NEVER		(100.0*365*24*3600)
+
+// lockdown will answer this quickly, and won't if the session has gone away
+- (bool)sessionIsAlive
+{
+	CFTypeRef value = AMDeviceCopyValue(_device, 0, CFSTR("DeviceName"));
+	if (!value) return NO;
+	CFRelease(value);
+	return YES;
+}
+
+- (void)closeSession
+{
+	if (_insession) [self stopSession];
+	if (_connected) [self deviceDisconnect];
+	_insession = _connected = NO;
+}
+
+- (bool)acquireSession
+{
+	if (!_device) {
+		[self setLastError:@"Device is not attached"];
+		return NO;
+	}
+	[_sessionLock lock];
+	if (_connected && _insession && _sessionUsers == 0 &&
+		CFAbsoluteTimeGetCurrent() - _sessionLastUsed > _keepAliveInterval &&
+		![self sessionIsAlive]) {
+		// the device got bored and dropped us
+		[self closeSession];
+	}
+	if (_connected && _insession) {
+		_sessionHits++;
+	} else {
+		_sessionMisses++;
+		if (!_connected && ![self deviceConnect]) {
+			[_sessionLock unlock];
+			return NO;
+		}
+		if (!_insession && ![self startSession]) {
+			NSString *err = [[self.lasterror retain] autorelease];
+			[self deviceDisconnect];
+			[self setLastError:err];
+			[_sessionLock unlock];
+			return NO;
+		}
+	}
+	_sessionUsers++;
+	[_sessionLock unlock];
+	return YES;
+}
+
+// Sessions are released from worker threads as often as from the main thread,
+// and a worker's run loop never runs, so the idle check goes on the main one.
+static void session_idle_timer(CFRunLoopTimerRef timer, void *info)
+{
+	NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+	[(AMDevice*)info sessionIdleCheck];
+	[pool drain];
+}
+
+// Run -sessionIdleCheck after delay.  The timer doesn't retain the device, so
+// an idle session doesn't keep one alive; it is cancelled when the device goes.
+// Called with _sessionLock held.
+- (void)scheduleIdleCheck:(NSTimeInterval)delay
+{
+	CFAbsoluteTime when = CFAbsoluteTimeGetCurrent() + delay;
+	if (_idleTimer) {
+		CFRunLoopTimerSetNextFireDate(_idleTimer, when);
+		return;
+	}
+	// it never repeats by itself - each check schedules the next
+	CFRunLoopTimerContext ctx = { 0, self, 0, 0, 0 };
+	_idleTimer = CFRunLoopTimerCreate(NULL, when, AMDEVICE_IDLE_NEVER, 0, 0, session_idle_timer, &ctx);
+	if (_idleTimer) CFRunLoopAddTimer(CFRunLoopGetMain(), _idleTimer, kCFRunLoopCommonModes);
+}
+
+- (void)cancelIdleCheck
+{
+	if (_idleTimer) {
+		CFRunLoopTimerInvalidate(_idleTimer);
+		CFRelease(_idleTimer);
+		_idleTimer = NULL;
+	}
+}
+
+- (void)releaseSession
+{
+	[_sessionLock lock];
+	if (_sessionUsers && --_sessionUsers == 0) {
+		_sessionLastUsed = CFAbsoluteTimeGetCurrent();
+		if (_sessionIdleTimeout <= 0) {
+			[self closeSession];
+		} else {
+			NSTimeInterval delay = MIN(_keepAliveInterval, _sessionIdleTimeout);
+			[self scheduleIdleCheck:(delay > 0 ? delay : _sessionIdleTimeout)];
+		}
+	}
+	[_sessionLock unlock];
+}
+
+// fired off the main run loop while the session is idle - keep it alive until
+// it has been idle long enough, then shut it (and the pool) down
+- (void)sessionIdleCheck
+{
+	[_sessionLock lock];
+	if (_device && _sessionUsers == 0 && _insession) {
+		NSTimeInterval idle = CFAbsoluteTimeGetCurrent() - _sessionLastUsed;
+		if (idle >= _sessionIdleTimeout) {
+			[self drainPool];
+		} else if (![self sessionIsAlive]) {
+			[self closeSession];
+			[self cancelIdleCheck];
+		} else {
+			[self scheduleIdleCheck:MIN(_keepAliveInterval, _sessionIdleTimeout - idle)];
+		}
+	} else if (_sessionUsers == 0) {
+		[self cancelIdleCheck];
+	}
+	[_sessionLock unlock];
+}
+
+// hand out a pooled service if there is a live one.  Returns a retained object.
+- (id)newPooledService:(NSString*)key
+{
+	id result = nil;
+	[_sessionLock lock];
+	NSMutableArray *idle = [_servicePool objectForKey:key];
+	while (!result && [idle count]) {
+		AMService *svc = [[idle lastObject] retain];
+		[idle removeLastObject];
+		// anything that has been sitting around a while gets a quick check
+		if (CFAbsoluteTimeGetCurrent() - [svc pooledAt] <= _keepAliveInterval || [svc pooledConnectionIsAlive]) {
+			result = svc;
+		} else {
+			[svc release];
+		}
+	}
+	if (result) {
+		_poolHits++;
+	} else {
+		_poolMisses++;
+	}
+	[_sessionLock unlock];
+	return result;
+}
+
+- (void)recycleService:(AMService*)service
+{
+	NSString *key = [service poolKey];
+	if (key && _device && _sessionIdleTimeout > 0) {
+		[_sessionLock lock];
+		NSMutableArray *idle = [_servicePool objectForKey:key];
+		if (!idle) {
+			idle = [NSMutableArray array];
+			[_servicePool setObject:idle forKey:key];
+		}
+		[service setPooledAt:CFAbsoluteTimeGetCurrent()];
+		// the delegate isn't retained, and may not outlive its caller
+		service.delegate = nil;
+		[idle addObject:service];
+		[_sessionLock unlock];
+	}
+	[service release];
+}
+
+- (void)drainPool
+{
+	[_sessionLock lock];
+	// releasing the services closes their connections
+	[_servicePool removeAllObjects];
+	if (_sessionUsers == 0) {
+		[self cancelIdleCheck];
+		if (_device) [self closeSession];
+	}
+	[_sessionLock unlock];
+}
+
 - (void)dealloc
 {
+	[self stopWatchingDeviceValues];
+	[_catalog stopWatching];
+	[_catalog release];
+	[_sessionLock lock];
+	[self cancelIdleCheck];
+	[_sessionLock unlock];
+	[_servicePool release];
+	[_valueCache release];
+	[_valueCacheTimes release];
 	if (_device) {
 		if (_insession) [self stopSession];
 		if (_connected) [self deviceDisconnect];
 	}
+	[_sessionLock release];
 	[_deviceName release];
 	[_udid release];
 	[_lasterror release];
@@ -2312,37 +5109,92 @@ plist_t build_contact_hello_msg(iphone_env *env)
 // dealloc because of reference counting
 - (void)applicationWillTerminate:(NSNotification*)notification
 {
+	[_servicePool removeAllObjects];
 	if (_device) {
 		if (_insession) [self stopSession];
 		if (_connected) [self deviceDisconnect];
 	}
 }
 
-- (id)deviceValueForKey:(NSString*)key inDomain:(NSString*)domain
+#pragma mark device values
+
+// Values are cached under "domain<tab>key", with "*" standing in for the key
+// when a whole domain was fetched.  Keys the device has no value for are
+// cached as NSNull so we don't keep asking.
+static NSString *value_cache_key(NSString *domain, NSString *key)
 {
-	BOOL opened_connection = NO;
-	BOOL opened_session = NO;
-	id result = nil;
+	return [NSString stringWithFormat:@"%@\t%@", domain ? domain : @"", key ? key : @"*"];
+}
+
+- (id)cachedValue:(NSString*)cachekey
+{
+	if (_valueCacheTTL <= 0) return nil;
+	NSNumber *when = [_valueCacheTimes objectForKey:cachekey];
+	if (!when || CFAbsoluteTimeGetCurrent() - [when doubleValue] > _valueCacheTTL) return nil;
+	return [_valueCache objectForKey:cachekey];
+}
+
+- (void)cacheValue:(id)value as:(NSString*)cachekey
+{
+	if (_valueCacheTTL <= 0) return;
+	[_valueCache setObject:(value ? value : [NSNull null]) forKey:cachekey];
+	[_valueCacheTimes setObject:[NSNumber numberWithDouble:CFAbsoluteTimeGetCurrent()] forKey:cachekey];
+}
+
+- (NSDictionary*)deviceValuesForKeys:(NSArray*)keys inDomain:(NSString*)domain
+{
+	NSMutableDictionary *result = [NSMutableDictionary dictionary];
+	[_sessionLock lock];
 
-	// first, check for a connection
-	if (!_connected) {
-		if (![self deviceConnect]) goto bail;
-		opened_connection = YES;
+	if (!keys) {
+		// the whole domain
+		NSString *all = value_cache_key(domain, nil);
+		id values = [self cachedValue:all];
+		if (!values && [self acquireSession]) {
+			values = [(id)AMDeviceCopyValue(_device, (CFStringRef)domain, NULL) autorelease];
+			[self releaseSession];
+			if (values) {
+				[self cacheValue:values as:all];
+				if ([values isKindOfClass:[NSDictionary class]]) {
+					for (NSString *key in values) {
+						[self cacheValue:[values objectForKey:key] as:value_cache_key(domain, key)];
+					}
+				}
+			}
+		}
+		[_sessionLock unlock];
+		return [values isKindOfClass:[NSDictionary class]] ? values : nil;
 	}
 
-	// one way or another, we have a connection, look for a session
-	if (!_insession) {
-		if (![self startSession]) goto bail;
-		opened_session = YES;
+	// answer what we can from the cache, then fetch the rest in one session
+	NSDictionary *domainValues = [self cachedValue:value_cache_key(domain, nil)];
+	NSMutableArray *missing = [NSMutableArray array];
+	for (NSString *key in keys) {
+		id value = [self cachedValue:value_cache_key(domain, key)];
+		if (!value) value = [domainValues objectForKey:key];
+		if (value) {
+			if (value != [NSNull null]) [result setObject:value forKey:key];
+		} else {
+			[missing addObject:key];
+		}
+	}
+	if ([missing count] && [self acquireSession]) {
+		for (NSString *key in missing) {
+			id value = [(id)AMDeviceCopyValue(_device, (CFStringRef)domain, (CFStringRef)key) autorelease];
+			[self cacheValue:value as:value_cache_key(domain, key)];
+			if (value) [result setObject:value forKey:key];
+		}
+		[self releaseSession];
 	}
 
-	// ok we have a session running, just query and set up to return
-	result = (id)AMDeviceCopyValue(_device,(CFStringRef)domain,(CFStringRef)key);
+	[_sessionLock unlock];
+	return result;
+}
 
-bail:
-	if (opened_session) [self stopSession];
-	if (opened_connection) [self deviceDisconnect];
-	return [result autorelease];
+- (id)deviceValueForKey:(NSString*)key inDomain:(NSString*)domain
+{
+	if (!key) return [self deviceValuesForKeys:nil inDomain:domain];
+	return [[self deviceValuesForKeys:[NSArray arrayWithObject:key] inDomain:domain] objectForKey:key];
 }
 
 - (id)deviceValueForKey:(NSString*)key
@@ -2355,6 +5207,99 @@ bail:
 	return [self deviceValueForKey:nil inDomain:domain];
 }
 
+- (NSTimeInterval)valueCacheTTL
+{
+	return _valueCacheTTL;
+}
+
+- (void)setValueCacheTTL:(NSTimeInterval)ttl
+{
+	_valueCacheTTL = ttl;
+	if (ttl <= 0) [self invalidateDeviceValues];
+}
+
+- (void)invalidateDeviceValues
+{
+	[_sessionLock lock];
+	[_valueCache removeAllObjects];
+	[_valueCacheTimes removeAllObjects];
+	[_sessionLock unlock];
+}
+
+// drop a root domain value, and the cached copy of the root domain as a whole
+- (void)invalidateDeviceValue:(NSString*)key
+{
+	NSString *k = value_cache_key(nil, key);
+	NSString *all = value_cache_key(nil, nil);
+	[_valueCache removeObjectForKey:k];
+	[_valueCacheTimes removeObjectForKey:k];
+	[_valueCache removeObjectForKey:all];
+	[_valueCacheTimes removeObjectForKey:all];
+}
+
+// lockdown notifications and the root domain values they invalidate.  Anything
+// not listed here throws the whole cache away.
+static struct {
+	NSString *notification;
+	NSString *keys[3];
+} value_notifications[] = {
+	{ @"com.apple.mobile.lockdown.device_name_changed",		{ @"DeviceName", nil } },
+	{ @"com.apple.mobile.lockdown.phone_number_changed",	{ @"PhoneNumber", nil } },
+	{ @"com.apple.mobile.lockdown.activation_state",		{ @"ActivationState", @"ActivationStateAcknowledged", nil } },
+	{ @"com.apple.mobile.lockdown.brick_state",				{ @"BrickState", nil } },
+	{ @"com.apple.mobile.lockdown.trusted_host_attached",	{ @"TrustedHostAttached", @"HostAttached", nil } },
+	{ @"com.apple.mobile.lockdown.host_attached",			{ @"HostAttached", nil } },
+	{ @"com.apple.mobile.lockdown.host_detached",			{ @"HostAttached", @"TrustedHostAttached", nil } },
+	{ @"com.apple.language.changed",						{ nil } },
+	{ @"com.apple.mobile.data_sync.domain_changed",			{ nil } },
+};
+
+- (void)deviceValuesChanged:(id)notification
+{
+	unsigned i, k;
+	[_sessionLock lock];
+	for (i=0; i<sizeof(value_notifications)/sizeof(value_notifications[0]); i++) {
+		if (![notification isEqualToString:value_notifications[i].notification]) continue;
+		if (!value_notifications[i].keys[0]) break;
+		for (k=0; k<3 && value_notifications[i].keys[k]; k++) {
+			[self invalidateDeviceValue:value_notifications[i].keys[k]];
+		}
+		if ([notification isEqualToString:@"com.apple.mobile.lockdown.device_name_changed"]) {
+			// deviceName is remembered separately
+			NSString *name = [self deviceValueForKey:@"DeviceName"];
+			if (name) {
+				[_deviceName release];
+				_deviceName = [name copy];
+			}
+		}
+		[_sessionLock unlock];
+		return;
+	}
+	[self invalidateDeviceValues];
+	[_sessionLock unlock];
+}
+
+- (bool)startWatchingDeviceValues
+{
+	if (_valueWatcher) return YES;
+	_valueWatcher = [self newAMNotificationProxy];
+	if (!_valueWatcher) return NO;
+	unsigned i;
+	for (i=0; i<sizeof(value_notifications)/sizeof(value_notifications[0]); i++) {
+		[_valueWatcher addObserver:self selector:@selector(deviceValuesChanged:) name:value_notifications[i].notification];
+	}
+	return YES;
+}
+
+- (void)stopWatchingDeviceValues
+{
+	// the proxy holds on to its observers, so this also breaks the retain
+	// cycle between us and it
+	[_valueWatcher removeObserver:self];
+	[_valueWatcher release];
+	_valueWatcher = nil;
+}
+
 - (NSString*)productType
 {
 	return [self deviceValueForKey:@"ProductType"];
@@ -2389,14 +5334,24 @@ bail:
 		// we can access device values once we are connected
 		_deviceName = (NSString*)AMDeviceCopyValue(_device, 0, CFSTR("DeviceName"));
 		_udid = (NSString*)AMDeviceCopyValue(_device, 0, CFSTR("UniqueDeviceID"));
+		op_stats_name(_device, [_udid UTF8String]);
 
 		// NSLog(@"AMDeviceGetInterfaceType() returns %d",AMDeviceGetInterfaceType(device));
 		// NSLog(@"AMDeviceGetInterfaceSpeed() returns %.0fK",AMDeviceGetInterfaceSpeed(device)/1024.0);
 		// NSLog(@"AMDeviceGetConnectionID() returns %d",AMDeviceGetConnectionID(device));
 
 		// apparently we need to disconnect whenever we aren't doing anything or
-		// the connection will time-out at the other end???
+		// the connection will time-out at the other end???  Sessions we keep
+		// around are pinged to stop that happening - see sessionIdleCheck
 		[self deviceDisconnect];
+
+		_sessionLock = [NSRecursiveLock new];
+		_servicePool = [NSMutableDictionary new];
+		_sessionIdleTimeout = 30;
+		_keepAliveInterval = 10;
+		_valueCache = [NSMutableDictionary new];
+		_valueCacheTimes = [NSMutableDictionary new];
+		_valueCacheTTL = 60;
 	}
 	return self;
 }
@@ -2412,92 +5367,83 @@ bail:
 
 - (AFCMediaDirectory*)newAFCMediaDirectory
 {
-	AFCMediaDirectory *result = nil;
-	if ([self deviceConnect]) {
-		if ([self startSession]) {
-			result = [[AFCMediaDirectory alloc] initWithAMDevice:self];
-			[self stopSession];
-		}
-		[self deviceDisconnect];
+	NSString *key = @"com.apple.afc";
+	AFCMediaDirectory *result = [self newPooledService:key];
+	if (!result && [self acquireSession]) {
+		result = [[AFCMediaDirectory alloc] initWithAMDevice:self];
+		[result setPoolKey:key];
+		[self releaseSession];
 	}
 	return result;
 }
 
 - (AFCCrashLogDirectory*)newAFCCrashLogDirectory
 {
-	AFCCrashLogDirectory *result = nil;
-	if ([self deviceConnect]) {
-		if ([self startSession]) {
-			result = [[AFCCrashLogDirectory alloc] initWithAMDevice:self];
-			[self stopSession];
-		}
-		[self deviceDisconnect];
+	NSString *key = @"com.apple.crashreportcopymobile";
+	AFCCrashLogDirectory *result = [self newPooledService:key];
+	if (!result && [self acquireSession]) {
+		result = [[AFCCrashLogDirectory alloc] initWithAMDevice:self];
+		[result setPoolKey:key];
+		[self releaseSession];
 	}
 	return result;
 }
 
 - (AFCRootDirectory*)newAFCRootDirectory
 {
-	AFCRootDirectory *result = nil;
-	if ([self deviceConnect]) {
-		if ([self startSession]) {
-			result = [[AFCRootDirectory alloc] initWithAMDevice:self];
-			[self stopSession];
-		}
-		[self deviceDisconnect];
+	NSString *key = @"com.apple.afc2";
+	AFCRootDirectory *result = [self newPooledService:key];
+	if (!result && [self acquireSession]) {
+		result = [[AFCRootDirectory alloc] initWithAMDevice:self];
+		[result setPoolKey:key];
+		[self releaseSession];
 	}
 	return result;
 }
 
 - (AFCApplicationDirectory*)newAFCApplicationDirectory:(NSString*)name
 {
-	AFCApplicationDirectory *result = nil;
-	if ([self deviceConnect]) {
-		if ([self startSession]) {
-			result = [[AFCApplicationDirectory alloc] initWithAMDevice:self andName:name];
-			[self stopSession];
-		}
-		[self deviceDisconnect];
+	NSString *key = [NSString stringWithFormat:@"com.apple.mobile.house_arrest/%@", name];
+	AFCApplicationDirectory *result = [self newPooledService:key];
+	if (!result && [self acquireSession]) {
+		result = [[AFCApplicationDirectory alloc] initWithAMDevice:self andName:name];
+		[result setPoolKey:key];
+		[self releaseSession];
 	}
 	return result;
 }
 
 - (AMInstallationProxy*)newAMInstallationProxyWithDelegate:(id<AMInstallationProxyDelegate>)delegate
 {
-	AMInstallationProxy *result = nil;
-	if ([self deviceConnect]) {
-		if ([self startSession]) {
-			result = [[AMInstallationProxy alloc] initWithAMDevice:self];
-			result.delegate = delegate;
-			[self stopSession];
-		}
-		[self deviceDisconnect];
+	NSString *key = @"com.apple.mobile.installation_proxy";
+	AMInstallationProxy *result = [self newPooledService:key];
+	if (!result && [self acquireSession]) {
+		result = [[AMInstallationProxy alloc] initWithAMDevice:self];
+		[result setPoolKey:key];
+		[self releaseSession];
 	}
+	result.delegate = delegate;
 	return result;
 }
 
 - (AMNotificationProxy*)newAMNotificationProxy
 {
 	AMNotificationProxy *result = nil;
-	if ([self deviceConnect]) {
-		if ([self startSession]) {
-			result = [[AMNotificationProxy alloc] initWithAMDevice:self];
-			[self stopSession];
-		}
-		[self deviceDisconnect];
+	if ([self acquireSession]) {
+		result = [[AMNotificationProxy alloc] initWithAMDevice:self];
+		[self releaseSession];
 	}
 	return result;
 }
 
 - (AMSpringboardServices*)newAMSpringboardServices
 {
-	AMSpringboardServices *result = nil;
-	if ([self deviceConnect]) {
-		if ([self startSession]) {
-			result = [[AMSpringboardServices alloc] initWithAMDevice:self];
-			[self stopSession];
-		}
-		[self deviceDisconnect];
+	NSString *key = @"com.apple.springboardservices";
+	AMSpringboardServices *result = [self newPooledService:key];
+	if (!result && [self acquireSession]) {
+		result = [[AMSpringboardServices alloc] initWithAMDevice:self];
+		[result setPoolKey:key];
+		[self releaseSession];
 	}
 	return result;
 }
@@ -2505,12 +5451,19 @@ bail:
 - (AMSyslogRelay*)newAMSyslogRelay:(id)listener message:(SEL)message
 {
 	AMSyslogRelay *result = nil;
-	if ([self deviceConnect]) {
-		if ([self startSession]) {
-			result = [[AMSyslogRelay alloc] initWithAMDevice:self listener:listener message:message];
-			[self stopSession];
-		}
-		[self deviceDisconnect];
+	if ([self acquireSession]) {
+		result = [[AMSyslogRelay alloc] initWithAMDevice:self listener:listener message:message];
+		[self releaseSession];
+	}
+	return result;
+}
+
+- (AMSyslogRelay*)newAMSyslogRelay:(id)listener batchMessage:(SEL)message
+{
+	AMSyslogRelay *result = nil;
+	if ([self acquireSession]) {
+		result = [[AMSyslogRelay alloc] initWithAMDevice:self listener:listener batchMessage:message];
+		[self releaseSession];
 	}
 	return result;
 }
@@ -2518,12 +5471,9 @@ bail:
 - (AMFileRelay*)newAMFileRelay
 {
 	AMFileRelay *result = nil;
-	if ([self deviceConnect]) {
-		if ([self startSession]) {
-			result = [[AMFileRelay alloc] initWithAMDevice:self];
-			[self stopSession];
-		}
-		[self deviceDisconnect];
+	if ([self acquireSession]) {
+		result = [[AMFileRelay alloc] initWithAMDevice:self];
+		[self releaseSession];
 	}
 	return result;
 }
@@ -2531,12 +5481,26 @@ bail:
 - (AMMobileSync*)newAMMobileSync
 {
 	AMMobileSync *result = nil;
-	if ([self deviceConnect]) {
-		if ([self startSession]) {
-			result = [[AMMobileSync alloc] initWithAMDevice:self];
-			[self stopSession];
+	if ([self acquireSession]) {
+		result = [[AMMobileSync alloc] initWithAMDevice:self];
+		[self releaseSession];
+	}
+	return result;
+}
+
+// Every application on the device, bundle id -> info.
+- (NSDictionary*)lookupApplications
+{
+	NSDictionary *result = nil;
+	if ([self acquireSession]) {
+		CFDictionaryRef dict = nil;
+		if (
+			[self checkStatus:AMDeviceLookupApplications(_device, nil, &dict)
+						 from:"AMDeviceLookupApplications"]
+		) {
+			result = [(NSDictionary*)dict autorelease];
 		}
-		[self deviceDisconnect];
+		[self releaseSession];
 	}
 	return result;
 }
@@ -2544,54 +5508,78 @@ bail:
 - (NSArray*)installedApplications
 {
 	NSMutableArray* result = nil;
-	if ([self deviceConnect]) {
-		if ([self startSession]) {
-			CFDictionaryRef dict = nil;
-			if (
-				[self checkStatus:AMDeviceLookupApplications(_device, nil, &dict)
-							 from:"AMDeviceLookupApplications"]
-			) {
-				result = [[NSMutableArray new] autorelease];
-				for (NSString *key in (NSDictionary*)dict) {
-					NSDictionary *info = [(NSDictionary*)dict objectForKey:key];
-					// "User", "System", "Internal" ??
-					if ([[info objectForKey:@"ApplicationType"] isEqual:@"User"]) {
-						AMApplication *newapp = [[AMApplication alloc] initWithDictionary:info];
-						[result addObject:newapp];
-						[newapp release];
-					}
-				}
-				CFRelease(dict);
-				result = [NSArray arrayWithArray:result];
+	NSDictionary *dict = [self lookupApplications];
+	if (dict) {
+		result = [[NSMutableArray new] autorelease];
+		for (NSString *key in dict) {
+			NSDictionary *info = [dict objectForKey:key];
+			// "User", "System", "Internal" ??
+			if ([[info objectForKey:@"ApplicationType"] isEqual:@"User"]) {
+				AMApplication *newapp = [[AMApplication alloc] initWithDictionary:info];
+				[result addObject:newapp];
+				[newapp release];
 			}
-			[self stopSession];
 		}
-		[self deviceDisconnect];
+		result = [NSArray arrayWithArray:result];
+		// we have it, so the catalog may as well
+		[[self applicationCatalog] takeApplications:dict verified:YES];
 	}
 	return result;
 }
 
 - (AMApplication*)installedApplicationWithId:(NSString*)id
 {
-	AMApplication* result = nil;
-	if ([self deviceConnect]) {
-		if ([self startSession]) {
-			CFDictionaryRef dict = nil;
-			if (
-				[self checkStatus:AMDeviceLookupApplications(_device, nil, &dict)
-							 from:"AMDeviceLookupApplications"]
-			) {
-				NSDictionary *info = [(NSDictionary*)dict objectForKey:id];
-				if (info) {
-					result = [[[AMApplication alloc] initWithDictionary:info] autorelease];
-				}
-				CFRelease(dict);
-			}
-			[self stopSession];
+	return [[self applicationCatalog] applicationWithId:id];
+}
+
+- (AMApplicationCatalog*)applicationCatalog
+{
+	[_sessionLock lock];
+	if (!_catalog) _catalog = [[AMApplicationCatalog alloc] initWithDevice:self];
+	[_sessionLock unlock];
+	return _catalog;
+}
+
+- (BOOL)installPackageAtPath:(NSString*)path progress:(void (^)(NSString *status, NSInteger percent))progress
+{
+	NSString *staged = [@"PublicStaging" stringByAppendingPathComponent:[path lastPathComponent]];
+	BOOL ok = NO;
+	if (![[NSFileManager defaultManager] fileExistsAtPath:path]) {
+		[self setLastError:[NSString stringWithFormat:@"%@ doesn't exist", path]];
+		return NO;
+	}
+
+	// start the proxy before uploading, so a device which can't install isn't
+	// sent the package first, and Install goes out the moment the upload is done
+	AMInstallationProxy *proxy = [self newAMInstallationProxyWithDelegate:nil];
+	if (!proxy) return NO;
+	AFCMediaDirectory *media = [self newAFCMediaDirectory];
+	if (!media) {
+		[self setLastError:@"Can't open the media directory"];
+	} else {
+		// only what has changed since the last time is sent
+		if (progress) progress(@"Uploading", 0);
+		AFCStagingCache *cache = [[AFCStagingCache alloc] initWithDirectory:media root:@"/PublicStaging"];
+		ok = [cache stageLocalPath:path];
+		if (!ok) {
+			[self setLastError:[NSString stringWithFormat:@"Upload failed: %@", cache.lasterror]];
+		} else if (progress) {
+			progress([NSString stringWithFormat:@"Uploaded %llu bytes, %llu unchanged", cache.bytesSent, cache.bytesSkipped], 0);
 		}
-		[self deviceDisconnect];
+		[cache release];
+		if (ok) [self recycleService:media];
+		else [media release];
 	}
-	return result;
+	if (ok) {
+		// Upgrade installs the package whether or not it is already there
+		ok = [proxy installPackage:staged upgrade:YES progress:progress];
+		if (ok) [self clearLastError];
+		else [self setLastError:proxy.lasterror];
+		[_catalog invalidate];
+	}
+	if (ok) [self recycleService:proxy];
+	else [proxy release];
+	return ok;
 }
 
 @end
@@ -2616,6 +5604,8 @@ bail:
 
 	case ADNCI_MSG_CONNECTED:
 		d = [AMDevice deviceFrom:info->dev];
+		if (!d) return;
+		[d setAttachLatency:CFAbsoluteTimeGetCurrent() - _subscribedAt];
 		[_devices addObject:d];
 		if (_listener && [_listener respondsToSelector:@selector(deviceConnected:)]) {
 			[_listener deviceConnected:d];
@@ -2669,6 +5659,7 @@ void notify_callback(struct am_device_notification_callback_info *info, void* ar
 		_devices = [NSMutableArray new];	// we have no device connected
 		_waitingInRunLoop = NO;			// we are not currently waiting in a runloop
 
+#ifdef __APPLE__
 		// we opened, we need to ensure that we get closed or our
 		// services stay running on the ipod
 		[[NSNotificationCenter defaultCenter] 
@@ -2676,26 +5667,32 @@ void notify_callback(struct am_device_notification_callback_info *info, void* ar
 			   selector: @selector(applicationWillTerminate:)
 				   name: NSApplicationWillTerminateNotification
 				 object: nil];
+#endif
     }
 	return self;
 }
 
-- (bool)setListener:(id<MobileDeviceAccessListener>)listener
+- (BOOL)subscribe
 {
-	_listener = listener;
-	if (_listener) {
-		// if we are not subscribed yet, do it now
-		if (!_subscribed) {
-			// try to subscribe for notifications - pass self as the callback_data
-			int ret = AMDeviceNotificationSubscribe(notify_callback, 0, 0, self, &_notification);
-			if (ret == 0) {
-				_subscribed = YES;
-			} else {
-				// we should throw or something in here...
-				NSLog(@"AMDeviceNotificationSubscribe failed: %d", ret);
-			}
+	// if we are not subscribed yet, do it now
+	if (!_subscribed) {
+		// try to subscribe for notifications - pass self as the callback_data
+		_subscribedAt = CFAbsoluteTimeGetCurrent();
+		int ret = AMDeviceNotificationSubscribe(notify_callback, 0, 0, self, &_notification);
+		if (ret == 0) {
+			_subscribed = YES;
+		} else {
+			// we should throw or something in here...
+			NSLog(@"AMDeviceNotificationSubscribe failed: %d", ret);
 		}
 	}
+	return _subscribed;
+}
+
+- (bool)setListener:(id<MobileDeviceAccessListener>)listener
+{
+	_listener = listener;
+	if (_listener) [self subscribe];
 	return YES;
 }
 
@@ -2719,26 +5716,110 @@ void notify_callback(struct am_device_notification_callback_info *info, void* ar
 	// point waiting
 	if (!_subscribed) return NO;
 
-	NSLog(@"calling CFRunLoopRun(), plug iPod in now!!!");
-	_waitingInRunLoop = YES;
-	CFRunLoopRun();
-	_waitingInRunLoop = NO;
-	NSLog(@"back from calling CFRunLoopRun()");
-
-// while (something?) {
-// 		_waitingInRunLoop = YES;
-//		CFRunLoopRunInMode (@"waiting for connection", 5/*seconds*/, NO/*returnAfterSourceHandled*/);
-//		_waitingInRunLoop = NO;
-//		if (_device) return YES;
-// }
+	return [self waitForDevice:nil timeout:0] != nil;
+}
+
+// Run the run loop until done() says so, or timeout seconds (0 for ever) have
+// passed.  Notify: stops the run loop after each attach or detach, so done() is
+// checked as soon as anything changes rather than on a timer.
+- (BOOL)waitUntil:(BOOL (^)(void))done timeout:(NSTimeInterval)timeout
+{
+	CFAbsoluteTime deadline = CFAbsoluteTimeGetCurrent() + timeout;
+	BOOL wasWaiting = _waitingInRunLoop;
+
+	// we didn't manage to subscribe for notifications so there is no
+	// point waiting
+	if (![self subscribe]) return done();
+
+	while (!done()) {
+		CFTimeInterval left = timeout > 0 ? deadline - CFAbsoluteTimeGetCurrent() : 1e10;
+		if (left <= 0) return NO;
+		_waitingInRunLoop = YES;
+		SInt32 rc = CFRunLoopRunInMode(kCFRunLoopDefaultMode, left, true);
+		_waitingInRunLoop = wasWaiting;
+		// nothing left to wait on
+		if (rc == kCFRunLoopRunFinished) return done();
+	}
 	return YES;
 }
 
+- (AMDevice*)attachedDevice:(NSString*)udid
+{
+	for (AMDevice *d in _devices) {
+		if (!udid || [d.udid caseInsensitiveCompare:udid] == NSOrderedSame) return d;
+	}
+	return nil;
+}
+
+- (AMDevice*)waitForDevice:(NSString*)udid timeout:(NSTimeInterval)timeout
+{
+	[self waitUntil:^BOOL{ return [self attachedDevice:udid] != nil; } timeout:timeout];
+	return [self attachedDevice:udid];
+}
+
+- (NSArray*)waitForDevicesWithUdids:(NSArray*)udids timeout:(NSTimeInterval)timeout
+{
+	NSMutableArray *result = [NSMutableArray arrayWithCapacity:[udids count]];
+	[self waitUntil:^BOOL{
+		for (NSString *udid in udids) {
+			if (![self attachedDevice:udid]) return NO;
+		}
+		return YES;
+	} timeout:timeout];
+	for (NSString *udid in udids) {
+		AMDevice *d = [self attachedDevice:udid];
+		if (d) [result addObject:d];
+	}
+	return result;
+}
+
+- (NSArray*)waitForDevices:(NSUInteger)count timeout:(NSTimeInterval)timeout
+{
+	[self waitUntil:^BOOL{ return [_devices count] >= count; } timeout:timeout];
+	return [NSArray arrayWithArray:_devices];
+}
+
 - (NSString*)clientVersion
 {
 	return [NSString stringWithUTF8String:AFCGetClientVersionString()];
 }
 
++ (void)load
+{
+#if MD_FRAMEWORK_BACKEND
+	if (!framework_installed()) backend = &md_native_backend;
+#endif
+}
+
++ (BOOL)useBackend:(NSString*)name
+{
+#if MD_FRAMEWORK_BACKEND
+	if ([name isEqual:@"framework"]) {
+		if (!framework_installed()) {
+			NSLog(@"MobileDevice.framework isn't installed");
+			return NO;
+		}
+		backend = &framework_backend;
+		return YES;
+	}
+#endif
+	if ([name isEqual:@"native"]) {
+		backend = &md_native_backend;
+		return YES;
+	}
+	return NO;
+}
+
++ (NSString*)backendName
+{
+	return [NSString stringWithUTF8String:backend->name];
+}
+
++ (void)setUsbmuxAddress:(NSString*)address
+{
+	md_native_set_usbmux_address([address UTF8String]);
+}
+
 + (MobileDeviceAccess*)singleton
 {
 	static MobileDeviceAccess *_singleton = nil;
@@ -0,0 +1,166 @@
+//
+//  MobileDeviceBackend.h
+//  mobileDeviceManager
+//
+//  What MobileDeviceAccess needs from whatever talks to the device: the handful
+//  of MobileDevice.framework calls it makes, as a table of function pointers.
+//  The framework itself fills one in (in MobileDeviceAccess.m, where its calls
+//  are declared); md_native_backend fills in another by speaking the usbmuxd,
+//  lockdown, notification_proxy and AFC protocols itself, so nothing depends
+//  on the framework being there.  +[MobileDeviceAccess useBackend:] picks one.
+//
+//  The fields are named after the framework calls, with the framework's
+//  argument conventions, so MobileDeviceAccess.m can #define each call to go
+//  through the table and otherwise read as it always has.
+//
+
+#import "MobileDeviceAccess.h"
+
+#ifdef __APPLE__
+#include <mach/error.h>
+#else
+// the little of <mach/error.h> that we use: the framework's error codes are
+// mach_error_ts, which the native backend keeps to
+typedef int mach_error_t;
+#define ERR_SUCCESS			0
+#define err_get_system(err)	(((err) >> 26) & 0x3f)
+#define err_get_sub(err)	(((err) >> 14) & 0xfff)
+#define err_get_code(err)	((err) & 0x3fff)
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// opaque structures
+typedef struct _afc_directory			*afc_directory;
+typedef struct _afc_dictionary			*afc_dictionary;
+
+// Messages passed to device notification callbacks: passed as part of
+// am_device_notification_callback_info.
+typedef enum {
+	ADNCI_MSG_CONNECTED		= 1,
+	ADNCI_MSG_DISCONNECTED	= 2,
+	ADNCI_MSG_UNSUBSCRIBED	= 3
+} adnci_msg;
+
+struct am_device_notification_callback_info {
+	am_device	dev;				// 0    device
+	uint32_t	msg;				// 4    one of adnci_msg
+} __attribute__ ((packed));
+
+// The type of the device notification callback function.
+typedef void (*am_device_notification_callback)(struct am_device_notification_callback_info *,void* callback_data);
+
+// The type of the notification_proxy callback function.
+typedef void (*NOTIFY_CALLBACK)(CFStringRef notification, void* data);
+
+/// Errors the native backend returns where the framework would have returned
+/// one of its own.  They are kept out of the framework's range (0xe80000xx) so
+/// a "failed: e8ff0004" in a log can't be mistaken for one of its codes.
+enum {
+	MD_E_USBMUXD			= 0xe8ff0001,	///< couldn't talk to usbmuxd
+	MD_E_NOT_CONNECTED		= 0xe8ff0002,	///< not connected, or the device has gone
+	MD_E_IO					= 0xe8ff0003,	///< the connection failed mid-request
+	MD_E_BAD_REPLY			= 0xe8ff0004,	///< a reply we couldn't make sense of
+	MD_E_REFUSED			= 0xe8ff0005,	///< the device answered with an Error
+	MD_E_NO_PAIR_RECORD		= 0xe8ff0006,	///< usbmuxd has no pairing for the device
+	MD_E_SSL_REQUIRED		= 0xe8ff0007	///< the device wants TLS, which we don't speak
+};
+
+typedef struct md_backend {
+	const char		*name;
+
+	// devices
+	mach_error_t	(*AMDeviceNotificationSubscribe)(am_device_notification_callback callback, uint32_t unused0,
+													 uint32_t unused1, void *callback_data,
+													 am_device_notification *notification);
+	mach_error_t	(*AMDeviceConnect)(am_device device);
+	mach_error_t	(*AMDeviceDisconnect)(am_device device);
+	CFStringRef		(*AMDeviceCopyValue)(am_device device, CFStringRef domain, CFStringRef key);
+	mach_error_t	(*AMDeviceStartSession)(am_device device);
+	mach_error_t	(*AMDeviceStopSession)(am_device device);
+	mach_error_t	(*AMDeviceStartService)(am_device device, CFStringRef service_name, am_service *handle,
+											uint32_t *unknown);
+	mach_error_t	(*AMDeviceLookupApplications)(am_device device, CFStringRef apptype, CFDictionaryRef *result);
+
+	// notification_proxy
+	mach_error_t	(*AMDPostNotification)(am_service socket, CFStringRef notification, CFStringRef userinfo);
+	mach_error_t	(*AMDShutdownNotificationProxy)(am_service socket);
+	mach_error_t	(*AMDObserveNotification)(am_service socket, CFStringRef notification);
+	mach_error_t	(*AMDListenForNotifications)(am_service socket, NOTIFY_CALLBACK cb, void* data);
+
+	// AFC
+	afc_error_t		(*AFCConnectionOpen)(am_service handle, uint32_t io_timeout, afc_connection *conn);
+	afc_error_t		(*AFCConnectionClose)(afc_connection conn);
+	const char *	(*AFCGetClientVersionString)(void);
+	afc_error_t		(*AFCDirectoryOpen)(afc_connection conn, const char *path, afc_directory *dir);
+	afc_error_t		(*AFCDirectoryRead)(afc_connection conn, afc_directory dir, char **dirent);
+	afc_error_t		(*AFCDirectoryClose)(afc_connection conn, afc_directory dir);
+	afc_error_t		(*AFCDirectoryCreate)(afc_connection conn, const char *dirname);
+	afc_error_t		(*AFCRemovePath)(afc_connection conn, const char *dirname);
+	afc_error_t		(*AFCRenamePath)(afc_connection conn, const char *from, const char *to);
+	afc_error_t		(*AFCLinkPath)(afc_connection conn, uint64_t mode, const char *target, const char *link);
+	afc_error_t		(*AFCFileRefOpen)(afc_connection conn, const char *path, uint64_t mode, afc_file_ref *ref);
+	afc_error_t		(*AFCFileRefClose)(afc_connection conn, afc_file_ref ref);
+	afc_error_t		(*AFCFileRefSeek)(afc_connection conn, afc_file_ref ref, int64_t offset, uint64_t mode);
+	afc_error_t		(*AFCFileRefTell)(afc_connection conn, afc_file_ref ref, uint64_t *offset);
+	afc_error_t		(*AFCFileRefRead)(afc_connection conn, afc_file_ref ref, void *buf, uint64_t *len);
+	afc_error_t		(*AFCFileRefSetFileSize)(afc_connection conn, afc_file_ref ref, uint64_t offset);
+	afc_error_t		(*AFCFileRefWrite)(afc_connection conn, afc_file_ref ref, const void *buf, uint32_t len);
+	afc_error_t		(*AFCDeviceInfoOpen)(afc_connection conn, afc_dictionary *info);
+	afc_error_t		(*AFCFileInfoOpen)(afc_connection conn, const char *path, afc_dictionary *info);
+	afc_error_t		(*AFCKeyValueRead)(afc_dictionary dict, const char **key, const char **val);
+	afc_error_t		(*AFCKeyValueClose)(afc_dictionary dict);
+
+	// Not a framework call: split each read and write on \p conn into \p chunk
+	// byte requests, with up to \p window of them in flight at once.  NULL for a
+	// backend which sends one request per call, as the framework does.
+	void			(*AFCConnectionSetPipeline)(afc_connection conn, uint32_t chunk, uint32_t window);
+} md_backend;
+
+/// The backend that needs nothing but a usbmuxd (see MobileDeviceNative.m).
+extern const md_backend md_native_backend;
+
+/// Where the native backend finds usbmuxd - see usbmux_open().  NULL goes back
+/// to the default.
+void md_native_set_usbmux_address(const char *address);
+
+#ifdef __cplusplus
+}
+#endif
+
+struct usbmuxd_standin;
+
+/// A usbmuxd with one device attached, in process (see usbmuxd_standin.h), for
+/// the native backend to be pointed at with md_native_set_usbmux_address().
+/// The device's lockdown answers QueryType, GetValue, StartSession,
+/// StopSession and StartService as a device does, and the one service it
+/// starts is \p com.apple.afc, which serves a local directory through
+/// afc_standin - so everything from device notifications to AFC can be
+/// exercised without a device.
+@interface AMUsbmuxdStandIn : NSObject {
+@private
+	struct usbmuxd_standin *_server;
+	NSString *_root;
+	NSString *_udid;
+	NSDictionary *_pairRecord;
+	NSMutableArray *_services;		// what is playing each connected port
+	volatile BOOL _requiresSSL;
+}
+
+/// Listen on the socket \p path, which mustn't exist yet, with a device whose
+/// AFC service shows the local directory \p root as "/".
+- (id)initWithRoot:(NSString*)root socketPath:(NSString*)path;
+
+/// The attached device's UniqueDeviceID.
+@property (readonly) NSString *udid;
+
+/// If YES, lockdown asks for SSL when a session is started, as a paired device
+/// does.
+@property (assign) BOOL requiresSSL;
+
+/// Number of messages usbmuxd has received.
+- (uint64_t)requests;
+
+@end
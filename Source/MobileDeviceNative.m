@@ -0,0 +1,961 @@
+//
+//  MobileDeviceNative.m
+//  mobileDeviceManager
+//
+//  md_native_backend: the calls MobileDeviceAccess makes of MobileDevice.framework,
+//  done over usbmuxd's socket instead.  usbmuxd announces devices and connects
+//  us to their ports; lockdownd (port 62078) answers questions about the device
+//  and starts its services; AFC goes through afc_client.
+//
+//  What it can't do is TLS.  A device which wants its lockdown session or a
+//  service wrapped in SSL - which real devices do, once paired - is refused
+//  with MD_E_SSL_REQUIRED, so for now this is for usbmuxd stand-ins (such as
+//  AMUsbmuxdStandIn, at the end of this file), and relays which terminate the
+//  SSL themselves.
+//
+//  See also: http://www.libimobiledevice.org
+//
+
+#import "MobileDeviceBackend.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "afc_client.h"
+#include "afc_standin.h"
+#include "service_standin.h"
+#include "usbmux.h"
+#include "usbmuxd_standin.h"
+
+// what we call ourselves to usbmuxd and lockdown
+#define NATIVE_LABEL	@"mobileDeviceManager"
+
+struct _am_device {
+	uint32_t			device_id;		// usbmuxd's number for it
+	NSString			*udid;
+	pthread_mutex_t		lock;			// one lockdown request at a time
+	int					lockdown;		// -1 unless AMDeviceConnect()ed
+	NSString			*session;		// SessionID, while we have one
+	BOOL				gone;			// detached
+	struct _am_device	*next;
+};
+
+struct _am_device_notification {
+	int									fd;			// Listening to usbmuxd
+	CFSocketRef							socket;
+	am_device_notification_callback		callback;
+	void								*data;
+	// never freed, since an AMDevice may still be holding on to a detached one
+	struct _am_device					*devices;
+};
+
+// a notification_proxy being listened to
+struct notify_listener {
+	am_service				fd;
+	CFSocketRef				socket;
+	NOTIFY_CALLBACK			callback;
+	void					*data;
+	struct notify_listener	*next;
+};
+
+static pthread_mutex_t listeners_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct notify_listener *listeners;
+
+static char *native_usbmux_address;		// NULL for usbmux_open()'s default
+static uint32_t native_usbmux_tag;
+
+void md_native_set_usbmux_address(const char *address)
+{
+	free(native_usbmux_address);
+	native_usbmux_address = address ? strdup(address) : NULL;
+}
+
+#pragma mark property lists
+
+static NSData *plist_data(id plist)
+{
+	return [(id)CFPropertyListCreateXMLData(NULL, (CFPropertyListRef)plist) autorelease];
+}
+
+// only dictionaries are any use to us
+static NSDictionary *plist_dictionary(const void *buf, uint32_t len)
+{
+	NSData *data = [NSData dataWithBytes:buf length:len];
+	id plist = [NSPropertyListSerialization propertyListWithData:data options:NSPropertyListImmutable format:NULL error:NULL];
+	return [plist isKindOfClass:[NSDictionary class]] ? plist : nil;
+}
+
+// lockdown and its services frame each property list with its length
+static BOOL send_plist(int fd, NSDictionary *message)
+{
+	NSData *data = plist_data(message);
+	return data && usbmux_send_message(fd, [data bytes], (uint32_t)[data length]) == 0;
+}
+
+static NSDictionary *recv_plist(int fd)
+{
+	uint8_t *buf;
+	uint32_t len;
+	if (usbmux_recv_message(fd, &buf, &len) != 0) return nil;
+	NSDictionary *result = plist_dictionary(buf, len);
+	free(buf);
+	return result;
+}
+
+#pragma mark usbmuxd
+
+// Send \p request to usbmuxd and wait for the reply carrying its tag.
+static NSDictionary *usbmux_request(int fd, NSDictionary *request)
+{
+	NSMutableDictionary *message = [NSMutableDictionary dictionaryWithDictionary:request];
+	[message setObject:NATIVE_LABEL forKey:@"ClientVersionString"];
+	[message setObject:NATIVE_LABEL forKey:@"ProgName"];
+	NSData *data = plist_data(message);
+	uint32_t tag = __sync_add_and_fetch(&native_usbmux_tag, 1);
+	if (!data || usbmux_send(fd, tag, [data bytes], (uint32_t)[data length]) != 0) return nil;
+
+	for (;;) {
+		uint8_t *buf;
+		uint32_t len, replytag;
+		if (usbmux_recv(fd, &replytag, &buf, &len) != 0) return nil;
+		NSDictionary *reply = plist_dictionary(buf, len);
+		free(buf);
+		if (replytag == tag) return reply;
+	}
+}
+
+// usbmuxd says yes with a Result whose Number is 0
+static BOOL usbmux_succeeded(NSDictionary *reply)
+{
+	return [[reply objectForKey:@"MessageType"] isEqual:@"Result"] && [[reply objectForKey:@"Number"] intValue] == 0;
+}
+
+// A socket connected to \p port on the device, or -1.
+static int usbmux_connect(uint32_t device_id, uint16_t port, mach_error_t *err)
+{
+	int fd = usbmux_open(native_usbmux_address);
+	if (fd < 0) {
+		*err = MD_E_USBMUXD;
+		return -1;
+	}
+	NSDictionary *reply = usbmux_request(fd, [NSDictionary dictionaryWithObjectsAndKeys:
+		@"Connect", @"MessageType",
+		[NSNumber numberWithUnsignedInt:device_id], @"DeviceID",
+		[NSNumber numberWithUnsignedInt:usbmux_port_number(port)], @"PortNumber",
+		nil]);
+	if (!usbmux_succeeded(reply)) {
+		NSLog(@"usbmuxd wouldn't connect to port %u of device %u: %@", port, device_id, [reply objectForKey:@"Number"]);
+		close(fd);
+		*err = reply ? MD_E_REFUSED : MD_E_USBMUXD;
+		return -1;
+	}
+	return fd;
+}
+
+// What usbmuxd remembers from pairing with the device - the HostID and
+// SystemBUID a session has to be started with.
+static NSDictionary *pair_record(NSString *udid, mach_error_t *err)
+{
+	int fd = usbmux_open(native_usbmux_address);
+	if (fd < 0) {
+		*err = MD_E_USBMUXD;
+		return nil;
+	}
+	NSDictionary *reply = usbmux_request(fd, [NSDictionary dictionaryWithObjectsAndKeys:
+		@"ReadPairRecord", @"MessageType",
+		udid, @"PairRecordID",
+		nil]);
+	close(fd);
+
+	NSData *data = [reply objectForKey:@"PairRecordData"];
+	NSDictionary *record = [data isKindOfClass:[NSData class]] ? plist_dictionary([data bytes], (uint32_t)[data length]) : nil;
+	if (![record objectForKey:@"HostID"] || ![record objectForKey:@"SystemBUID"]) {
+		*err = reply ? MD_E_NO_PAIR_RECORD : MD_E_USBMUXD;
+		return nil;
+	}
+	return record;
+}
+
+#pragma mark device notifications
+
+static void notify(struct _am_device_notification *n, am_device device, adnci_msg msg)
+{
+	struct am_device_notification_callback_info info;
+	info.dev = device;
+	info.msg = msg;
+	n->callback(&info, n->data);
+}
+
+static void device_gone(am_device device)
+{
+	pthread_mutex_lock(&device->lock);
+	device->gone = YES;
+	if (device->lockdown >= 0) close(device->lockdown);
+	device->lockdown = -1;
+	[device->session release];
+	device->session = nil;
+	pthread_mutex_unlock(&device->lock);
+}
+
+static void device_event(struct _am_device_notification *n, NSDictionary *event)
+{
+	NSString *type = [event objectForKey:@"MessageType"];
+	uint32_t device_id = [[event objectForKey:@"DeviceID"] unsignedIntValue];
+	am_device device;
+
+	for (device = n->devices; device; device = device->next) {
+		if (!device->gone && device->device_id == device_id) break;
+	}
+
+	if ([type isEqual:@"Attached"]) {
+		NSString *udid = [[event objectForKey:@"Properties"] objectForKey:@"SerialNumber"];
+		if (device || ![udid isKindOfClass:[NSString class]]) return;
+		device = calloc(1, sizeof(*device));
+		device->device_id = device_id;
+		device->udid = [udid copy];
+		device->lockdown = -1;
+		pthread_mutex_init(&device->lock, NULL);
+		device->next = n->devices;
+		n->devices = device;
+		notify(n, device, ADNCI_MSG_CONNECTED);
+	} else if ([type isEqual:@"Detached"]) {
+		if (!device) return;
+		device_gone(device);
+		notify(n, device, ADNCI_MSG_DISCONNECTED);
+	}
+}
+
+static void listen_callback(CFSocketRef s, CFSocketCallBackType type, CFDataRef address, const void *data, void *info)
+{
+	NSAutoreleasePool *pool = [NSAutoreleasePool new];
+	struct _am_device_notification *n = info;
+	uint8_t *buf;
+	uint32_t len, tag;
+
+	if (usbmux_recv(n->fd, &tag, &buf, &len) == 0) {
+		NSDictionary *event = plist_dictionary(buf, len);
+		free(buf);
+		if (event) device_event(n, event);
+	} else {
+		// without usbmuxd, nothing we're connected to is reachable
+		NSLog(@"Lost the connection to usbmuxd");
+		CFSocketInvalidate(n->socket);
+		for (am_device device = n->devices; device; device = device->next) {
+			if (device->gone) continue;
+			device_gone(device);
+			notify(n, device, ADNCI_MSG_DISCONNECTED);
+		}
+		notify(n, NULL, ADNCI_MSG_UNSUBSCRIBED);
+	}
+	[pool release];
+}
+
+// Devices are announced on the current run loop, as the framework does.
+static mach_error_t native_AMDeviceNotificationSubscribe(
+	am_device_notification_callback callback,
+	uint32_t unused0,
+	uint32_t unused1,
+	void *callback_data,
+	am_device_notification *notification)
+{
+	int fd = usbmux_open(native_usbmux_address);
+	if (fd < 0) {
+		NSLog(@"Can't reach usbmuxd: %s", strerror(errno));
+		return MD_E_USBMUXD;
+	}
+	NSDictionary *reply = usbmux_request(fd, [NSDictionary dictionaryWithObject:@"Listen" forKey:@"MessageType"]);
+	if (!usbmux_succeeded(reply)) {
+		NSLog(@"usbmuxd won't tell us about devices: %@", reply);
+		close(fd);
+		return MD_E_USBMUXD;
+	}
+
+	struct _am_device_notification *n = calloc(1, sizeof(*n));
+	n->fd = fd;
+	n->callback = callback;
+	n->data = callback_data;
+	CFSocketContext context = { 0, n, NULL, NULL, NULL };
+	n->socket = CFSocketCreateWithNative(NULL, fd, kCFSocketReadCallBack, listen_callback, &context);
+	CFRunLoopSourceRef source = CFSocketCreateRunLoopSource(NULL, n->socket, 0);
+	CFRunLoopAddSource(CFRunLoopGetCurrent(), source, kCFRunLoopDefaultMode);
+	CFRelease(source);
+	*notification = (am_device_notification)n;
+	return 0;
+}
+
+#pragma mark lockdown
+
+// The caller holds device->lock.
+static NSDictionary *lockdown_request(am_device device, NSDictionary *request, mach_error_t *err)
+{
+	if (device->gone || device->lockdown < 0) {
+		*err = MD_E_NOT_CONNECTED;
+		return nil;
+	}
+	NSMutableDictionary *message = [NSMutableDictionary dictionaryWithDictionary:request];
+	[message setObject:NATIVE_LABEL forKey:@"Label"];
+	if (!send_plist(device->lockdown, message)) {
+		*err = MD_E_IO;
+		return nil;
+	}
+	NSDictionary *reply = recv_plist(device->lockdown);
+	if (!reply) {
+		*err = MD_E_IO;
+		return nil;
+	}
+	if ([reply objectForKey:@"Error"]) {
+		*err = MD_E_REFUSED;
+		return nil;
+	}
+	*err = 0;
+	return reply;
+}
+
+// The caller holds device->lock.
+static void drop_lockdown(am_device device)
+{
+	if (device->lockdown >= 0) close(device->lockdown);
+	device->lockdown = -1;
+	[device->session release];
+	device->session = nil;
+}
+
+static mach_error_t native_AMDeviceConnect(am_device device)
+{
+	mach_error_t err = 0;
+	pthread_mutex_lock(&device->lock);
+	if (device->gone) {
+		err = MD_E_NOT_CONNECTED;
+	} else if (device->lockdown < 0) {
+		device->lockdown = usbmux_connect(device->device_id, USBMUX_LOCKDOWN_PORT, &err);
+		if (device->lockdown >= 0) {
+			NSDictionary *reply = lockdown_request(device, [NSDictionary dictionaryWithObject:@"QueryType" forKey:@"Request"], &err);
+			if (reply && ![[reply objectForKey:@"Type"] isEqual:@"com.apple.mobile.lockdown"]) err = MD_E_BAD_REPLY;
+			if (err) drop_lockdown(device);
+		}
+	}
+	pthread_mutex_unlock(&device->lock);
+	return err;
+}
+
+static mach_error_t native_AMDeviceDisconnect(am_device device)
+{
+	pthread_mutex_lock(&device->lock);
+	drop_lockdown(device);
+	pthread_mutex_unlock(&device->lock);
+	return 0;
+}
+
+static CFStringRef native_AMDeviceCopyValue(am_device device, CFStringRef domain, CFStringRef key)
+{
+	NSMutableDictionary *request = [NSMutableDictionary dictionaryWithObject:@"GetValue" forKey:@"Request"];
+	if (domain) [request setObject:(NSString*)domain forKey:@"Domain"];
+	if (key) [request setObject:(NSString*)key forKey:@"Key"];
+
+	mach_error_t err;
+	pthread_mutex_lock(&device->lock);
+	id value = [[lockdown_request(device, request, &err) objectForKey:@"Value"] retain];
+	pthread_mutex_unlock(&device->lock);
+	return (CFStringRef)value;
+}
+
+static mach_error_t native_AMDeviceStartSession(am_device device)
+{
+	mach_error_t err;
+	NSDictionary *record = pair_record(device->udid, &err);
+	if (!record) return err;
+
+	pthread_mutex_lock(&device->lock);
+	NSDictionary *reply = lockdown_request(device, [NSDictionary dictionaryWithObjectsAndKeys:
+		@"StartSession", @"Request",
+		[record objectForKey:@"HostID"], @"HostID",
+		[record objectForKey:@"SystemBUID"], @"SystemBUID",
+		nil], &err);
+	if (reply) {
+		NSString *session = [reply objectForKey:@"SessionID"];
+		if ([[reply objectForKey:@"EnableSessionSSL"] boolValue]) {
+			NSLog(@"%@ requires TLS for its lockdown session, which the native backend doesn't support - use -backend framework", device->udid);
+			// lockdown is now waiting for a TLS handshake, so the connection is no use
+			drop_lockdown(device);
+			err = MD_E_SSL_REQUIRED;
+		} else if (![session isKindOfClass:[NSString class]]) {
+			err = MD_E_BAD_REPLY;
+		} else {
+			[device->session release];
+			device->session = [session copy];
+		}
+	}
+	pthread_mutex_unlock(&device->lock);
+	return err;
+}
+
+static mach_error_t native_AMDeviceStopSession(am_device device)
+{
+	mach_error_t err = 0;
+	pthread_mutex_lock(&device->lock);
+	if (device->session) {
+		lockdown_request(device, [NSDictionary dictionaryWithObjectsAndKeys:
+			@"StopSession", @"Request",
+			device->session, @"SessionID",
+			nil], &err);
+		[device->session release];
+		device->session = nil;
+	}
+	pthread_mutex_unlock(&device->lock);
+	return err;
+}
+
+// The service's socket is a connection of its own, so it outlives the session
+// and the lockdown connection it was started on.
+static mach_error_t native_AMDeviceStartService(am_device device, CFStringRef service_name, am_service *handle, uint32_t *unknown)
+{
+	mach_error_t err;
+	pthread_mutex_lock(&device->lock);
+	NSDictionary *reply = lockdown_request(device, [NSDictionary dictionaryWithObjectsAndKeys:
+		@"StartService", @"Request",
+		(NSString*)service_name, @"Service",
+		nil], &err);
+	pthread_mutex_unlock(&device->lock);
+	if (!reply) return err;
+
+	if ([[reply objectForKey:@"EnableServiceSSL"] boolValue]) {
+		NSLog(@"%@ requires TLS, which the native backend doesn't support - use -backend framework", service_name);
+		return MD_E_SSL_REQUIRED;
+	}
+	NSNumber *port = [reply objectForKey:@"Port"];
+	if (![port isKindOfClass:[NSNumber class]]) return MD_E_BAD_REPLY;
+
+	int fd = usbmux_connect(device->device_id, [port unsignedShortValue], &err);
+	if (fd < 0) return err;
+	*handle = fd;
+	if (unknown) *unknown = 0;
+	return 0;
+}
+
+// The framework asks installation_proxy too; we just have to do it ourselves.
+static mach_error_t native_AMDeviceLookupApplications(am_device device, CFStringRef apptype, CFDictionaryRef *result)
+{
+	am_service fd;
+	mach_error_t err = native_AMDeviceStartService(device, CFSTR("com.apple.mobile.installation_proxy"), &fd, NULL);
+	if (err) return err;
+
+	NSMutableDictionary *apps = [NSMutableDictionary dictionary];
+	NSDictionary *options = [NSDictionary dictionaryWithObject:(apptype ? (NSString*)apptype : @"Any") forKey:@"ApplicationType"];
+	if (!send_plist(fd, [NSDictionary dictionaryWithObjectsAndKeys:@"Lookup", @"Command", options, @"ClientOptions", nil])) {
+		err = MD_E_IO;
+	}
+	while (!err) {
+		NSDictionary *reply = recv_plist(fd);
+		if (!reply) {
+			err = MD_E_IO;
+		} else if ([reply objectForKey:@"Error"]) {
+			err = MD_E_REFUSED;
+		} else {
+			NSDictionary *found = [reply objectForKey:@"LookupResult"];
+			if ([found isKindOfClass:[NSDictionary class]]) [apps addEntriesFromDictionary:found];
+			if ([[reply objectForKey:@"Status"] isEqual:@"Complete"]) break;
+		}
+	}
+	close(fd);
+	if (!err) *result = (CFDictionaryRef)[apps retain];
+	return err;
+}
+
+#pragma mark notification_proxy
+
+static mach_error_t native_AMDPostNotification(am_service socket, CFStringRef notification, CFStringRef userinfo)
+{
+	NSDictionary *message = [NSDictionary dictionaryWithObjectsAndKeys:
+		@"PostNotification", @"Command",
+		(NSString*)notification, @"Name",
+		nil];
+	return send_plist(socket, message) ? 0 : MD_E_IO;
+}
+
+static mach_error_t native_AMDObserveNotification(am_service socket, CFStringRef notification)
+{
+	NSDictionary *message = [NSDictionary dictionaryWithObjectsAndKeys:
+		@"ObserveNotification", @"Command",
+		(NSString*)notification, @"Name",
+		nil];
+	return send_plist(socket, message) ? 0 : MD_E_IO;
+}
+
+// Stop listening (and release the listener) - it belongs to whoever is
+// shutting the proxy down, so they mustn't be called back afterwards.
+static void forget_listener(am_service socket)
+{
+	struct notify_listener **p, *l = NULL;
+	pthread_mutex_lock(&listeners_lock);
+	for (p = &listeners; *p; p = &(*p)->next) {
+		if ((*p)->fd == socket) {
+			l = *p;
+			*p = l->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&listeners_lock);
+	if (l) {
+		CFSocketInvalidate(l->socket);
+		CFRelease(l->socket);
+		free(l);
+	}
+}
+
+static mach_error_t native_AMDShutdownNotificationProxy(am_service socket)
+{
+	forget_listener(socket);
+	return send_plist(socket, [NSDictionary dictionaryWithObject:@"Shutdown" forKey:@"Command"]) ? 0 : MD_E_IO;
+}
+
+static void relay_callback(CFSocketRef s, CFSocketCallBackType type, CFDataRef address, const void *data, void *info)
+{
+	NSAutoreleasePool *pool = [NSAutoreleasePool new];
+	struct notify_listener *l = info;
+	NSDictionary *message = recv_plist(l->fd);
+	NSString *command = [message objectForKey:@"Command"];
+
+	if ([command isEqual:@"RelayNotification"]) {
+		NSString *name = [message objectForKey:@"Name"];
+		if ([name isKindOfClass:[NSString class]]) l->callback((CFStringRef)name, l->data);
+	} else if (!message || [command isEqual:@"ProxyDeath"]) {
+		// what the framework says when the proxy goes away
+		l->callback(CFSTR("AMDNotificationFaceplant"), l->data);
+		forget_listener(l->fd);
+	}
+	[pool release];
+}
+
+// Notifications arrive on the current run loop, as the framework does it.
+static mach_error_t native_AMDListenForNotifications(am_service socket, NOTIFY_CALLBACK cb, void* data)
+{
+	struct notify_listener *l = calloc(1, sizeof(*l));
+	l->fd = socket;
+	l->callback = cb;
+	l->data = data;
+	CFSocketContext context = { 0, l, NULL, NULL, NULL };
+	l->socket = CFSocketCreateWithNative(NULL, socket, kCFSocketReadCallBack, relay_callback, &context);
+	// the socket is still the caller's
+	CFSocketSetSocketFlags(l->socket, CFSocketGetSocketFlags(l->socket) & ~kCFSocketCloseOnInvalidate);
+	CFRunLoopSourceRef source = CFSocketCreateRunLoopSource(NULL, l->socket, 0);
+	CFRunLoopAddSource(CFRunLoopGetCurrent(), source, kCFRunLoopDefaultMode);
+	CFRelease(source);
+
+	pthread_mutex_lock(&listeners_lock);
+	l->next = listeners;
+	listeners = l;
+	pthread_mutex_unlock(&listeners_lock);
+	return 0;
+}
+
+#pragma mark AFC
+
+// AFC connections, directory listings and info dictionaries are afc_client's
+#define CLIENT(conn)	((afc_client*)(conn))
+#define LIST(list)		((afc_client_list*)(list))
+
+static afc_error_t native_AFCConnectionOpen(am_service handle, uint32_t io_timeout, afc_connection *conn)
+{
+	afc_client *client;
+	afc_error_t ret = afc_client_open(handle, &client);
+	if (ret == 0) *conn = (afc_connection)client;
+	return ret;
+}
+
+static afc_error_t native_AFCConnectionClose(afc_connection conn)
+{
+	return afc_client_close(CLIENT(conn));
+}
+
+static void native_AFCConnectionSetPipeline(afc_connection conn, uint32_t chunk, uint32_t window)
+{
+	afc_client_set_pipeline(CLIENT(conn), chunk, window);
+}
+
+static const char *native_AFCGetClientVersionString(void)
+{
+	return "@(#)PROGRAM:afc  PROJECT:mobileDeviceManager-native";
+}
+
+static afc_error_t native_AFCDirectoryOpen(afc_connection conn, const char *path, afc_directory *dir)
+{
+	afc_client_list *list;
+	afc_error_t ret = afc_client_read_dir(CLIENT(conn), path, &list);
+	if (ret == 0) *dir = (afc_directory)list;
+	return ret;
+}
+
+static afc_error_t native_AFCDirectoryRead(afc_connection conn, afc_directory dir, char **dirent)
+{
+	*dirent = (char*)afc_client_list_next(LIST(dir));
+	return 0;
+}
+
+static afc_error_t native_AFCDirectoryClose(afc_connection conn, afc_directory dir)
+{
+	afc_client_list_free(LIST(dir));
+	return 0;
+}
+
+static afc_error_t native_AFCDirectoryCreate(afc_connection conn, const char *dirname)
+{
+	return afc_client_make_dir(CLIENT(conn), dirname);
+}
+
+static afc_error_t native_AFCRemovePath(afc_connection conn, const char *dirname)
+{
+	return afc_client_remove_path(CLIENT(conn), dirname);
+}
+
+static afc_error_t native_AFCRenamePath(afc_connection conn, const char *from, const char *to)
+{
+	return afc_client_rename_path(CLIENT(conn), from, to);
+}
+
+static afc_error_t native_AFCLinkPath(afc_connection conn, uint64_t mode, const char *target, const char *link)
+{
+	return afc_client_make_link(CLIENT(conn), mode, target, link);
+}
+
+static afc_error_t native_AFCFileRefOpen(afc_connection conn, const char *path, uint64_t mode, afc_file_ref *ref)
+{
+	return afc_client_file_open(CLIENT(conn), path, mode, ref);
+}
+
+static afc_error_t native_AFCFileRefClose(afc_connection conn, afc_file_ref ref)
+{
+	return afc_client_file_close(CLIENT(conn), ref);
+}
+
+static afc_error_t native_AFCFileRefSeek(afc_connection conn, afc_file_ref ref, int64_t offset, uint64_t mode)
+{
+	return afc_client_file_seek(CLIENT(conn), ref, offset, mode);
+}
+
+static afc_error_t native_AFCFileRefTell(afc_connection conn, afc_file_ref ref, uint64_t *offset)
+{
+	return afc_client_file_tell(CLIENT(conn), ref, offset);
+}
+
+static afc_error_t native_AFCFileRefRead(afc_connection conn, afc_file_ref ref, void *buf, uint64_t *len)
+{
+	return afc_client_file_read(CLIENT(conn), ref, buf, len);
+}
+
+static afc_error_t native_AFCFileRefSetFileSize(afc_connection conn, afc_file_ref ref, uint64_t offset)
+{
+	return afc_client_file_set_size(CLIENT(conn), ref, offset);
+}
+
+static afc_error_t native_AFCFileRefWrite(afc_connection conn, afc_file_ref ref, const void *buf, uint32_t len)
+{
+	return afc_client_file_write(CLIENT(conn), ref, buf, len);
+}
+
+static afc_error_t native_AFCDeviceInfoOpen(afc_connection conn, afc_dictionary *info)
+{
+	afc_client_list *list;
+	afc_error_t ret = afc_client_device_info(CLIENT(conn), &list);
+	if (ret == 0) *info = (afc_dictionary)list;
+	return ret;
+}
+
+static afc_error_t native_AFCFileInfoOpen(afc_connection conn, const char *path, afc_dictionary *info)
+{
+	afc_client_list *list;
+	afc_error_t ret = afc_client_file_info(CLIENT(conn), path, &list);
+	if (ret == 0) *info = (afc_dictionary)list;
+	return ret;
+}
+
+// like the framework, the end is a NULL key rather than an error
+static afc_error_t native_AFCKeyValueRead(afc_dictionary dict, const char **key, const char **val)
+{
+	*key = afc_client_list_next(LIST(dict));
+	*val = *key ? afc_client_list_next(LIST(dict)) : NULL;
+	if (!*val) *key = NULL;
+	return 0;
+}
+
+static afc_error_t native_AFCKeyValueClose(afc_dictionary dict)
+{
+	afc_client_list_free(LIST(dict));
+	return 0;
+}
+
+#pragma mark the backend
+
+const md_backend md_native_backend = {
+	.name							= "native",
+	.AMDeviceNotificationSubscribe	= native_AMDeviceNotificationSubscribe,
+	.AMDeviceConnect				= native_AMDeviceConnect,
+	.AMDeviceDisconnect				= native_AMDeviceDisconnect,
+	.AMDeviceCopyValue				= native_AMDeviceCopyValue,
+	.AMDeviceStartSession			= native_AMDeviceStartSession,
+	.AMDeviceStopSession			= native_AMDeviceStopSession,
+	.AMDeviceStartService			= native_AMDeviceStartService,
+	.AMDeviceLookupApplications		= native_AMDeviceLookupApplications,
+	.AMDPostNotification			= native_AMDPostNotification,
+	.AMDShutdownNotificationProxy	= native_AMDShutdownNotificationProxy,
+	.AMDObserveNotification			= native_AMDObserveNotification,
+	.AMDListenForNotifications		= native_AMDListenForNotifications,
+	.AFCConnectionOpen				= native_AFCConnectionOpen,
+	.AFCConnectionClose				= native_AFCConnectionClose,
+	.AFCGetClientVersionString		= native_AFCGetClientVersionString,
+	.AFCDirectoryOpen				= native_AFCDirectoryOpen,
+	.AFCDirectoryRead				= native_AFCDirectoryRead,
+	.AFCDirectoryClose				= native_AFCDirectoryClose,
+	.AFCDirectoryCreate				= native_AFCDirectoryCreate,
+	.AFCRemovePath					= native_AFCRemovePath,
+	.AFCRenamePath					= native_AFCRenamePath,
+	.AFCLinkPath					= native_AFCLinkPath,
+	.AFCFileRefOpen					= native_AFCFileRefOpen,
+	.AFCFileRefClose				= native_AFCFileRefClose,
+	.AFCFileRefSeek					= native_AFCFileRefSeek,
+	.AFCFileRefTell					= native_AFCFileRefTell,
+	.AFCFileRefRead					= native_AFCFileRefRead,
+	.AFCFileRefSetFileSize			= native_AFCFileRefSetFileSize,
+	.AFCFileRefWrite				= native_AFCFileRefWrite,
+	.AFCDeviceInfoOpen				= native_AFCDeviceInfoOpen,
+	.AFCFileInfoOpen				= native_AFCFileInfoOpen,
+	.AFCKeyValueRead				= native_AFCKeyValueRead,
+	.AFCKeyValueClose				= native_AFCKeyValueClose,
+	.AFCConnectionSetPipeline		= native_AFCConnectionSetPipeline,
+};
+
+#pragma mark usbmuxd stand-in
+
+#define STANDIN_DEVICE_ID			1
+#define STANDIN_AFC_PORT			49152
+
+// the Number of a usbmuxd Result
+#define USBMUX_RESULT_OK			0
+#define USBMUX_RESULT_BADCOMMAND	1
+#define USBMUX_RESULT_BADDEVICE		2
+#define USBMUX_RESULT_REFUSED		3
+
+// a connection to one of the device's ports, and what is answering it
+struct standin_port {
+	AMUsbmuxdStandIn	*device;
+	service_standin		*lockdown;
+	afc_standin			*afc;
+	NSString			*session;		// lockdown's SessionID, while it has one
+};
+
+@interface AMUsbmuxdStandIn (Private)
+- (BOOL)answer:(NSDictionary*)message tag:(uint32_t)tag client:(usbmuxd_standin_client*)client;
+- (NSDictionary*)lockdownReplyTo:(NSDictionary*)request port:(struct standin_port*)port;
+@end
+
+static BOOL standin_send(usbmuxd_standin_client *client, uint32_t tag, NSDictionary *message)
+{
+	NSData *data = plist_data(message);
+	return data && usbmuxd_standin_reply(client, tag, [data bytes], [data length]);
+}
+
+static NSDictionary *standin_result(int number)
+{
+	return [NSDictionary dictionaryWithObjectsAndKeys:
+		@"Result", @"MessageType",
+		[NSNumber numberWithInt:number], @"Number",
+		nil];
+}
+
+// usbmuxd_standin handler - ctx is the AMUsbmuxdStandIn
+static int usbmuxd_standin_message(void *ctx, usbmuxd_standin_client *client, uint32_t tag, const void *plist, size_t len)
+{
+	NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+	NSDictionary *message = plist_dictionary(plist, (uint32_t)len);
+	int ok = message && [(AMUsbmuxdStandIn*)ctx answer:message tag:tag client:client];
+	[pool drain];
+	return ok;
+}
+
+// service_standin handler for a lockdown connection - ctx is its standin_port
+static int lockdown_standin_handler(void *ctx, service_standin *server, const void *msg, size_t len)
+{
+	NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+	struct standin_port *port = ctx;
+	NSDictionary *request = plist_dictionary(msg, (uint32_t)len);
+	NSDictionary *reply = request ? [port->device lockdownReplyTo:request port:port] : nil;
+	NSData *data = reply ? plist_data(reply) : nil;
+	int ok = data && service_standin_reply(server, [data bytes], [data length]);
+	[pool drain];
+	return ok;
+}
+
+@implementation AMUsbmuxdStandIn
+
+@synthesize udid=_udid;
+@synthesize requiresSSL=_requiresSSL;
+
+- (id)initWithRoot:(NSString*)root socketPath:(NSString*)path
+{
+	if ((self = [super init])) {
+		_root = [root copy];
+		_udid = [@"0123456789abcdef0123456789abcdef0standin" copy];
+		_pairRecord = [[NSDictionary alloc] initWithObjectsAndKeys:
+			@"STANDIN-HOST", @"HostID",
+			@"STANDIN-SYSTEM-BUID", @"SystemBUID",
+			nil];
+		_services = [NSMutableArray new];
+		int ret = usbmuxd_standin_start([path fileSystemRepresentation], usbmuxd_standin_message, self, &_server);
+		if (ret != 0) {
+			NSLog(@"usbmuxd_standin_start failed: %s", strerror(ret));
+			[self release];
+			return nil;
+		}
+	}
+	return self;
+}
+
+- (uint64_t)requests
+{
+	return _server ? usbmuxd_standin_requests(_server) : 0;
+}
+
+- (void)dealloc
+{
+	// dropping the relayed connections lets what was answering them finish
+	if (_server) usbmuxd_standin_stop(_server);
+	for (NSValue *value in _services) {
+		struct standin_port *port = [value pointerValue];
+		if (port->lockdown) service_standin_stop(port->lockdown);
+		if (port->afc) afc_standin_stop(port->afc);
+		[port->session release];
+		free(port);
+	}
+	[_services release];
+	[_pairRecord release];
+	[_udid release];
+	[_root release];
+	[super dealloc];
+}
+
+@end
+
+@implementation AMUsbmuxdStandIn (Private)
+
+- (NSDictionary*)attached
+{
+	NSNumber *device_id = [NSNumber numberWithInt:STANDIN_DEVICE_ID];
+	NSDictionary *properties = [NSDictionary dictionaryWithObjectsAndKeys:
+		_udid, @"SerialNumber",
+		@"USB", @"ConnectionType",
+		device_id, @"DeviceID",
+		nil];
+	return [NSDictionary dictionaryWithObjectsAndKeys:
+		@"Attached", @"MessageType",
+		device_id, @"DeviceID",
+		properties, @"Properties",
+		nil];
+}
+
+// A socket whose other end is answering device port \p number, or -1 if
+// nothing listens there.
+- (int)openPort:(uint16_t)number
+{
+	struct standin_port *port = calloc(1, sizeof(*port));
+	int fd = -1, ret = ECONNREFUSED;
+	if (!port) return -1;
+	port->device = self;
+	if (number == USBMUX_LOCKDOWN_PORT) {
+		ret = service_standin_start(lockdown_standin_handler, port, 0, &port->lockdown, &fd);
+	} else if (number == STANDIN_AFC_PORT) {
+		ret = afc_standin_start([_root fileSystemRepresentation], 0, &port->afc, &fd);
+	}
+	if (ret != 0) {
+		free(port);
+		return -1;
+	}
+	@synchronized(self) {
+		[_services addObject:[NSValue valueWithPointer:port]];
+	}
+	return fd;
+}
+
+- (BOOL)answer:(NSDictionary*)message tag:(uint32_t)tag client:(usbmuxd_standin_client*)client
+{
+	NSString *type = [message objectForKey:@"MessageType"];
+
+	if ([type isEqual:@"Listen"]) {
+		// then the device, as though it had just been plugged in
+		return standin_send(client, tag, standin_result(USBMUX_RESULT_OK)) && standin_send(client, 0, [self attached]);
+	}
+	if ([type isEqual:@"ListDevices"]) {
+		return standin_send(client, tag, [NSDictionary dictionaryWithObject:[NSArray arrayWithObject:[self attached]] forKey:@"DeviceList"]);
+	}
+	if ([type isEqual:@"ReadPairRecord"]) {
+		if (![[message objectForKey:@"PairRecordID"] isEqual:_udid]) return standin_send(client, tag, standin_result(USBMUX_RESULT_BADDEVICE));
+		return standin_send(client, tag, [NSDictionary dictionaryWithObject:plist_data(_pairRecord) forKey:@"PairRecordData"]);
+	}
+	if ([type isEqual:@"Connect"]) {
+		if ([[message objectForKey:@"DeviceID"] intValue] != STANDIN_DEVICE_ID) return standin_send(client, tag, standin_result(USBMUX_RESULT_BADDEVICE));
+		// the port is in network byte order, and swapping it back is the same swap
+		int fd = [self openPort:(uint16_t)usbmux_port_number([[message objectForKey:@"PortNumber"] unsignedShortValue])];
+		if (fd < 0) return standin_send(client, tag, standin_result(USBMUX_RESULT_REFUSED));
+		// the relay only starts once the Result has gone
+		usbmuxd_standin_relay(client, fd);
+		return standin_send(client, tag, standin_result(USBMUX_RESULT_OK));
+	}
+	return standin_send(client, tag, standin_result(USBMUX_RESULT_BADCOMMAND));
+}
+
+// What lockdown says to request on the connection port.  Nil drops the
+// connection.
+- (NSDictionary*)lockdownReplyTo:(NSDictionary*)request port:(struct standin_port*)port
+{
+	static int sessions;
+	NSString *name = [request objectForKey:@"Request"];
+	if (![name isKindOfClass:[NSString class]]) return nil;
+	NSMutableDictionary *reply = [NSMutableDictionary dictionaryWithObject:name forKey:@"Request"];
+	NSString *error = nil;
+
+	if ([name isEqual:@"QueryType"]) {
+		[reply setObject:@"com.apple.mobile.lockdown" forKey:@"Type"];
+	} else if ([name isEqual:@"GetValue"]) {
+		NSDictionary *values = [NSDictionary dictionaryWithObjectsAndKeys:
+			_udid, @"UniqueDeviceID",
+			@"Stand-in", @"DeviceName",
+			@"iPhone", @"DeviceClass",
+			nil];
+		NSString *key = [request objectForKey:@"Key"];
+		// only the default domain is known
+		id value = [request objectForKey:@"Domain"] ? nil : key ? [values objectForKey:key] : values;
+		if (value) [reply setObject:value forKey:@"Value"];
+		else error = @"MissingValue";
+	} else if ([name isEqual:@"StartSession"]) {
+		if (![[request objectForKey:@"HostID"] isEqual:[_pairRecord objectForKey:@"HostID"]]) {
+			error = @"InvalidHostID";
+		} else {
+			[port->session release];
+			port->session = [[NSString alloc] initWithFormat:@"STANDIN-SESSION-%d", __sync_add_and_fetch(&sessions, 1)];
+			[reply setObject:port->session forKey:@"SessionID"];
+			[reply setObject:[NSNumber numberWithBool:_requiresSSL] forKey:@"EnableSessionSSL"];
+		}
+	} else if ([name isEqual:@"StopSession"]) {
+		if (!port->session || ![[request objectForKey:@"SessionID"] isEqual:port->session]) {
+			error = @"InvalidSessionID";
+		} else {
+			[port->session release];
+			port->session = nil;
+		}
+	} else if ([name isEqual:@"StartService"]) {
+		NSString *service = [request objectForKey:@"Service"];
+		if (!port->session) {
+			error = @"SessionInactive";
+		} else if (![service isEqual:@"com.apple.afc"]) {
+			error = @"InvalidService";
+		} else {
+			[reply setObject:service forKey:@"Service"];
+			[reply setObject:[NSNumber numberWithInt:STANDIN_AFC_PORT] forKey:@"Port"];
+		}
+	} else {
+		error = @"InvalidRequest";
+	}
+	if (error) [reply setObject:error forKey:@"Error"];
+	return reply;
+}
+
+@end
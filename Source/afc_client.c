@@ -0,0 +1,427 @@
+//
+//  afc_client.c
+//  mobileDeviceManager
+//
+//  See afc_client.h.
+//
+
+#include "afc_client.h"
+#include "afc_protocol.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+// a write to a connection the device has dropped fails with EPIPE rather than
+// killing the process - by socket option where there is one, else per send()
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS	MSG_NOSIGNAL
+#else
+#define SEND_FLAGS	0
+#endif
+
+#define CLIENT_MAX_WINDOW		64
+#define CLIENT_MAX_REPLY_ARGS	4096
+#define CLIENT_MAX_LIST			(64*1024*1024)
+
+struct afc_client {
+	int					fd;
+	pthread_mutex_t		lock;
+	uint64_t			packet_num;
+	uint32_t			chunk;
+	unsigned			window;
+	int					broken;			// out of step with afcd, so every call fails
+	size_t				arglen;
+	unsigned char		*out;			// header and arguments of the request being sent
+	size_t				out_cap;
+	unsigned char		args[CLIENT_MAX_REPLY_ARGS];	// arguments of the last reply
+};
+
+struct afc_client_list {
+	char		*buf;
+	size_t		len;
+	size_t		pos;
+};
+
+#pragma mark I/O
+
+static int read_full(int fd, void *buf, size_t len)
+{
+	unsigned char *p = buf;
+	while (len) {
+		ssize_t n = read(fd, p, len);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return 0;
+		p += n;
+		len -= n;
+	}
+	return 1;
+}
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	while (len) {
+		ssize_t n = send(fd, p, len, SEND_FLAGS);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return 0;
+		p += n;
+		len -= n;
+	}
+	return 1;
+}
+
+static int discard(int fd, uint64_t len)
+{
+	unsigned char junk[4096];
+	while (len) {
+		size_t n = len < sizeof(junk) ? (size_t)len : sizeof(junk);
+		if (!read_full(fd, junk, n)) return 0;
+		len -= n;
+	}
+	return 1;
+}
+
+#pragma mark packets
+
+// Send one request.  The arguments are given as up to two runs of bytes (a
+// fixed part and a path, say); payload is sent after them as it is.  Returns the
+// packet number to expect the reply under, or 0 if the connection has failed.
+static uint64_t send_request(afc_client *c, uint64_t op,
+							 const void *args, size_t arglen, const void *args2, size_t arglen2,
+							 const void *payload, size_t paylen)
+{
+	size_t head = AFC_HEADER_SIZE + arglen + arglen2;
+	if (head > c->out_cap) {
+		unsigned char *n = realloc(c->out, head);
+		if (!n) return 0;
+		c->out = n;
+		c->out_cap = head;
+	}
+
+	afc_packet_header h;
+	h.this_length = head;
+	h.entire_length = head + paylen;
+	h.packet_num = ++c->packet_num;
+	h.operation = op;
+	afc_encode_header(c->out, &h);
+	if (arglen) memcpy(c->out + AFC_HEADER_SIZE, args, arglen);
+	if (arglen2) memcpy(c->out + AFC_HEADER_SIZE + arglen, args2, arglen2);
+
+	if (!write_full(c->fd, c->out, head) || (paylen && !write_full(c->fd, payload, paylen))) {
+		c->broken = 1;
+		return 0;
+	}
+	return h.packet_num;
+}
+
+// Receive the reply to packet pn.  Its arguments land in c->args; its payload
+// goes to dst (which must have room for it), or, if alloc is given, to a new
+// buffer with a \0 after it, or is thrown away.  Returns the status - for a
+// status reply the one it carries, for anything else AFC_E_SUCCESS if it was
+// the operation expected.
+static int recv_reply(afc_client *c, uint64_t pn, uint64_t expect, void *dst, uint64_t dstcap,
+					  char **alloc, uint64_t *paylen)
+{
+	unsigned char raw[AFC_HEADER_SIZE];
+	afc_packet_header h;
+
+	if (!pn || !read_full(c->fd, raw, sizeof(raw)) || !afc_decode_header(raw, &h) || h.packet_num != pn) {
+		c->broken = 1;
+		return AFC_E_SERVICE_NOT_CONNECTED;
+	}
+	uint64_t arglen = h.this_length - AFC_HEADER_SIZE;
+	uint64_t len = h.entire_length - h.this_length;
+	if (arglen > sizeof(c->args) || !read_full(c->fd, c->args, (size_t)arglen)) {
+		c->broken = 1;
+		return AFC_E_SERVICE_NOT_CONNECTED;
+	}
+	c->arglen = (size_t)arglen;
+
+	if (h.operation == AFC_OP_STATUS) {
+		if (!discard(c->fd, len)) c->broken = 1;
+		if (c->broken) return AFC_E_SERVICE_NOT_CONNECTED;
+		return arglen >= 8 ? (int)afc_get_le64(c->args) : AFC_E_UNKNOWN_ERROR;
+	}
+
+	int ok;
+	if (dst) {
+		ok = (len <= dstcap) && read_full(c->fd, dst, (size_t)len);
+	} else if (alloc) {
+		*alloc = (len <= CLIENT_MAX_LIST) ? malloc((size_t)len + 1) : NULL;
+		ok = *alloc && read_full(c->fd, *alloc, (size_t)len);
+		if (ok) {
+			(*alloc)[len] = '\0';
+		} else {
+			free(*alloc);
+			*alloc = NULL;
+		}
+	} else {
+		ok = discard(c->fd, len);
+	}
+	if (!ok) {
+		c->broken = 1;
+		return AFC_E_SERVICE_NOT_CONNECTED;
+	}
+	if (paylen) *paylen = len;
+	return h.operation == expect ? AFC_E_SUCCESS : AFC_E_UNKNOWN_PACKET_TYPE;
+}
+
+// A request which is answered by a status, or by expect with a number in its
+// arguments (stored in value) or a list of strings as its payload.
+static int transact(afc_client *c, uint64_t op, const void *args, size_t arglen, const char *path, const char *path2,
+					uint64_t expect, uint64_t *value, afc_client_list **list)
+{
+	// paths go out one after another, each with its \0
+	size_t plen = path ? strlen(path) + 1 : 0;
+	size_t plen2 = path2 ? strlen(path2) + 1 : 0;
+	char *paths = NULL;
+	if (path2) {
+		paths = malloc(plen + plen2);
+		if (!paths) return AFC_E_NO_RESOURCES;
+		memcpy(paths, path, plen);
+		memcpy(paths + plen, path2, plen2);
+	}
+
+	pthread_mutex_lock(&c->lock);
+	int ret = AFC_E_SERVICE_NOT_CONNECTED;
+	if (!c->broken) {
+		char *buf = NULL;
+		uint64_t len = 0;
+		uint64_t pn = send_request(c, op, args, arglen, paths ? paths : path, plen + plen2, NULL, 0);
+		ret = recv_reply(c, pn, expect, NULL, 0, list ? &buf : NULL, &len);
+		if (ret == AFC_E_SUCCESS && value) {
+			if (c->arglen >= 8) {
+				*value = afc_get_le64(c->args);
+			} else {
+				ret = AFC_E_OP_HEADER_INVALID;
+			}
+		}
+		if (ret == AFC_E_SUCCESS && list) {
+			*list = calloc(1, sizeof(**list));
+			if (*list) {
+				(*list)->buf = buf;
+				(*list)->len = (size_t)len;
+				buf = NULL;
+			} else {
+				ret = AFC_E_NO_RESOURCES;
+			}
+		}
+		free(buf);
+	}
+	pthread_mutex_unlock(&c->lock);
+	free(paths);
+	return ret;
+}
+
+#pragma mark connection
+
+int afc_client_open(int fd, afc_client **client)
+{
+	afc_client *c = calloc(1, sizeof(*c));
+	if (!c) {
+		close(fd);
+		return AFC_E_NO_RESOURCES;
+	}
+#ifdef SO_NOSIGPIPE
+	int on = 1;
+	setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+	c->fd = fd;
+	c->chunk = 64*1024;
+	c->window = 8;
+	pthread_mutex_init(&c->lock, NULL);
+	*client = c;
+	return AFC_E_SUCCESS;
+}
+
+int afc_client_close(afc_client *c)
+{
+	if (!c) return AFC_E_INVALID_ARG;
+	close(c->fd);
+	pthread_mutex_destroy(&c->lock);
+	free(c->out);
+	free(c);
+	return AFC_E_SUCCESS;
+}
+
+void afc_client_set_pipeline(afc_client *c, uint32_t chunk, unsigned window)
+{
+	pthread_mutex_lock(&c->lock);
+	c->chunk = chunk ? chunk : 64*1024;
+	c->window = window == 0 ? 1 : window > CLIENT_MAX_WINDOW ? CLIENT_MAX_WINDOW : window;
+	pthread_mutex_unlock(&c->lock);
+}
+
+#pragma mark files
+
+int afc_client_file_open(afc_client *c, const char *path, uint64_t mode, uint64_t *ref)
+{
+	unsigned char args[8];
+	afc_put_le64(args, mode);
+	return transact(c, AFC_OP_FILE_OPEN, args, sizeof(args), path, NULL, AFC_OP_FILE_OPEN_RES, ref, NULL);
+}
+
+int afc_client_file_close(afc_client *c, uint64_t ref)
+{
+	unsigned char args[8];
+	afc_put_le64(args, ref);
+	return transact(c, AFC_OP_FILE_CLOSE, args, sizeof(args), NULL, NULL, AFC_OP_STATUS, NULL, NULL);
+}
+
+int afc_client_file_seek(afc_client *c, uint64_t ref, int64_t offset, uint64_t whence)
+{
+	unsigned char args[24];
+	afc_put_le64(args, ref);
+	afc_put_le64(args+8, whence);
+	afc_put_le64(args+16, (uint64_t)offset);
+	return transact(c, AFC_OP_FILE_SEEK, args, sizeof(args), NULL, NULL, AFC_OP_STATUS, NULL, NULL);
+}
+
+int afc_client_file_tell(afc_client *c, uint64_t ref, uint64_t *offset)
+{
+	unsigned char args[8];
+	afc_put_le64(args, ref);
+	return transact(c, AFC_OP_FILE_TELL, args, sizeof(args), NULL, NULL, AFC_OP_FILE_TELL_RES, offset, NULL);
+}
+
+int afc_client_file_set_size(afc_client *c, uint64_t ref, uint64_t size)
+{
+	unsigned char args[16];
+	afc_put_le64(args, ref);
+	afc_put_le64(args+8, size);
+	return transact(c, AFC_OP_FILE_SET_SIZE, args, sizeof(args), NULL, NULL, AFC_OP_STATUS, NULL, NULL);
+}
+
+// Reads go out chunk bytes at a time, up to window of them ahead of the replies.
+// The file position moves on with each read afcd carries out, so the replies
+// are contiguous however short any of them is; once one comes back short no
+// more are sent, and those already sent are collected (empty, if it was the end
+// of the file) to keep the connection in step.
+int afc_client_file_read(afc_client *c, uint64_t ref, void *buf, uint64_t *len)
+{
+	uint64_t pns[CLIENT_MAX_WINDOW], sizes[CLIENT_MAX_WINDOW];
+	uint64_t want = *len, sent = 0, got = 0;
+	unsigned head = 0, inflight = 0;
+	int ret = AFC_E_SUCCESS, done = 0;
+	unsigned char args[16];
+
+	pthread_mutex_lock(&c->lock);
+	if (c->broken) ret = AFC_E_SERVICE_NOT_CONNECTED;
+	while (ret != AFC_E_SERVICE_NOT_CONNECTED) {
+		while (!done && ret == AFC_E_SUCCESS && inflight < c->window && sent < want) {
+			uint64_t n = want - sent < c->chunk ? want - sent : c->chunk;
+			afc_put_le64(args, ref);
+			afc_put_le64(args+8, n);
+			unsigned slot = (head + inflight) % CLIENT_MAX_WINDOW;
+			pns[slot] = send_request(c, AFC_OP_FILE_READ, args, sizeof(args), NULL, 0, NULL, 0);
+			sizes[slot] = n;
+			sent += n;
+			inflight++;
+		}
+		if (inflight == 0) break;
+
+		uint64_t n = 0;
+		int r = recv_reply(c, pns[head], AFC_OP_DATA, (unsigned char*)buf + got, want - got, NULL, &n);
+		if (r == AFC_E_SUCCESS) {
+			got += n;
+			if (n < sizes[head]) done = 1;
+		} else if (ret == AFC_E_SUCCESS || r == AFC_E_SERVICE_NOT_CONNECTED) {
+			ret = r;
+		}
+		head = (head + 1) % CLIENT_MAX_WINDOW;
+		inflight--;
+	}
+	pthread_mutex_unlock(&c->lock);
+	*len = got;
+	return ret;
+}
+
+// Writes are pipelined in the same way, each answered by a status.
+int afc_client_file_write(afc_client *c, uint64_t ref, const void *buf, uint64_t len)
+{
+	uint64_t pns[CLIENT_MAX_WINDOW];
+	uint64_t sent = 0;
+	unsigned head = 0, inflight = 0;
+	int ret = AFC_E_SUCCESS;
+	unsigned char args[8];
+
+	afc_put_le64(args, ref);
+	pthread_mutex_lock(&c->lock);
+	if (c->broken) ret = AFC_E_SERVICE_NOT_CONNECTED;
+	while (ret != AFC_E_SERVICE_NOT_CONNECTED) {
+		while (ret == AFC_E_SUCCESS && inflight < c->window && sent < len) {
+			uint64_t n = len - sent < c->chunk ? len - sent : c->chunk;
+			pns[(head + inflight) % CLIENT_MAX_WINDOW] = send_request(c, AFC_OP_FILE_WRITE, args, sizeof(args), NULL, 0,
+																	  (const unsigned char*)buf + sent, (size_t)n);
+			sent += n;
+			inflight++;
+		}
+		if (inflight == 0) break;
+
+		int r = recv_reply(c, pns[head], AFC_OP_STATUS, NULL, 0, NULL, NULL);
+		if (r != AFC_E_SUCCESS && (ret == AFC_E_SUCCESS || r == AFC_E_SERVICE_NOT_CONNECTED)) ret = r;
+		head = (head + 1) % CLIENT_MAX_WINDOW;
+		inflight--;
+	}
+	pthread_mutex_unlock(&c->lock);
+	return ret;
+}
+
+#pragma mark paths
+
+int afc_client_make_dir(afc_client *c, const char *path)
+{
+	return transact(c, AFC_OP_MAKE_DIR, NULL, 0, path, NULL, AFC_OP_STATUS, NULL, NULL);
+}
+
+int afc_client_remove_path(afc_client *c, const char *path)
+{
+	return transact(c, AFC_OP_REMOVE_PATH, NULL, 0, path, NULL, AFC_OP_STATUS, NULL, NULL);
+}
+
+int afc_client_rename_path(afc_client *c, const char *from, const char *to)
+{
+	return transact(c, AFC_OP_RENAME_PATH, NULL, 0, from, to, AFC_OP_STATUS, NULL, NULL);
+}
+
+int afc_client_make_link(afc_client *c, uint64_t type, const char *target, const char *link)
+{
+	unsigned char args[8];
+	afc_put_le64(args, type);
+	return transact(c, AFC_OP_MAKE_LINK, args, sizeof(args), target, link, AFC_OP_STATUS, NULL, NULL);
+}
+
+int afc_client_read_dir(afc_client *c, const char *path, afc_client_list **list)
+{
+	return transact(c, AFC_OP_READ_DIR, NULL, 0, path, NULL, AFC_OP_DATA, NULL, list);
+}
+
+int afc_client_file_info(afc_client *c, const char *path, afc_client_list **list)
+{
+	return transact(c, AFC_OP_GET_FILE_INFO, NULL, 0, path, NULL, AFC_OP_DATA, NULL, list);
+}
+
+int afc_client_device_info(afc_client *c, afc_client_list **list)
+{
+	return transact(c, AFC_OP_GET_DEVINFO, NULL, 0, NULL, NULL, AFC_OP_DATA, NULL, list);
+}
+
+const char *afc_client_list_next(afc_client_list *list)
+{
+	if (!list || list->pos >= list->len) return NULL;
+	const char *s = list->buf + list->pos;
+	list->pos += strlen(s) + 1;
+	return s;
+}
+
+void afc_client_list_free(afc_client_list *list)
+{
+	if (!list) return;
+	free(list->buf);
+	free(list);
+}
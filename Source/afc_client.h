@@ -0,0 +1,79 @@
+//
+//  afc_client.h
+//  mobileDeviceManager
+//
+//  A client for the AFC protocol (see afc_protocol.h), for a socket which is
+//  already connected to afcd - through usbmuxd, or to an afc_standin.  It is
+//  what the native backend uses in place of MobileDevice.framework's AFC calls,
+//  so the calls mirror those: every function returns an AFC_E_* status, 0 on
+//  success.
+//
+//  Large reads and writes are split into pieces with several in flight at once,
+//  rather than waiting a round trip for each - see afc_client_set_pipeline().
+//  A client may be used from several threads, one call at a time.
+//
+
+#ifndef AFC_CLIENT_H
+#define AFC_CLIENT_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct afc_client afc_client;
+
+/// A directory listing, or the key/value pairs of a file or device info
+/// request - a run of strings, read with afc_client_list_next().
+typedef struct afc_client_list afc_client_list;
+
+/// Start talking AFC on \p fd, which the client owns from now on, even if this
+/// fails.
+int afc_client_open(int fd, afc_client **client);
+
+/// Close the connection (and the socket).
+int afc_client_close(afc_client *client);
+
+/// Split reads and writes into \p chunk byte pieces, keeping up to \p window of
+/// them in flight.  Defaults to 64K and 8.
+void afc_client_set_pipeline(afc_client *client, uint32_t chunk, unsigned window);
+
+/// Open \p path with an AFC_FOPEN_* \p mode.
+int afc_client_file_open(afc_client *client, const char *path, uint64_t mode, uint64_t *ref);
+int afc_client_file_close(afc_client *client, uint64_t ref);
+int afc_client_file_seek(afc_client *client, uint64_t ref, int64_t offset, uint64_t whence);
+int afc_client_file_tell(afc_client *client, uint64_t ref, uint64_t *offset);
+
+/// Read up to \p *len bytes, storing how many arrived in \p *len - fewer at the
+/// end of the file, or if afcd sent less than a piece asked for.
+int afc_client_file_read(afc_client *client, uint64_t ref, void *buf, uint64_t *len);
+int afc_client_file_write(afc_client *client, uint64_t ref, const void *buf, uint64_t len);
+int afc_client_file_set_size(afc_client *client, uint64_t ref, uint64_t size);
+
+int afc_client_make_dir(afc_client *client, const char *path);
+int afc_client_remove_path(afc_client *client, const char *path);
+int afc_client_rename_path(afc_client *client, const char *from, const char *to);
+
+/// \p type is AFC_HARDLINK or AFC_SYMLINK.
+int afc_client_make_link(afc_client *client, uint64_t type, const char *target, const char *link);
+
+/// The names in directory \p path, including "." and "..".  A file gives
+/// AFC_E_READ_ERROR, as it does from afcd.
+int afc_client_read_dir(afc_client *client, const char *path, afc_client_list **list);
+
+/// Alternating keys and values describing \p path (st_size, st_ifmt...).
+int afc_client_file_info(afc_client *client, const char *path, afc_client_list **list);
+
+/// Alternating keys and values describing the device (Model, FSFreeBytes...).
+int afc_client_device_info(afc_client *client, afc_client_list **list);
+
+/// The next string in \p list, or NULL once they have all been read.
+const char *afc_client_list_next(afc_client_list *list);
+void afc_client_list_free(afc_client_list *list);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
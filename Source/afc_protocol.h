@@ -0,0 +1,149 @@
+//
+//  afc_protocol.h
+//  mobileDeviceManager
+//
+//  Wire-level definitions for the Apple File Conduit protocol, as spoken by
+//  /usr/libexec/afcd on the device.  MobileDevice.framework hides all of this
+//  behind AFCConnectionOpen() and friends, but we need it for anything that
+//  talks to an AFC socket directly (the stand-in server, mostly).
+//
+//  Everything on the wire is little-endian.  Each packet starts with a 40 byte
+//  header; this_length covers the header plus the fixed "arguments" portion of
+//  the request, entire_length additionally covers any bulk payload (file data,
+//  directory listings, etc) which follows.
+//
+//  See also: http://www.libimobiledevice.org (src/afc.h)
+//
+
+#ifndef AFC_PROTOCOL_H
+#define AFC_PROTOCOL_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define AFC_MAGIC				"CFA6LPAA"
+#define AFC_MAGIC_LEN			8
+#define AFC_HEADER_SIZE			40
+
+typedef struct afc_packet_header {
+	char		magic[AFC_MAGIC_LEN];
+	uint64_t	entire_length;
+	uint64_t	this_length;
+	uint64_t	packet_num;
+	uint64_t	operation;
+} afc_packet_header;
+
+// operations
+enum {
+	AFC_OP_STATUS			= 0x01,
+	AFC_OP_DATA				= 0x02,
+	AFC_OP_READ_DIR			= 0x03,
+	AFC_OP_READ_FILE		= 0x04,
+	AFC_OP_WRITE_FILE		= 0x05,
+	AFC_OP_WRITE_PART		= 0x06,
+	AFC_OP_TRUNCATE			= 0x07,
+	AFC_OP_REMOVE_PATH		= 0x08,
+	AFC_OP_MAKE_DIR			= 0x09,
+	AFC_OP_GET_FILE_INFO	= 0x0A,
+	AFC_OP_GET_DEVINFO		= 0x0B,
+	AFC_OP_WRITE_FILE_ATOM	= 0x0C,
+	AFC_OP_FILE_OPEN		= 0x0D,
+	AFC_OP_FILE_OPEN_RES	= 0x0E,
+	AFC_OP_FILE_READ		= 0x0F,
+	AFC_OP_FILE_WRITE		= 0x10,
+	AFC_OP_FILE_SEEK		= 0x11,
+	AFC_OP_FILE_TELL		= 0x12,
+	AFC_OP_FILE_TELL_RES	= 0x13,
+	AFC_OP_FILE_CLOSE		= 0x14,
+	AFC_OP_FILE_SET_SIZE	= 0x15,
+	AFC_OP_GET_CON_INFO		= 0x16,
+	AFC_OP_SET_CON_OPTIONS	= 0x17,
+	AFC_OP_RENAME_PATH		= 0x18,
+	AFC_OP_SET_FS_BS		= 0x19,
+	AFC_OP_SET_SOCKET_BS	= 0x1A,
+	AFC_OP_FILE_LOCK		= 0x1B,
+	AFC_OP_MAKE_LINK		= 0x1C,
+	AFC_OP_SET_FILE_TIME	= 0x1E
+};
+
+// status codes carried in an AFC_OP_STATUS reply.  These are also what
+// the framework hands back from the AFCxxx() entry points.
+enum {
+	AFC_E_SUCCESS				= 0,
+	AFC_E_UNKNOWN_ERROR			= 1,
+	AFC_E_OP_HEADER_INVALID		= 2,
+	AFC_E_NO_RESOURCES			= 3,
+	AFC_E_READ_ERROR			= 4,		// also "that's a file, not a directory"
+	AFC_E_WRITE_ERROR			= 5,
+	AFC_E_UNKNOWN_PACKET_TYPE	= 6,
+	AFC_E_INVALID_ARG			= 7,
+	AFC_E_OBJECT_NOT_FOUND		= 8,
+	AFC_E_OBJECT_IS_DIR			= 9,
+	AFC_E_PERM_DENIED			= 10,
+	AFC_E_SERVICE_NOT_CONNECTED	= 11,
+	AFC_E_OP_TIMEOUT			= 12,
+	AFC_E_TOO_MUCH_DATA			= 13,
+	AFC_E_END_OF_DATA			= 14,
+	AFC_E_OP_NOT_SUPPORTED		= 15,
+	AFC_E_OBJECT_EXISTS			= 16,
+	AFC_E_OBJECT_BUSY			= 17,
+	AFC_E_NO_SPACE_LEFT			= 18,
+	AFC_E_OP_WOULD_BLOCK		= 19,
+	AFC_E_IO_ERROR				= 20
+};
+
+// file open modes, as sent in AFC_OP_FILE_OPEN
+enum {
+	AFC_FOPEN_RDONLY	= 1,	// r
+	AFC_FOPEN_RW		= 2,	// r+ (creates if missing)
+	AFC_FOPEN_WRONLY	= 3,	// w
+	AFC_FOPEN_WR		= 4,	// w+
+	AFC_FOPEN_APPEND	= 5,	// a
+	AFC_FOPEN_RDAPPEND	= 6		// a+
+};
+
+// link types, as sent in AFC_OP_MAKE_LINK
+enum {
+	AFC_HARDLINK	= 1,
+	AFC_SYMLINK		= 2
+};
+
+static inline void afc_put_le64(unsigned char *p, uint64_t v)
+{
+	int i;
+	for (i=0; i<8; i++) p[i] = (unsigned char)(v >> (8*i));
+}
+
+static inline uint64_t afc_get_le64(const unsigned char *p)
+{
+	uint64_t v = 0;
+	int i;
+	for (i=7; i>=0; i--) v = (v << 8) | p[i];
+	return v;
+}
+
+// serialise a header into exactly AFC_HEADER_SIZE bytes
+static inline void afc_encode_header(unsigned char *p, const afc_packet_header *h)
+{
+	memcpy(p, AFC_MAGIC, AFC_MAGIC_LEN);
+	afc_put_le64(p+8, h->entire_length);
+	afc_put_le64(p+16, h->this_length);
+	afc_put_le64(p+24, h->packet_num);
+	afc_put_le64(p+32, h->operation);
+}
+
+// returns 0 if the bytes don't look like an AFC header
+static inline int afc_decode_header(const unsigned char *p, afc_packet_header *h)
+{
+	if (memcmp(p, AFC_MAGIC, AFC_MAGIC_LEN) != 0) return 0;
+	memcpy(h->magic, p, AFC_MAGIC_LEN);
+	h->entire_length = afc_get_le64(p+8);
+	h->this_length = afc_get_le64(p+16);
+	h->packet_num = afc_get_le64(p+24);
+	h->operation = afc_get_le64(p+32);
+	if (h->this_length < AFC_HEADER_SIZE) return 0;
+	if (h->entire_length < h->this_length) return 0;
+	return 1;
+}
+
+#endif
@@ -0,0 +1,539 @@
+//
+//  afc_standin.c
+//  mobileDeviceManager
+//
+//  See afc_standin.h.  This implements just enough of afcd for the operations
+//  that AFCDirectoryAccess uses - directory reads, file info, open/read/write/
+//  seek/tell/close, set-size, mkdir, remove, rename and links.
+//
+
+#include "afc_standin.h"
+#include "afc_protocol.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/time.h>
+
+#define STANDIN_MAX_FILES		64
+#define STANDIN_MAX_READ		(8*1024*1024)
+
+struct afc_standin {
+	int					fd;						// our end of the socketpair
+	char				root[PATH_MAX];
+	volatile unsigned	latency_us;
+	volatile unsigned	bandwidth;				// bytes per second, 0 for unlimited
+	uint64_t			link_free;				// when the simulated link is next idle, in us
+	volatile uint64_t	requests;
+	volatile uint64_t	fail_reads_from;		// reads past this file offset fail, 0 for never
+	pthread_t			thread;
+	int					files[STANDIN_MAX_FILES];	// open handles, -1 if free
+
+	// scratch buffers, grown as required and reused for every packet
+	unsigned char		*args;
+	size_t				args_cap;
+	unsigned char		*in;					// data sent with a request
+	size_t				in_cap;
+	unsigned char		*payload;
+	size_t				payload_cap;
+	unsigned char		*out;
+	size_t				out_cap;
+};
+
+static int read_full(int fd, void *buf, size_t len)
+{
+	unsigned char *p = buf;
+	while (len) {
+		ssize_t n = read(fd, p, len);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return 0;
+		p += n;
+		len -= n;
+	}
+	return 1;
+}
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	while (len) {
+		ssize_t n = write(fd, p, len);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return 0;
+		p += n;
+		len -= n;
+	}
+	return 1;
+}
+
+static int grow(unsigned char **buf, size_t *cap, size_t want)
+{
+	if (want <= *cap) return 1;
+	size_t ncap = *cap ? *cap : 4096;
+	while (ncap < want) ncap *= 2;
+	unsigned char *n = realloc(*buf, ncap);
+	if (!n) return 0;
+	*buf = n;
+	*cap = ncap;
+	return 1;
+}
+
+static uint64_t now_us(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+// Hold a transfer of len bytes (either way) back to the configured bandwidth.
+// The link is busy until link_free, and anything sent meanwhile queues behind
+// it, so short sleeps that overrun are made up for by the next transfer.
+static void pace(afc_standin *s, size_t len)
+{
+	unsigned bandwidth = s->bandwidth;
+	if (!bandwidth) return;
+	uint64_t now = now_us();
+	if (s->link_free < now) s->link_free = now;
+	s->link_free += (uint64_t)len * 1000000 / bandwidth;
+	if (s->link_free > now + 1000) usleep((useconds_t)(s->link_free - now));
+}
+
+static uint64_t status_for_errno(int e)
+{
+	switch (e) {
+	case 0:				return AFC_E_SUCCESS;
+	case ENOENT:		return AFC_E_OBJECT_NOT_FOUND;
+	case EISDIR:		return AFC_E_OBJECT_IS_DIR;
+	case ENOTDIR:		return AFC_E_READ_ERROR;
+	case EACCES:
+	case EPERM:			return AFC_E_PERM_DENIED;
+	case EEXIST:		return AFC_E_OBJECT_EXISTS;
+	case ENOTEMPTY:		return AFC_E_OBJECT_BUSY;
+	case ENOSPC:		return AFC_E_NO_SPACE_LEFT;
+	case EINVAL:		return AFC_E_INVALID_ARG;
+	default:			return AFC_E_IO_ERROR;
+	}
+}
+
+// map a device path onto the served root, refusing anything that tries
+// to climb out of it
+static int resolve(afc_standin *s, const char *path, char *out)
+{
+	if (strstr(path, "..")) {
+		const char *p = path;
+		while ((p = strstr(p, ".."))) {
+			int starts = (p == path || p[-1] == '/');
+			int ends = (p[2] == '\0' || p[2] == '/');
+			if (starts && ends) return 0;
+			p += 2;
+		}
+	}
+	int n = snprintf(out, PATH_MAX, "%s%s%s", s->root, (*path == '/') ? "" : "/", path);
+	return n > 0 && n < PATH_MAX;
+}
+
+static int send_packet(afc_standin *s, uint64_t packet_num, uint64_t op,
+					   const void *data, size_t datalen,
+					   const void *payload, size_t paylen)
+{
+	afc_packet_header h;
+	h.this_length = AFC_HEADER_SIZE + datalen;
+	h.entire_length = h.this_length + paylen;
+	h.packet_num = packet_num;
+	h.operation = op;
+
+	// small replies go out in a single write, bulk data gets a second one
+	// straight from the caller's buffer
+	if (!grow(&s->out, &s->out_cap, AFC_HEADER_SIZE + datalen)) return 0;
+	afc_encode_header(s->out, &h);
+	if (datalen) memcpy(s->out + AFC_HEADER_SIZE, data, datalen);
+
+	if (s->latency_us) usleep(s->latency_us);
+
+	pace(s, AFC_HEADER_SIZE + datalen + paylen);
+	if (!write_full(s->fd, s->out, AFC_HEADER_SIZE + datalen)) return 0;
+	if (paylen && !write_full(s->fd, payload, paylen)) return 0;
+	return 1;
+}
+
+static int send_status(afc_standin *s, uint64_t packet_num, uint64_t status)
+{
+	unsigned char v[8];
+	afc_put_le64(v, status);
+	return send_packet(s, packet_num, AFC_OP_STATUS, v, sizeof(v), NULL, 0);
+}
+
+static int send_u64(afc_standin *s, uint64_t packet_num, uint64_t op, uint64_t value)
+{
+	unsigned char v[8];
+	afc_put_le64(v, value);
+	return send_packet(s, packet_num, op, v, sizeof(v), NULL, 0);
+}
+
+// append "key\0value\0" to the scratch payload buffer
+static int append_kv(afc_standin *s, size_t *len, const char *key, const char *fmt, unsigned long long value)
+{
+	char val[64];
+	snprintf(val, sizeof(val), fmt, value);
+	size_t kl = strlen(key)+1, vl = strlen(val)+1;
+	if (!grow(&s->payload, &s->payload_cap, *len + kl + vl)) return 0;
+	memcpy(s->payload + *len, key, kl);
+	memcpy(s->payload + *len + kl, val, vl);
+	*len += kl + vl;
+	return 1;
+}
+
+static int append_string(afc_standin *s, size_t *len, const char *str)
+{
+	size_t l = strlen(str)+1;
+	if (!grow(&s->payload, &s->payload_cap, *len + l)) return 0;
+	memcpy(s->payload + *len, str, l);
+	*len += l;
+	return 1;
+}
+
+static int file_slot(afc_standin *s, uint64_t handle)
+{
+	if (handle < 1 || handle > STANDIN_MAX_FILES) return -1;
+	return s->files[handle-1];
+}
+
+static int do_read_dir(afc_standin *s, uint64_t pn, const char *path)
+{
+	char full[PATH_MAX];
+	if (!resolve(s, path, full)) return send_status(s, pn, AFC_E_PERM_DENIED);
+	DIR *d = opendir(full);
+	if (!d) return send_status(s, pn, status_for_errno(errno));
+	size_t len = 0;
+	struct dirent *e;
+	while ((e = readdir(d))) {
+		if (!append_string(s, &len, e->d_name)) break;
+	}
+	closedir(d);
+	return send_packet(s, pn, AFC_OP_DATA, NULL, 0, s->payload, len);
+}
+
+static int do_file_info(afc_standin *s, uint64_t pn, const char *path)
+{
+	char full[PATH_MAX];
+	struct stat st;
+	if (!resolve(s, path, full)) return send_status(s, pn, AFC_E_PERM_DENIED);
+	if (lstat(full, &st) != 0) return send_status(s, pn, status_for_errno(errno));
+
+	const char *ifmt = "S_IFREG";
+	if (S_ISDIR(st.st_mode)) ifmt = "S_IFDIR";
+	else if (S_ISLNK(st.st_mode)) ifmt = "S_IFLNK";
+	else if (S_ISCHR(st.st_mode)) ifmt = "S_IFCHR";
+	else if (S_ISBLK(st.st_mode)) ifmt = "S_IFBLK";
+
+	// afcd reports times in nanoseconds, and to the nanosecond - a sync
+	// compares them with local ones
+#ifdef __APPLE__
+	unsigned long long mtime = (unsigned long long)st.st_mtimespec.tv_sec * 1000000000ULL + st.st_mtimespec.tv_nsec;
+#else
+	unsigned long long mtime = (unsigned long long)st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+#endif
+	size_t len = 0;
+	append_kv(s, &len, "st_size", "%llu", (unsigned long long)st.st_size);
+	append_kv(s, &len, "st_blocks", "%llu", (unsigned long long)st.st_blocks);
+	append_kv(s, &len, "st_nlink", "%llu", (unsigned long long)st.st_nlink);
+	append_string(s, &len, "st_ifmt");
+	append_string(s, &len, ifmt);
+	append_kv(s, &len, "st_mtime", "%llu", mtime);
+	append_kv(s, &len, "st_birthtime", "%llu", mtime);
+	if (S_ISLNK(st.st_mode)) {
+		char target[PATH_MAX];
+		ssize_t n = readlink(full, target, sizeof(target)-1);
+		if (n > 0) {
+			target[n] = '\0';
+			append_string(s, &len, "LinkTarget");
+			append_string(s, &len, target);
+		}
+	}
+	return send_packet(s, pn, AFC_OP_DATA, NULL, 0, s->payload, len);
+}
+
+static int do_device_info(afc_standin *s, uint64_t pn)
+{
+	struct statvfs vfs;
+	size_t len = 0;
+	if (statvfs(s->root, &vfs) != 0) memset(&vfs, 0, sizeof(vfs));
+	append_string(s, &len, "Model");
+	append_string(s, &len, "StandIn1,1");
+	append_kv(s, &len, "FSTotalBytes", "%llu", (unsigned long long)vfs.f_blocks * vfs.f_frsize);
+	append_kv(s, &len, "FSFreeBytes", "%llu", (unsigned long long)vfs.f_bavail * vfs.f_frsize);
+	append_kv(s, &len, "FSBlockSize", "%llu", (unsigned long long)vfs.f_bsize);
+	return send_packet(s, pn, AFC_OP_DATA, NULL, 0, s->payload, len);
+}
+
+static int do_file_open(afc_standin *s, uint64_t pn, uint64_t mode, const char *path)
+{
+	char full[PATH_MAX];
+	int flags;
+	if (!resolve(s, path, full)) return send_status(s, pn, AFC_E_PERM_DENIED);
+	switch (mode) {
+	case AFC_FOPEN_RDONLY:		flags = O_RDONLY; break;
+	case AFC_FOPEN_RW:			flags = O_RDWR | O_CREAT; break;
+	case AFC_FOPEN_WRONLY:		flags = O_WRONLY | O_CREAT | O_TRUNC; break;
+	case AFC_FOPEN_WR:			flags = O_RDWR | O_CREAT | O_TRUNC; break;
+	case AFC_FOPEN_APPEND:		flags = O_WRONLY | O_CREAT | O_APPEND; break;
+	case AFC_FOPEN_RDAPPEND:	flags = O_RDWR | O_CREAT | O_APPEND; break;
+	default:					return send_status(s, pn, AFC_E_INVALID_ARG);
+	}
+	int slot;
+	for (slot=0; slot<STANDIN_MAX_FILES; slot++) if (s->files[slot] < 0) break;
+	if (slot == STANDIN_MAX_FILES) return send_status(s, pn, AFC_E_NO_RESOURCES);
+	int fd = open(full, flags, 0644);
+	if (fd < 0) return send_status(s, pn, status_for_errno(errno));
+	s->files[slot] = fd;
+	return send_u64(s, pn, AFC_OP_FILE_OPEN_RES, slot+1);
+}
+
+static int do_file_read(afc_standin *s, uint64_t pn, uint64_t handle, uint64_t len)
+{
+	int fd = file_slot(s, handle);
+	if (fd < 0) return send_status(s, pn, AFC_E_INVALID_ARG);
+	if (len > STANDIN_MAX_READ) len = STANDIN_MAX_READ;
+	uint64_t limit = s->fail_reads_from;
+	if (limit) {
+		off_t at = lseek(fd, 0, SEEK_CUR);
+		if (at >= 0 && (uint64_t)at + len > limit) return send_status(s, pn, AFC_E_READ_ERROR);
+	}
+	if (!grow(&s->payload, &s->payload_cap, len)) return send_status(s, pn, AFC_E_NO_RESOURCES);
+	ssize_t n = read(fd, s->payload, len);
+	if (n < 0) return send_status(s, pn, status_for_errno(errno));
+	return send_packet(s, pn, AFC_OP_DATA, NULL, 0, s->payload, n);
+}
+
+static int do_file_write(afc_standin *s, uint64_t pn, uint64_t handle, const unsigned char *data, size_t len)
+{
+	int fd = file_slot(s, handle);
+	if (fd < 0) return send_status(s, pn, AFC_E_INVALID_ARG);
+	if (!write_full(fd, data, len)) return send_status(s, pn, status_for_errno(errno));
+	return send_status(s, pn, AFC_E_SUCCESS);
+}
+
+static int dispatch(afc_standin *s, const afc_packet_header *h,
+					const unsigned char *args, size_t arglen,
+					const unsigned char *payload, size_t paylen)
+{
+	uint64_t pn = h->packet_num;
+	char full[PATH_MAX], full2[PATH_MAX];
+	int fd;
+
+	// string arguments are \0 terminated by the sender, but don't trust it
+	// (serve() always leaves room for the extra byte)
+	s->args[arglen] = '\0';
+
+	switch (h->operation) {
+	case AFC_OP_READ_DIR:
+		return do_read_dir(s, pn, (const char*)args);
+
+	case AFC_OP_GET_FILE_INFO:
+		return do_file_info(s, pn, (const char*)args);
+
+	case AFC_OP_GET_DEVINFO:
+		return do_device_info(s, pn);
+
+	case AFC_OP_FILE_OPEN:
+		if (arglen < 9) return send_status(s, pn, AFC_E_INVALID_ARG);
+		return do_file_open(s, pn, afc_get_le64(args), (const char*)args+8);
+
+	case AFC_OP_FILE_READ:
+		if (arglen < 16) return send_status(s, pn, AFC_E_INVALID_ARG);
+		return do_file_read(s, pn, afc_get_le64(args), afc_get_le64(args+8));
+
+	case AFC_OP_FILE_WRITE:
+		if (arglen < 8) return send_status(s, pn, AFC_E_INVALID_ARG);
+		return do_file_write(s, pn, afc_get_le64(args), payload, paylen);
+
+	case AFC_OP_FILE_SEEK:
+		if (arglen < 24) return send_status(s, pn, AFC_E_INVALID_ARG);
+		fd = file_slot(s, afc_get_le64(args));
+		if (fd < 0) return send_status(s, pn, AFC_E_INVALID_ARG);
+		if (lseek(fd, (off_t)(int64_t)afc_get_le64(args+16), (int)afc_get_le64(args+8)) < 0)
+			return send_status(s, pn, status_for_errno(errno));
+		return send_status(s, pn, AFC_E_SUCCESS);
+
+	case AFC_OP_FILE_TELL:
+		if (arglen < 8) return send_status(s, pn, AFC_E_INVALID_ARG);
+		fd = file_slot(s, afc_get_le64(args));
+		if (fd < 0) return send_status(s, pn, AFC_E_INVALID_ARG);
+		return send_u64(s, pn, AFC_OP_FILE_TELL_RES, (uint64_t)lseek(fd, 0, SEEK_CUR));
+
+	case AFC_OP_FILE_SET_SIZE:
+		if (arglen < 16) return send_status(s, pn, AFC_E_INVALID_ARG);
+		fd = file_slot(s, afc_get_le64(args));
+		if (fd < 0) return send_status(s, pn, AFC_E_INVALID_ARG);
+		if (ftruncate(fd, (off_t)afc_get_le64(args+8)) != 0)
+			return send_status(s, pn, status_for_errno(errno));
+		return send_status(s, pn, AFC_E_SUCCESS);
+
+	case AFC_OP_FILE_CLOSE:
+		if (arglen < 8) return send_status(s, pn, AFC_E_INVALID_ARG);
+		fd = file_slot(s, afc_get_le64(args));
+		if (fd < 0) return send_status(s, pn, AFC_E_INVALID_ARG);
+		close(fd);
+		s->files[afc_get_le64(args)-1] = -1;
+		return send_status(s, pn, AFC_E_SUCCESS);
+
+	case AFC_OP_REMOVE_PATH:
+		if (!resolve(s, (const char*)args, full)) return send_status(s, pn, AFC_E_PERM_DENIED);
+		return send_status(s, pn, remove(full) == 0 ? AFC_E_SUCCESS : status_for_errno(errno));
+
+	case AFC_OP_MAKE_DIR:
+		if (!resolve(s, (const char*)args, full)) return send_status(s, pn, AFC_E_PERM_DENIED);
+		return send_status(s, pn, mkdir(full, 0755) == 0 ? AFC_E_SUCCESS : status_for_errno(errno));
+
+	case AFC_OP_RENAME_PATH: {
+		const char *from = (const char*)args;
+		const char *to = from + strlen(from) + 1;
+		if ((const unsigned char*)to >= args+arglen) return send_status(s, pn, AFC_E_INVALID_ARG);
+		if (!resolve(s, from, full) || !resolve(s, to, full2)) return send_status(s, pn, AFC_E_PERM_DENIED);
+		return send_status(s, pn, rename(full, full2) == 0 ? AFC_E_SUCCESS : status_for_errno(errno));
+	}
+
+	case AFC_OP_MAKE_LINK: {
+		if (arglen < 10) return send_status(s, pn, AFC_E_INVALID_ARG);
+		uint64_t type = afc_get_le64(args);
+		const char *target = (const char*)args+8;
+		const char *linkname = target + strlen(target) + 1;
+		if ((const unsigned char*)linkname >= args+arglen) return send_status(s, pn, AFC_E_INVALID_ARG);
+		if (!resolve(s, linkname, full)) return send_status(s, pn, AFC_E_PERM_DENIED);
+		int rc;
+		if (type == AFC_SYMLINK) {
+			rc = symlink(target, full);
+		} else {
+			if (!resolve(s, target, full2)) return send_status(s, pn, AFC_E_PERM_DENIED);
+			rc = link(full2, full);
+		}
+		return send_status(s, pn, rc == 0 ? AFC_E_SUCCESS : status_for_errno(errno));
+	}
+
+	case AFC_OP_SET_FILE_TIME: {
+		if (arglen < 9) return send_status(s, pn, AFC_E_INVALID_ARG);
+		uint64_t ns = afc_get_le64(args);
+		if (!resolve(s, (const char*)args+8, full)) return send_status(s, pn, AFC_E_PERM_DENIED);
+		struct timeval tv[2];
+		tv[0].tv_sec = tv[1].tv_sec = (time_t)(ns / 1000000000ULL);
+		tv[0].tv_usec = tv[1].tv_usec = (suseconds_t)((ns % 1000000000ULL) / 1000);
+		return send_status(s, pn, utimes(full, tv) == 0 ? AFC_E_SUCCESS : status_for_errno(errno));
+	}
+
+	// connection tuning - accept and ignore
+	case AFC_OP_SET_CON_OPTIONS:
+	case AFC_OP_SET_FS_BS:
+	case AFC_OP_SET_SOCKET_BS:
+		return send_status(s, pn, AFC_E_SUCCESS);
+
+	default:
+		return send_status(s, pn, AFC_E_OP_NOT_SUPPORTED);
+	}
+}
+
+static void *serve(void *arg)
+{
+	afc_standin *s = arg;
+	unsigned char raw[AFC_HEADER_SIZE];
+	afc_packet_header h;
+
+	for (;;) {
+		if (!read_full(s->fd, raw, sizeof(raw))) break;
+		if (!afc_decode_header(raw, &h)) break;
+
+		size_t arglen = h.this_length - AFC_HEADER_SIZE;
+		size_t paylen = h.entire_length - h.this_length;
+		if (!grow(&s->args, &s->args_cap, arglen+1)) break;
+		if (!read_full(s->fd, s->args, arglen)) break;
+
+		// file data sent with the request lives in its own buffer, because
+		// the reply path reuses s->payload
+		if (!grow(&s->in, &s->in_cap, paylen+1)) break;
+		if (!read_full(s->fd, s->in, paylen)) break;
+		pace(s, h.entire_length);
+		__sync_fetch_and_add(&s->requests, 1);
+		int ok = dispatch(s, &h, s->args, arglen, paylen ? s->in : NULL, paylen);
+		if (!ok) break;
+	}
+
+	int i;
+	for (i=0; i<STANDIN_MAX_FILES; i++) {
+		if (s->files[i] >= 0) close(s->files[i]);
+		s->files[i] = -1;
+	}
+	return NULL;
+}
+
+int afc_standin_start(const char *root, unsigned latency_us, afc_standin **server, int *client_fd)
+{
+	int fds[2];
+	afc_standin *s = calloc(1, sizeof(*s));
+	if (!s) return ENOMEM;
+	if (!realpath(root, s->root)) {
+		int e = errno;
+		free(s);
+		return e;
+	}
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+		int e = errno;
+		free(s);
+		return e;
+	}
+	int i;
+	for (i=0; i<STANDIN_MAX_FILES; i++) s->files[i] = -1;
+	s->fd = fds[0];
+	s->latency_us = latency_us;
+	int rc = pthread_create(&s->thread, NULL, serve, s);
+	if (rc != 0) {
+		close(fds[0]);
+		close(fds[1]);
+		free(s);
+		return rc;
+	}
+	*server = s;
+	*client_fd = fds[1];
+	return 0;
+}
+
+void afc_standin_set_latency(afc_standin *s, unsigned latency_us)
+{
+	s->latency_us = latency_us;
+}
+
+void afc_standin_set_bandwidth(afc_standin *s, unsigned bytes_per_second)
+{
+	s->bandwidth = bytes_per_second;
+}
+
+void afc_standin_fail_reads_from(afc_standin *s, uint64_t offset)
+{
+	s->fail_reads_from = offset;
+}
+
+uint64_t afc_standin_requests(afc_standin *s)
+{
+	return __sync_fetch_and_add(&s->requests, 0);
+}
+
+void afc_standin_stop(afc_standin *s)
+{
+	if (!s) return;
+	shutdown(s->fd, SHUT_RDWR);
+	pthread_join(s->thread, NULL);
+	close(s->fd);
+	free(s->args);
+	free(s->in);
+	free(s->payload);
+	free(s->out);
+	free(s);
+}
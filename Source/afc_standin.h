@@ -0,0 +1,54 @@
+//
+//  afc_standin.h
+//  mobileDeviceManager
+//
+//  A tiny AFC server that serves a local directory over one end of a
+//  socketpair.  The other end can be handed to AFCConnectionOpen() exactly as
+//  if it was a service socket vended by the device, which lets us exercise the
+//  real copy/list code without an iPhone plugged in.
+//
+//  Each stand-in serves a single connection on its own thread.  An artificial
+//  per-request latency can be injected to approximate a USB round-trip, and the
+//  bandwidth limited to approximate the link itself.
+//
+
+#ifndef AFC_STANDIN_H
+#define AFC_STANDIN_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct afc_standin afc_standin;
+
+/// Start serving \p root.  On success returns 0, stores the server handle in
+/// \p server and the client end of the socketpair in \p client_fd.  The caller
+/// owns \p client_fd and must close it (usually by closing the AFC connection
+/// built on top of it) before calling afc_standin_stop().
+int afc_standin_start(const char *root, unsigned latency_us, afc_standin **server, int *client_fd);
+
+/// Change the latency injected before every reply.
+void afc_standin_set_latency(afc_standin *server, unsigned latency_us);
+
+/// Limit the bytes carried in both directions to \p bytes_per_second (0, the
+/// default, for no limit).
+void afc_standin_set_bandwidth(afc_standin *server, unsigned bytes_per_second);
+
+/// Make every read which would go past byte \p offset of a file fail with
+/// AFC_E_READ_ERROR, as a device with a bad flash block might (0, the default,
+/// for never).
+void afc_standin_fail_reads_from(afc_standin *server, uint64_t offset);
+
+/// Number of requests served so far.
+uint64_t afc_standin_requests(afc_standin *server);
+
+/// Shut the server down and wait for its thread to exit.
+void afc_standin_stop(afc_standin *server);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
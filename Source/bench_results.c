@@ -0,0 +1,312 @@
+//
+//  bench_results.c
+//  mobileDeviceManager
+//
+//  See bench_results.h.
+//
+
+#include "bench_results.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+int bench_results_add(bench_results *r, const char *name, double seconds,
+					  uint64_t requests, uint64_t bytes, uint64_t items)
+{
+	if (r->count >= BENCH_MAX_CASES || strlen(name) >= BENCH_NAME_MAX) return 0;
+	bench_case *c = &r->cases[r->count++];
+	memset(c, 0, sizeof(*c));
+	strcpy(c->name, name);
+	c->seconds = seconds;
+	c->requests = requests;
+	c->bytes = bytes;
+	c->items = items;
+	return 1;
+}
+
+const bench_case *bench_results_find(const bench_results *r, const char *name)
+{
+	size_t i;
+	for (i = 0; i < r->count; i++) {
+		if (strcmp(r->cases[i].name, name) == 0) return &r->cases[i];
+	}
+	return NULL;
+}
+
+int bench_results_comparable(const bench_results *a, const bench_results *b)
+{
+	return strcmp(a->driver, b->driver) == 0 && a->latency_ms == b->latency_ms &&
+		   a->bandwidth_mbs == b->bandwidth_mbs && a->scale == b->scale && a->connections == b->connections;
+}
+
+#pragma mark writing
+
+// names are ours (scenario.case), so there is nothing to escape
+int bench_results_save(const bench_results *r, const char *path)
+{
+	FILE *f = fopen(path, "w");
+	size_t i;
+	if (!f) return errno;
+	fprintf(f, "{\n  \"driver\": \"%s\",\n", r->driver);
+	fprintf(f, "  \"settings\": {\"latency_ms\": %.17g, \"bandwidth_mbs\": %.17g, \"scale\": %.17g, \"connections\": %u},\n",
+			r->latency_ms, r->bandwidth_mbs, r->scale, r->connections);
+	fprintf(f, "  \"results\": {");
+	for (i = 0; i < r->count; i++) {
+		const bench_case *c = &r->cases[i];
+		fprintf(f, "%s\n    \"%s\": {\"seconds\": %.6f, \"requests\": %llu, \"bytes\": %llu, \"items\": %llu}",
+				i ? "," : "", c->name, c->seconds, (unsigned long long)c->requests,
+				(unsigned long long)c->bytes, (unsigned long long)c->items);
+	}
+	fprintf(f, "\n  }\n}\n");
+	int bad = ferror(f);
+	if (fclose(f) != 0 || bad) return errno ? errno : EIO;
+	return 0;
+}
+
+#pragma mark reading
+
+// Just enough JSON for what bench_results_save() writes, though members it
+// doesn't know (and their values, whatever they are) are skipped.
+
+typedef struct json_in {
+	const char	*p, *end;
+	int			depth;
+} json_in;
+
+#define JSON_MAX_DEPTH	16
+
+static void skip_space(json_in *in)
+{
+	while (in->p < in->end && (*in->p == ' ' || *in->p == '\t' || *in->p == '\n' || *in->p == '\r')) in->p++;
+}
+
+static int expect(json_in *in, char c)
+{
+	skip_space(in);
+	if (in->p >= in->end || *in->p != c) return 0;
+	in->p++;
+	return 1;
+}
+
+// A string into buf, truncated to fit.  \u escapes outside ASCII become '?'.
+static int read_string(json_in *in, char *buf, size_t size)
+{
+	size_t n = 0;
+	if (!expect(in, '"')) return 0;
+	while (in->p < in->end && *in->p != '"') {
+		char c = *in->p++;
+		if (c == '\\') {
+			if (in->p >= in->end) return 0;
+			c = *in->p++;
+			switch (c) {
+				case 'n': c = '\n'; break;
+				case 't': c = '\t'; break;
+				case 'r': c = '\r'; break;
+				case 'b': c = '\b'; break;
+				case 'f': c = '\f'; break;
+				case 'u': {
+					unsigned v = 0, k;
+					if (in->end - in->p < 4) return 0;
+					for (k = 0; k < 4; k++) {
+						char h = *in->p++;
+						v <<= 4;
+						if (h >= '0' && h <= '9') v |= h - '0';
+						else if (h >= 'a' && h <= 'f') v |= h - 'a' + 10;
+						else if (h >= 'A' && h <= 'F') v |= h - 'A' + 10;
+						else return 0;
+					}
+					c = v < 0x80 ? (char)v : '?';
+					break;
+				}
+				default: break;		// \" \\ \/
+			}
+		}
+		if (n + 1 < size) buf[n++] = c;
+	}
+	if (size) buf[n] = 0;
+	return expect(in, '"');
+}
+
+static int read_number(json_in *in, double *value)
+{
+	char buf[64], *stop;
+	size_t n = 0;
+	skip_space(in);
+	while (in->p < in->end && n + 1 < sizeof(buf) && strchr("+-0123456789.eE", *in->p)) buf[n++] = *in->p++;
+	buf[n] = 0;
+	if (n == 0) return 0;
+	*value = strtod(buf, &stop);
+	return *stop == 0;
+}
+
+static int skip_value(json_in *in);
+
+// Call member with each key of an object, positioned at its value, which it
+// must consume
+static int read_object(json_in *in, int (*member)(json_in *in, const char *key, void *ctx), void *ctx)
+{
+	char key[BENCH_NAME_MAX * 2];
+	if (!expect(in, '{') || ++in->depth > JSON_MAX_DEPTH) return 0;
+	skip_space(in);
+	if (in->p < in->end && *in->p == '}') {
+		in->p++;
+		in->depth--;
+		return 1;
+	}
+	do {
+		if (!read_string(in, key, sizeof(key)) || !expect(in, ':')) return 0;
+		if (!(member ? member(in, key, ctx) : skip_value(in))) return 0;
+	} while (expect(in, ','));
+	in->depth--;
+	return expect(in, '}');
+}
+
+static int skip_value(json_in *in)
+{
+	double d;
+	skip_space(in);
+	if (in->p >= in->end) return 0;
+	switch (*in->p) {
+		case '{':
+			return read_object(in, NULL, NULL);
+		case '[':
+			in->p++;
+			if (++in->depth > JSON_MAX_DEPTH) return 0;
+			skip_space(in);
+			if (in->p < in->end && *in->p == ']') {
+				in->p++;
+			} else {
+				do {
+					if (!skip_value(in)) return 0;
+				} while (expect(in, ','));
+				if (!expect(in, ']')) return 0;
+			}
+			in->depth--;
+			return 1;
+		case '"':
+			return read_string(in, NULL, 0);
+		case 't':
+		case 'f':
+		case 'n': {
+			static const char *words[] = { "true", "false", "null" };
+			size_t k;
+			for (k = 0; k < 3; k++) {
+				size_t len = strlen(words[k]);
+				if ((size_t)(in->end - in->p) >= len && memcmp(in->p, words[k], len) == 0) {
+					in->p += len;
+					return 1;
+				}
+			}
+			return 0;
+		}
+		default:
+			return read_number(in, &d);
+	}
+}
+
+static int case_member(json_in *in, const char *key, void *ctx)
+{
+	bench_case *c = ctx;
+	double v;
+	if (strcmp(key, "seconds") == 0) return read_number(in, &c->seconds);
+	if (strcmp(key, "requests") != 0 && strcmp(key, "bytes") != 0 && strcmp(key, "items") != 0) return skip_value(in);
+	if (!read_number(in, &v) || v < 0) return 0;
+	if (strcmp(key, "requests") == 0) c->requests = (uint64_t)v;
+	else if (strcmp(key, "bytes") == 0) c->bytes = (uint64_t)v;
+	else c->items = (uint64_t)v;
+	return 1;
+}
+
+static int results_member(json_in *in, const char *key, void *ctx)
+{
+	bench_results *r = ctx;
+	bench_case c;
+	memset(&c, 0, sizeof(c));
+	if (!read_object(in, case_member, &c)) return 0;
+	return bench_results_add(r, key, c.seconds, c.requests, c.bytes, c.items);
+}
+
+static int settings_member(json_in *in, const char *key, void *ctx)
+{
+	bench_results *r = ctx;
+	double v;
+	if (strcmp(key, "latency_ms") == 0) return read_number(in, &r->latency_ms);
+	if (strcmp(key, "bandwidth_mbs") == 0) return read_number(in, &r->bandwidth_mbs);
+	if (strcmp(key, "scale") == 0) return read_number(in, &r->scale);
+	if (strcmp(key, "connections") != 0) return skip_value(in);
+	if (!read_number(in, &v) || v < 0) return 0;
+	r->connections = (unsigned)v;
+	return 1;
+}
+
+static int top_member(json_in *in, const char *key, void *ctx)
+{
+	bench_results *r = ctx;
+	if (strcmp(key, "driver") == 0) return read_string(in, r->driver, sizeof(r->driver));
+	if (strcmp(key, "settings") == 0) return read_object(in, settings_member, r);
+	if (strcmp(key, "results") == 0) return read_object(in, results_member, r);
+	return skip_value(in);
+}
+
+int bench_results_load(const char *path, bench_results *r)
+{
+	FILE *f = fopen(path, "r");
+	if (!f) return errno;
+	char *buf = NULL;
+	size_t len = 0, cap = 0;
+	for (;;) {
+		if (len == cap) {
+			char *more = realloc(buf, cap = cap ? cap * 2 : 4096);
+			if (!more) {
+				free(buf);
+				fclose(f);
+				return ENOMEM;
+			}
+			buf = more;
+		}
+		size_t n = fread(buf + len, 1, cap - len, f);
+		if (n == 0) break;
+		len += n;
+	}
+	int bad = ferror(f);
+	fclose(f);
+	if (bad) {
+		free(buf);
+		return EIO;
+	}
+
+	json_in in = { buf, buf + len, 0 };
+	memset(r, 0, sizeof(*r));
+	int ok = read_object(&in, top_member, r);
+	skip_space(&in);
+	free(buf);
+	return ok && in.p == in.end ? 0 : EINVAL;
+}
+
+#pragma mark reporting
+
+unsigned bench_results_report(FILE *f, const bench_results *r, const bench_results *baseline, double tolerance)
+{
+	unsigned regressed = 0;
+	size_t i;
+	fprintf(f, "%-18s %9s %9s %9s %9s %10s %9s\n", "case", "seconds", "requests", "items", "MB/s", "baseline", "change");
+	for (i = 0; i < r->count; i++) {
+		const bench_case *c = &r->cases[i];
+		double mbs = c->seconds > 0 ? c->bytes / c->seconds / 1e6 : 0;
+		fprintf(f, "%-18s %9.3f %9llu %9llu %9.1f", c->name, c->seconds, (unsigned long long)c->requests,
+				(unsigned long long)c->items, mbs);
+
+		const bench_case *b = baseline ? bench_results_find(baseline, c->name) : NULL;
+		if (b) {
+			// a change of under 10ms is noise, however many percent it is
+			int slower = c->seconds > b->seconds * (1 + tolerance) && c->seconds - b->seconds > 0.01;
+			int chattier = c->requests > b->requests * (1 + tolerance);
+			fprintf(f, " %10.3f %+8.1f%%%s", b->seconds, b->seconds > 0 ? (c->seconds - b->seconds) * 100 / b->seconds : 0.0,
+					chattier ? "  REGRESSED (requests)" : slower ? "  REGRESSED" : "");
+			if (slower || chattier) regressed++;
+		}
+		fprintf(f, "\n");
+	}
+	return regressed;
+}
@@ -0,0 +1,73 @@
+//
+//  bench_results.h
+//  mobileDeviceManager
+//
+//  The results of a benchmark run - the time, requests and bytes of each case,
+//  and the settings of the simulated link they were measured over - saved as
+//  JSON and compared with an earlier run.  Both benchmarks use it: -o bench in
+//  the tool, and the plain C bench driver (Bench/bench.c) that builds and runs
+//  anywhere, so a baseline can be checked on a machine with no Xcode.
+//
+//  The JSON is a single object:
+//      { "driver": "bench",
+//        "settings": { "latency_ms": 1, "bandwidth_mbs": 30, "scale": 1, "connections": 1 },
+//        "results": { "storm.push": { "seconds": 0.5, "requests": 2150, "bytes": 4358872, "items": 1071 }, ... } }
+//
+
+#ifndef BENCH_RESULTS_H
+#define BENCH_RESULTS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BENCH_MAX_CASES		16
+#define BENCH_NAME_MAX		32
+
+typedef struct bench_case {
+	char		name[BENCH_NAME_MAX];
+	double		seconds;
+	uint64_t	requests, bytes, items;
+} bench_case;
+
+typedef struct bench_results {
+	char		driver[BENCH_NAME_MAX];		// what measured them: "mobileDeviceManager" or "bench"
+	double		latency_ms, bandwidth_mbs, scale;
+	unsigned	connections;
+	size_t		count;
+	bench_case	cases[BENCH_MAX_CASES];
+} bench_results;
+
+/// Add a case.  Returns 0 if there is no room for it.
+int bench_results_add(bench_results *results, const char *name, double seconds,
+					  uint64_t requests, uint64_t bytes, uint64_t items);
+
+/// The case called \p name, or NULL.
+const bench_case *bench_results_find(const bench_results *results, const char *name);
+
+/// Returns 1 if both were measured by the same driver over the same link.
+int bench_results_comparable(const bench_results *a, const bench_results *b);
+
+/// Write \p results to \p path as JSON.  Returns 0, or an errno value.
+int bench_results_save(const bench_results *results, const char *path);
+
+/// Read what bench_results_save() wrote.  Returns 0, an errno value if \p path
+/// can't be read, or EINVAL if it isn't JSON of that shape.
+int bench_results_load(const char *path, bench_results *results);
+
+/// Print a line per case to \p f - its time, requests, items and throughput,
+/// and against \p baseline (if not NULL) how much it changed.  A case whose time
+/// has grown by more than \p tolerance (a fraction) and 10ms, or whose requests
+/// have grown by more than \p tolerance, has regressed.  Returns the number of
+/// cases which regressed.
+unsigned bench_results_report(FILE *f, const bench_results *results, const bench_results *baseline,
+							  double tolerance);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
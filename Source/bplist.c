@@ -0,0 +1,722 @@
+//
+//  bplist.c
+//  mobileDeviceManager
+//
+//  See bplist.h.  The layout of a bplist00 file is
+//
+//		"bplist00"
+//		objects, each a marker byte (type in the high nibble, size or length in
+//			the low nibble) followed by its payload
+//		offset table - one big-endian offset per object
+//		32 byte trailer - offset and reference widths, object count, root
+//			object and where the offset table starts
+//
+//  Containers hold object numbers (indexes into the offset table) rather than
+//  offsets, so objects can be shared.
+//
+
+#include "bplist.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define BPLIST_BLOCK_SIZE		(64*1024)
+#define BPLIST_MAX_DEPTH		512
+
+struct bplist_block {
+	bplist_block	*next;
+	size_t			used;
+	size_t			size;
+	// followed by size bytes
+};
+
+void *bplist_alloc(bplist_arena *arena, size_t size)
+{
+	bplist_block *b = arena->blocks;
+
+	size = (size + 7) & ~(size_t)7;
+	if (!b || b->size - b->used < size) {
+		size_t want = size > BPLIST_BLOCK_SIZE ? size : BPLIST_BLOCK_SIZE;
+		b = malloc(sizeof(*b) + want);
+		if (!b) return NULL;
+		b->used = 0;
+		b->size = want;
+		if (arena->blocks && size > BPLIST_BLOCK_SIZE) {
+			// an outsized allocation - keep filling the current block afterwards
+			b->next = arena->blocks->next;
+			arena->blocks->next = b;
+		} else {
+			b->next = arena->blocks;
+			arena->blocks = b;
+		}
+	}
+	void *p = (char*)(b + 1) + b->used;
+	b->used += size;
+	return p;
+}
+
+void bplist_arena_free(bplist_arena *arena)
+{
+	while (arena->blocks) {
+		bplist_block *next = arena->blocks->next;
+		free(arena->blocks);
+		arena->blocks = next;
+	}
+}
+
+bplist_node *bplist_new(bplist_arena *arena, bplist_type type)
+{
+	bplist_node *n = bplist_alloc(arena, sizeof(*n));
+	if (n) {
+		memset(n, 0, sizeof(*n));
+		n->type = type;
+	}
+	return n;
+}
+
+bplist_node *bplist_new_int(bplist_arena *arena, int64_t value)
+{
+	bplist_node *n = bplist_new(arena, BPLIST_INT);
+	if (n) n->v.integer = value;
+	return n;
+}
+
+bplist_node *bplist_new_string(bplist_arena *arena, const char *utf8, size_t len)
+{
+	bplist_node *n = bplist_new(arena, BPLIST_STRING);
+	char *s = bplist_alloc(arena, len + 1);
+	if (!n || !s) return NULL;
+	memcpy(s, utf8, len);
+	s[len] = 0;
+	n->v.string = s;
+	n->count = len;
+	return n;
+}
+
+bplist_node *bplist_new_container(bplist_arena *arena, bplist_type type, size_t count)
+{
+	bplist_node *n = bplist_new(arena, type);
+	size_t slots = type == BPLIST_DICT ? count * 2 : count;
+	if (!n) return NULL;
+	if (slots > SIZE_MAX / sizeof(bplist_node*)) return NULL;
+	n->v.items = bplist_alloc(arena, slots * sizeof(bplist_node*));
+	if (!n->v.items) return NULL;
+	memset(n->v.items, 0, slots * sizeof(bplist_node*));
+	n->count = count;
+	return n;
+}
+
+const bplist_node *bplist_dict_get(const bplist_node *dict, const char *key)
+{
+	size_t i, len = strlen(key);
+
+	if (!dict || dict->type != BPLIST_DICT) return NULL;
+	for (i = 0; i < dict->count; i++) {
+		const bplist_node *k = dict->v.items[i];
+		if (k->type == BPLIST_STRING && k->count == len && memcmp(k->v.string, key, len) == 0)
+			return dict->v.items[dict->count + i];
+	}
+	return NULL;
+}
+
+int bplist_is_binary(const void *buf, size_t len)
+{
+	return len >= 8 && memcmp(buf, "bplist00", 8) == 0;
+}
+
+#pragma mark decoding
+
+typedef struct {
+	const uint8_t	*buf;
+	size_t			len;
+	uint64_t		table;			// where the offset table starts
+	unsigned		offset_size;
+	unsigned		ref_size;
+	uint64_t		count;
+	bplist_node		**done;			// objects decoded so far, by number
+	uint8_t			*busy;			// objects being decoded, to catch cycles
+	bplist_arena	*arena;
+} bplist_reader;
+
+static uint64_t be_uint(const uint8_t *p, unsigned width)
+{
+	uint64_t v = 0;
+	while (width--) v = (v << 8) | *p++;
+	return v;
+}
+
+static double be_real(const uint8_t *p, unsigned width)
+{
+	if (width == 4) {
+		uint32_t u = (uint32_t)be_uint(p, 4);
+		float f;
+		memcpy(&f, &u, sizeof(f));
+		return f;
+	} else {
+		uint64_t u = be_uint(p, 8);
+		double d;
+		memcpy(&d, &u, sizeof(d));
+		return d;
+	}
+}
+
+// Read the length of a variable sized object at *pos, which is either the low
+// nibble of the marker or, if that is 0xF, an integer object following it.
+static int read_length(bplist_reader *r, uint64_t *pos, uint64_t *length)
+{
+	uint8_t marker = r->buf[*pos];
+
+	(*pos)++;
+	if ((marker & 0x0F) != 0x0F) {
+		*length = marker & 0x0F;
+		return 1;
+	}
+	if (*pos >= r->table) return 0;
+	marker = r->buf[*pos];
+	if ((marker & 0xF0) != 0x10 || (marker & 0x0F) > 3) return 0;
+	unsigned width = 1u << (marker & 0x0F);
+	(*pos)++;
+	if (*pos + width > r->table) return 0;
+	*length = be_uint(r->buf + *pos, width);
+	*pos += width;
+	return 1;
+}
+
+static size_t utf16_to_utf8(const uint8_t *in, size_t chars, char *out)
+{
+	char *o = out;
+	size_t i;
+
+	for (i = 0; i < chars; i++) {
+		uint32_t c = (uint32_t)in[2*i] << 8 | in[2*i+1];
+		if (c >= 0xD800 && c < 0xDC00 && i+1 < chars) {
+			uint32_t lo = (uint32_t)in[2*i+2] << 8 | in[2*i+3];
+			if (lo >= 0xDC00 && lo < 0xE000) {
+				c = 0x10000 + ((c - 0xD800) << 10) + (lo - 0xDC00);
+				i++;
+			}
+		}
+		if (c < 0x80) {
+			*o++ = (char)c;
+		} else if (c < 0x800) {
+			*o++ = (char)(0xC0 | c >> 6);
+			*o++ = (char)(0x80 | (c & 0x3F));
+		} else if (c < 0x10000) {
+			*o++ = (char)(0xE0 | c >> 12);
+			*o++ = (char)(0x80 | (c >> 6 & 0x3F));
+			*o++ = (char)(0x80 | (c & 0x3F));
+		} else {
+			*o++ = (char)(0xF0 | c >> 18);
+			*o++ = (char)(0x80 | (c >> 12 & 0x3F));
+			*o++ = (char)(0x80 | (c >> 6 & 0x3F));
+			*o++ = (char)(0x80 | (c & 0x3F));
+		}
+	}
+	*o = 0;
+	return o - out;
+}
+
+static bplist_node *read_object(bplist_reader *r, uint64_t num, unsigned depth);
+
+static bplist_node *read_ref(bplist_reader *r, const uint8_t *p, unsigned depth)
+{
+	return read_object(r, be_uint(p, r->ref_size), depth);
+}
+
+static bplist_node *read_object(bplist_reader *r, uint64_t num, unsigned depth)
+{
+	if (num >= r->count || depth > BPLIST_MAX_DEPTH) return NULL;
+	if (r->done[num]) return r->done[num];
+	if (r->busy[num]) return NULL;
+
+	uint64_t pos = be_uint(r->buf + r->table + num * r->offset_size, r->offset_size);
+	if (pos < 8 || pos >= r->table) return NULL;
+
+	uint8_t marker = r->buf[pos];
+	uint64_t length, i;
+	bplist_node *n = NULL;
+	unsigned width;
+
+	r->busy[num] = 1;
+	switch (marker >> 4) {
+		case 0x0:
+			if (marker == 0x00) {
+				n = bplist_new(r->arena, BPLIST_NULL);
+			} else if (marker == 0x08 || marker == 0x09) {
+				if ((n = bplist_new(r->arena, BPLIST_BOOL))) n->v.integer = marker & 1;
+			}
+			break;
+		case 0x1:
+			// 1, 2 and 4 byte integers are unsigned, 8 bytes signed; of a
+			// 16 byte integer we keep the low 64 bits.
+			width = 1u << (marker & 0x0F);
+			if (width > 16 || pos + 1 + width > r->table) break;
+			if (width == 16)
+				n = bplist_new_int(r->arena, (int64_t)be_uint(r->buf + pos + 9, 8));
+			else
+				n = bplist_new_int(r->arena, (int64_t)be_uint(r->buf + pos + 1, width));
+			break;
+		case 0x2:
+		case 0x3:
+			width = 1u << (marker & 0x0F);
+			if (marker >> 4 == 0x3 && width != 8) break;
+			if ((width != 4 && width != 8) || pos + 1 + width > r->table) break;
+			if ((n = bplist_new(r->arena, marker >> 4 == 0x2 ? BPLIST_REAL : BPLIST_DATE)))
+				n->v.real = be_real(r->buf + pos + 1, width);
+			break;
+		case 0x4:
+			if (!read_length(r, &pos, &length) || length > r->table - pos) break;
+			if ((n = bplist_new(r->arena, BPLIST_DATA))) {
+				n->v.data = r->buf + pos;
+				n->count = (size_t)length;
+			}
+			break;
+		case 0x5:
+			if (!read_length(r, &pos, &length) || length > r->table - pos) break;
+			n = bplist_new_string(r->arena, (const char*)r->buf + pos, (size_t)length);
+			break;
+		case 0x6: {
+			if (!read_length(r, &pos, &length) || length > (r->table - pos) / 2) break;
+			char *s = bplist_alloc(r->arena, (size_t)length * 3 + 1);
+			if (!s || !(n = bplist_new(r->arena, BPLIST_STRING))) break;
+			n->count = utf16_to_utf8(r->buf + pos, (size_t)length, s);
+			n->v.string = s;
+			break;
+		}
+		case 0x8:
+			width = (marker & 0x0F) + 1;
+			if (width > 8 || pos + 1 + width > r->table) break;
+			if ((n = bplist_new(r->arena, BPLIST_UID)))
+				n->v.integer = (int64_t)be_uint(r->buf + pos + 1, width);
+			break;
+		case 0xA:
+		case 0xD: {
+			bplist_type type = marker >> 4 == 0xA ? BPLIST_ARRAY : BPLIST_DICT;
+			uint64_t slots;
+			if (!read_length(r, &pos, &length)) break;
+			slots = type == BPLIST_DICT ? length * 2 : length;
+			// every slot is a ref in the buffer, which bounds what is allocated;
+			// the same object may be referred to any number of times
+			if (length > SIZE_MAX / 2 || slots > (r->table - pos) / r->ref_size) break;
+			if (!(n = bplist_new_container(r->arena, type, (size_t)length))) break;
+			for (i = 0; i < slots; i++) {
+				const uint8_t *ref = r->buf + pos + i * r->ref_size;
+				if (!(n->v.items[i] = read_ref(r, ref, depth + 1))) {
+					n = NULL;
+					break;
+				}
+			}
+			break;
+		}
+		default:
+			break;
+	}
+	r->busy[num] = 0;
+	r->done[num] = n;
+	return n;
+}
+
+bplist_node *bplist_decode(const void *buf, size_t len, bplist_arena *arena)
+{
+	bplist_reader r;
+	const uint8_t *trailer;
+	bplist_node *root;
+	uint64_t top;
+
+	if (len < 8 + 32 || !bplist_is_binary(buf, len)) return NULL;
+
+	memset(&r, 0, sizeof(r));
+	r.buf = buf;
+	r.len = len;
+	r.arena = arena;
+
+	trailer = r.buf + len - 32;
+	r.offset_size = trailer[6];
+	r.ref_size = trailer[7];
+	r.count = be_uint(trailer + 8, 8);
+	top = be_uint(trailer + 16, 8);
+	r.table = be_uint(trailer + 24, 8);
+
+	if (r.offset_size < 1 || r.offset_size > 8 || r.ref_size < 1 || r.ref_size > 8) return NULL;
+	if (r.count == 0 || top >= r.count || r.table < 8 || r.table > len - 32) return NULL;
+	if (r.count > (len - 32 - r.table) / r.offset_size) return NULL;
+
+	r.done = calloc((size_t)r.count, sizeof(bplist_node*));
+	r.busy = calloc((size_t)r.count, 1);
+	root = r.done && r.busy ? read_object(&r, top, 0) : NULL;
+	free(r.done);
+	free(r.busy);
+	return root;
+}
+
+#pragma mark encoding
+
+typedef struct {
+	const bplist_node	*node;
+	size_t				refs;			// containers: where their children's numbers start
+} bplist_object;
+
+typedef struct {
+	uint32_t			num;			// object number + 1, 0 if the slot is free
+	uint32_t			hash;
+} bplist_slot;
+
+typedef struct {
+	uint8_t				*buf;
+	size_t				len;
+	size_t				cap;
+	int					failed;
+
+	// every distinct object, in object number order
+	bplist_object		*objects;
+	size_t				count;
+
+	// the object numbers of every container's children, consecutively
+	uint64_t			*refs;
+	size_t				refs_used;
+
+	// scalar contents -> object number, so equal values are written once
+	bplist_slot			*values;
+	size_t				table_size;		// a power of two
+} bplist_writer;
+
+static uint32_t hash_bytes(uint32_t h, const void *p, size_t len)
+{
+	const uint8_t *b = p;
+	while (len--) h = (h ^ *b++) * 0x01000193;
+	return h;
+}
+
+static uint32_t hash_value(const bplist_node *n)
+{
+	uint32_t h = hash_bytes(0x811c9dc5, &n->type, sizeof(n->type));
+	switch (n->type) {
+		case BPLIST_STRING:
+		case BPLIST_DATA:
+			return hash_bytes(h, n->v.data, n->count);
+		case BPLIST_REAL:
+		case BPLIST_DATE:
+			return hash_bytes(h, &n->v.real, sizeof(n->v.real));
+		default:
+			return hash_bytes(h, &n->v.integer, sizeof(n->v.integer));
+	}
+}
+
+static int same_value(const bplist_node *a, const bplist_node *b)
+{
+	if (a->type != b->type) return 0;
+	switch (a->type) {
+		case BPLIST_STRING:
+		case BPLIST_DATA:
+			return a->count == b->count && memcmp(a->v.data, b->v.data, a->count) == 0;
+		case BPLIST_REAL:
+		case BPLIST_DATE:
+			return memcmp(&a->v.real, &b->v.real, sizeof(a->v.real)) == 0;
+		default:
+			return a->v.integer == b->v.integer;
+	}
+}
+
+static bplist_slot *find_value(bplist_writer *w, const bplist_node *n, uint32_t h)
+{
+	size_t i = h & (w->table_size - 1);
+	while (w->values[i].num) {
+		if (w->values[i].hash == h && same_value(w->objects[w->values[i].num - 1].node, n)) break;
+		i = (i + 1) & (w->table_size - 1);
+	}
+	return &w->values[i];
+}
+
+// Count the nodes and container slots in the tree, so everything can be sized
+// once up front.  Returns 0 if the tree is too deep or has a hole in it.
+static int count_nodes(const bplist_node *n, unsigned depth, size_t *nodes, size_t *refs)
+{
+	size_t i, slots;
+
+	if (!n || depth > BPLIST_MAX_DEPTH) return 0;
+	(*nodes)++;
+	if (n->type == BPLIST_ARRAY || n->type == BPLIST_DICT) {
+		slots = n->type == BPLIST_DICT ? n->count * 2 : n->count;
+		*refs += slots;
+		for (i = 0; i < slots; i++) {
+			if (!count_nodes(n->v.items[i], depth + 1, nodes, refs)) return 0;
+		}
+	}
+	return 1;
+}
+
+// Give every distinct object in the tree a number, and return it.  Containers
+// are numbered before their contents, so the root is object 0.  A subtree that
+// is referenced twice is written twice.
+static uint64_t number_objects(bplist_writer *w, const bplist_node *n)
+{
+	bplist_slot *v = NULL;
+	uint32_t h = 0;
+	size_t i, slots, num = w->count;
+
+	if (n->type != BPLIST_ARRAY && n->type != BPLIST_DICT) {
+		h = hash_value(n);
+		v = find_value(w, n, h);
+		if (v->num) return v->num - 1;
+		v->num = (uint32_t)num + 1;
+		v->hash = h;
+	}
+
+	w->objects[num].node = n;
+	w->objects[num].refs = w->refs_used;
+	w->count++;
+
+	if (!v) {
+		size_t refs = w->refs_used;
+		slots = n->type == BPLIST_DICT ? n->count * 2 : n->count;
+		w->refs_used += slots;
+		for (i = 0; i < slots; i++) w->refs[refs + i] = number_objects(w, n->v.items[i]);
+	}
+	return num;
+}
+
+static uint8_t *reserve(bplist_writer *w, size_t len)
+{
+	if (w->failed) return NULL;
+	if (w->cap - w->len < len) {
+		size_t cap = w->cap ? w->cap : 4096;
+		while (cap - w->len < len) cap *= 2;
+		uint8_t *buf = realloc(w->buf, cap);
+		if (!buf) {
+			w->failed = 1;
+			return NULL;
+		}
+		w->buf = buf;
+		w->cap = cap;
+	}
+	uint8_t *p = w->buf + w->len;
+	w->len += len;
+	return p;
+}
+
+static void put_be(uint8_t *p, uint64_t v, unsigned width)
+{
+	while (width--) {
+		p[width] = (uint8_t)v;
+		v >>= 8;
+	}
+}
+
+static unsigned width_for(uint64_t v)
+{
+	if (v <= 0xFF) return 1;
+	if (v <= 0xFFFF) return 2;
+	if (v <= 0xFFFFFFFFULL) return 4;
+	return 8;
+}
+
+static void write_int(bplist_writer *w, int64_t value)
+{
+	// negative numbers are always written as 8 bytes, which is signed
+	unsigned width = value < 0 ? 8 : width_for((uint64_t)value);
+	uint8_t *p = reserve(w, 1 + width);
+	if (!p) return;
+	p[0] = 0x10 | (width == 1 ? 0 : width == 2 ? 1 : width == 4 ? 2 : 3);
+	put_be(p + 1, (uint64_t)value, width);
+}
+
+static void write_marker(bplist_writer *w, uint8_t type, size_t length)
+{
+	uint8_t *p;
+	if (length < 15) {
+		if ((p = reserve(w, 1))) p[0] = type | (uint8_t)length;
+	} else {
+		if ((p = reserve(w, 1))) p[0] = type | 0x0F;
+		write_int(w, (int64_t)length);
+	}
+}
+
+static void write_real(bplist_writer *w, uint8_t marker, double d)
+{
+	uint8_t *p = reserve(w, 9);
+	uint64_t u;
+	if (!p) return;
+	memcpy(&u, &d, sizeof(u));
+	p[0] = marker;
+	put_be(p + 1, u, 8);
+}
+
+// Returns the number of UTF-16 units needed for \p s, or 0 if it is plain ASCII
+// (which is written as is).  Malformed UTF-8 is taken a byte at a time.
+static size_t utf16_length(const uint8_t *s, size_t len)
+{
+	size_t i = 0, units = 0;
+	int ascii = 1;
+
+	while (i < len) {
+		uint8_t c = s[i];
+		if (c < 0x80) {
+			i++;
+		} else if ((c & 0xE0) == 0xC0 && i + 1 < len) {
+			i += 2;
+			ascii = 0;
+		} else if ((c & 0xF0) == 0xE0 && i + 2 < len) {
+			i += 3;
+			ascii = 0;
+		} else if ((c & 0xF8) == 0xF0 && i + 3 < len) {
+			i += 4;
+			units++;			// surrogate pair
+			ascii = 0;
+		} else {
+			i++;
+			ascii = 0;
+		}
+		units++;
+	}
+	return ascii ? 0 : units;
+}
+
+static void write_utf16(uint8_t *out, const uint8_t *s, size_t len)
+{
+	size_t i = 0;
+
+	while (i < len) {
+		uint32_t c = s[i];
+		if (c < 0x80) {
+			i++;
+		} else if ((c & 0xE0) == 0xC0 && i + 1 < len) {
+			c = (c & 0x1F) << 6 | (s[i+1] & 0x3F);
+			i += 2;
+		} else if ((c & 0xF0) == 0xE0 && i + 2 < len) {
+			c = (c & 0x0F) << 12 | (s[i+1] & 0x3F) << 6 | (s[i+2] & 0x3F);
+			i += 3;
+		} else if ((c & 0xF8) == 0xF0 && i + 3 < len) {
+			c = (c & 0x07) << 18 | (s[i+1] & 0x3F) << 12 | (s[i+2] & 0x3F) << 6 | (s[i+3] & 0x3F);
+			i += 4;
+		} else {
+			c = 0xFFFD;
+			i++;
+		}
+		if (c >= 0x10000) {
+			c -= 0x10000;
+			put_be(out, 0xD800 | (c >> 10), 2);
+			put_be(out + 2, 0xDC00 | (c & 0x3FF), 2);
+			out += 4;
+		} else {
+			put_be(out, c, 2);
+			out += 2;
+		}
+	}
+}
+
+static void write_object(bplist_writer *w, const bplist_object *o, unsigned ref_size)
+{
+	const bplist_node *n = o->node;
+	const uint64_t *refs = w->refs + o->refs;
+	uint8_t *p;
+	size_t i, slots, units;
+
+	switch (n->type) {
+		case BPLIST_NULL:
+			if ((p = reserve(w, 1))) p[0] = 0x00;
+			break;
+		case BPLIST_BOOL:
+			if ((p = reserve(w, 1))) p[0] = n->v.integer ? 0x09 : 0x08;
+			break;
+		case BPLIST_INT:
+			write_int(w, n->v.integer);
+			break;
+		case BPLIST_REAL:
+			write_real(w, 0x23, n->v.real);
+			break;
+		case BPLIST_DATE:
+			write_real(w, 0x33, n->v.real);
+			break;
+		case BPLIST_UID: {
+			unsigned width = width_for((uint64_t)n->v.integer);
+			if ((p = reserve(w, 1 + width))) {
+				p[0] = 0x80 | (uint8_t)(width - 1);
+				put_be(p + 1, (uint64_t)n->v.integer, width);
+			}
+			break;
+		}
+		case BPLIST_DATA:
+			write_marker(w, 0x40, n->count);
+			if ((p = reserve(w, n->count))) memcpy(p, n->v.data, n->count);
+			break;
+		case BPLIST_STRING:
+			units = utf16_length((const uint8_t*)n->v.string, n->count);
+			if (units == 0) {
+				write_marker(w, 0x50, n->count);
+				if ((p = reserve(w, n->count))) memcpy(p, n->v.string, n->count);
+			} else {
+				write_marker(w, 0x60, units);
+				if ((p = reserve(w, units * 2))) write_utf16(p, (const uint8_t*)n->v.string, n->count);
+			}
+			break;
+		case BPLIST_ARRAY:
+		case BPLIST_DICT:
+			write_marker(w, n->type == BPLIST_ARRAY ? 0xA0 : 0xD0, n->count);
+			slots = n->type == BPLIST_DICT ? n->count * 2 : n->count;
+			if ((p = reserve(w, slots * ref_size))) {
+				for (i = 0; i < slots; i++) put_be(p + i * ref_size, refs[i], ref_size);
+			}
+			break;
+	}
+}
+
+int bplist_encode(const bplist_node *root, uint8_t **out, size_t *outlen)
+{
+	bplist_writer w;
+	uint64_t *offsets = NULL;
+	unsigned ref_size, offset_size;
+	size_t i, table, nodes = 0, refs = 0;
+	uint8_t *p;
+	int rc = -1;
+
+	memset(&w, 0, sizeof(w));
+	if (!count_nodes(root, 0, &nodes, &refs) || nodes > UINT32_MAX - 1) goto done;
+
+	// keep the value table under half full
+	w.table_size = 256;
+	while (w.table_size / 2 <= nodes) w.table_size *= 2;
+	w.values = calloc(w.table_size, sizeof(bplist_slot));
+	w.objects = malloc(nodes * sizeof(bplist_object));
+	w.refs = malloc((refs ? refs : 1) * sizeof(uint64_t));
+	if (!w.values || !w.objects || !w.refs) goto done;
+
+	number_objects(&w, root);
+	free(w.values);
+	w.values = NULL;
+	if (!(offsets = malloc(w.count * sizeof(*offsets)))) goto done;
+
+	ref_size = width_for(w.count - 1);
+	if ((p = reserve(&w, 8))) memcpy(p, "bplist00", 8);
+	for (i = 0; i < w.count; i++) {
+		offsets[i] = w.len;
+		write_object(&w, &w.objects[i], ref_size);
+	}
+
+	table = w.len;
+	offset_size = width_for(table);
+	if ((p = reserve(&w, w.count * offset_size))) {
+		for (i = 0; i < w.count; i++) put_be(p + i * offset_size, offsets[i], offset_size);
+	}
+	if ((p = reserve(&w, 32))) {
+		memset(p, 0, 6);
+		p[6] = (uint8_t)offset_size;
+		p[7] = (uint8_t)ref_size;
+		put_be(p + 8, w.count, 8);
+		put_be(p + 16, 0, 8);			// the root is always object 0
+		put_be(p + 24, table, 8);
+	}
+	if (!w.failed) {
+		*out = w.buf;
+		*outlen = w.len;
+		w.buf = NULL;
+		rc = 0;
+	}
+
+done:
+	free(offsets);
+	free(w.buf);
+	free(w.objects);
+	free(w.refs);
+	free(w.values);
+	return rc;
+}
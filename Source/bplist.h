@@ -0,0 +1,88 @@
+//
+//  bplist.h
+//  mobileDeviceManager
+//
+//  A small, self-contained reader and writer for Apple's binary property list
+//  format ("bplist00").  It has no dependency on CoreFoundation, so it can be
+//  built and exercised anywhere.
+//
+//  Decoded property lists are trees of bplist_node allocated from an arena;
+//  everything is released in one go with bplist_arena_free().  Data nodes point
+//  straight into the buffer they were decoded from, so that buffer must outlive
+//  the tree.
+//
+
+#ifndef BPLIST_H
+#define BPLIST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+	BPLIST_NULL,
+	BPLIST_BOOL,		// v.integer is 0 or 1
+	BPLIST_INT,			// v.integer
+	BPLIST_REAL,		// v.real
+	BPLIST_DATE,		// v.real, seconds since 1 Jan 2001 GMT
+	BPLIST_DATA,		// v.data, count bytes
+	BPLIST_STRING,		// v.string, UTF-8, count bytes (plus a terminating NUL)
+	BPLIST_UID,			// v.integer (keyed archiver object references)
+	BPLIST_ARRAY,		// v.items, count nodes
+	BPLIST_DICT			// v.items, count keys followed by count values
+} bplist_type;
+
+typedef struct bplist_node bplist_node;
+struct bplist_node {
+	bplist_type		type;
+	size_t			count;
+	union {
+		int64_t				integer;
+		double				real;
+		const char			*string;
+		const uint8_t		*data;
+		bplist_node			**items;
+	} v;
+};
+
+typedef struct bplist_block bplist_block;
+
+typedef struct bplist_arena {
+	bplist_block	*blocks;
+} bplist_arena;
+
+/// Allocate \p size bytes from \p arena.  Returns NULL if out of memory.
+void *bplist_alloc(bplist_arena *arena, size_t size);
+
+/// Release everything allocated from \p arena.  The arena itself may be reused.
+void bplist_arena_free(bplist_arena *arena);
+
+/// Returns 1 if \p buf starts with the bplist00 magic.
+int bplist_is_binary(const void *buf, size_t len);
+
+/// Decode a binary property list.  Returns the root node, or NULL if the buffer
+/// is not a well-formed bplist00 (truncated, bad offsets, reference cycles...).
+bplist_node *bplist_decode(const void *buf, size_t len, bplist_arena *arena);
+
+/// Encode the tree rooted at \p root.  Equal strings, numbers and data are
+/// written once and shared.  On success returns 0 and stores a malloc()ed buffer
+/// in \p out (which the caller must free) and its length in \p outlen.
+int bplist_encode(const bplist_node *root, uint8_t **out, size_t *outlen);
+
+// helpers for building trees to encode
+bplist_node *bplist_new(bplist_arena *arena, bplist_type type);
+bplist_node *bplist_new_int(bplist_arena *arena, int64_t value);
+bplist_node *bplist_new_string(bplist_arena *arena, const char *utf8, size_t len);
+bplist_node *bplist_new_container(bplist_arena *arena, bplist_type type, size_t count);
+
+/// Look up \p key in a dictionary node.  Returns NULL if it isn't there.
+const bplist_node *bplist_dict_get(const bplist_node *dict, const char *key);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
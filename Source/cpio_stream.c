@@ -0,0 +1,464 @@
+//
+//  cpio_stream.c
+//  mobileDeviceManager
+//
+//  See cpio_stream.h.
+//
+
+#include "cpio_stream.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define INFLATE_BUFFER	(256*1024)
+#define MAGIC_SIZE		6
+#define ODC_HEADER		76
+#define NEWC_HEADER		110
+#define MAX_NAME		(64*1024)
+#define TRAILER			"TRAILER!!!"
+
+enum { ST_HEADER, ST_NAME, ST_DATA, ST_SKIP, ST_DONE, ST_FAILED };
+
+struct cpio_stream {
+	cpio_callbacks	cb;
+	void			*ctx;
+	int				state;
+	int				compressed;			// -1 until the first byte is seen
+	z_stream		z;
+	int				z_live;
+	unsigned char	*out;				// inflated bytes
+
+	unsigned char	header[NEWC_HEADER];
+	size_t			header_len, header_need;
+	int				newc;
+
+	char			*name;
+	size_t			name_len, name_need, name_cap;
+	size_t			name_size;			// from the header, including the nul
+
+	uint64_t		remaining;			// of the current state
+	unsigned		data_pad;			// after the entry's contents
+	cpio_entry		entry;
+	char			error[128];
+};
+
+static int fail(cpio_stream *s, const char *why)
+{
+	snprintf(s->error, sizeof(s->error), "%s", why);
+	s->state = ST_FAILED;
+	return CPIO_ERROR;
+}
+
+cpio_stream *cpio_stream_create(const cpio_callbacks *callbacks, void *ctx)
+{
+	cpio_stream *s = calloc(1, sizeof(*s));
+	if (!s) return NULL;
+	s->cb = *callbacks;
+	s->ctx = ctx;
+	s->state = ST_HEADER;
+	s->compressed = -1;
+	s->header_need = MAGIC_SIZE;
+	return s;
+}
+
+void cpio_stream_destroy(cpio_stream *s)
+{
+	if (!s) return;
+	if (s->z_live) inflateEnd(&s->z);
+	free(s->out);
+	free(s->name);
+	free(s);
+}
+
+const char *cpio_stream_error(const cpio_stream *s)
+{
+	return s->error[0] ? s->error : NULL;
+}
+
+#pragma mark headers
+
+static int field(const unsigned char *p, int width, int base, uint64_t *out)
+{
+	uint64_t v = 0;
+	for (int i = 0; i < width; i++) {
+		int c = p[i], d;
+		if (c >= '0' && c <= '9') d = c - '0';
+		else if (base == 16 && c >= 'a' && c <= 'f') d = c - 'a' + 10;
+		else if (base == 16 && c >= 'A' && c <= 'F') d = c - 'A' + 10;
+		else return 0;
+		if (d >= base) return 0;
+		v = v * base + d;
+	}
+	*out = v;
+	return 1;
+}
+
+/// Decode the header just collected.  The name follows.
+static int decode_header(cpio_stream *s)
+{
+	const unsigned char *h = s->header;
+	uint64_t mode, mtime, namesize, filesize;
+	size_t pad;
+
+	if (s->newc) {
+		// magic ino mode uid gid nlink mtime filesize devmajor devminor rdevmajor rdevminor namesize check
+		if (!field(h + 14, 8, 16, &mode) || !field(h + 46, 8, 16, &mtime) ||
+			!field(h + 54, 8, 16, &filesize) || !field(h + 94, 8, 16, &namesize))
+			return fail(s, "bad newc header");
+		pad = (4 - (NEWC_HEADER + namesize) % 4) % 4;
+		s->data_pad = (4 - filesize % 4) % 4;
+	} else {
+		// magic dev ino mode uid gid nlink rdev mtime namesize filesize
+		if (!field(h + 18, 6, 8, &mode) || !field(h + 48, 11, 8, &mtime) ||
+			!field(h + 59, 6, 8, &namesize) || !field(h + 65, 11, 8, &filesize))
+			return fail(s, "bad odc header");
+		pad = 0;
+		s->data_pad = 0;
+	}
+	if (namesize == 0 || namesize > MAX_NAME) return fail(s, "bad name length");
+
+	if (s->name_cap < namesize + pad) {
+		char *name = realloc(s->name, namesize + pad);
+		if (!name) return fail(s, "out of memory");
+		s->name = name;
+		s->name_cap = namesize + pad;
+	}
+	s->name_size = namesize;
+	s->name_need = namesize + pad;
+	s->name_len = 0;
+	s->entry.mode = (mode_t)mode;
+	s->entry.mtime = (time_t)mtime;
+	s->entry.size = filesize;
+	s->state = ST_NAME;
+	return CPIO_MORE;
+}
+
+/// The name has been collected: start the entry.
+static int begin_entry(cpio_stream *s)
+{
+	s->name[s->name_size - 1] = '\0';
+	if (strcmp(s->name, TRAILER) == 0) {
+		s->state = ST_DONE;
+		return CPIO_DONE;
+	}
+	s->entry.name = s->name;
+	if (s->cb.begin && s->cb.begin(s->ctx, &s->entry) != 0) return fail(s, "stopped by handler");
+	s->remaining = s->entry.size;
+	s->state = ST_DATA;
+	if (s->remaining == 0) {
+		if (s->cb.end && s->cb.end(s->ctx) != 0) return fail(s, "stopped by handler");
+		s->remaining = s->data_pad;
+		s->state = ST_SKIP;
+	}
+	return CPIO_MORE;
+}
+
+#pragma mark decoding
+
+/// Decode some of the uncompressed archive.
+static int unpack(cpio_stream *s, const unsigned char *p, size_t len)
+{
+	while (len) {
+		size_t take;
+		int r;
+
+		switch (s->state) {
+		case ST_HEADER:
+			take = s->header_need - s->header_len;
+			if (take > len) take = len;
+			memcpy(s->header + s->header_len, p, take);
+			s->header_len += take;
+			p += take; len -= take;
+			if (s->header_len < s->header_need) break;
+
+			if (s->header_need == MAGIC_SIZE) {
+				if (memcmp(s->header, "070707", 6) == 0) {
+					s->newc = 0;
+					s->header_need = ODC_HEADER;
+				} else if (memcmp(s->header, "070701", 6) == 0 || memcmp(s->header, "070702", 6) == 0) {
+					s->newc = 1;
+					s->header_need = NEWC_HEADER;
+				} else
+					return fail(s, "not a cpio archive");
+				break;
+			}
+			s->header_len = 0;
+			s->header_need = MAGIC_SIZE;
+			if ((r = decode_header(s)) != CPIO_MORE) return r;
+			break;
+
+		case ST_NAME:
+			take = s->name_need - s->name_len;
+			if (take > len) take = len;
+			memcpy(s->name + s->name_len, p, take);
+			s->name_len += take;
+			p += take; len -= take;
+			if (s->name_len < s->name_need) break;
+			if ((r = begin_entry(s)) != CPIO_MORE) return r;
+			break;
+
+		case ST_DATA:
+			take = s->remaining < len ? (size_t)s->remaining : len;
+			if (s->cb.data && s->cb.data(s->ctx, p, take) != 0) return fail(s, "stopped by handler");
+			s->remaining -= take;
+			p += take; len -= take;
+			if (s->remaining) break;
+			if (s->cb.end && s->cb.end(s->ctx) != 0) return fail(s, "stopped by handler");
+			s->remaining = s->data_pad;
+			s->state = ST_SKIP;
+			break;
+
+		case ST_SKIP:
+			take = s->remaining < len ? (size_t)s->remaining : len;
+			s->remaining -= take;
+			p += take; len -= take;
+			if (s->remaining == 0) s->state = ST_HEADER;
+			break;
+
+		case ST_DONE:
+			return CPIO_DONE;
+		default:
+			return CPIO_ERROR;
+		}
+	}
+	// a zero length entry just before the end of a piece still needs finishing
+	if (s->state == ST_SKIP && s->remaining == 0) s->state = ST_HEADER;
+	return s->state == ST_DONE ? CPIO_DONE : CPIO_MORE;
+}
+
+int cpio_stream_feed(cpio_stream *s, const void *buf, size_t len)
+{
+	if (s->state == ST_DONE) return CPIO_DONE;
+	if (s->state == ST_FAILED) return CPIO_ERROR;
+	if (len == 0) return CPIO_MORE;
+
+	if (s->compressed < 0) {
+		s->compressed = ((const unsigned char *)buf)[0] == 0x1f;
+		if (s->compressed) {
+			s->out = malloc(INFLATE_BUFFER);
+			if (!s->out) return fail(s, "out of memory");
+			if (inflateInit2(&s->z, 15 + 32) != Z_OK) return fail(s, "can't start zlib");
+			s->z_live = 1;
+		}
+	}
+	if (!s->compressed) return unpack(s, buf, len);
+
+	s->z.next_in = (Bytef *)buf;
+	s->z.avail_in = (uInt)len;
+	do {
+		s->z.next_out = s->out;
+		s->z.avail_out = INFLATE_BUFFER;
+		int z = inflate(&s->z, Z_NO_FLUSH);
+		if (z != Z_OK && z != Z_STREAM_END && z != Z_BUF_ERROR)
+			return fail(s, s->z.msg ? s->z.msg : "bad gzip data");
+
+		int r = unpack(s, s->out, INFLATE_BUFFER - s->z.avail_out);
+		if (r != CPIO_MORE) return r;
+		// gzip allows several members one after another
+		if (z == Z_STREAM_END && s->z.avail_in) inflateReset(&s->z);
+		else if (z == Z_BUF_ERROR) break;
+		// a full buffer may mean zlib is holding more back
+	} while (s->z.avail_in || s->z.avail_out == 0);
+	return CPIO_MORE;
+}
+
+#pragma mark extracting to a directory
+
+enum { KIND_SKIP, KIND_FILE, KIND_LINK };
+
+struct cpio_dir {
+	char		*root;
+	size_t		root_len;
+	char		*path;				// of the current entry
+	size_t		path_cap;
+	int			kind;
+	int			fd;
+	mode_t		mode;
+	time_t		mtime;
+	char		link[1024];
+	size_t		link_len;
+	uint64_t	files, bytes;
+	char		error[256];
+};
+
+static int dir_fail(cpio_dir *d, const char *what)
+{
+	snprintf(d->error, sizeof(d->error), "%s: %s", what, strerror(errno));
+	return -1;
+}
+
+static int make_dirs(char *path, size_t from)
+{
+	for (char *p = path + from; *p; p++) {
+		if (*p != '/') continue;
+		*p = '\0';
+		int ok = mkdir(path, 0755) == 0 || errno == EEXIST;
+		*p = '/';
+		if (!ok) return 0;
+	}
+	return 1;
+}
+
+/// Does \p name have a ".." in it?
+static int climbs(const char *name)
+{
+	for (const char *p = name; *p; ) {
+		const char *e = strchr(p, '/');
+		size_t n = e ? (size_t)(e - p) : strlen(p);
+		if (n == 2 && p[0] == '.' && p[1] == '.') return 1;
+		p += n;
+		while (*p == '/') p++;
+	}
+	return 0;
+}
+
+/// Set d->path to where \p name goes, leaving out empty and "." components.
+/// Returns 0 if it would be outside the root, or is the root itself.
+static int place(cpio_dir *d, const char *name)
+{
+	size_t need = d->root_len + strlen(name) + 2;
+	if (d->path_cap < need) {
+		char *path = realloc(d->path, need);
+		if (!path) return 0;
+		d->path = path;
+		d->path_cap = need;
+	}
+	if (climbs(name)) return 0;
+
+	char *out = d->path + d->root_len;
+	for (const char *p = name; *p; ) {
+		while (*p == '/') p++;
+		const char *e = strchr(p, '/');
+		size_t n = e ? (size_t)(e - p) : strlen(p);
+		if (n && !(n == 1 && p[0] == '.')) {
+			*out++ = '/';
+			memcpy(out, p, n);
+			out += n;
+		}
+		p += n;
+	}
+	*out = '\0';
+	return out != d->path + d->root_len;
+}
+
+static int dir_begin(void *ctx, const cpio_entry *e)
+{
+	cpio_dir *d = ctx;
+	d->kind = KIND_SKIP;
+	if (!place(d, e->name)) return 0;
+
+	if (S_ISDIR(e->mode)) {
+		if (!make_dirs(d->path, d->root_len + 1) || (mkdir(d->path, 0755) < 0 && errno != EEXIST))
+			return dir_fail(d, d->path);
+	} else if (S_ISREG(e->mode) || S_ISLNK(e->mode)) {
+		if (!make_dirs(d->path, d->root_len + 1)) return dir_fail(d, d->path);
+		// whatever was there goes, so a link left behind can't be written through
+		unlink(d->path);
+		if (S_ISLNK(e->mode)) {
+			d->kind = KIND_LINK;
+			d->link_len = 0;
+			return 0;
+		}
+		d->fd = open(d->path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, 0600);
+		if (d->fd < 0) return dir_fail(d, d->path);
+		d->kind = KIND_FILE;
+		d->mode = (e->mode & 07777) | S_IRUSR | S_IWUSR;
+		d->mtime = e->mtime;
+	}
+	return 0;
+}
+
+static int dir_data(void *ctx, const void *buf, size_t len)
+{
+	cpio_dir *d = ctx;
+	if (d->kind == KIND_LINK) {
+		if (d->link_len + len >= sizeof(d->link)) d->kind = KIND_SKIP;
+		else {
+			memcpy(d->link + d->link_len, buf, len);
+			d->link_len += len;
+		}
+	} else if (d->kind == KIND_FILE) {
+		const char *p = buf;
+		while (len) {
+			ssize_t n = write(d->fd, p, len);
+			if (n < 0) {
+				if (errno == EINTR) continue;
+				return dir_fail(d, d->path);
+			}
+			p += n; len -= n;
+			d->bytes += n;
+		}
+	}
+	return 0;
+}
+
+static int dir_end(void *ctx)
+{
+	cpio_dir *d = ctx;
+	if (d->kind == KIND_FILE) {
+		fchmod(d->fd, d->mode);
+		int failed = close(d->fd) < 0;
+		d->fd = -1;
+		d->kind = KIND_SKIP;
+		if (failed) return dir_fail(d, d->path);
+
+		struct timeval times[2] = { { d->mtime, 0 }, { d->mtime, 0 } };
+		utimes(d->path, times);
+		d->files++;
+	} else if (d->kind == KIND_LINK) {
+		d->link[d->link_len] = '\0';
+		d->kind = KIND_SKIP;
+		// only links which stay inside the root
+		if (d->link[0] == '/' || climbs(d->link)) return 0;
+		if (symlink(d->link, d->path) < 0) return dir_fail(d, d->path);
+		d->files++;
+	}
+	return 0;
+}
+
+const cpio_callbacks cpio_dir_callbacks = { dir_begin, dir_data, dir_end };
+
+cpio_dir *cpio_dir_open(const char *root)
+{
+	cpio_dir *d = calloc(1, sizeof(*d));
+	if (!d) return NULL;
+	d->root_len = strlen(root);
+	while (d->root_len > 1 && root[d->root_len - 1] == '/') d->root_len--;
+	d->path_cap = d->root_len + 256;
+	d->root = strndup(root, d->root_len);
+	d->path = malloc(d->path_cap);
+	d->fd = -1;
+	if (!d->root || !d->path) {
+		free(d->root);
+		free(d->path);
+		free(d);
+		return NULL;
+	}
+	memcpy(d->path, d->root, d->root_len + 1);
+	if (!make_dirs(d->path, 1) || (mkdir(d->root, 0755) < 0 && errno != EEXIST))
+		dir_fail(d, d->root);
+	return d;
+}
+
+const char *cpio_dir_error(const cpio_dir *d)
+{
+	return d->error[0] ? d->error : NULL;
+}
+
+void cpio_dir_close(cpio_dir *d, uint64_t *files, uint64_t *bytes)
+{
+	if (!d) return;
+	if (d->fd >= 0) close(d->fd);
+	if (files) *files = d->files;
+	if (bytes) *bytes = d->bytes;
+	free(d->root);
+	free(d->path);
+	free(d);
+}
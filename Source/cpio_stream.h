@@ -0,0 +1,81 @@
+//
+//  cpio_stream.h
+//  mobileDeviceManager
+//
+//  Unpacks a cpio archive, gzip'd or not, as it arrives - which is how the
+//  file_relay service sends its filesets.  Bytes are pushed in with
+//  cpio_stream_feed() in whatever pieces they come in, and each entry is
+//  handed to a set of callbacks as it is decoded, so nothing bigger than one
+//  buffer is ever held in memory.
+//
+//  Both the "odc" (070707) and "newc" (070701/070702) header formats are
+//  understood.
+//
+
+#ifndef CPIO_STREAM_H
+#define CPIO_STREAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct cpio_entry {
+	const char	*name;			// as in the archive, eg "./var/mobile/Library/Logs/foo.log"
+	mode_t		mode;			// type and permissions, as in st_mode
+	uint64_t	size;
+	time_t		mtime;
+} cpio_entry;
+
+/// What to do with the entries.  Any callback may return non-zero to stop the
+/// extraction with an error.
+typedef struct cpio_callbacks {
+	int (*begin)(void *ctx, const cpio_entry *entry);
+	int (*data)(void *ctx, const void *buf, size_t len);	// the entry's contents, in pieces
+	int (*end)(void *ctx);
+} cpio_callbacks;
+
+typedef struct cpio_stream cpio_stream;
+
+enum {
+	CPIO_MORE = 0,			// fine so far
+	CPIO_DONE = 1,			// the end of the archive has been seen
+	CPIO_ERROR = -1			// see cpio_stream_error()
+};
+
+cpio_stream *cpio_stream_create(const cpio_callbacks *callbacks, void *ctx);
+void cpio_stream_destroy(cpio_stream *s);
+
+/// Decode \p len more bytes of the archive.  Returns one of the values above;
+/// once it has returned CPIO_DONE or CPIO_ERROR, further bytes are ignored.
+int cpio_stream_feed(cpio_stream *s, const void *buf, size_t len);
+
+/// What went wrong, or NULL.
+const char *cpio_stream_error(const cpio_stream *s);
+
+/// Extract into a directory.  Pass cpio_dir_callbacks to cpio_stream_create()
+/// with a cpio_dir as the context.  Names are made relative to the root, and
+/// entries which would end up outside it (through "..", or a symbolic link
+/// pointing out of it) are skipped.
+typedef struct cpio_dir cpio_dir;
+
+extern const cpio_callbacks cpio_dir_callbacks;
+
+cpio_dir *cpio_dir_open(const char *root);
+
+/// Returns what went wrong, or NULL.  The string lasts as long as the cpio_dir.
+const char *cpio_dir_error(const cpio_dir *d);
+
+/// Finish up.  \p files and \p bytes (either may be NULL) are set to what was
+/// written.
+void cpio_dir_close(cpio_dir *d, uint64_t *files, uint64_t *bytes);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
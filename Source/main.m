@@ -10,118 +10,301 @@
 #import <Foundation/Foundation.h>
 #import "DeviceAdapter.h"
 #import "MobileDeviceAccess.h"
+#import "AFCStagingCache.h"
+#import "AFCTreeTransfer.h"
+#import "AMIconCache.h"
+#import "AMServiceIO.h"
+#import "MobileDeviceBackend.h"
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "op_stats.h"
+#include "syslog_store.h"
+#include "bench_results.h"
 
-int main (int argc, const char * argv[]) {
+// -window, -blocksize and -writesize
+static void applyTransferArguments(AFCDirectoryAccess *dir, NSUserDefaults *arguments)
+{
+    NSInteger window = [arguments integerForKey:@"window"];
+    NSInteger blocksize = [arguments integerForKey:@"blocksize"];
+    NSInteger writesize = [arguments integerForKey:@"writesize"];
+    if (window > 0) dir.readWindow = (uint32_t)window;
+    if (blocksize > 0) dir.readBlockSize = (uint32_t)blocksize;
+    if (writesize > 0) dir.writeBlockSize = (uint32_t)writesize;
+}
 
-    NSAutoreleasePool * pool = [[NSAutoreleasePool alloc] init];
-    
-    
-    //get arguments
-	NSUserDefaults *arguments = [NSUserDefaults standardUserDefaults];
-	NSString *option = [arguments stringForKey:@"o"];
-    
-    if	(!option) {
-        printf("\n\
-The script usage:\n\n\
-Copy file from desktop to device (App Documents) or specify path with filename:\n\
-    mobileDeviceManager -o push -app \"Application_ID\" -from \"from file\" [-to \"to file\"]\n\
-Copy file from device to desktop (Current folder) or specify path with filename:\n\
-    mobileDeviceManager -o pull -app \"Application_ID\" -from \"from file\" [-to \"to file\"]\n\
-List Applications:\n\
-    mobileDeviceManager -o list\n\
-List Files in Application Documents (path):\n\
-    mobileDeviceManager -o listFiles -app Appliction_ID [-path /Documents]\n\
-Delete Files in Application Documents (path):\n\
-    mobileDeviceManager -o delete -app Appliction_ID [-path /Documents]\n\
-Get appId for application name:\n\
-    mobileDeviceManager -o getAppId -name Application_Name\n\
-Show device info:\n\
-    mobileDeviceManager -o info\n");
-        return 1001;
-	}
+// Open the AFC connection that push/pull/listFiles/delete work against.  Normally
+// this is the application's sandbox on the device, but -standin serves a local
+// directory instead so the copy code can be exercised without a device.
+static AFCDirectoryAccess *newAppDirectory(AMDevice *device, NSString *appId, NSUserDefaults *arguments)
+{
+    AFCDirectoryAccess *dir;
+    NSString *standin = [arguments stringForKey:@"standin"];
+    if (standin) {
+        // -latency is in milliseconds
+        dir = [[AFCStandInDirectory alloc] initWithRoot:standin latency:[arguments doubleForKey:@"latency"] / 1000.0];
+    } else {
+        dir = [device newAFCApplicationDirectory:appId];
+    }
+    applyTransferArguments(dir, arguments);
+    return dir;
+}
+
+// Finished with a connection from newAppDirectory().  A device keeps it for the
+// next operation on the same application (see -recycleService:), which is what
+// lets a daemon skip starting the service again; a stand-in is just closed.
+static void doneWithAppDirectory(AMDevice *device, AFCDirectoryAccess *dir)
+{
+    if (device && ![dir isKindOfClass:[AFCStandInDirectory class]]) {
+        [device recycleService:dir];
+    } else {
+        [dir release];
+    }
+}
+
+// With -connections N (N > 1), directories are copied over N AFC connections in
+// parallel.  Returns nil if a single connection was asked for.
+static AFCTreeTransfer *newTreeTransfer(AMDevice *device, NSString *appId, NSUserDefaults *arguments)
+{
+    NSInteger count = [arguments integerForKey:@"connections"];
+    if (count < 2) return nil;
     
-    DeviceAdapter *adapter = [[DeviceAdapter alloc] init];
-	
+    NSMutableArray *connections = [NSMutableArray arrayWithCapacity:count];
+    for (NSInteger i = 0; i < count; i++) {
+        AFCDirectoryAccess *dir = newAppDirectory(device, appId, arguments);
+        if (!dir) break;
+        [connections addObject:dir];
+        [dir release];
+    }
+    return [[AFCTreeTransfer alloc] initWithConnections:connections];
+}
+
+// -o syslog runs until ^C, or for -duration seconds
+static volatile sig_atomic_t interrupted = 0;
+
+static void on_interrupt(int sig)
+{
+    interrupted = 1;
+}
+
+// An operation's messages: logged when it runs from the command line, or
+// written to err as plain lines when a daemon runs it for a client - so what
+// other threads log meanwhile stays in the daemon's own log.
+static void op_log(FILE *err, NSString *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    if (err == stderr) {
+        NSLogv(format, args);
+    } else {
+        NSString *line = [[NSString alloc] initWithFormat:format arguments:args];
+        fprintf(err, "%s\n", [line UTF8String]);
+        [line release];
+    }
+    va_end(args);
+}
+
+// The syslog filter given by -process a,b,... -level error -contains TEXT -grep
+// REGEX.  Returns NO (having said why on err) if -level isn't a level.
+static BOOL syslog_filter_arguments(NSUserDefaults *arguments, NSArray **processes, int *level,
+                                    NSString **text, NSString **pattern, FILE *err)
+{
+    NSString *processList = [arguments stringForKey:@"process"];
+    NSString *levelName = [arguments stringForKey:@"level"];
+    *processes = processList ? [processList componentsSeparatedByString:@","] : nil;
+    *level = levelName ? syslog_level_named([levelName UTF8String]) : -1;
+    *text = [arguments stringForKey:@"contains"];
+    *pattern = [arguments stringForKey:@"grep"];
+    if (levelName && *level < 0) {
+        op_log(err, @"Unknown level %@ - use Emergency, Alert, Critical, Error, Warning, Notice, Info or Debug", levelName);
+        return NO;
+    }
+    return YES;
+}
+
+// -since and -until: "2011-03-01 14:00[:00]", a date, seconds since 1970, or a
+// time ago like 90m, 12h or 3d.  Returns -1 if it's none of those.
+static time_t time_argument(NSString *value)
+{
+    if (!value) return 0;
     
-    while(!adapter.iosDevice && [[NSRunLoop currentRunLoop] runMode:NSDefaultRunLoopMode beforeDate:[NSDate distantFuture]]) {
-        // Here you can perform other checks, like making sure the method isn't running forever (with a timeout variable)
-        // Just set callComplete to YES when done
+    double n;
+    NSScanner *scanner = [NSScanner scannerWithString:value];
+    if ([scanner scanDouble:&n]) {
+        if ([scanner isAtEnd]) return (time_t)n;
+        NSString *unit = [[value substringFromIndex:[scanner scanLocation]] lowercaseString];
+        double seconds = [unit isEqualToString:@"s"] ? 1 : [unit isEqualToString:@"m"] ? 60 :
+                         [unit isEqualToString:@"h"] ? 3600 : [unit isEqualToString:@"d"] ? 86400 : 0;
+        if (seconds) return time(NULL) - (time_t)(n * seconds);
     }
     
-    AMDevice *device = adapter.iosDevice;
+    NSDateFormatter *formatter = [[[NSDateFormatter alloc] init] autorelease];
+    for (NSString *format in [NSArray arrayWithObjects:@"yyyy-MM-dd HH:mm:ss", @"yyyy-MM-dd HH:mm", @"yyyy-MM-dd", nil]) {
+        [formatter setDateFormat:format];
+        NSDate *date = [formatter dateFromString:value];
+        if (date) return (time_t)[date timeIntervalSince1970];
+    }
+    return -1;
+}
+
+// Run the operation named by -o against one device.  What it prints goes to
+// out and its messages to err.  Returns the process exit status for a single
+// device run: 0 on success, 1 if the operation failed and 1001 for bad arguments.
+static int run_operation(NSString *option, AMDevice *device, DeviceAdapter *adapter,
+                         NSUserDefaults *arguments, BOOL standin, BOOL fleet, FILE *out, FILE *err)
+{
+    BOOL ok = YES;
     
+    // names are resolved from a saved catalog of the device's applications
+    NSString *appcache = [arguments stringForKey:@"appcache"];
+    if (appcache && device) [[device applicationCatalog] persistInDirectory:appcache];
     
     if ([option isEqualToString:@"copy"] || [option isEqualToString:@"push"]) {
-        NSLog(@"Will copy to Device: %@", device);
+        op_log(err, @"Will copy to Device: %@", device);
         
         NSString *fromFile = [arguments stringForKey:@"from"];
         NSString *toFile = [arguments stringForKey:@"to"];
         NSString *appId = [arguments stringForKey:@"app"];
         
-        if (!fromFile || !appId) {
-            NSLog(@"no fromFile | no appId");
+        if (!fromFile || (!appId && !standin)) {
+            op_log(err, @"no fromFile | no appId");
             return 1001;
         }
         
-        AFCApplicationDirectory *appDir = [device newAFCApplicationDirectory:appId];
+        AFCDirectoryAccess *appDir = newAppDirectory(device, appId, arguments);
+        if (!appDir) {
+            op_log(err, @"Can't open the files of %@ on %@", appId, device);
+            return 1;
+        }
         
         NSArray *files = [appDir directoryContents:@"/Documents"];
-        NSLog(@"app Documents files: %@", files);
+        op_log(err, @"app Documents files: %@", files);
         
-        if (!toFile) {
-            [appDir copyLocalFile:fromFile toRemoteDir:@"/Documents"];
+        BOOL isDir = NO;
+        AFCTreeTransfer *tree = nil;
+        if ([[NSFileManager defaultManager] fileExistsAtPath:fromFile isDirectory:&isDir] && isDir) {
+            tree = newTreeTransfer(device, appId, arguments);
+        }
+        
+        if (tree) {
+            ok = [tree pushLocalPath:fromFile toRemoteDir:(toFile ? toFile : @"/Documents")];
+            [tree release];
+        } else if (!toFile) {
+            ok = [appDir copyLocalFile:fromFile toRemoteDir:@"/Documents"];
         } else {
-            [appDir copyLocalFile:fromFile toRemoteFile:toFile];
+            ok = [appDir copyLocalFile:fromFile toRemoteFile:toFile];
         }
         
         files = [appDir directoryContents:@"/Documents"];
-        NSLog(@"app Documents files: %@", files);
+        op_log(err, @"app Documents files: %@", files);
+        doneWithAppDirectory(device, appDir);
         
     } else if ([option isEqualToString:@"pull"]) {
-        NSLog(@"Will copy from Device: %@", device);
+        op_log(err, @"Will copy from Device: %@", device);
 
         NSString *fromFile = [arguments stringForKey:@"from"];
         NSString *toFile = [arguments stringForKey:@"to"];
         NSString *appId = [arguments stringForKey:@"app"];
-
-        if (!fromFile || !appId) {
-            NSLog(@"no fromFile | no appId");
+        
+        if (!fromFile || (!appId && !standin)) {
+            op_log(err, @"no fromFile | no appId");
             return 1001;
         }
 
-        AFCApplicationDirectory *appDir = [device newAFCApplicationDirectory:appId];
+        // every device in a fleet gets its own local directory, in which even
+        // a single file keeps its name
+        if (fleet) {
+            toFile = [(toFile ? toFile : @".") stringByAppendingPathComponent:device.udid];
+            if (![[NSFileManager defaultManager] createDirectoryAtPath:toFile withIntermediateDirectories:YES attributes:nil error:NULL]) {
+                op_log(err, @"Can't create %@", toFile);
+                return 1;
+            }
+        }
+
+        AFCDirectoryAccess *appDir = newAppDirectory(device, appId, arguments);
+        if (!appDir) {
+            op_log(err, @"Can't open the files of %@ on %@", appId, device);
+            return 1;
+        }
 
         NSArray *files = [appDir directoryContents:@"/Documents"];
-        NSLog(@"app Documents files: %@", files);
+        op_log(err, @"app Documents files: %@", files);
 
         NSDictionary *finfo =[appDir getFileInfo:fromFile];
         NSString *iftm = [finfo valueForKey:@"st_ifmt"];
         BOOL isDir = [iftm compare:@"S_IFDIR"] == NSOrderedSame;
-        if (isDir) {
+        AFCTreeTransfer *tree = isDir ? newTreeTransfer(device, appId, arguments) : nil;
+        if (tree) {
+            ok = [tree pullRemotePath:fromFile toLocalDir:(toFile ? toFile : @".")];
+            [tree release];
+        } else if (isDir) {
             NSArray *files = [appDir directoryContents:fromFile];
             for (NSString *fname in files) {
-                NSLog(@"Copy %@", fname);
+                op_log(err, @"Copy %@", fname);
                 NSString *src = [fromFile stringByAppendingPathComponent:fname];
-                [appDir copyRemoteFile:src toLocalDir:(toFile ? toFile : @".")];
+                if (![appDir copyRemoteFile:src toLocalDir:(toFile ? toFile : @".")]) ok = NO;
             }
         } else {
-            if (!toFile) {
-                [appDir copyRemoteFile:fromFile toLocalDir:@"."];
+            if (!toFile || fleet) {
+                ok = [appDir copyRemoteFile:fromFile toLocalDir:(toFile ? toFile : @".")];
             } else {
-                [appDir copyRemoteFile:fromFile toLocalFile:toFile];
+                ok = [appDir copyRemoteFile:fromFile toLocalFile:toFile];
             }
         }
+        doneWithAppDirectory(device, appDir);
+    } else if ([option isEqualToString:@"sync"]) {
+        NSString *pushPath = [arguments stringForKey:@"push"];
+        NSString *pullPath = [arguments stringForKey:@"pull"];
+        NSString *toPath = [arguments stringForKey:@"to"];
+        NSString *appId = [arguments stringForKey:@"app"];
+        
+        if ((!pushPath && !pullPath) || (!appId && !standin)) {
+            op_log(err, @"no push/pull path | no appId");
+            return 1001;
+        }
+        
+        AFCSyncOptions options = 0;
+        if ([arguments boolForKey:@"delete"]) options |= AFCSyncDelete;
+        if ([arguments boolForKey:@"checksum"]) options |= AFCSyncChecksum;
+        if ([arguments boolForKey:@"dryrun"]) options |= AFCSyncDryRun;
+        
+        AFCDirectoryAccess *appDir = newAppDirectory(device, appId, arguments);
+        if (!appDir) {
+            op_log(err, @"Can't open the files of %@ on %@", appId, device);
+            return 1;
+        }
+        
+        BOOL synced;
+        if (pushPath) {
+            synced = [appDir syncLocalPath:pushPath toRemoteDir:(toPath ? toPath : @"/Documents") options:options];
+        } else {
+            NSString *localDir = toPath ? toPath : @".";
+            if (fleet) localDir = [localDir stringByAppendingPathComponent:device.udid];
+            synced = [appDir syncRemotePath:pullPath toLocalDir:localDir options:options];
+        }
+        if (!synced) op_log(err, @"sync failed: %@", appDir.lasterror);
+        doneWithAppDirectory(device, appDir);
+        if (!synced) return 1;
+        
     } else if ([option isEqualToString:@"delete"]) {
 
         NSString *path = [arguments stringForKey:@"path"];
         NSString *appId = [arguments stringForKey:@"app"];
 
-        if (!appId) {
-            NSLog(@"no appId");
+        if (!appId && !standin) {
+            op_log(err, @"no appId");
             return 1001;
         }
 
-        AFCApplicationDirectory *appDir = [device newAFCApplicationDirectory:appId];
+        AFCDirectoryAccess *appDir = newAppDirectory(device, appId, arguments);
+        if (!appDir) {
+            op_log(err, @"Can't open the files of %@ on %@", appId, device);
+            return 1;
+        }
 
         if (!path) path = @"/Documents";
 
@@ -131,45 +314,1971 @@ Show device info:\n\
         if (isDir) {
             NSArray *files = [appDir directoryContents:path];
             for (NSString *fname in files) {
-                NSLog(@"Delete %@", fname);
+                op_log(err, @"Delete %@", fname);
                 NSString *dest = [path stringByAppendingPathComponent:fname];
-                [appDir unlink:dest];
+                if (![appDir unlink:dest]) ok = NO;
             }
         } else {
-            NSLog(@"Delete %@", path);
-            [appDir unlink:path];
+            op_log(err, @"Delete %@", path);
+            ok = [appDir unlink:path];
         }
+        doneWithAppDirectory(device, appDir);
     } else if ([option isEqualToString:@"listFiles"]) {
         
         NSString *path = [arguments stringForKey:@"path"];
         NSString *appId = [arguments stringForKey:@"app"];
         
-        if (!appId) {
-            NSLog(@"no appId");
+        if (!appId && !standin) {
+            op_log(err, @"no appId");
             return 1001;
         }
         
-        AFCApplicationDirectory *appDir = [device newAFCApplicationDirectory:appId];
+        AFCDirectoryAccess *appDir = newAppDirectory(device, appId, arguments);
+        if (!appDir) {
+            op_log(err, @"Can't open the files of %@ on %@", appId, device);
+            return 1;
+        }
         
         if (!path) path = @"/Documents";
 
-        NSArray *files = [appDir directoryContents:path];
-        
-        NSLog(@"Files in %@ : %@", path, files);
+        NSString *match = [arguments stringForKey:@"match"];
+        NSInteger depth = [arguments integerForKey:@"depth"];
+        if ([arguments boolForKey:@"recursive"] || match || depth > 0) {
+            // stream the tree out as it is read, one line per entry
+            BOOL withInfo = [arguments boolForKey:@"stat"];
+            ok = [appDir walkDirectory:path depth:(depth > 0 ? depth : 0) matching:match withInfo:withInfo
+                                 usingBlock:^BOOL(NSString *entry, BOOL isdir, NSDictionary *info) {
+                if (withInfo) {
+                    fprintf(out, "%12llu  %s%s\n", [[info objectForKey:@"st_size"] unsignedLongLongValue],
+                                 [entry UTF8String], isdir ? "/" : "");
+                } else {
+                    fprintf(out, "%s%s\n", [entry UTF8String], isdir ? "/" : "");
+                }
+                return YES;
+            }];
+            if (!ok) op_log(err, @"listFiles failed: %@", appDir.lasterror);
+        } else {
+            NSArray *files = [appDir directoryContents:path];
+            
+            op_log(err, @"Files in %@ : %@", path, files);
+            ok = (files != nil);
+        }
+        doneWithAppDirectory(device, appDir);
         
     } else if ([option isEqualToString:@"list"]) {
-        NSArray *apps = [device installedApplications];
-        NSLog(@"Installed Applications: %@", apps);
+        NSString *type = [arguments stringForKey:@"type"];
+        NSString *ids = [arguments stringForKey:@"ids"];
+        NSString *attributes = [arguments stringForKey:@"attributes"];
+        if (type || ids || attributes) {
+            // the device does the filtering, and only sends the attributes asked
+            // for; each application is printed as it arrives
+            AMInstallationProxy *proxy = [device newAMInstallationProxyWithDelegate:nil];
+            NSArray *keys = [attributes componentsSeparatedByString:@","];
+            ok = proxy && [proxy browseType:type bundleIds:[ids componentsSeparatedByString:@","] attributes:keys
+                                 usingBlock:^BOOL(AMApplication *app) {
+                NSMutableString *line = [NSMutableString stringWithFormat:@"%@\t%@", [app bundleid], [app appname]];
+                for (NSString *key in keys) {
+                    id value = [[app info] objectForKey:key];
+                    [line appendFormat:@"\t%@", value ? value : @""];
+                }
+                fprintf(out, "%s\n", [line UTF8String]);
+                return YES;
+            }];
+            if (!ok) op_log(err, @"Can't list the applications on %@: %@", device, proxy ? proxy.lasterror : device.lasterror);
+            if (ok) [device recycleService:proxy];
+            else [proxy release];
+        } else {
+            NSArray *apps = [device installedApplications];
+            op_log(err, @"Installed Applications: %@", apps);
+            ok = (apps != nil);
+        }
 
     } else if ([option isEqualToString:@"info"]) {
-        NSLog(@"Device connected: %@", device);
+        op_log(err, @"Device connected: %@", device);
+        
+        // everything is fetched in one session; -keys picks which values
+        NSString *keyList = [arguments stringForKey:@"keys"];
+        NSString *domain = [arguments stringForKey:@"domain"];
+        NSArray *keys = keyList ? [keyList componentsSeparatedByString:@","]
+                                : [NSArray arrayWithObjects:@"UniqueDeviceID", @"ProductType", @"DeviceClass",
+                                   @"SerialNumber", @"ProductVersion", @"BuildVersion", nil];
+        if ([keyList isEqualToString:@"all"]) keys = nil;
+        NSDictionary *values = [device deviceValuesForKeys:keys inDomain:domain];
+        for (NSString *key in (keys ? keys : [[values allKeys] sortedArrayUsingSelector:@selector(compare:)])) {
+            id value = [values objectForKey:key];
+            if (value) fprintf(out, "%s: %s\n", [key UTF8String], [[value description] UTF8String]);
+        }
+        ok = (values != nil);
+    } else if ([option isEqualToString:@"syslog"]) {
+        // capture into -to/<udid>, for -o syslogquery to search afterwards
+        NSString *to = [arguments stringForKey:@"to"];
+        NSArray *processes;
+        NSString *text, *pattern;
+        int level;
+        if (!to || !device) {
+            op_log(err, @"syslog needs -to, a directory to capture into, and a device");
+            return 1001;
+        }
+        if (!syslog_filter_arguments(arguments, &processes, &level, &text, &pattern, err)) return 1001;
+        
+        NSString *dir = [to stringByAppendingPathComponent:device.udid];
+        unsigned long long segment = (unsigned long long)[arguments integerForKey:@"segment"] * 1024 * 1024;
+        AMSyslogRelay *relay = [device newAMSyslogRelay:nil batchMessage:NULL];
+        if (!relay) {
+            op_log(err, @"Can't start the syslog relay on %@", device);
+            return 1;
+        }
+        if (![relay filterProcesses:processes level:level containing:text matching:pattern] ||
+            ![relay recordToDirectory:dir segmentSize:segment]) {
+            op_log(err, @"%@", relay.lasterror);
+            [relay release];
+            return 1;
+        }
+        
+        NSTimeInterval duration = [arguments doubleForKey:@"duration"];
+        NSDate *until = duration > 0 ? [NSDate dateWithTimeIntervalSinceNow:duration] : [NSDate distantFuture];
+        signal(SIGINT, on_interrupt);
+        op_log(err, @"Capturing the syslog of %@ in %@ - ^C to stop", device.udid, dir);
+        for (NSUInteger seconds = 1; !interrupted && [until timeIntervalSinceNow] > 0; seconds++) {
+            [NSThread sleepForTimeInterval:1.0];
+            if (seconds % 60 == 0) {
+                op_log(err, @"%@: %lu records, %lu filtered out, %lu recorded", device.udid,
+                            (unsigned long)relay.received, (unsigned long)relay.filtered, (unsigned long)relay.recorded);
+            }
+        }
+        op_log(err, @"%@: %lu records, %lu filtered out, %lu recorded", device.udid,
+                    (unsigned long)relay.received, (unsigned long)relay.filtered, (unsigned long)relay.recorded);
+        // closing the relay writes out the last block
+        [relay release];
+        
+    } else if ([option isEqualToString:@"filerelay"]) {
+        // unpacked into -to/<udid> as it arrives - the archive is never saved
+        NSString *sets = [arguments stringForKey:@"sets"];
+        NSString *to = [arguments stringForKey:@"to"];
+        if (!sets || !device) {
+            op_log(err, @"filerelay needs -sets, the filesets to get (eg CrashReporter,MobileInstallation), and a device");
+            return 1001;
+        }
+        if (!to) to = [[NSFileManager defaultManager] currentDirectoryPath];
+        
+        NSString *dir = [to stringByAppendingPathComponent:device.udid];
+        AMFileRelay *relay = [device newAMFileRelay];
+        if (!relay) {
+            op_log(err, @"Can't start the file relay on %@", device);
+            return 1;
+        }
+        NSDate *start = [NSDate date];
+        ok = [relay getFileSets:[sets componentsSeparatedByString:@","] extractTo:dir];
+        if (ok) {
+            op_log(err, @"%@: %llu files, %llu bytes (%llu received) in %@ in %.1fs", device.udid,
+                        relay.extractedFiles, relay.extractedBytes, relay.received, dir, -[start timeIntervalSinceNow]);
+        } else {
+            op_log(err, @"filerelay failed on %@: %@", device.udid, relay.lasterror);
+        }
+        [relay release];
+        
+    } else if ([option isEqualToString:@"icons"]) {
+        // written to -to/<udid>/<bundle id>.png; the cache is shared by every
+        // device, so an icon is only fetched from the first device to have it
+        NSString *to = [arguments stringForKey:@"to"];
+        NSString *ids = [arguments stringForKey:@"ids"];
+        NSString *cacheDir = [arguments stringForKey:@"cache"];
+        NSInteger connections = [arguments integerForKey:@"connections"];
+        if (!device) {
+            op_log(err, @"icons needs a device");
+            return 1001;
+        }
+        if (!to) to = [[NSFileManager defaultManager] currentDirectoryPath];
+        if (!cacheDir) cacheDir = [to stringByAppendingPathComponent:@".iconcache"];
+        
+        AMIconCache *cache = [[AMIconCache alloc] initWithDirectory:cacheDir];
+        if (connections > 0) cache.connections = connections;
+        NSDate *start = [NSDate date];
+        NSDictionary *icons = [cache iconsForIds:[ids componentsSeparatedByString:@","] onDevice:device];
+        if (icons) {
+            NSString *dir = [to stringByAppendingPathComponent:device.udid];
+            ok = [[NSFileManager defaultManager] createDirectoryAtPath:dir withIntermediateDirectories:YES attributes:nil error:nil];
+            for (NSString *bundleId in icons) {
+                NSString *path = [dir stringByAppendingPathComponent:[[bundleId lastPathComponent] stringByAppendingPathExtension:@"png"]];
+                if (![[icons objectForKey:bundleId] writeToFile:path atomically:YES]) {
+                    op_log(err, @"Can't write %@", path);
+                    ok = NO;
+                }
+            }
+            op_log(err, @"%@: %lu icons (%lu fetched, %lu from the cache) in %.1fs", device.udid, (unsigned long)[icons count],
+                        (unsigned long)cache.fetched, (unsigned long)cache.cached, -[start timeIntervalSinceNow]);
+        } else {
+            op_log(err, @"icons failed on %@: %@", device.udid, cache.lasterror);
+        }
+        [cache release];
+        
+    } else if ([option isEqualToString:@"install"]) {
+        // with -devices/-udid every device uploads and installs on its own, so
+        // one device's installation overlaps the next one's upload
+        NSString *ipa = [arguments stringForKey:@"ipa"];
+        if (!ipa || !device) {
+            op_log(err, @"install needs -ipa, the .ipa (or .app directory) to install, and a device");
+            return 1001;
+        }
+        
+        NSString *udid = device.udid;
+        __block NSString *last = nil;
+        ok = [device installPackageAtPath:ipa progress:^(NSString *status, NSInteger percent) {
+            if ([status isEqualToString:last]) return;
+            last = status;
+            fprintf(out, "%s  %3ld%%  %s\n", [udid UTF8String], (long)percent, [status UTF8String]);
+            fflush(out);
+        }];
+        if (!ok) op_log(err, @"install failed on %@: %@", udid, device.lasterror);
+        
     } else if ([option isEqualToString:@"getAppId"]) {
         NSString *appName = [arguments stringForKey:@"name"];
-        NSString *appId = [adapter getAppIdForName:appName];
-        printf("%s\n", [appId UTF8String]);
+        NSString *appId = [adapter getAppIdForName:appName onDevice:device];
+        fprintf(out, "%s\n", [appId UTF8String]);
+        ok = (appId != nil);
+    }
+    
+    return ok ? 0 : 1;
+}
+
+// run_operation(), timed into the stats as one call on the device, so the time
+// spent at this end shows up as the difference from the calls it made
+static int run_timed_operation(NSString *option, AMDevice *device, DeviceAdapter *adapter,
+                               NSUserDefaults *arguments, BOOL standin, BOOL fleet, FILE *out, FILE *err)
+{
+    uint64_t started = op_stats_start();
+    int status = run_operation(option, device, adapter, arguments, standin, fleet, out, err);
+    op_stats_record_device(device ? [device.udid UTF8String] : "standin", OP_OPERATION, started, status != 0, 0, 0);
+    return status;
+}
+
+// -stats FILE (- for stdout): when the run is over, write out the timings of
+// the calls made to the devices, as JSON or, with -statsformat prometheus, in
+// Prometheus' text format
+static int stats_format(NSUserDefaults *arguments)
+{
+    return [[arguments stringForKey:@"statsformat"] isEqualToString:@"prometheus"] ? OP_STATS_PROMETHEUS : OP_STATS_JSON;
+}
+
+static void write_stats(NSUserDefaults *arguments)
+{
+    NSString *path = [arguments stringForKey:@"stats"];
+    if (!path) return;
+    if ([path isEqualToString:@"-"]) {
+        op_stats_write(stdout, stats_format(arguments));
+        return;
     }
+    FILE *f = fopen([path fileSystemRepresentation], "w");
+    if (!f) {
+        NSLog(@"Can't write the stats to %@: %s", path, strerror(errno));
+        return;
+    }
+    op_stats_write(f, stats_format(arguments));
+    fclose(f);
+}
+
+// Fleet mode: -devices all, or -udid a,b,c.  Wait for the devices to turn up,
+// run the operation on each of them (at most -jobs at once, each on its own
+// thread) and report how each one went.  Returns non-zero if any device failed.
+static int run_fleet(NSString *option, DeviceAdapter *adapter, NSUserDefaults *arguments)
+{
+    NSString *udidList = [arguments stringForKey:@"udid"];
+    NSArray *wanted = udidList ? [udidList componentsSeparatedByString:@","] : nil;
+    NSInteger count = [[arguments stringForKey:@"devices"] integerValue];
+    NSTimeInterval settle = [arguments objectForKey:@"settle"] ? [arguments doubleForKey:@"settle"] : 2.0;
+    NSTimeInterval timeout = [arguments doubleForKey:@"timeout"];
+    MobileDeviceAccess *mda = [MobileDeviceAccess singleton];
+    CFAbsoluteTime waitStarted = CFAbsoluteTimeGetCurrent();
     
+    // devices which are already plugged in are announced as soon as we start
+    // listening.  With -udid, wait until all of them are here, and with
+    // -devices N until N are; either way we go as soon as they are.  With
+    // -devices all, wait until no new device has appeared for -settle seconds.
+    // -timeout bounds the whole wait
+    NSArray *missing = nil;
+    if (wanted) {
+        NSArray *found = [mda waitForDevicesWithUdids:wanted timeout:timeout];
+        if ([found count] < [wanted count]) {
+            NSMutableArray *absent = [NSMutableArray arrayWithArray:wanted];
+            for (AMDevice *device in found) {
+                for (NSString *udid in wanted) {
+                    if ([device.udid caseInsensitiveCompare:udid] == NSOrderedSame) [absent removeObject:udid];
+                }
+            }
+            missing = absent;
+        }
+    } else if (count > 0) {
+        [mda waitForDevices:count timeout:timeout];
+    } else if ([mda waitForDevice:nil timeout:timeout]) {
+        for (;;) {
+            NSUInteger seen = [adapter.devices count];
+            NSTimeInterval left = timeout > 0 ? timeout - (CFAbsoluteTimeGetCurrent() - waitStarted) : settle;
+            if (left <= 0) break;
+            if ([[mda waitForDevices:seen + 1 timeout:MIN(settle, left)] count] <= seen) break;
+        }
+    }
+    
+    NSArray *devices = [adapter devicesWithUdids:wanted];
+    if (count > 0 && [devices count] > (NSUInteger)count) devices = [devices subarrayWithRange:NSMakeRange(0, count)];
+    for (AMDevice *device in devices) {
+        NSLog(@"%@ attached after %.3fs", device.udid, device.attachLatency);
+    }
+    if (count > 0 && [devices count] < (NSUInteger)count) {
+        NSLog(@"Only %lu of %ld devices attached within %gs", (unsigned long)[devices count], (long)count, timeout);
+    }
+    NSInteger jobs = [arguments integerForKey:@"jobs"];
+    NSString *idle = [arguments stringForKey:@"idle"];
+    NSMutableDictionary *results = [NSMutableDictionary dictionary];
+    NSOperationQueue *queue = [[NSOperationQueue alloc] init];
+    [queue setMaxConcurrentOperationCount:(jobs > 0 ? jobs : (NSInteger)[devices count])];
+    NSLog(@"Running %@ on %lu devices, %ld at a time", option, (unsigned long)[devices count],
+          (long)[queue maxConcurrentOperationCount]);
+    
+    for (AMDevice *device in devices) {
+        if (idle) device.sessionIdleTimeout = [idle doubleValue];
+        [queue addOperationWithBlock:^{
+            NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+            CFAbsoluteTime started = CFAbsoluteTimeGetCurrent();
+            int status = run_timed_operation(option, device, adapter, arguments, NO, YES, stdout, stderr);
+            [device drainPool];
+            NSArray *result = [NSArray arrayWithObjects:[NSNumber numberWithInt:status],
+                               [NSNumber numberWithDouble:CFAbsoluteTimeGetCurrent() - started], nil];
+            @synchronized (results) {
+                [results setObject:result forKey:device.udid];
+            }
+            [pool drain];
+        }];
+    }
+    
+    // device attach/detach and notification proxy callbacks are delivered on the
+    // main run loop, so keep it turning while the workers run
+    while ([queue operationCount]) {
+        [[NSRunLoop currentRunLoop] runMode:NSDefaultRunLoopMode beforeDate:[NSDate dateWithTimeIntervalSinceNow:0.1]];
+    }
+    [queue release];
+    
+    NSUInteger failed = 0;
+    for (AMDevice *device in devices) {
+        NSArray *result = [results objectForKey:device.udid];
+        int status = [[result objectAtIndex:0] intValue];
+        if (status) failed++;
+        printf("%s  %-24s  %-6s  %.1fs\n", [device.udid UTF8String], [device.deviceName UTF8String],
+               status ? "FAILED" : "ok", [[result objectAtIndex:1] doubleValue]);
+    }
+    for (NSString *udid in missing) {
+        printf("%-40s  %-24s  %-6s\n", [udid UTF8String], "", "MISSING");
+    }
+    printf("%lu devices, %lu failed, %lu missing\n", (unsigned long)[devices count], (unsigned long)failed,
+           (unsigned long)[missing count]);
+    
+    if ([devices count] == 0 || [missing count]) return 1;
+    if (count > 0 && [devices count] < (NSUInteger)count) return 1;
+    return failed ? 1 : 0;
+}
+
+// Time one call of block, averaged over n calls, in microseconds.
+static double microseconds_per_call(NSUInteger n, void (^block)(void))
+{
+    CFAbsoluteTime started = CFAbsoluteTimeGetCurrent();
+    for (NSUInteger i = 0; i < n; i++) {
+        NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+        block();
+        [pool drain];
+    }
+    return (CFAbsoluteTimeGetCurrent() - started) * 1e6 / n;
+}
+
+// -o plistbench: compare XML and binary property lists on replies saved with
+// -record (or any plist files), for size and for encode/decode time.  Needs no
+// device.
+static int run_plistbench(NSUserDefaults *arguments)
+{
+    NSString *from = [arguments stringForKey:@"from"];
+    NSInteger iterations = [arguments integerForKey:@"iterations"];
+    if (iterations <= 0) iterations = 100;
+    if (!from) {
+        NSLog(@"plistbench needs -from, a plist file or a directory of them");
+        return 1001;
+    }
+    
+    NSMutableArray *files = [NSMutableArray array];
+    BOOL isdir = NO;
+    if ([[NSFileManager defaultManager] fileExistsAtPath:from isDirectory:&isdir] && isdir) {
+        for (NSString *name in [[[NSFileManager defaultManager] contentsOfDirectoryAtPath:from error:NULL] sortedArrayUsingSelector:@selector(compare:)]) {
+            if ([[name pathExtension] isEqualToString:@"plist"]) [files addObject:[from stringByAppendingPathComponent:name]];
+        }
+    } else {
+        [files addObject:from];
+    }
+    
+    printf("%-40s %10s %10s %12s %12s %12s %12s\n", "reply", "xml bytes", "bin bytes",
+           "xml decode", "bin decode", "xml encode", "bin encode");
+    double totals[4] = { 0, 0, 0, 0 };
+    unsigned long long xmlBytes = 0, binBytes = 0;
+    int status = 0;
+    for (NSString *file in files) {
+        NSData *raw = [NSData dataWithContentsOfFile:file];
+        id plist = raw ? [NSPropertyListSerialization propertyListWithData:raw options:0 format:NULL error:NULL] : nil;
+        NSData *xml = plist ? [NSPropertyListSerialization dataWithPropertyList:plist format:NSPropertyListXMLFormat_v1_0 options:0 error:NULL] : nil;
+        NSData *bin = plist ? [AMService binaryPlistWithObject:plist] : nil;
+        if (!xml || !bin) {
+            NSLog(@"%@: not a property list", file);
+            status = 1;
+            continue;
+        }
+        if (![[AMService objectWithBinaryPlist:bin] isEqual:plist]) {
+            NSLog(@"%@: binary round trip doesn't match", file);
+            status = 1;
+        }
+        
+        double t[4];
+        t[0] = microseconds_per_call(iterations, ^{
+            [NSPropertyListSerialization propertyListWithData:xml options:0 format:NULL error:NULL];
+        });
+        t[1] = microseconds_per_call(iterations, ^{ [AMService objectWithBinaryPlist:bin]; });
+        t[2] = microseconds_per_call(iterations, ^{
+            [NSPropertyListSerialization dataWithPropertyList:plist format:NSPropertyListXMLFormat_v1_0 options:0 error:NULL];
+        });
+        t[3] = microseconds_per_call(iterations, ^{ [AMService binaryPlistWithObject:plist]; });
+        for (int i = 0; i < 4; i++) totals[i] += t[i];
+        xmlBytes += [xml length];
+        binBytes += [bin length];
+        printf("%-40s %10lu %10lu %10.1fus %10.1fus %10.1fus %10.1fus\n", [[file lastPathComponent] UTF8String],
+               (unsigned long)[xml length], (unsigned long)[bin length], t[0], t[1], t[2], t[3]);
+    }
+    if ([files count] > 1) {
+        printf("%-40s %10llu %10llu %10.1fus %10.1fus %10.1fus %10.1fus\n", "total",
+               xmlBytes, binBytes, totals[0], totals[1], totals[2], totals[3]);
+    }
+    return status;
+}
+
+#pragma mark bench
+
+// Deterministic bytes for the generated files, so every run (and every machine)
+// moves exactly the same data.
+static uint32_t bench_random(uint32_t *state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static BOOL bench_write_file(NSString *path, uint64_t size, uint32_t *seed)
+{
+    FILE *f = fopen([path fileSystemRepresentation], "wb");
+    if (!f) return NO;
+    uint32_t block[16384];
+    BOOL ok = YES;
+    while (size && ok) {
+        size_t n = size < sizeof(block) ? (size_t)size : sizeof(block);
+        for (size_t i = 0; i < (n + 3) / 4; i++) block[i] = bench_random(seed);
+        ok = (fwrite(block, 1, n, f) == n);
+        size -= n;
+    }
+    if (fclose(f) != 0) ok = NO;
+    return ok;
+}
+
+// A tree depth levels deep, with fanout subdirectories and files files of up
+// to size bytes in every directory.  Returns the number of entries made, or -1.
+static long bench_make_tree(NSString *dir, NSUInteger depth, NSUInteger fanout, NSUInteger files,
+                            uint64_t size, uint32_t *seed)
+{
+    if (![[NSFileManager defaultManager] createDirectoryAtPath:dir withIntermediateDirectories:YES
+                                                    attributes:nil error:NULL]) return -1;
+    long entries = 0;
+    for (NSUInteger i = 0; i < files; i++) {
+        NSString *name = [NSString stringWithFormat:@"file%03lu.dat", (unsigned long)i];
+        uint64_t n = size ? bench_random(seed) % size + 1 : 0;
+        if (!bench_write_file([dir stringByAppendingPathComponent:name], n, seed)) return -1;
+        entries++;
+    }
+    if (depth == 0) return entries;
+    for (NSUInteger i = 0; i < fanout; i++) {
+        NSString *name = [NSString stringWithFormat:@"dir%02lu", (unsigned long)i];
+        long n = bench_make_tree([dir stringByAppendingPathComponent:name], depth - 1, fanout, files, size, seed);
+        if (n < 0) return -1;
+        entries += n + 1;
+    }
+    return entries;
+}
+
+// Info.plists of about the size and shape a device sends, a quarter of them
+// System applications.
+static NSArray *bench_applications(NSUInteger count)
+{
+    NSMutableArray *apps = [NSMutableArray arrayWithCapacity:count];
+    for (NSUInteger i = 0; i < count; i++) {
+        NSString *bundleId = [NSString stringWithFormat:@"com.example.bench%04lu", (unsigned long)i];
+        NSString *name = [NSString stringWithFormat:@"Bench %lu", (unsigned long)i];
+        NSString *container = [NSString stringWithFormat:@"/private/var/mobile/Applications/%08lX-BE9C-4E1A-8D3F-%012lX",
+                               (unsigned long)(i * 2654435761u), (unsigned long)i];
+        NSMutableArray *icons = [NSMutableArray array];
+        NSMutableArray *groups = [NSMutableArray array];
+        for (NSUInteger k = 0; k < 8; k++) {
+            [icons addObject:[NSString stringWithFormat:@"Icon-%lu@2x.png", (unsigned long)(k * 16 + 29)]];
+            [groups addObject:[NSString stringWithFormat:@"ABCDE12345.%@.group%lu", bundleId, (unsigned long)k]];
+        }
+        NSDictionary *entitlements = [NSDictionary dictionaryWithObjectsAndKeys:
+            [@"ABCDE12345." stringByAppendingString:bundleId],  @"application-identifier",
+            groups,                                             @"keychain-access-groups",
+            [NSNumber numberWithBool:NO],                       @"get-task-allow",
+            nil];
+        NSDictionary *urlType = [NSDictionary dictionaryWithObjectsAndKeys:
+            bundleId,                                           @"CFBundleURLName",
+            [NSArray arrayWithObject:[NSString stringWithFormat:@"bench%lu", (unsigned long)i]], @"CFBundleURLSchemes",
+            nil];
+        [apps addObject:[NSDictionary dictionaryWithObjectsAndKeys:
+            bundleId,                                           @"CFBundleIdentifier",
+            name,                                               @"CFBundleDisplayName",
+            name,                                               @"CFBundleName",
+            @"Bench",                                           @"CFBundleExecutable",
+            [NSString stringWithFormat:@"1.%lu", (unsigned long)i], @"CFBundleVersion",
+            @"1.0",                                             @"CFBundleShortVersionString",
+            (i % 4 == 0) ? @"System" : @"User",                 @"ApplicationType",
+            container,                                          @"Container",
+            [container stringByAppendingPathComponent:@"Bench.app"], @"Path",
+            icons,                                              @"CFBundleIconFiles",
+            entitlements,                                       @"Entitlements",
+            [NSArray arrayWithObject:urlType],                  @"CFBundleURLTypes",
+            [NSArray arrayWithObjects:[NSNumber numberWithInt:1], [NSNumber numberWithInt:2], nil], @"UIDeviceFamily",
+            [NSArray arrayWithObject:@"armv7"],                 @"UIRequiredDeviceCapabilities",
+            [NSArray arrayWithObjects:@"UIInterfaceOrientationPortrait", @"UIInterfaceOrientationLandscapeLeft",
+                                      @"UIInterfaceOrientationLandscapeRight", nil], @"UISupportedInterfaceOrientations",
+            @"MainWindow",                                      @"NSMainNibFile",
+            @"en",                                              @"CFBundleDevelopmentRegion",
+            @"APPL",                                            @"CFBundlePackageType",
+            @"iPhoneOS",                                        @"DTPlatformName",
+            @"4.3",                                             @"MinimumOSVersion",
+            nil]];
+    }
+    return apps;
+}
+
+// An AFC stand-in serving root at the -latency and -bandwidth of the run
+static AFCStandInDirectory *newBenchDirectory(NSString *root, double latency, double bandwidth, NSUserDefaults *arguments)
+{
+    AFCStandInDirectory *dir = [[AFCStandInDirectory alloc] initWithRoot:root latency:latency];
+    [dir setBandwidth:bandwidth];
+    applyTransferArguments(dir, arguments);
+    return dir;
+}
+
+// Push local into remote (or, with pull, remote into local) over connections
+// stand-ins serving root, as -o push/pull -connections N do.  Returns the
+// result for the case, or nil if the copy failed.
+static NSDictionary *bench_transfer(BOOL pull, NSString *root, NSString *local, NSString *remote, NSUInteger connections,
+                                    double latency, double bandwidth, NSUserDefaults *arguments)
+{
+    NSMutableArray *dirs = [NSMutableArray array];
+    for (NSUInteger i = 0; i < connections; i++) {
+        AFCStandInDirectory *dir = newBenchDirectory(root, latency, bandwidth, arguments);
+        if (!dir) return nil;
+        [dirs addObject:dir];
+        [dir release];
+    }
+    AFCTreeTransfer *tree = [[[AFCTreeTransfer alloc] initWithConnections:dirs] autorelease];
+    CFAbsoluteTime started = CFAbsoluteTimeGetCurrent();
+    BOOL ok = pull ? [tree pullRemotePath:remote toLocalDir:local] : [tree pushLocalPath:local toRemoteDir:remote];
+    CFAbsoluteTime elapsed = CFAbsoluteTimeGetCurrent() - started;
+    if (!ok) {
+        NSLog(@"%@ failed: %@", pull ? @"pull" : @"push", tree.errors);
+        return nil;
+    }
+    uint64_t requests = 0;
+    for (AFCStandInDirectory *dir in dirs) requests += [dir requests];
+    return [NSDictionary dictionaryWithObjectsAndKeys:
+            [NSNumber numberWithDouble:elapsed],                        @"Seconds",
+            [NSNumber numberWithUnsignedLongLong:requests],             @"Requests",
+            [NSNumber numberWithUnsignedLongLong:tree.bytesTransferred], @"Bytes",
+            [NSNumber numberWithUnsignedInteger:tree.filesTransferred], @"Items",
+            nil];
+}
+
+static NSDictionary *bench_result(CFAbsoluteTime started, uint64_t requests, uint64_t bytes, NSUInteger items)
+{
+    return [NSDictionary dictionaryWithObjectsAndKeys:
+            [NSNumber numberWithDouble:CFAbsoluteTimeGetCurrent() - started], @"Seconds",
+            [NSNumber numberWithUnsignedLongLong:requests],             @"Requests",
+            [NSNumber numberWithUnsignedLongLong:bytes],                @"Bytes",
+            [NSNumber numberWithUnsignedInteger:items],                 @"Items",
+            nil];
+}
+
+// -o bench: time the real copy, walk and browse code against stand-ins for the
+// device - afc_standin for AFC and service_standin for installation_proxy - with
+// a simulated USB link (-latency MS per request, default 1, and -bandwidth MB/s,
+// default 30) over generated files and applications.  Since the link dominates,
+// the times are much the same on any machine, and the request counts are exact.
+//
+// The results can be saved as JSON with -save FILE and later runs checked against
+// them with -baseline FILE: a case whose time or request count has grown by more
+// than -tolerance percent (default 10) is a regression, and makes the exit status
+// 1.  The file is the one Bench/bench.c reads and writes (see bench_results.h).
+static int run_bench(NSUserDefaults *arguments)
+{
+    NSFileManager *fm = [NSFileManager defaultManager];
+    double latency = ([arguments objectForKey:@"latency"] ? [arguments doubleForKey:@"latency"] : 1.0) / 1000.0;
+    double bandwidth = ([arguments objectForKey:@"bandwidth"] ? [arguments doubleForKey:@"bandwidth"] : 30.0) * 1e6;
+    double scale = [arguments objectForKey:@"scale"] ? [arguments doubleForKey:@"scale"] : 1.0;
+    double tolerance = ([arguments objectForKey:@"tolerance"] ? [arguments doubleForKey:@"tolerance"] : 10.0) / 100.0;
+    NSInteger connections = [arguments integerForKey:@"connections"];
+    if (connections < 1) connections = 1;
+    NSString *scenarioList = [arguments stringForKey:@"scenarios"];
+    NSArray *scenarios = scenarioList ? [scenarioList componentsSeparatedByString:@","]
+                                      : [NSArray arrayWithObjects:@"storm", @"stream", @"tree", @"browse", nil];
+    NSString *baselineFile = [arguments stringForKey:@"baseline"];
+    bench_results results, baseline;
+    if (baselineFile) {
+        int rc = bench_results_load([baselineFile fileSystemRepresentation], &baseline);
+        if (rc != 0) {
+            NSLog(@"Can't read the baseline %@: %s", baselineFile, rc == EINVAL ? "not a bench results file" : strerror(rc));
+            return 1001;
+        }
+    }
+    if (scale <= 0) {
+        NSLog(@"-scale must be more than 0");
+        return 1001;
+    }
+    
+    memset(&results, 0, sizeof(results));
+    strcpy(results.driver, "mobileDeviceManager");
+    results.latency_ms = latency * 1000.0;
+    results.bandwidth_mbs = bandwidth / 1e6;
+    results.scale = scale;
+    results.connections = (unsigned)connections;
+    if (baselineFile && !bench_results_comparable(&baseline, &results)) {
+        NSLog(@"The baseline was run by %s with %gms latency, %gMB/s, scale %g and %u connections, not by %s with %gms, %gMB/s, "
+              "scale %g and %u - the comparison means little", baseline.driver, baseline.latency_ms, baseline.bandwidth_mbs,
+              baseline.scale, baseline.connections, results.driver, results.latency_ms, results.bandwidth_mbs,
+              results.scale, results.connections);
+    }
+    
+    // device/ is what the stand-ins serve, local/ the Mac side
+    NSString *work = [arguments stringForKey:@"work"];
+    if (!work) work = NSTemporaryDirectory();
+    work = [work stringByAppendingPathComponent:[NSString stringWithFormat:@"mobileDeviceManager-bench-%d", getpid()]];
+    NSString *device = [work stringByAppendingPathComponent:@"device"];
+    NSString *local = [work stringByAppendingPathComponent:@"local"];
+    NSString *pulled = [work stringByAppendingPathComponent:@"pulled"];
+    [fm removeItemAtPath:work error:NULL];
+    if (![fm createDirectoryAtPath:device withIntermediateDirectories:YES attributes:nil error:NULL] ||
+        ![fm createDirectoryAtPath:local withIntermediateDirectories:YES attributes:nil error:NULL]) {
+        NSLog(@"Can't create %@", work);
+        return 1;
+    }
+    
+    int status = 0;
+    uint32_t seed = 2463534242u;
+    
+    for (NSString *scenario in scenarios) {
+        NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+        NSMutableArray *cases = [NSMutableArray array];
+        BOOL ok = YES;
+        
+        if ([scenario isEqualToString:@"storm"]) {
+            // lots of small files, where the time goes on round trips
+            NSString *from = [local stringByAppendingPathComponent:@"storm"];
+            NSUInteger files = (NSUInteger)(50 * scale) + 1;
+            ok = bench_make_tree(from, 1, 20, files, 8192, &seed) >= 0;
+            NSDictionary *push = ok ? bench_transfer(NO, device, from, @"/", connections, latency, bandwidth, arguments) : nil;
+            NSDictionary *pull = push ? bench_transfer(YES, device, pulled, @"/storm", connections, latency, bandwidth, arguments) : nil;
+            if (push) [cases addObject:[NSArray arrayWithObjects:@"storm.push", push, nil]];
+            if (pull) [cases addObject:[NSArray arrayWithObjects:@"storm.pull", pull, nil]];
+            ok = pull && [fm contentsEqualAtPath:from andPath:[device stringByAppendingPathComponent:@"storm"]] &&
+                 [fm contentsEqualAtPath:from andPath:pulled];
+        } else if ([scenario isEqualToString:@"stream"]) {
+            // one big file, where the time goes on the bandwidth
+            NSString *from = [local stringByAppendingPathComponent:@"stream"];
+            NSString *file = [from stringByAppendingPathComponent:@"stream.dat"];
+            ok = [fm createDirectoryAtPath:from withIntermediateDirectories:YES attributes:nil error:NULL] &&
+                 bench_write_file(file, (uint64_t)(64 * 1024 * 1024 * scale), &seed);
+            NSDictionary *push = ok ? bench_transfer(NO, device, from, @"/", connections, latency, bandwidth, arguments) : nil;
+            NSDictionary *pull = push ? bench_transfer(YES, device, pulled, @"/stream", connections, latency, bandwidth, arguments) : nil;
+            if (push) [cases addObject:[NSArray arrayWithObjects:@"stream.push", push, nil]];
+            if (pull) [cases addObject:[NSArray arrayWithObjects:@"stream.pull", pull, nil]];
+            ok = pull && [fm contentsEqualAtPath:file andPath:[pulled stringByAppendingPathComponent:@"stream.dat"]];
+        } else if ([scenario isEqualToString:@"tree"]) {
+            // a deep tree of empty files, listed with their sizes as -o listFiles -recursive -stat does
+            NSUInteger depth = scale >= 1 ? 5 + (NSUInteger)log2(scale) : 4;
+            long entries = bench_make_tree([device stringByAppendingPathComponent:@"tree"], depth, 3, 4, 0, &seed);
+            AFCStandInDirectory *dir = entries >= 0 ? newBenchDirectory(device, latency, bandwidth, arguments) : nil;
+            __block NSUInteger seen = 0;
+            CFAbsoluteTime started = CFAbsoluteTimeGetCurrent();
+            ok = [dir walkDirectory:@"/tree" depth:0 matching:nil withInfo:YES
+                         usingBlock:^BOOL(NSString *entry, BOOL isdir, NSDictionary *info) {
+                seen++;
+                return YES;
+            }];
+            if (ok) [cases addObject:[NSArray arrayWithObjects:@"tree.walk", bench_result(started, [dir requests], 0, seen), nil]];
+            if (ok && seen != (NSUInteger)entries) {
+                NSLog(@"tree.walk saw %lu entries, not %ld", (unsigned long)seen, entries);
+                ok = NO;
+            }
+            [dir release];
+        } else if ([scenario isEqualToString:@"browse"]) {
+            // every application, then just the versions, as -o list [-attributes] does
+            NSArray *apps = bench_applications((NSUInteger)(300 * scale) + 1);
+            NSArray *attributes = [NSArray arrayWithObject:@"CFBundleVersion"];
+            for (int projected = 0; projected < 2 && ok; projected++) {
+                AMInstallationProxyStandIn *proxy = [[AMInstallationProxyStandIn alloc] initWithApplications:apps latency:latency];
+                [proxy setBandwidth:bandwidth];
+                __block NSUInteger seen = 0;
+                CFAbsoluteTime started = CFAbsoluteTimeGetCurrent();
+                ok = [proxy browseType:nil bundleIds:nil attributes:(projected ? attributes : nil)
+                            usingBlock:^BOOL(AMApplication *app) {
+                    seen++;
+                    return YES;
+                }];
+                if (ok) {
+                    [cases addObject:[NSArray arrayWithObjects:(projected ? @"browse.projected" : @"browse.full"),
+                                      bench_result(started, [proxy requests], 0, seen), nil]];
+                }
+                if (ok && seen != [apps count]) {
+                    NSLog(@"browse saw %lu applications, not %lu", (unsigned long)seen, (unsigned long)[apps count]);
+                    ok = NO;
+                }
+                if (!ok && proxy.lasterror) NSLog(@"browse failed: %@", proxy.lasterror);
+                [proxy release];
+            }
+        } else {
+            NSLog(@"Unknown scenario %@ - use storm, stream, tree or browse", scenario);
+            [pool drain];
+            status = 1001;
+            break;
+        }
+        
+        if (!ok) {
+            NSLog(@"%@ failed", scenario);
+            status = 1;
+        }
+        for (NSArray *c in cases) {
+            NSDictionary *r = [c objectAtIndex:1];
+            bench_results_add(&results, [[c objectAtIndex:0] UTF8String], [[r objectForKey:@"Seconds"] doubleValue],
+                              [[r objectForKey:@"Requests"] unsignedLongLongValue], [[r objectForKey:@"Bytes"] unsignedLongLongValue],
+                              [[r objectForKey:@"Items"] unsignedLongLongValue]);
+        }
+        [fm removeItemAtPath:pulled error:NULL];
+        [pool drain];
+    }
+    
+    if (bench_results_report(stdout, &results, baselineFile ? &baseline : NULL, tolerance) && status == 0) status = 1;
+    
+    NSString *save = [arguments stringForKey:@"save"];
+    if (save && status != 1001) {
+        int rc = bench_results_save(&results, [save fileSystemRepresentation]);
+        if (rc != 0) {
+            NSLog(@"Can't write %@: %s", save, strerror(rc));
+            status = 1;
+        }
+    }
+    if (![arguments boolForKey:@"keep"]) [fm removeItemAtPath:work error:NULL];
+    return status;
+}
+
+#pragma mark selftest
+
+// The applications of bench_applications() a browse for type should return
+static NSUInteger selftest_count_type(NSArray *apps, NSString *type)
+{
+    NSUInteger n = 0;
+    for (NSDictionary *app in apps) {
+        if (!type || [[app objectForKey:@"ApplicationType"] isEqual:type]) n++;
+    }
+    return n;
+}
+
+// Browsing for "Any" type is the same as browsing with no type at all
+static NSString *selftest_browse_any(NSString *work)
+{
+    NSArray *apps = bench_applications(45);
+    NSArray *types = [NSArray arrayWithObjects:@"Any", @"User", @"System", nil];
+    NSString *failure = nil;
+    for (NSString *type in types) {
+        AMInstallationProxyStandIn *proxy = [[AMInstallationProxyStandIn alloc] initWithApplications:apps latency:0];
+        __block NSUInteger seen = 0;
+        BOOL ok = [proxy browseType:type bundleIds:nil attributes:nil usingBlock:^BOOL(AMApplication *app) {
+            seen++;
+            return YES;
+        }];
+        NSUInteger want = selftest_count_type(apps, [type isEqualToString:@"Any"] ? nil : type);
+        if (!ok) {
+            failure = [NSString stringWithFormat:@"browse %@ failed: %@", type, proxy.lasterror];
+        } else if (seen != want) {
+            failure = [NSString stringWithFormat:@"browse %@ saw %lu applications, not %lu", type,
+                       (unsigned long)seen, (unsigned long)want];
+        }
+        [proxy release];
+        if (failure) break;
+    }
+    return failure;
+}
+
+// A browse which the device ends with an Error rather than "Complete" fails,
+// with that error, even though every application it sent was still seen
+static NSString *selftest_browse_error(NSString *work)
+{
+    NSArray *apps = bench_applications(45);
+    AMInstallationProxyStandIn *proxy = [[AMInstallationProxyStandIn alloc] initWithApplications:apps latency:0];
+    if (!proxy) return @"can't start the stand-in";
+    proxy.browseError = @"APIInternalError";
+    __block NSUInteger seen = 0;
+    BOOL ok = [proxy browseType:nil bundleIds:nil attributes:nil usingBlock:^BOOL(AMApplication *app) {
+        seen++;
+        return YES;
+    }];
+    NSString *failure = nil;
+    if (ok) {
+        failure = @"a browse ending in an error succeeded";
+    } else if ([proxy.lasterror rangeOfString:@"APIInternalError"].location == NSNotFound) {
+        failure = [NSString stringWithFormat:@"a browse ending in an error failed with \"%@\"", proxy.lasterror];
+    } else if (seen != [apps count]) {
+        failure = [NSString stringWithFormat:@"browse saw %lu applications, not %lu",
+                   (unsigned long)seen, (unsigned long)[apps count]];
+    }
+    [proxy release];
+    return failure;
+}
+
+// A service which never answers fails once its timeout has passed, rather than
+// hanging - whether it is asked with a blocking request or a future
+static NSString *selftest_service_timeout(NSString *work)
+{
+    AMInstallationProxyStandIn *proxy = [[AMInstallationProxyStandIn alloc] initWithApplications:[NSArray array] latency:0];
+    if (!proxy) return @"can't start the stand-in";
+    NSString *failure = nil;
+    if (proxy.timeout <= 0) failure = @"a new service has no timeout";
+    proxy.mute = YES;
+    proxy.timeout = 0.5;
+
+    CFAbsoluteTime started = CFAbsoluteTimeGetCurrent();
+    if (!failure && [proxy browse:nil]) failure = @"a browse nobody answered succeeded";
+    if (!failure && CFAbsoluteTimeGetCurrent() - started > 5) {
+        failure = [NSString stringWithFormat:@"a blocking request took %.1fs to time out", CFAbsoluteTimeGetCurrent() - started];
+    }
+    if (!failure) {
+        // 0 means the service's timeout
+        NSDictionary *message = [NSDictionary dictionaryWithObject:@"Browse" forKey:@"Command"];
+        AMServiceFuture *f = [proxy requestAsync:message timeout:0];
+        if (![f waitUntilDate:[NSDate dateWithTimeIntervalSinceNow:5]]) {
+            [f cancel];
+            failure = @"a future nobody answered was still waiting after 5s";
+        } else if (!f.error) {
+            failure = @"a future nobody answered succeeded";
+        }
+    }
+    [proxy release];
+    return failure;
+}
+
+// A big file that fails part way through one of its ranges is reported and
+// removed, rather than counted as copied and left half written
+static NSString *selftest_pull_error(NSString *work)
+{
+    NSFileManager *fm = [NSFileManager defaultManager];
+    NSString *root = [work stringByAppendingPathComponent:@"device"];
+    NSString *tree = [root stringByAppendingPathComponent:@"tree"];
+    NSString *local = [work stringByAppendingPathComponent:@"local"];
+    uint32_t seed = 1;
+    if (![fm createDirectoryAtPath:tree withIntermediateDirectories:YES attributes:nil error:NULL] ||
+        !bench_write_file([tree stringByAppendingPathComponent:@"big"], 12 * 1024 * 1024, &seed) ||
+        !bench_write_file([tree stringByAppendingPathComponent:@"small"], 4096, &seed)) {
+        return [NSString stringWithFormat:@"can't create the files in %@", tree];
+    }
+
+    NSMutableArray *dirs = [NSMutableArray array];
+    for (NSUInteger i = 0; i < 2; i++) {
+        AFCStandInDirectory *dir = [[AFCStandInDirectory alloc] initWithRoot:root latency:0];
+        if (!dir) return @"can't start the stand-in";
+        // the first read of big and its first range are fine, the later ranges aren't
+        [dir failReadsFrom:6 * 1024 * 1024];
+        [dirs addObject:dir];
+        [dir release];
+    }
+    AFCTreeTransfer *transfer = [[[AFCTreeTransfer alloc] initWithConnections:dirs] autorelease];
+    if ([transfer pullRemotePath:@"/tree" toLocalDir:local]) return @"a pull with a failed range succeeded";
+    if ([fm fileExistsAtPath:[local stringByAppendingPathComponent:@"big"]]) return @"the partial copy was left behind";
+    if (![fm fileExistsAtPath:[local stringByAppendingPathComponent:@"small"]]) return @"the file that could be read wasn't copied";
+    if (transfer.filesTransferred != 1) {
+        return [NSString stringWithFormat:@"counted %lu files copied, not 1", (unsigned long)transfer.filesTransferred];
+    }
+    for (NSString *error in transfer.errors) {
+        if ([error rangeOfString:@"incomplete"].location != NSNotFound) return nil;
+    }
+    return [NSString stringWithFormat:@"the failed file wasn't reported: %@", transfer.errors];
+}
+
+// A file a sync rewrites is written alongside and renamed into place, so a
+// new inode means it was copied again
+static ino_t selftest_inode(NSString *path)
+{
+    struct stat s;
+    return lstat([path fileSystemRepresentation], &s) == 0 ? s.st_ino : 0;
+}
+
+static int64_t selftest_mtime(NSString *path)
+{
+    struct stat s;
+    if (lstat([path fileSystemRepresentation], &s) != 0) return -1;
+#ifdef __APPLE__
+    return (int64_t)s.st_mtimespec.tv_sec * 1000000000LL + s.st_mtimespec.tv_nsec;
+#else
+    return (int64_t)s.st_mtim.tv_sec * 1000000000LL + s.st_mtim.tv_nsec;
+#endif
+}
+
+// A sync copies what differs and only that: a second sync copies nothing, a
+// changed file is copied again, a dry run touches nothing, -delete removes
+// what the source doesn't have, and pulled files take the device's times
+static NSString *selftest_sync_inventory(NSString *work)
+{
+    NSFileManager *fm = [NSFileManager defaultManager];
+    NSString *root = [work stringByAppendingPathComponent:@"device"];
+    NSString *local = [work stringByAppendingPathComponent:@"local/tree"];
+    NSString *pulled = [work stringByAppendingPathComponent:@"pulled"];
+    NSString *remote = [root stringByAppendingPathComponent:@"tree"];
+    NSArray *files = [NSArray arrayWithObjects:@"a", @"sub/b", @"sub/c", nil];
+    uint32_t seed = 1;
+
+    if (![fm createDirectoryAtPath:[local stringByAppendingPathComponent:@"sub"] withIntermediateDirectories:YES attributes:nil error:NULL] ||
+        ![fm createDirectoryAtPath:root withIntermediateDirectories:YES attributes:nil error:NULL] ||
+        !bench_write_file([local stringByAppendingPathComponent:@"a"], 300 * 1024, &seed) ||
+        !bench_write_file([local stringByAppendingPathComponent:@"sub/b"], 4096, &seed) ||
+        !bench_write_file([local stringByAppendingPathComponent:@"sub/c"], 100, &seed) ||
+        symlink("a", [[local stringByAppendingPathComponent:@"link"] fileSystemRepresentation]) != 0) {
+        return [NSString stringWithFormat:@"can't create the files in %@", local];
+    }
+    AFCStandInDirectory *dir = [[[AFCStandInDirectory alloc] initWithRoot:root latency:0] autorelease];
+    if (!dir) return @"can't start the stand-in";
+
+    if (![dir syncLocalPath:local toRemoteDir:@"/" options:0]) return [NSString stringWithFormat:@"the first push failed: %@", dir.lasterror];
+    for (NSString *rel in files) {
+        if (![[NSData dataWithContentsOfFile:[local stringByAppendingPathComponent:rel]]
+              isEqual:[NSData dataWithContentsOfFile:[remote stringByAppendingPathComponent:rel]]]) {
+            return [NSString stringWithFormat:@"%@ wasn't pushed", rel];
+        }
+    }
+    if (![[fm destinationOfSymbolicLinkAtPath:[remote stringByAppendingPathComponent:@"link"] error:NULL] isEqualToString:@"a"]) {
+        return @"the link wasn't pushed";
+    }
+
+    ino_t a = selftest_inode([remote stringByAppendingPathComponent:@"a"]);
+    ino_t b = selftest_inode([remote stringByAppendingPathComponent:@"sub/b"]);
+    ino_t c = selftest_inode([remote stringByAppendingPathComponent:@"sub/c"]);
+    if (![dir syncLocalPath:local toRemoteDir:@"/" options:0]) return [NSString stringWithFormat:@"the second push failed: %@", dir.lasterror];
+    if (selftest_inode([remote stringByAppendingPathComponent:@"a"]) != a ||
+        selftest_inode([remote stringByAppendingPathComponent:@"sub/b"]) != b ||
+        selftest_inode([remote stringByAppendingPathComponent:@"sub/c"]) != c) {
+        return @"a second push copied files which hadn't changed";
+    }
+
+    if (!bench_write_file([local stringByAppendingPathComponent:@"sub/b"], 5000, &seed) ||
+        ![dir syncLocalPath:local toRemoteDir:@"/" options:0]) {
+        return [NSString stringWithFormat:@"the push of a changed file failed: %@", dir.lasterror];
+    }
+    if (![[NSData dataWithContentsOfFile:[local stringByAppendingPathComponent:@"sub/b"]]
+          isEqual:[NSData dataWithContentsOfFile:[remote stringByAppendingPathComponent:@"sub/b"]]]) {
+        return @"a changed file wasn't pushed again";
+    }
+    if (selftest_inode([remote stringByAppendingPathComponent:@"a"]) != a) return @"pushing one changed file copied another";
+
+    // things on the device which aren't here, and a change which a dry run
+    // mustn't send
+    if (!bench_write_file([remote stringByAppendingPathComponent:@"extra"], 10, &seed) ||
+        ![fm createDirectoryAtPath:[remote stringByAppendingPathComponent:@"old/older"] withIntermediateDirectories:YES attributes:nil error:NULL] ||
+        !bench_write_file([remote stringByAppendingPathComponent:@"old/older/x"], 10, &seed) ||
+        !bench_write_file([local stringByAppendingPathComponent:@"sub/c"], 200, &seed)) {
+        return @"can't change the files";
+    }
+    if (![dir syncLocalPath:local toRemoteDir:@"/" options:AFCSyncDelete | AFCSyncDryRun]) {
+        return [NSString stringWithFormat:@"a dry run failed: %@", dir.lasterror];
+    }
+    if (selftest_inode([remote stringByAppendingPathComponent:@"sub/c"]) != c ||
+        ![fm fileExistsAtPath:[remote stringByAppendingPathComponent:@"extra"]] ||
+        ![fm fileExistsAtPath:[remote stringByAppendingPathComponent:@"old/older/x"]]) {
+        return @"a dry run changed the device";
+    }
+    if (![dir syncLocalPath:local toRemoteDir:@"/" options:AFCSyncDelete]) {
+        return [NSString stringWithFormat:@"a push with -delete failed: %@", dir.lasterror];
+    }
+    if ([fm fileExistsAtPath:[remote stringByAppendingPathComponent:@"extra"]] ||
+        [fm fileExistsAtPath:[remote stringByAppendingPathComponent:@"old"]]) {
+        return @"-delete left files the source doesn't have";
+    }
+    if (selftest_inode([remote stringByAppendingPathComponent:@"sub/c"]) == c) return @"the change the dry run skipped wasn't pushed";
+
+    // the other way: pulled files get the device's times, to the microsecond
+    // utimes() keeps, and so a second pull finds nothing to do
+    if (![dir syncRemotePath:@"/tree" toLocalDir:pulled options:0]) return [NSString stringWithFormat:@"the pull failed: %@", dir.lasterror];
+    NSMutableArray *inodes = [NSMutableArray array];
+    for (NSString *rel in files) {
+        NSString *to = [[pulled stringByAppendingPathComponent:@"tree"] stringByAppendingPathComponent:rel];
+        if (![[NSData dataWithContentsOfFile:[remote stringByAppendingPathComponent:rel]] isEqual:[NSData dataWithContentsOfFile:to]]) {
+            return [NSString stringWithFormat:@"%@ wasn't pulled", rel];
+        }
+        if (selftest_mtime(to) / 1000 != selftest_mtime([remote stringByAppendingPathComponent:rel]) / 1000) {
+            return [NSString stringWithFormat:@"%@ was pulled without the device's time", rel];
+        }
+        [inodes addObject:[NSNumber numberWithUnsignedLongLong:selftest_inode(to)]];
+    }
+    if (![dir syncRemotePath:@"/tree" toLocalDir:pulled options:0]) return [NSString stringWithFormat:@"the second pull failed: %@", dir.lasterror];
+    for (NSUInteger i = 0; i < [files count]; i++) {
+        NSString *to = [[pulled stringByAppendingPathComponent:@"tree"] stringByAppendingPathComponent:[files objectAtIndex:i]];
+        if (selftest_inode(to) != [[inodes objectAtIndex:i] unsignedLongLongValue]) return @"a second pull copied files which hadn't changed";
+    }
+    return nil;
+}
+
+static BOOL selftest_same_file(NSString *path1, NSString *path2)
+{
+    NSData *data = [NSData dataWithContentsOfFile:path1];
+    return data && [data isEqual:[NSData dataWithContentsOfFile:path2]];
+}
+
+// What the last staging did, to compare with what it should have done
+static NSString *selftest_staged(AFCStagingCache *cache, NSUInteger sent, NSUInteger patched, NSUInteger skipped, uint64_t bytes)
+{
+    if (cache.filesSent == sent && cache.filesPatched == patched && cache.filesSkipped == skipped && cache.bytesSent == bytes) return nil;
+    return [NSString stringWithFormat:@"%lu sent, %lu patched, %lu skipped, %llu bytes rather than %lu, %lu, %lu, %llu",
+            (unsigned long)cache.filesSent, (unsigned long)cache.filesPatched, (unsigned long)cache.filesSkipped,
+            (unsigned long long)cache.bytesSent, (unsigned long)sent, (unsigned long)patched, (unsigned long)skipped,
+            (unsigned long long)bytes];
+}
+
+// Staging a bundle again sends only what changed: nothing when nothing has,
+// the changed piece of a file written over the old copy, files the bundle has
+// lost removed, and a whole file when the device's copy isn't what the
+// manifest saw written
+static NSString *selftest_staging_cache(NSString *work)
+{
+    NSFileManager *fm = [NSFileManager defaultManager];
+    NSString *root = [work stringByAppendingPathComponent:@"device"];
+    NSString *bundle = [work stringByAppendingPathComponent:@"Test.app"];
+    NSString *staged = [root stringByAppendingPathComponent:@"PublicStaging/Test.app"];
+    NSString *big = @"Test", *small = @"Resources/Info.plist", *gone = @"Resources/Old.nib";
+    const uint32_t chunk = 64 * 1024;
+    uint32_t seed = 1;
+
+    if (![fm createDirectoryAtPath:[bundle stringByAppendingPathComponent:@"Resources"] withIntermediateDirectories:YES attributes:nil error:NULL] ||
+        ![fm createDirectoryAtPath:root withIntermediateDirectories:YES attributes:nil error:NULL] ||
+        !bench_write_file([bundle stringByAppendingPathComponent:big], 4 * chunk + 1000, &seed) ||
+        !bench_write_file([bundle stringByAppendingPathComponent:small], 700, &seed) ||
+        !bench_write_file([bundle stringByAppendingPathComponent:gone], 300, &seed)) {
+        return [NSString stringWithFormat:@"can't create the files in %@", bundle];
+    }
+    AFCStandInDirectory *dir = [[[AFCStandInDirectory alloc] initWithRoot:root latency:0] autorelease];
+    if (!dir) return @"can't start the stand-in";
+
+    NSString *failure = nil;
+    AFCStagingCache *cache = [[[AFCStagingCache alloc] initWithDirectory:dir root:@"/PublicStaging"] autorelease];
+    cache.chunkSize = chunk;
+    if (![cache stageLocalPath:bundle]) return [NSString stringWithFormat:@"the first staging failed: %@", cache.lasterror];
+    if ((failure = selftest_staged(cache, 3, 0, 0, 4 * chunk + 2000))) return [@"first staging: " stringByAppendingString:failure];
+    for (NSString *rel in [NSArray arrayWithObjects:big, small, gone, nil]) {
+        if (!selftest_same_file([bundle stringByAppendingPathComponent:rel], [staged stringByAppendingPathComponent:rel])) {
+            return [NSString stringWithFormat:@"%@ wasn't staged", rel];
+        }
+    }
+
+    // another cache goes by the manifest on the device
+    cache = [[[AFCStagingCache alloc] initWithDirectory:dir root:@"/PublicStaging"] autorelease];
+    cache.chunkSize = chunk;
+    if (![cache stageLocalPath:bundle]) return [NSString stringWithFormat:@"restaging failed: %@", cache.lasterror];
+    if ((failure = selftest_staged(cache, 0, 0, 3, 0))) return [@"restaging unchanged: " stringByAppendingString:failure];
+
+    // a few bytes changed in the second piece, then the last piece cut short;
+    // the rest of the old copy stays where it is
+    NSString *local = [bundle stringByAppendingPathComponent:big];
+    NSString *remote = [staged stringByAppendingPathComponent:big];
+    ino_t inode = selftest_inode(remote);
+    int fd = open([local fileSystemRepresentation], O_WRONLY);
+    BOOL changed = (fd >= 0 && pwrite(fd, "changed", 7, chunk + 100) == 7);
+    if (fd >= 0) close(fd);
+    if (!changed) return @"can't change the bundle";
+    if (![cache stageLocalPath:bundle]) return [NSString stringWithFormat:@"staging a changed file failed: %@", cache.lasterror];
+    if ((failure = selftest_staged(cache, 0, 1, 2, chunk))) return [@"one piece changed: " stringByAppendingString:failure];
+    if (truncate([local fileSystemRepresentation], 3 * chunk + 10) != 0) return @"can't change the bundle";
+    if (![cache stageLocalPath:bundle]) return [NSString stringWithFormat:@"staging a shorter file failed: %@", cache.lasterror];
+    if ((failure = selftest_staged(cache, 0, 1, 2, 10))) return [@"file cut short: " stringByAppendingString:failure];
+    if (!selftest_same_file(local, remote)) return @"the staged copy doesn't match after patching";
+    if (selftest_inode(remote) != inode) return @"a patched file was written afresh";
+
+    // files the bundle no longer has go, and are forgotten
+    if (![fm removeItemAtPath:[bundle stringByAppendingPathComponent:gone] error:NULL]) return @"can't change the bundle";
+    if (![cache stageLocalPath:bundle]) return [NSString stringWithFormat:@"staging without a file failed: %@", cache.lasterror];
+    if ([fm fileExistsAtPath:[staged stringByAppendingPathComponent:gone]]) return @"a file removed from the bundle was left staged";
+    if ((failure = selftest_staged(cache, 0, 0, 2, 0))) return [@"file removed: " stringByAppendingString:failure];
+
+    // changed on the device, to the same size: the manifest no longer speaks
+    // for it, so it is sent whole
+    seed = 99;
+    if (!bench_write_file([staged stringByAppendingPathComponent:small], 700, &seed)) return @"can't change the staged copy";
+    if (![cache stageLocalPath:bundle]) return [NSString stringWithFormat:@"staging over a changed copy failed: %@", cache.lasterror];
+    if ((failure = selftest_staged(cache, 1, 0, 1, 700))) return [@"staged copy changed: " stringByAppendingString:failure];
+    if (!selftest_same_file([bundle stringByAppendingPathComponent:small], [staged stringByAppendingPathComponent:small])) {
+        return @"a copy changed on the device wasn't put right";
+    }
+
+    // an unreadable manifest means everything is sent again
+    seed = 7;
+    if (!bench_write_file([root stringByAppendingPathComponent:@"PublicStaging/.staging-manifest.plist"], 100, &seed)) return @"can't damage the manifest";
+    cache = [[[AFCStagingCache alloc] initWithDirectory:dir root:@"/PublicStaging"] autorelease];
+    cache.chunkSize = chunk;
+    if (![cache stageLocalPath:bundle]) return [NSString stringWithFormat:@"staging with a damaged manifest failed: %@", cache.lasterror];
+    if ((failure = selftest_staged(cache, 2, 0, 0, 3 * chunk + 10 + 700))) return [@"damaged manifest: " stringByAppendingString:failure];
+    return nil;
+}
+
+// What the native backend's device notifications have said
+struct selftest_native_watch {
+    am_device   device;
+    BOOL        detached;
+    BOOL        unsubscribed;
+};
+
+static void selftest_native_notified(struct am_device_notification_callback_info *info, void *data)
+{
+    struct selftest_native_watch *watch = data;
+    if (info->msg == ADNCI_MSG_CONNECTED) watch->device = info->dev;
+    else if (info->msg == ADNCI_MSG_DISCONNECTED) watch->detached = YES;
+    else if (info->msg == ADNCI_MSG_UNSUBSCRIBED) watch->unsubscribed = YES;
+}
+
+// Run the run loop, where the native backend's notifications arrive, until
+// done() or 5s have passed
+static BOOL selftest_run_until(BOOL (^done)(void))
+{
+    CFAbsoluteTime give_up = CFAbsoluteTimeGetCurrent() + 5;
+    while (!done()) {
+        if (CFAbsoluteTimeGetCurrent() > give_up) return NO;
+        CFRunLoopRunInMode(kCFRunLoopDefaultMode, 0.05, true);
+    }
+    return YES;
+}
+
+// Connect to device, start a session and AFC, and read back what the stand-in
+// is serving as /hello
+static NSString *selftest_native_afc_read(const md_backend *md, am_device device, NSString *udid, NSData *hello)
+{
+    mach_error_t err = md->AMDeviceConnect(device);
+    if (err) return [NSString stringWithFormat:@"AMDeviceConnect failed: %x", err];
+
+    NSString *failure = nil;
+    NSString *value = [(NSString*)md->AMDeviceCopyValue(device, NULL, CFSTR("UniqueDeviceID")) autorelease];
+    if (![value isEqual:udid]) failure = [NSString stringWithFormat:@"the UniqueDeviceID was %@, not %@", value, udid];
+    if (!failure && (err = md->AMDeviceStartSession(device))) failure = [NSString stringWithFormat:@"AMDeviceStartSession failed: %x", err];
+
+    am_service service;
+    afc_connection afc = NULL;
+    if (!failure && (err = md->AMDeviceStartService(device, CFSTR("com.apple.afc"), &service, NULL))) {
+        failure = [NSString stringWithFormat:@"AMDeviceStartService failed: %x", err];
+    }
+    // the connection owns the service socket, whether it opens or not
+    if (!failure && (err = md->AFCConnectionOpen(service, 0, &afc))) failure = [NSString stringWithFormat:@"AFCConnectionOpen failed: %x", err];
+    if (!failure) {
+        afc_file_ref ref;
+        char buf[256];
+        uint64_t len = sizeof(buf);
+        if ((err = md->AFCFileRefOpen(afc, "/hello", 1, &ref))) {
+            failure = [NSString stringWithFormat:@"AFCFileRefOpen failed: %x", err];
+        } else {
+            if ((err = md->AFCFileRefRead(afc, ref, buf, &len))) {
+                failure = [NSString stringWithFormat:@"AFCFileRefRead failed: %x", err];
+            } else if (![[NSData dataWithBytes:buf length:(NSUInteger)len] isEqual:hello]) {
+                failure = [NSString stringWithFormat:@"read %llu bytes of /hello, which aren't what it holds", (unsigned long long)len];
+            }
+            md->AFCFileRefClose(afc, ref);
+        }
+    }
+    if (afc) md->AFCConnectionClose(afc);
+    if (!failure && (err = md->AMDeviceStopSession(device))) failure = [NSString stringWithFormat:@"AMDeviceStopSession failed: %x", err];
+    md->AMDeviceDisconnect(device);
+    return failure;
+}
+
+// A device which asks for SSL is refused with MD_E_SSL_REQUIRED, rather than
+// the session being used in the clear
+static NSString *selftest_native_ssl_refused(const md_backend *md, am_device device)
+{
+    mach_error_t err = md->AMDeviceConnect(device);
+    if (err) return [NSString stringWithFormat:@"AMDeviceConnect failed: %x", err];
+
+    NSString *failure = nil;
+    err = md->AMDeviceStartSession(device);
+    if (err != MD_E_SSL_REQUIRED) {
+        failure = [NSString stringWithFormat:@"AMDeviceStartSession returned %x, not MD_E_SSL_REQUIRED", err];
+    } else {
+        // and the connection lockdown wanted TLS on has been dropped
+        am_service service;
+        err = md->AMDeviceStartService(device, CFSTR("com.apple.afc"), &service, NULL);
+        if (!err) {
+            close(service);
+            failure = @"a service was started after the session was refused";
+        }
+    }
+    md->AMDeviceDisconnect(device);
+    return failure;
+}
+
+// Run the native backend against an AMUsbmuxdStandIn with one device on it,
+// from its device notification until it goes away
+static NSString *selftest_native(NSString *work, BOOL requiresSSL)
+{
+    NSString *root = [work stringByAppendingPathComponent:@"device"];
+    NSData *hello = [@"hello from the stand-in\n" dataUsingEncoding:NSUTF8StringEncoding];
+    if (![[NSFileManager defaultManager] createDirectoryAtPath:root withIntermediateDirectories:YES attributes:nil error:NULL] ||
+        ![hello writeToFile:[root stringByAppendingPathComponent:@"hello"] atomically:NO]) {
+        return [NSString stringWithFormat:@"can't create the files in %@", root];
+    }
+    // a socket path can only be about 100 bytes, which -work may not leave room for
+    char dir[] = "/tmp/mobileDeviceManager-usbmuxd.XXXXXX";
+    if (!mkdtemp(dir)) return [NSString stringWithFormat:@"can't create %s: %s", dir, strerror(errno)];
+    NSString *socketPath = [[NSString stringWithUTF8String:dir] stringByAppendingPathComponent:@"usbmuxd"];
+    AMUsbmuxdStandIn *usbmuxd = [[AMUsbmuxdStandIn alloc] initWithRoot:root socketPath:socketPath];
+    if (!usbmuxd) {
+        rmdir(dir);
+        return @"can't start the usbmuxd stand-in";
+    }
+    usbmuxd.requiresSSL = requiresSSL;
+    md_native_set_usbmux_address([socketPath fileSystemRepresentation]);
+
+    const md_backend *md = &md_native_backend;
+    NSString *failure = nil;
+    // heap allocated, since it is called back until the subscription has ended
+    struct selftest_native_watch *watch = calloc(1, sizeof(*watch));
+    am_device_notification notification;
+    BOOL subscribed = (md->AMDeviceNotificationSubscribe(selftest_native_notified, 0, 0, watch, &notification) == 0);
+    if (!subscribed) {
+        failure = @"can't subscribe to device notifications";
+    } else if (!selftest_run_until(^BOOL{ return watch->device != NULL; })) {
+        failure = @"the device was never announced";
+    } else if (requiresSSL) {
+        failure = selftest_native_ssl_refused(md, watch->device);
+    } else {
+        failure = selftest_native_afc_read(md, watch->device, usbmuxd.udid, hello);
+    }
+
+    // without usbmuxd the device is gone, and so is the subscription
+    [usbmuxd release];
+    if (subscribed && !selftest_run_until(^BOOL{ return watch->detached && watch->unsubscribed; }) && !failure) {
+        failure = @"the device wasn't detached when usbmuxd went away";
+    }
+    if (!subscribed || watch->unsubscribed) free(watch);
+    md_native_set_usbmux_address(NULL);
+    rmdir(dir);
+    return failure;
+}
+
+// The native backend gets from usbmuxd to reading a file over AFC
+static NSString *selftest_native_afc(NSString *work)
+{
+    return selftest_native(work, NO);
+}
+
+// ... and refuses a device which wants TLS, which it can't do
+static NSString *selftest_native_ssl(NSString *work)
+{
+    return selftest_native(work, YES);
+}
+
+// -o selftest: check behaviour that is easy to break, against the same stand-ins
+// as -o bench, so no device is needed.  -checks NAME,... runs only those checks.
+// Each prints "ok" or why it failed; the exit status is 1 if any failed.
+static const struct {
+    NSString    *name;
+    NSString    *(*check)(NSString *work);
+} selftests[] = {
+    { @"browse.any",        selftest_browse_any },
+    { @"browse.error",      selftest_browse_error },
+    { @"service.timeout",   selftest_service_timeout },
+    { @"pull.error",        selftest_pull_error },
+    { @"sync.inventory",    selftest_sync_inventory },
+    { @"staging.cache",     selftest_staging_cache },
+    { @"native.afc",        selftest_native_afc },
+    { @"native.ssl",        selftest_native_ssl },
+};
+
+static int run_selftest(NSUserDefaults *arguments)
+{
+    NSFileManager *fm = [NSFileManager defaultManager];
+    NSString *list = [arguments stringForKey:@"checks"];
+    NSArray *wanted = list ? [list componentsSeparatedByString:@","] : nil;
+    size_t i, n = sizeof(selftests) / sizeof(selftests[0]);
+    int status = 0;
+
+    for (NSString *name in wanted) {
+        for (i = 0; i < n && ![selftests[i].name isEqualToString:name]; i++) ;
+        if (i == n) {
+            NSLog(@"Unknown check %@", name);
+            return 1001;
+        }
+    }
+    NSString *work = [arguments stringForKey:@"work"];
+    if (!work) work = NSTemporaryDirectory();
+    work = [work stringByAppendingPathComponent:[NSString stringWithFormat:@"mobileDeviceManager-selftest-%d", getpid()]];
+    for (i = 0; i < n; i++) {
+        if (wanted && ![wanted containsObject:selftests[i].name]) continue;
+        NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+        NSString *dir = [work stringByAppendingPathComponent:selftests[i].name];
+        [fm removeItemAtPath:dir error:NULL];
+        NSString *failure = [fm createDirectoryAtPath:dir withIntermediateDirectories:YES attributes:nil error:NULL]
+                            ? selftests[i].check(dir) : [NSString stringWithFormat:@"can't create %@", dir];
+        printf("%-18s %s\n", [selftests[i].name UTF8String], failure ? [failure UTF8String] : "ok");
+        if (failure) status = 1;
+        [pool drain];
+    }
+    [fm removeItemAtPath:work error:NULL];
+    return status;
+}
+
+static int print_syslog_record(void *ctx, time_t when, const char *rec, size_t len)
+{
+    const char *device = ctx;
+    if (device) printf("%s ", device);
+    fwrite(rec, 1, len, stdout);
+    putchar('\n');
+    return 0;
+}
+
+// -o syslogquery: search what -o syslog captured, by time, process, level and
+// text.  Needs no device.
+static int run_syslogquery(NSUserDefaults *arguments)
+{
+    NSString *from = [arguments stringForKey:@"from"];
+    NSArray *processes;
+    NSString *text, *pattern;
+    int level;
+    if (!from) {
+        NSLog(@"syslogquery needs -from, the directory -o syslog captured into");
+        return 1001;
+    }
+    if (!syslog_filter_arguments(arguments, &processes, &level, &text, &pattern, stderr)) return 1001;
+    time_t since = time_argument([arguments stringForKey:@"since"]);
+    time_t until = time_argument([arguments stringForKey:@"until"]);
+    if (since < 0 || until < 0) {
+        NSLog(@"Can't make sense of -since or -until - use \"yyyy-MM-dd HH:mm\", or a time ago like 90m or 12h");
+        return 1001;
+    }
+    
+    syslog_filter *filter = syslog_filter_create();
+    for (NSString *process in processes) syslog_filter_add_process(filter, [process UTF8String]);
+    if (level >= 0) syslog_filter_set_level(filter, level);
+    if (text) syslog_filter_add_substring(filter, [text UTF8String]);
+    char err[256];
+    if (pattern && !syslog_filter_add_regex(filter, [pattern UTF8String], err, sizeof(err))) {
+        NSLog(@"Bad -grep pattern: %s", err);
+        syslog_filter_destroy(filter);
+        return 1001;
+    }
+    // with a single process, blocks which don't mention it are skipped unread
+    const char *process = ([processes count] == 1) ? [[processes lastObject] UTF8String] : NULL;
+    
+    // there's a store for each device, named by udid - or -from may be one of them
+    NSMutableArray *stores = [NSMutableArray array];
+    for (NSString *name in [[[NSFileManager defaultManager] contentsOfDirectoryAtPath:from error:NULL] sortedArrayUsingSelector:@selector(compare:)]) {
+        BOOL isdir = NO;
+        NSString *path = [from stringByAppendingPathComponent:name];
+        if ([[NSFileManager defaultManager] fileExistsAtPath:path isDirectory:&isdir] && isdir) [stores addObject:path];
+    }
+    if (![stores count]) [stores addObject:from];
+    
+    syslog_store_stats stats;
+    memset(&stats, 0, sizeof(stats));
+    int status = 0;
+    for (NSString *store in stores) {
+        const char *device = ([stores count] > 1) ? [[store lastPathComponent] UTF8String] : NULL;
+        if (!syslog_store_query([store fileSystemRepresentation], since, until, process, filter,
+                                print_syslog_record, (void*)device, &stats)) {
+            NSLog(@"Can't read %@: %s", store, strerror(errno));
+            status = 1;
+        }
+    }
+    fflush(stdout);
+    NSLog(@"%llu of %llu records matched; %llu of %llu blocks read",
+          (unsigned long long)stats.records_matched, (unsigned long long)stats.records_read,
+          (unsigned long long)stats.blocks_read, (unsigned long long)stats.blocks);
+    syslog_filter_destroy(filter);
+    return status;
+}
+
+// -o daemon (or --daemon): stay running, keeping MobileDeviceAccess, the devices'
+// lockdown sessions and their pooled AFC connections warm, and run operations
+// sent by clients (any other operation given -socket PATH) over a Unix domain
+// socket.  Each request and reply is a 32 bit big-endian length followed by a
+// binary property list - the same framing as the lockdown services:
+//     request  { Operation = pull; Arguments = { app = ...; from = ...; }; Directory = "/client/cwd"; }
+//     reply    { Status = 0; Output = <what it printed>; Errors = <its messages>; Elapsed = 0.012; }
+// Requests are run one at a time, on the main thread, with the client's
+// arguments and working directory in place of the daemon's.
+#define DAEMON_MAX_FRAME        (16*1024*1024)
+// Requests are run one at a time, so one waiting for ever on a device nobody
+// has plugged in would stall every other client: without a -timeout of its own
+// (or the daemon's) a request waits this long
+#define DAEMON_DEVICE_TIMEOUT   10.0
+
+static BOOL read_fully(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+    while (len) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return NO;
+        p += n;
+        len -= n;
+    }
+    return YES;
+}
+
+static BOOL write_fully(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    while (len) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return NO;
+        p += n;
+        len -= n;
+    }
+    return YES;
+}
+
+static BOOL write_frame(int fd, id plist)
+{
+    NSData *body = [AMService binaryPlistWithObject:plist];
+    if (!body) return NO;
+    uint32_t len = htonl((uint32_t)[body length]);
+    return write_fully(fd, &len, sizeof(len)) && write_fully(fd, [body bytes], [body length]);
+}
+
+static id read_frame(int fd)
+{
+    uint32_t len;
+    if (!read_fully(fd, &len, sizeof(len))) return nil;
+    len = ntohl(len);
+    if (len == 0 || len > DAEMON_MAX_FRAME) return nil;
+    NSMutableData *body = [NSMutableData dataWithLength:len];
+    if (!read_fully(fd, [body mutableBytes], len)) return nil;
+    return [AMService objectWithBinaryPlist:body];
+}
+
+// The default socket lives in a directory only we can get into, so nobody else
+// can connect to it, or plant something of their own at the path first
+static NSString *default_socket_path(void)
+{
+    return [NSString stringWithFormat:@"/tmp/mobileDeviceManager-%u/daemon.socket", (unsigned)getuid()];
+}
+
+// -socket PATH, or the default socket if it was given as "default"
+static NSString *socket_path(NSUserDefaults *arguments)
+{
+    NSString *path = [arguments stringForKey:@"socket"];
+    return (!path || [path isEqualToString:@"default"]) ? nil : path;
+}
+
+static BOOL private_socket_dir(NSString *dir)
+{
+    const char *path = [dir fileSystemRepresentation];
+    struct stat st;
+    if (mkdir(path, 0700) != 0 && errno != EEXIST) {
+        NSLog(@"Can't create %@: %s", dir, strerror(errno));
+        return NO;
+    }
+    if (lstat(path, &st) != 0 || !S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077)) {
+        NSLog(@"%@ isn't a directory only you can use - not serving from it", dir);
+        return NO;
+    }
+    return YES;
+}
+
+static BOOL socket_address(NSString *path, struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen([path fileSystemRepresentation]) >= sizeof(addr->sun_path)) return NO;
+    strcpy(addr->sun_path, [path fileSystemRepresentation]);
+    return YES;
+}
+
+// everything a request needs that the CFSocket callbacks can't be handed
+static struct {
+    DeviceAdapter *adapter;
+    NSUserDefaults *arguments;
+    NSDictionary *own;              // the daemon's own command line
+    NSTimeInterval timeout;
+    NSString *idle;
+    BOOL busy;
+    NSMutableArray *deferred;       // clients which sent a request while busy
+} daemon_state;
+
+static NSData *drain_scratch(FILE *f)
+{
+    NSMutableData *data = [NSMutableData data];
+    char buf[16384];
+    size_t n;
+    fflush(f);
+    rewind(f);
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) [data appendBytes:buf length:n];
+    fclose(f);
+    return data;
+}
+
+static FILE *scratch_file(void)
+{
+    char name[] = "/tmp/mobileDeviceManager.XXXXXX";
+    int fd = mkstemp(name);
+    if (fd < 0) return NULL;
+    unlink(name);
+    FILE *f = fdopen(fd, "w+");
+    if (!f) close(fd);
+    return f;
+}
+
+// Run one request with its output and messages going to scratch files, and
+// return the reply.  stdout and stderr are left alone: whatever other threads
+// print meanwhile belongs to the daemon, not to this client.
+static NSDictionary *daemon_request(NSDictionary *request)
+{
+    NSString *option = [request objectForKey:@"Operation"];
+    NSDictionary *args = [request objectForKey:@"Arguments"];
+    NSString *dir = [request objectForKey:@"Directory"];
+    CFAbsoluteTime started = CFAbsoluteTimeGetCurrent();
+    int status = 1001;
+
+    if (![option isKindOfClass:[NSString class]] || [option isEqualToString:@"daemon"]) {
+        return [NSDictionary dictionaryWithObjectsAndKeys:[NSNumber numberWithInt:status], @"Status",
+                [NSData data], @"Output", [@"Bad request\n" dataUsingEncoding:NSUTF8StringEncoding], @"Errors", nil];
+    }
+    if (![args isKindOfClass:[NSDictionary class]]) args = [NSDictionary dictionary];
+    // the daemon runs each request on one device; a fleet is the client's to
+    // split up, one request per -udid
+    id udid = [args objectForKey:@"udid"];
+    if ([args objectForKey:@"devices"] || ([udid isKindOfClass:[NSString class]] && [udid rangeOfString:@","].location != NSNotFound)) {
+        return [NSDictionary dictionaryWithObjectsAndKeys:[NSNumber numberWithInt:status], @"Status",
+                [NSData data], @"Output",
+                [@"The daemon runs operations on one device at a time - send a request per -udid instead of -devices or a list\n"
+                 dataUsingEncoding:NSUTF8StringEncoding], @"Errors", nil];
+    }
+
+    FILE *out = scratch_file(), *err = scratch_file();
+    if (!out || !err) {
+        if (out) fclose(out);
+        if (err) fclose(err);
+        NSLog(@"Can't create scratch files: %s", strerror(errno));
+        return [NSDictionary dictionaryWithObjectsAndKeys:[NSNumber numberWithInt:1], @"Status",
+                [NSData data], @"Output", [@"The daemon can't create scratch files\n" dataUsingEncoding:NSUTF8StringEncoding], @"Errors", nil];
+    }
+    char *cwd = getcwd(NULL, 0);
+    if ([dir isKindOfClass:[NSString class]] && chdir([dir fileSystemRepresentation]) != 0) {
+        op_log(err, @"Can't change to %@", dir);
+    } else {
+        // the operation sees the client's command line instead of ours
+        [daemon_state.arguments removeVolatileDomainForName:NSArgumentDomain];
+        [daemon_state.arguments setVolatileDomain:args forName:NSArgumentDomain];
+
+        BOOL standin = ([daemon_state.arguments stringForKey:@"standin"] != nil);
+        AMDevice *device = nil;
+        if (!standin && ![option isEqualToString:@"stats"]) {
+            NSString *udid = [daemon_state.arguments stringForKey:@"udid"];
+            NSTimeInterval timeout = [daemon_state.arguments objectForKey:@"timeout"] ? [daemon_state.arguments doubleForKey:@"timeout"] : daemon_state.timeout;
+            if (timeout <= 0) timeout = DAEMON_DEVICE_TIMEOUT;
+            device = [[MobileDeviceAccess singleton] waitForDevice:udid timeout:timeout];
+            if (device && daemon_state.idle) device.sessionIdleTimeout = [daemon_state.idle doubleValue];
+            // the catalog outlives this request, so have the device say when it changes
+            if (device) [[device applicationCatalog] startWatching];
+        }
+        if ([option isEqualToString:@"stats"]) {
+            // -o stats -socket PATH [-statsformat prometheus] [-statsreset YES]
+            op_stats_write(out, stats_format(daemon_state.arguments));
+            if ([daemon_state.arguments boolForKey:@"statsreset"]) op_stats_reset();
+            status = 0;
+        } else if (standin || device) {
+            status = run_timed_operation(option, device, daemon_state.adapter, daemon_state.arguments, standin, NO, out, err);
+        } else {
+            op_log(err, @"No device attached");
+            status = 1;
+        }
+
+        [daemon_state.arguments removeVolatileDomainForName:NSArgumentDomain];
+        [daemon_state.arguments setVolatileDomain:daemon_state.own forName:NSArgumentDomain];
+    }
+    if (cwd) chdir(cwd);
+    free(cwd);
+
+    double elapsed = CFAbsoluteTimeGetCurrent() - started;
+    NSLog(@"%@ -> %d in %.3fs", option, status, elapsed);
+    return [NSDictionary dictionaryWithObjectsAndKeys:
+            [NSNumber numberWithInt:status], @"Status",
+            drain_scratch(out), @"Output",
+            drain_scratch(err), @"Errors",
+            [NSNumber numberWithDouble:elapsed], @"Elapsed",
+            nil];
+}
+
+static void daemon_client_callback(CFSocketRef s, CFSocketCallBackType type, CFDataRef address, const void *data, void *info)
+{
+    // an operation which runs the run loop (waiting for a device, say) can let
+    // another client's request in; hold it until this one is done
+    if (daemon_state.busy) {
+        CFSocketDisableCallBacks(s, kCFSocketReadCallBack);
+        [daemon_state.deferred addObject:(id)s];
+        return;
+    }
+
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    int fd = CFSocketGetNative(s);
+    NSDictionary *request = read_frame(fd);
+    BOOL ok = NO;
+    if ([request isKindOfClass:[NSDictionary class]]) {
+        daemon_state.busy = YES;
+        ok = write_frame(fd, daemon_request(request));
+        daemon_state.busy = NO;
+    }
+    if (!ok) {
+        // closed by the client, or out of step - either way it's done
+        CFSocketInvalidate(s);
+        CFRelease(s);
+    }
+    while ([daemon_state.deferred count]) {
+        CFSocketRef next = (CFSocketRef)[daemon_state.deferred objectAtIndex:0];
+        CFSocketEnableCallBacks(next, kCFSocketReadCallBack);
+        [daemon_state.deferred removeObjectAtIndex:0];
+    }
     [pool drain];
+}
+
+static void daemon_accept_callback(CFSocketRef s, CFSocketCallBackType type, CFDataRef address, const void *data, void *info)
+{
+    int fd = *(const CFSocketNativeHandle*)data;
+    int on = 1;
+    struct timeval tv = { 10, 0 };
+
+    // a client which stops half way through a request mustn't hang the daemon
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+    CFSocketRef client = CFSocketCreateWithNative(NULL, fd, kCFSocketReadCallBack, daemon_client_callback, NULL);
+    if (!client) {
+        close(fd);
+        return;
+    }
+    CFRunLoopSourceRef source = CFSocketCreateRunLoopSource(NULL, client, 0);
+    CFRunLoopAddSource(CFRunLoopGetCurrent(), source, kCFRunLoopDefaultMode);
+    CFRelease(source);
+}
+
+static int run_daemon(DeviceAdapter *adapter, NSUserDefaults *arguments)
+{
+    NSString *path = socket_path(arguments);
+    struct sockaddr_un addr;
+
+    if (!path) {
+        path = default_socket_path();
+        if (!private_socket_dir([path stringByDeletingLastPathComponent])) return 1;
+    }
+    if (!socket_address(path, &addr)) {
+        NSLog(@"Socket path %@ is too long", path);
+        return 1001;
+    }
+    // only ever replace a socket of ours, left behind by an earlier daemon
+    struct stat st;
+    if (lstat(addr.sun_path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode) || st.st_uid != getuid()) {
+            NSLog(@"%@ exists and isn't a socket of yours - not replacing it", path);
+            return 1;
+        }
+        unlink(addr.sun_path);
+    }
+    // created private, rather than open to everyone until a chmod afterwards
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    mode_t mask = umask(077);
+    BOOL bound = (fd >= 0 && bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+    umask(mask);
+    if (!bound || listen(fd, 16) != 0) {
+        NSLog(@"Can't listen on %@: %s", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+
+    daemon_state.adapter = adapter;
+    daemon_state.arguments = arguments;
+    daemon_state.own = [[arguments volatileDomainForName:NSArgumentDomain] copy];
+    daemon_state.timeout = [arguments doubleForKey:@"timeout"];
+    daemon_state.idle = [arguments stringForKey:@"idle"];
+    daemon_state.deferred = [[NSMutableArray alloc] init];
+    op_stats_enable(1);
+
+    CFSocketRef listener = CFSocketCreateWithNative(NULL, fd, kCFSocketAcceptCallBack, daemon_accept_callback, NULL);
+    CFRunLoopSourceRef source = CFSocketCreateRunLoopSource(NULL, listener, 0);
+    CFRunLoopAddSource(CFRunLoopGetCurrent(), source, kCFRunLoopDefaultMode);
+    CFRelease(source);
+
+    signal(SIGINT, on_interrupt);
+    signal(SIGTERM, on_interrupt);
+    signal(SIGPIPE, SIG_IGN);
+    NSLog(@"Serving on %@", path);
+
+    // device attaches, session idle timers and requests all arrive on this run
+    // loop; wake once a second to notice a signal
+    while (!interrupted) {
+        NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+        CFRunLoopRunInMode(kCFRunLoopDefaultMode, 1.0, false);
+        [pool drain];
+    }
+
+    NSLog(@"Stopping");
+    CFSocketInvalidate(listener);
+    CFRelease(listener);
+    unlink(addr.sun_path);
+    for (AMDevice *device in adapter.devices) [device drainPool];
+    [daemon_state.own release];
+    [daemon_state.deferred release];
     return 0;
 }
 
+// Any operation given -socket PATH (or -socket default): send it to the daemon
+// listening there, and pass on what it printed and its exit status.
+static int run_client(NSString *option, NSUserDefaults *arguments)
+{
+    NSString *path = socket_path(arguments);
+    NSMutableDictionary *args = [[[arguments volatileDomainForName:NSArgumentDomain] mutableCopy] autorelease];
+    struct sockaddr_un addr;
+    int on = 1;
+
+    [args removeObjectForKey:@"socket"];
+    if (!path) path = default_socket_path();
+    if (!socket_address(path, &addr)) {
+        NSLog(@"Socket path %@ is too long", path);
+        return 1001;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        NSLog(@"Can't connect to the daemon on %@: %s", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+
+    NSDictionary *request = [NSDictionary dictionaryWithObjectsAndKeys:
+                             option, @"Operation",
+                             args, @"Arguments",
+                             [[NSFileManager defaultManager] currentDirectoryPath], @"Directory",
+                             nil];
+    NSDictionary *reply = write_frame(fd, request) ? read_frame(fd) : nil;
+    close(fd);
+    if (![reply isKindOfClass:[NSDictionary class]]) {
+        NSLog(@"No reply from the daemon on %@", path);
+        return 1;
+    }
+    NSData *output = [reply objectForKey:@"Output"];
+    NSData *errors = [reply objectForKey:@"Errors"];
+    fwrite([output bytes], 1, [output length], stdout);
+    fwrite([errors bytes], 1, [errors length], stderr);
+    return [[reply objectForKey:@"Status"] intValue];
+}
+
+int main (int argc, const char * argv[]) {
+
+    NSAutoreleasePool * pool = [[NSAutoreleasePool alloc] init];
+    
+    
+    //get arguments
+	NSUserDefaults *arguments = [NSUserDefaults standardUserDefaults];
+	NSString *option = [arguments stringForKey:@"o"];
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--daemon") == 0) option = @"daemon";
+    }
+    
+    if	(!option) {
+        printf("\n\
+The script usage:\n\n\
+Copy file from desktop to device (App Documents) or specify path with filename:\n\
+    mobileDeviceManager -o push -app \"Application_ID\" -from \"from file\" [-to \"to file\"]\n\
+Copy file from device to desktop (Current folder) or specify path with filename:\n\
+    mobileDeviceManager -o pull -app \"Application_ID\" -from \"from file\" [-to \"to file\"]\n\
+Copy only what has changed to (-push) or from (-pull) the device:\n\
+    mobileDeviceManager -o sync -app \"Application_ID\" -push \"local path\" [-to /Documents] [-delete YES] [-checksum YES] [-dryrun YES]\n\
+    mobileDeviceManager -o sync -app \"Application_ID\" -pull \"device path\" [-to \"local dir\"] [-delete YES] [-checksum YES] [-dryrun YES]\n\
+List Applications (-type User|System|Any, -ids and -attributes are applied by the device):\n\
+    mobileDeviceManager -o list [-type User] [-ids Bundle_ID,...] [-attributes CFBundleVersion,...]\n\
+List Files in Application Documents (path):\n\
+    mobileDeviceManager -o listFiles -app Appliction_ID [-path /Documents] [-recursive YES] [-depth N] [-match \"*.db\"] [-stat YES]\n\
+Delete Files in Application Documents (path):\n\
+    mobileDeviceManager -o delete -app Appliction_ID [-path /Documents]\n\
+Get appId for application name:\n\
+    mobileDeviceManager -o getAppId -name Application_Name\n\
+Show device info (-keys all for everything in the domain):\n\
+    mobileDeviceManager -o info [-keys Key1,Key2,...] [-domain com.apple.disk_usage]\n\
+Capture the device log into DIR/<udid> until ^C (or for -duration seconds), compressed and indexed:\n\
+    mobileDeviceManager -o syslog -to DIR [-duration SECONDS] [-segment MB] [filter options]\n\
+Search a capture (no device needed):\n\
+    mobileDeviceManager -o syslogquery -from DIR [-since TIME] [-until TIME] [filter options]\n\
+    TIME is \"yyyy-MM-dd HH:mm[:ss]\", seconds since 1970, or a time ago like 90m, 12h or 3d\n\
+Install an .ipa (or .app directory), replacing any copy already installed:\n\
+    mobileDeviceManager -o install -ipa \"path\"\n\
+Get filesets (CrashReporter, MobileInstallation, Lockdown, All...) from the device, unpacked into DIR/<udid>:\n\
+    mobileDeviceManager -o filerelay -sets Set1,Set2,... [-to DIR]\n\
+Save application icons as DIR/<udid>/<bundle id>.png, fetching only those not already in the cache:\n\
+    mobileDeviceManager -o icons [-to DIR] [-ids Bundle_ID,...] [-cache DIR/.iconcache] [-connections N]\n\
+Keep devices and their connections open, running operations sent with -socket (^C to stop):\n\
+    mobileDeviceManager --daemon [-socket PATH] [-idle SECONDS] [-timeout SECS]\n\
+    mobileDeviceManager -o pull -socket PATH ...   (any operation: run it in the daemon)\n\
+    PATH defaults to /tmp/mobileDeviceManager-<uid>/daemon.socket for the daemon; give -socket default\n\
+    to send to that one.  A request waits -timeout SECS for its device (default 10), and runs on one\n\
+    device: -udid picks it, -devices and lists of udids are refused\n\
+Compare XML and binary plists on replies saved with -record (no device needed):\n\
+    mobileDeviceManager -o plistbench -from \"reply.plist or dir\" [-iterations 100]\n\
+Time copying, listing and browsing against stand-ins for a device (no device needed):\n\
+    mobileDeviceManager -o bench [-scenarios storm,stream,tree,browse] [-latency 1] [-bandwidth MB/s]\n\
+                       [-scale 1] [-connections N] [-save FILE] [-baseline FILE] [-tolerance PCT] [-work DIR] [-keep YES]\n\
+    -bandwidth defaults to 30; -save writes the results as JSON, and -baseline fails the run if a case\n\
+    got over PCT%% (default 10) slower or chattier than in such a file (Bench/bench.c does the same without Xcode)\n\
+    mobileDeviceManager -o selftest [-checks browse.any,...] [-work DIR]\n\
+    checks behaviour that is easy to break against stand-ins for the device; exits 1 if a check fails\n\
+\n\
+Transfer options (push, pull, sync):\n\
+    -connections N  copy directories over N AFC connections in parallel\n\
+    -window N       overlap device reads with disk writes, keeping up to N reads queued;\n\
+                    with -backend native, N read requests are in flight on the wire at once\n\
+                    (the framework sends one at a time)\n\
+    -blocksize N    bytes requested from the device per read (default 102400)\n\
+    -writesize N    bytes sent to the device per write (default depends on file size)\n\
+    -standin DIR    use a local directory served by a stand-in AFC server instead of a device\n\
+    -latency MS     milliseconds of latency the stand-in adds to every reply\n\
+\n\
+Syslog filter options (syslog, syslogquery):\n\
+    -process A,B    only records from these processes\n\
+    -level LEVEL    only records at least this severe (Error, Warning, Notice...)\n\
+    -contains TEXT  only records whose message contains TEXT\n\
+    -grep REGEX     only records whose message matches the extended regular expression\n\
+\n\
+Run on several devices at once (any operation):\n\
+    -devices all    every attached device (waits until none has appeared for -settle seconds, default 2)\n\
+    -udid A,B,...   just these devices (waits until they are all attached)\n\
+    -devices N      the first N devices to attach (starts as soon as they have)\n\
+    -jobs N         at most N devices at a time (default: all of them)\n\
+    -timeout SECS   give up waiting for devices after SECS (default: wait for ever); missing\n\
+                    devices count as failures\n\
+    Pulled files go in a subdirectory per device of -to (or of the current directory),\n\
+    named by udid, keeping their names on the device. The exit status is non-zero if\n\
+    the operation failed on any device.\n\
+\n\
+Device options:\n\
+    -backend framework|native  what talks to devices: MobileDevice.framework (the default where it is\n\
+                    installed), or our own usbmuxd, lockdown and AFC client.  The native backend has no TLS,\n\
+                    which every paired device requires, so it only works against the stand-ins (see\n\
+                    -o selftest), not real devices\n\
+    -usbmux ADDRESS where -backend native finds usbmuxd: a socket path or host:port\n\
+                    (default $USBMUXD_SOCKET_ADDRESS, else /var/run/usbmuxd)\n\
+    -idle SECONDS   keep the lockdown session open this long between operations (default 30, 0 to disable)\n\
+    -codec xml|binary  property list format for requests to every service (default: binary where known to work)\n\
+    -record DIR     save every plist reply received from the device in DIR\n\
+    -appcache DIR   keep each device's list of applications in DIR, so names are resolved without asking it\n\
+    -stats FILE     when done, write the time taken by every call to the device and the bytes moved\n\
+                    to FILE (- for stdout); a daemon always keeps them, see -o stats -socket PATH\n\
+    -statsformat json|prometheus  (default json)\n");
+        return 1001;
+	}
+    
+    if ([option isEqualToString:@"plistbench"]) {
+        int status = run_plistbench(arguments);
+        [pool drain];
+        return status;
+    }
+    
+    if ([option isEqualToString:@"syslogquery"]) {
+        int status = run_syslogquery(arguments);
+        [pool drain];
+        return status;
+    }
+    
+    if ([arguments stringForKey:@"socket"] && ![option isEqualToString:@"daemon"]) {
+        int status = run_client(option, arguments);
+        [pool drain];
+        return status;
+    }
+    
+    NSString *codec = [arguments stringForKey:@"codec"];
+    if (codec) {
+        if ([codec isEqualToString:@"binary"]) {
+            [AMService setCodec:AMServiceCodecBinary forService:nil];
+        } else if ([codec isEqualToString:@"xml"]) {
+            [AMService setCodec:AMServiceCodecXML forService:nil];
+        } else {
+            NSLog(@"Unknown codec: %@ (use xml or binary)", codec);
+            [pool drain];
+            return 1001;
+        }
+    }
+    if ([arguments stringForKey:@"record"]) [AMService recordRepliesToDirectory:[arguments stringForKey:@"record"]];
+    
+    NSString *backend = [arguments stringForKey:@"backend"];
+    if (backend && ![MobileDeviceAccess useBackend:backend]) {
+        NSLog(@"Can't use backend: %@", backend);
+        [pool drain];
+        return 1001;
+    }
+    if ([arguments stringForKey:@"usbmux"]) [MobileDeviceAccess setUsbmuxAddress:[arguments stringForKey:@"usbmux"]];
+    
+    if ([arguments stringForKey:@"stats"]) op_stats_enable(1);
+    
+    if ([option isEqualToString:@"bench"]) {
+        int status = run_bench(arguments);
+        write_stats(arguments);
+        [pool drain];
+        return status;
+    }
+    if ([option isEqualToString:@"selftest"]) {
+        int status = run_selftest(arguments);
+        [pool drain];
+        return status;
+    }
+    DeviceAdapter *adapter = [[DeviceAdapter alloc] init];
+    BOOL standin = ([arguments stringForKey:@"standin"] != nil);
+    NSString *idle = [arguments stringForKey:@"idle"];
+    
+    if ([option isEqualToString:@"daemon"]) {
+        int status = run_daemon(adapter, arguments);
+        [pool drain];
+        return status;
+    }
+    
+    if (!standin && ([arguments stringForKey:@"devices"] || [arguments stringForKey:@"udid"])) {
+        int status = run_fleet(option, adapter, arguments);
+        write_stats(arguments);
+        [pool drain];
+        return status;
+    }
+    
+    // returns as soon as the first device is ready, or gives up after -timeout
+    AMDevice *device = nil;
+    if (!standin) {
+        NSTimeInterval timeout = [arguments doubleForKey:@"timeout"];
+        device = [[MobileDeviceAccess singleton] waitForDevice:nil timeout:timeout];
+        if (!device) {
+            NSLog(@"No device attached within %gs", timeout);
+            [pool drain];
+            return 1;
+        }
+        NSLog(@"%@ attached after %.3fs", device.udid, device.attachLatency);
+    }
+    
+    // how long to keep the lockdown session open between operations
+    if (idle && device) device.sessionIdleTimeout = [idle doubleValue];
+    
+    int status = run_timed_operation(option, device, adapter, arguments, standin, NO, stdout, stderr);
+    
+    if (device) {
+        NSLog(@"lockdown sessions: %lu reused, %lu started; service pool: %lu hits, %lu misses",
+              (unsigned long)device.sessionHits, (unsigned long)device.sessionMisses,
+              (unsigned long)device.poolHits, (unsigned long)device.poolMisses);
+        [device drainPool];
+    }
+    write_stats(arguments);
+    
+    [pool drain];
+    return status;
+}
+
@@ -0,0 +1,426 @@
+//
+//  op_stats.c
+//  mobileDeviceManager
+//
+//  See op_stats.h.
+//
+
+#include "op_stats.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef __APPLE__
+#include <mach/mach_time.h>
+#endif
+
+// bucket 0 counts calls under 1us, bucket k those under 2^k us; the last one
+// takes everything longer
+#define BUCKETS			32
+
+typedef struct op_hist {
+	uint64_t	count, errors;
+	uint64_t	sum_ns, min_ns, max_ns;
+	uint64_t	buckets[BUCKETS];
+} op_hist;
+
+typedef struct op_device {
+	struct op_device	*next;
+	char				*name;				// NULL until named
+	unsigned			serial;				// tells unnamed devices apart
+	uint64_t			bytes_in, bytes_out;
+	op_hist				ops[OP_COUNT];
+} op_device;
+
+typedef struct op_binding {
+	const void		*handle;
+	op_device		*device;
+} op_binding;
+
+static const char *op_names[OP_COUNT] = {
+	"device_connect",
+	"start_session",
+	"start_service",
+	"afc_open",
+	"afc_read",
+	"afc_write",
+	"afc_dir_open",
+	"afc_dir_read",
+	"afc_file_info",
+	"plist_request",
+	"plist_reply",
+	"plist_async",
+	"operation",
+};
+
+// everything below is guarded by lock.  A record is a few adds, so one lock
+// for the lot costs nothing next to a round trip to a device
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile int enabled = 0;
+static op_device *devices = NULL;
+static op_binding *bindings = NULL;
+static size_t nbindings = 0, capbindings = 0;
+static unsigned serials = 0;
+
+static uint64_t now_ns(void)
+{
+#ifdef __APPLE__
+	static mach_timebase_info_data_t timebase;
+	if (timebase.denom == 0) mach_timebase_info(&timebase);
+	return mach_absolute_time() * timebase.numer / timebase.denom;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+static op_device *new_device(const char *name)
+{
+	op_device *d = calloc(1, sizeof(*d));
+	if (!d) return NULL;
+	if (name) d->name = strdup(name);
+	d->serial = ++serials;
+	d->next = devices;
+	devices = d;
+	return d;
+}
+
+static op_device *named_device(const char *name)
+{
+	op_device *d;
+	for (d = devices; d; d = d->next) {
+		if (d->name && strcmp(d->name, name) == 0) return d;
+	}
+	return new_device(name);
+}
+
+static op_binding *find_binding(const void *handle)
+{
+	size_t i;
+	for (i = 0; i < nbindings; i++) {
+		if (bindings[i].handle == handle) return &bindings[i];
+	}
+	return NULL;
+}
+
+static void set_binding(const void *handle, op_device *device)
+{
+	op_binding *b = find_binding(handle);
+	if (!b) {
+		if (nbindings == capbindings) {
+			size_t cap = capbindings ? capbindings * 2 : 32;
+			op_binding *grown = realloc(bindings, cap * sizeof(*grown));
+			if (!grown) return;
+			bindings = grown;
+			capbindings = cap;
+		}
+		b = &bindings[nbindings++];
+		b->handle = handle;
+	}
+	b->device = device;
+}
+
+static void add_call(op_device *d, op_stats_op op, uint64_t ns, int failed, uint64_t bytes_in, uint64_t bytes_out)
+{
+	op_hist *h = &d->ops[op];
+	uint64_t us = ns / 1000;
+	unsigned k = 0;
+
+	while (k < BUCKETS - 1 && us >= (1ull << k)) k++;
+	if (h->count == 0 || ns < h->min_ns) h->min_ns = ns;
+	if (ns > h->max_ns) h->max_ns = ns;
+	h->count++;
+	h->sum_ns += ns;
+	h->buckets[k]++;
+	if (failed) h->errors++;
+	d->bytes_in += bytes_in;
+	d->bytes_out += bytes_out;
+}
+
+static void merge_device(op_device *into, const op_device *from)
+{
+	unsigned op, k;
+	into->bytes_in += from->bytes_in;
+	into->bytes_out += from->bytes_out;
+	for (op = 0; op < OP_COUNT; op++) {
+		const op_hist *f = &from->ops[op];
+		op_hist *t = &into->ops[op];
+		if (f->count == 0) continue;
+		if (t->count == 0 || f->min_ns < t->min_ns) t->min_ns = f->min_ns;
+		if (f->max_ns > t->max_ns) t->max_ns = f->max_ns;
+		t->count += f->count;
+		t->errors += f->errors;
+		t->sum_ns += f->sum_ns;
+		for (k = 0; k < BUCKETS; k++) t->buckets[k] += f->buckets[k];
+	}
+}
+
+static void free_device(op_device *d)
+{
+	op_device **p;
+	for (p = &devices; *p; p = &(*p)->next) {
+		if (*p == d) {
+			*p = d->next;
+			break;
+		}
+	}
+	free(d->name);
+	free(d);
+}
+
+void op_stats_enable(int on)
+{
+	enabled = on;
+}
+
+int op_stats_enabled(void)
+{
+	return enabled;
+}
+
+void op_stats_reset(void)
+{
+	op_device *d;
+	pthread_mutex_lock(&lock);
+	for (d = devices; d; d = d->next) {
+		d->bytes_in = d->bytes_out = 0;
+		memset(d->ops, 0, sizeof(d->ops));
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+uint64_t op_stats_start(void)
+{
+	return enabled ? now_ns() : 0;
+}
+
+void op_stats_record(const void *handle, op_stats_op op, uint64_t start, int failed,
+					 uint64_t bytes_in, uint64_t bytes_out)
+{
+	if (!start || op >= OP_COUNT) return;
+	uint64_t ns = now_ns() - start;
+	pthread_mutex_lock(&lock);
+	op_binding *b = find_binding(handle);
+	op_device *d = b ? b->device : NULL;
+	if (!d) {
+		d = new_device(NULL);
+		if (d) set_binding(handle, d);
+	}
+	if (d) add_call(d, op, ns, failed, bytes_in, bytes_out);
+	pthread_mutex_unlock(&lock);
+}
+
+void op_stats_record_device(const char *device, op_stats_op op, uint64_t start, int failed,
+							uint64_t bytes_in, uint64_t bytes_out)
+{
+	if (!start || op >= OP_COUNT) return;
+	uint64_t ns = now_ns() - start;
+	pthread_mutex_lock(&lock);
+	op_device *d = named_device(device ? device : "");
+	if (d) add_call(d, op, ns, failed, bytes_in, bytes_out);
+	pthread_mutex_unlock(&lock);
+}
+
+void op_stats_bind(const void *handle, const void *parent)
+{
+	pthread_mutex_lock(&lock);
+	op_binding *p = find_binding(parent);
+	if (p) {
+		set_binding(handle, p->device);
+	} else {
+		// the parent is yet to be seen; share a device with it for when it is
+		op_device *d = new_device(NULL);
+		if (d) {
+			set_binding(parent, d);
+			set_binding(handle, d);
+		}
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+void op_stats_name(const void *handle, const char *device)
+{
+	size_t i;
+	pthread_mutex_lock(&lock);
+	op_device *d = named_device(device ? device : "");
+	op_binding *b = find_binding(handle);
+	if (d && b && b->device != d) {
+		op_device *old = b->device;
+		if (old && !old->name) {
+			// recorded before we knew whose it was
+			merge_device(d, old);
+			for (i = 0; i < nbindings; i++) {
+				if (bindings[i].device == old) bindings[i].device = d;
+			}
+			free_device(old);
+		}
+		b->device = d;
+	} else if (d && !b) {
+		set_binding(handle, d);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+void op_stats_unbind(const void *handle)
+{
+	pthread_mutex_lock(&lock);
+	op_binding *b = find_binding(handle);
+	if (b) *b = bindings[--nbindings];
+	pthread_mutex_unlock(&lock);
+}
+
+#pragma mark export
+
+// What a device is called in the output.  Calls on handles which were never
+// named (or named "") still need a key of their own, or two such devices would
+// come out as duplicate series
+static const char *device_label(const op_device *d, char *buf, size_t len)
+{
+	if (d->name && *d->name) return d->name;
+	snprintf(buf, len, "unnamed-%u", d->serial);
+	return buf;
+}
+
+// The upper bound of the bucket in which the q'th fraction of calls falls, in
+// microseconds
+static uint64_t quantile_us(const op_hist *h, double q)
+{
+	uint64_t want = (uint64_t)(q * h->count + 0.5), seen = 0;
+	unsigned k;
+	if (want == 0) want = 1;
+	for (k = 0; k < BUCKETS - 1; k++) {
+		seen += h->buckets[k];
+		if (seen >= want) return 1ull << k;
+	}
+	return h->max_ns / 1000;
+}
+
+static void write_json_string(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for (; *s; s++) {
+		unsigned char c = (unsigned char)*s;
+		if (c == '"' || c == '\\') fprintf(f, "\\%c", c);
+		else if (c < 0x20) fprintf(f, "\\u%04x", c);
+		else fputc(c, f);
+	}
+	fputc('"', f);
+}
+
+static void write_json(FILE *f)
+{
+	op_device *d;
+	unsigned op, k;
+	int first = 1;
+	char label[32];
+
+	fprintf(f, "{\n  \"devices\": {");
+	for (d = devices; d; d = d->next) {
+		int firstop = 1;
+		fprintf(f, "%s\n    ", first ? "" : ",");
+		write_json_string(f, device_label(d, label, sizeof(label)));
+		fprintf(f, ": {\n      \"bytes_in\": %llu,\n      \"bytes_out\": %llu,\n      \"ops\": {",
+				(unsigned long long)d->bytes_in, (unsigned long long)d->bytes_out);
+		for (op = 0; op < OP_COUNT; op++) {
+			const op_hist *h = &d->ops[op];
+			if (h->count == 0) continue;
+			fprintf(f, "%s\n        \"%s\": {\"count\": %llu, \"errors\": %llu, \"sum_us\": %llu, "
+					"\"min_us\": %llu, \"max_us\": %llu, \"p50_us\": %llu, \"p90_us\": %llu, \"p99_us\": %llu, "
+					"\"buckets_us\": {", firstop ? "" : ",", op_names[op],
+					(unsigned long long)h->count, (unsigned long long)h->errors,
+					(unsigned long long)(h->sum_ns / 1000), (unsigned long long)(h->min_ns / 1000),
+					(unsigned long long)(h->max_ns / 1000), (unsigned long long)quantile_us(h, 0.5),
+					(unsigned long long)quantile_us(h, 0.9), (unsigned long long)quantile_us(h, 0.99));
+			// only the buckets in use, keyed by their upper bound
+			int firstbucket = 1;
+			for (k = 0; k < BUCKETS; k++) {
+				if (!h->buckets[k]) continue;
+				if (k < BUCKETS - 1) {
+					fprintf(f, "%s\"%llu\": %llu", firstbucket ? "" : ", ",
+							1ull << k, (unsigned long long)h->buckets[k]);
+				} else {
+					fprintf(f, "%s\"inf\": %llu", firstbucket ? "" : ", ", (unsigned long long)h->buckets[k]);
+				}
+				firstbucket = 0;
+			}
+			fprintf(f, "}}");
+			firstop = 0;
+		}
+		fprintf(f, "\n      }\n    }");
+		first = 0;
+	}
+	fprintf(f, "\n  }\n}\n");
+}
+
+static void write_label(FILE *f, const char *s)
+{
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\') fprintf(f, "\\%c", *s);
+		else if (*s == '\n') fprintf(f, "\\n");
+		else fputc(*s, f);
+	}
+}
+
+static void write_prometheus(FILE *f)
+{
+	op_device *d;
+	unsigned op, k;
+	char label[32];
+
+	fprintf(f, "# HELP mobiledevice_call_duration_seconds Time taken by calls to the device.\n");
+	fprintf(f, "# TYPE mobiledevice_call_duration_seconds histogram\n");
+	for (d = devices; d; d = d->next) {
+		for (op = 0; op < OP_COUNT; op++) {
+			const op_hist *h = &d->ops[op];
+			uint64_t cumulative = 0;
+			if (h->count == 0) continue;
+			for (k = 0; k < BUCKETS - 1; k++) {
+				cumulative += h->buckets[k];
+				fprintf(f, "mobiledevice_call_duration_seconds_bucket{device=\"");
+				write_label(f, device_label(d, label, sizeof(label)));
+				fprintf(f, "\",call=\"%s\",le=\"%g\"} %llu\n", op_names[op], (double)(1ull << k) / 1e6,
+						(unsigned long long)cumulative);
+			}
+			fprintf(f, "mobiledevice_call_duration_seconds_bucket{device=\"");
+			write_label(f, device_label(d, label, sizeof(label)));
+			fprintf(f, "\",call=\"%s\",le=\"+Inf\"} %llu\n", op_names[op], (unsigned long long)h->count);
+			fprintf(f, "mobiledevice_call_duration_seconds_sum{device=\"");
+			write_label(f, device_label(d, label, sizeof(label)));
+			fprintf(f, "\",call=\"%s\"} %.6f\n", op_names[op], h->sum_ns / 1e9);
+			fprintf(f, "mobiledevice_call_duration_seconds_count{device=\"");
+			write_label(f, device_label(d, label, sizeof(label)));
+			fprintf(f, "\",call=\"%s\"} %llu\n", op_names[op], (unsigned long long)h->count);
+		}
+	}
+	fprintf(f, "# HELP mobiledevice_call_errors_total Calls to the device which failed.\n");
+	fprintf(f, "# TYPE mobiledevice_call_errors_total counter\n");
+	for (d = devices; d; d = d->next) {
+		for (op = 0; op < OP_COUNT; op++) {
+			if (d->ops[op].count == 0) continue;
+			fprintf(f, "mobiledevice_call_errors_total{device=\"");
+			write_label(f, device_label(d, label, sizeof(label)));
+			fprintf(f, "\",call=\"%s\"} %llu\n", op_names[op], (unsigned long long)d->ops[op].errors);
+		}
+	}
+	fprintf(f, "# HELP mobiledevice_bytes_total Bytes moved to (out) and from (in) the device.\n");
+	fprintf(f, "# TYPE mobiledevice_bytes_total counter\n");
+	for (d = devices; d; d = d->next) {
+		fprintf(f, "mobiledevice_bytes_total{device=\"");
+		write_label(f, device_label(d, label, sizeof(label)));
+		fprintf(f, "\",direction=\"in\"} %llu\n", (unsigned long long)d->bytes_in);
+		fprintf(f, "mobiledevice_bytes_total{device=\"");
+		write_label(f, device_label(d, label, sizeof(label)));
+		fprintf(f, "\",direction=\"out\"} %llu\n", (unsigned long long)d->bytes_out);
+	}
+}
+
+void op_stats_write(FILE *f, int format)
+{
+	pthread_mutex_lock(&lock);
+	if (format == OP_STATS_PROMETHEUS) write_prometheus(f);
+	else write_json(f);
+	pthread_mutex_unlock(&lock);
+	fflush(f);
+}
@@ -0,0 +1,87 @@
+//
+//  op_stats.h
+//  mobileDeviceManager
+//
+//  Latency histograms and byte counts for the calls made to devices - the
+//  lockdown calls, the AFC primitives and the plist requests on services - kept
+//  per device, so a slow run can be pinned on the USB link (slow AFC reads and
+//  writes for the bytes moved), the device (slow session and service starts,
+//  slow replies to small requests) or this end (an operation taking much longer
+//  than the calls it made).
+//
+//  Calls are attributed through the handle they were made on - an am_device,
+//  a service socket or an AFC connection.  Handles are bound to a device when
+//  they are created, each to the one it came from, so only the am_device needs
+//  to be given a name.  Recording is off until op_stats_enable() is called.
+//
+
+#ifndef OP_STATS_H
+#define OP_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+	OP_DEVICE_CONNECT,		// AMDeviceConnect
+	OP_START_SESSION,		// AMDeviceStartSession
+	OP_START_SERVICE,		// AMDeviceStartService
+	OP_AFC_OPEN,			// AFCFileRefOpen
+	OP_AFC_READ,			// AFCFileRefRead
+	OP_AFC_WRITE,			// AFCFileRefWrite
+	OP_AFC_DIR_OPEN,		// AFCDirectoryOpen
+	OP_AFC_DIR_READ,		// AFCDirectoryRead
+	OP_AFC_FILE_INFO,		// AFCFileInfoOpen
+	OP_PLIST_REQUEST,		// sending a plist request on a service
+	OP_PLIST_REPLY,			// waiting for and reading its reply
+	OP_PLIST_ASYNC,			// an asynchronous request, from being queued to finishing
+	OP_OPERATION,			// a whole -o operation, as run by main
+	OP_COUNT
+} op_stats_op;
+
+enum {
+	OP_STATS_JSON,
+	OP_STATS_PROMETHEUS
+};
+
+/// Start or stop recording.  Turning it on doesn't clear what was recorded.
+void op_stats_enable(int on);
+int op_stats_enabled(void);
+
+/// Forget everything recorded (the bindings are kept).
+void op_stats_reset(void);
+
+/// The start of a call, for op_stats_record().  0 if recording is off.
+uint64_t op_stats_start(void);
+
+/// Record a call made on \p handle which began at \p start (from
+/// op_stats_start(); nothing is recorded if it is 0).  A handle which hasn't
+/// been bound gets a device of its own, named when it is.
+void op_stats_record(const void *handle, op_stats_op op, uint64_t start, int failed,
+					 uint64_t bytes_in, uint64_t bytes_out);
+
+/// As above, for a device given by name rather than by handle.
+void op_stats_record_device(const char *device, op_stats_op op, uint64_t start, int failed,
+							uint64_t bytes_in, uint64_t bytes_out);
+
+/// Attribute calls on \p handle to the same device as \p parent.
+void op_stats_bind(const void *handle, const void *parent);
+
+/// Attribute calls on \p handle to the device called \p device (a udid, say).
+/// Anything already recorded against \p handle moves to it.
+void op_stats_name(const void *handle, const char *device);
+
+/// \p handle has gone away (and its value may be reused).
+void op_stats_unbind(const void *handle);
+
+/// Write everything recorded as JSON or as Prometheus text format.
+void op_stats_write(FILE *f, int format);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
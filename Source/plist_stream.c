@@ -0,0 +1,115 @@
+//
+//  plist_stream.c
+//  mobileDeviceManager
+//
+//  See plist_stream.h.  CoreFoundation writes property lists without comments
+//  or CDATA, and escapes '<' and '>' in text, so every '<' starts a tag and the
+//  next '>' ends it.
+//
+
+#include "plist_stream.h"
+
+#include <string.h>
+
+enum {
+	PLS_SEEK_KEY,			// looking for the key in the top-level dictionary
+	PLS_IN_KEY,				// inside a top-level <key>
+	PLS_EXPECT_VALUE,		// found the key, waiting for its value
+	PLS_IN_LIST,			// inside the array
+	PLS_DONE
+};
+
+void plist_stream_init(plist_stream *s, const char *key)
+{
+	memset(s, 0, sizeof(*s));
+	s->key = key;
+	s->keylen = strlen(key);
+	s->state = PLS_SEEK_KEY;
+}
+
+static int is_tag(const char *name, size_t len, const char *tag)
+{
+	size_t n = strlen(tag);
+	return len == n && memcmp(name, tag, n) == 0;
+}
+
+int plist_stream_scan(plist_stream *s, const char *buf, size_t len,
+					  plist_stream_item item, void *ctx)
+{
+	while (s->pos < len && s->state != PLS_DONE) {
+		const char *lt = memchr(buf + s->pos, '<', len - s->pos);
+		if (!lt) {
+			s->pos = len;
+			break;
+		}
+		const char *gt = memchr(lt, '>', buf + len - lt);
+		if (!gt) {
+			// the rest of this tag hasn't arrived yet
+			s->pos = lt - buf;
+			break;
+		}
+		size_t start = lt - buf, end = gt + 1 - buf;
+		s->pos = end;
+
+		if (lt[1] == '?' || lt[1] == '!') continue;
+
+		if (lt[1] == '/') {
+			const char *name = lt + 2;
+			size_t namelen = gt - name;
+			if (--s->depth < 0) return 0;
+			if (s->state == PLS_IN_KEY && is_tag(name, namelen, "key")) {
+				if (start - s->key_text == s->keylen && memcmp(buf + s->key_text, s->key, s->keylen) == 0) {
+					s->state = PLS_EXPECT_VALUE;
+				} else {
+					s->state = PLS_SEEK_KEY;
+				}
+			} else if (s->state == PLS_IN_LIST && s->depth == s->list_depth) {
+				if (item) item(ctx, s->item_start, end);
+			} else if (s->state == PLS_IN_LIST && s->depth < s->list_depth) {
+				s->list_end = end;
+				s->state = PLS_DONE;
+			}
+			continue;
+		}
+
+		const char *name = lt + 1;
+		size_t namelen = strcspn(name, " \t\r\n/>");
+		int empty = (gt[-1] == '/');
+
+		if (s->state == PLS_EXPECT_VALUE) {
+			if (!is_tag(name, namelen, "array")) {
+				s->state = PLS_SEEK_KEY;		// there, but not an array
+			} else if (empty) {
+				s->list_end = end;
+				s->state = PLS_DONE;
+				continue;
+			} else {
+				s->state = PLS_IN_LIST;
+				s->list_depth = s->depth + 1;
+			}
+		} else if (s->state == PLS_IN_LIST && s->depth == s->list_depth) {
+			if (empty) {
+				if (item) item(ctx, start, end);
+				continue;
+			}
+			s->item_start = start;
+		} else if (s->state == PLS_SEEK_KEY && s->depth == s->root_depth && is_tag(name, namelen, "key") && !empty) {
+			s->state = PLS_IN_KEY;
+			s->key_start = start;
+			s->key_text = end;
+		}
+
+		if (!empty) {
+			s->depth++;
+			if (s->root_depth == 0 && is_tag(name, namelen, "dict")) s->root_depth = s->depth;
+		}
+	}
+	return 1;
+}
+
+size_t plist_stream_remove_list(plist_stream *s, char *buf, size_t len)
+{
+	if (s->state != PLS_DONE || s->list_end > len) return len;
+	memmove(buf + s->key_start, buf + s->list_end, len - s->list_end);
+	return len - (s->list_end - s->key_start);
+}
@@ -0,0 +1,59 @@
+//
+//  plist_stream.h
+//  mobileDeviceManager
+//
+//  Picks the entries of one array out of an XML property list while it is still
+//  arriving.  Services such as installation_proxy answer with a dictionary whose
+//  bulk is a single array (CurrentList); scanning for it as the bytes come in
+//  lets each entry be parsed as soon as it is complete, instead of waiting for
+//  the whole reply and parsing it in one go.
+//
+//  Only the structure is checked - entries are handed back as byte ranges to be
+//  parsed properly by the caller.
+//
+
+#ifndef PLIST_STREAM_H
+#define PLIST_STREAM_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct plist_stream {
+	const char	*key;			// top-level key whose array we want
+	size_t		keylen;
+	size_t		pos;			// how far we've scanned
+	int			depth;			// element nesting at pos
+	int			root_depth;		// nesting inside the top-level dictionary
+	int			list_depth;		// nesting inside the array
+	int			state;
+	size_t		key_start;		// the <key> tag of the entry being looked at
+	size_t		key_text;		// its text
+	size_t		item_start;		// the array entry being scanned
+	size_t		list_end;		// the end of the array, once seen
+} plist_stream;
+
+/// Called for each complete entry of the array, which occupies buf[start, end).
+typedef void (*plist_stream_item)(void *ctx, size_t start, size_t end);
+
+/// Get ready to scan a new document for the array under \p key.
+void plist_stream_init(plist_stream *s, const char *key);
+
+/// Scan what has arrived so far, \p len bytes of \p buf, carrying on from where
+/// the last call stopped (the buffer may have moved, but must start with the
+/// same bytes).  Returns 0 if the XML is malformed.
+int plist_stream_scan(plist_stream *s, const char *buf, size_t len,
+					  plist_stream_item item, void *ctx);
+
+/// Once the whole document has been scanned, cut the key and its array out of
+/// it, so what is left can be parsed without parsing the array again.  Returns
+/// the new length, which is \p len if the key wasn't found.
+size_t plist_stream_remove_list(plist_stream *s, char *buf, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,522 @@
+//
+//  service_io.c
+//  mobileDeviceManager
+//
+//  See service_io.h.  Each thread owns a poller and the sockets hashed to it;
+//  other threads only queue work under its lock and poke its wake-up pipe.
+//  Each socket's queue is a channel, and only the request at its head has a
+//  poller registration - for writing until its message is sent, then for reading
+//  until its reply is in.
+//
+
+#include "service_io.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <sys/event.h>
+#endif
+
+#define SIO_MAX_EVENTS		64
+
+#ifdef MSG_NOSIGNAL
+#define SIO_SEND_FLAGS		(MSG_DONTWAIT | MSG_NOSIGNAL)
+#else
+#define SIO_SEND_FLAGS		MSG_DONTWAIT
+#endif
+
+enum { SIO_NONE, SIO_IN, SIO_OUT };
+
+typedef struct sio_request sio_request;
+struct sio_request {
+	sio_request		*next;
+	uint64_t		id;
+	const uint8_t	*out;
+	uint32_t		out_len;
+	size_t			to_send;		// 4 + out_len, or 0 if only receiving
+	size_t			sent;
+	int				reply;
+	uint8_t			hdr[4];			// outgoing length, then incoming length
+	size_t			got;			// of the incoming length and body
+	uint8_t			*in;
+	uint32_t		in_len;
+	double			deadline;		// 0 for none
+	int				cancelled;
+	int				status;
+	sio_done		done;
+	void			*ctx;
+};
+
+typedef struct sio_channel sio_channel;
+struct sio_channel {
+	sio_channel		*next;
+	int				fd;
+	int				interest;		// what the poller is watching for
+	int				failed;			// errno which broke the connection
+	int				forgotten;
+	sio_request		*head, *tail;
+};
+
+typedef struct {
+	sio_loop		*loop;
+	pthread_t		thread;
+	pthread_mutex_t	lock;			// guards channels and stop
+	int				poller;
+	int				wake[2];
+	int				stop;
+	sio_channel		*channels;
+} sio_thread;
+
+struct sio_loop {
+	unsigned		count;
+	sio_thread		*threads;
+	pthread_mutex_t	id_lock;
+	uint64_t		next_id;
+};
+
+static double sio_now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void sio_wake(sio_thread *t)
+{
+	char c = 0;
+	// if the pipe is full, the thread is already due to wake
+	ssize_t rc = write(t->wake[1], &c, 1);
+	(void)rc;
+}
+
+static int sio_watch(sio_thread *t, int fd, int want, int had, void *udata)
+{
+#ifdef __linux__
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = want == SIO_IN ? EPOLLIN : EPOLLOUT;
+	ev.data.ptr = udata;
+	if (want == SIO_NONE) return epoll_ctl(t->poller, EPOLL_CTL_DEL, fd, &ev);
+	if (had != SIO_NONE) return epoll_ctl(t->poller, EPOLL_CTL_MOD, fd, &ev);
+	if (epoll_ctl(t->poller, EPOLL_CTL_ADD, fd, &ev) == 0) return 0;
+	// a socket which was closed and reopened under the same number
+	return errno == EEXIST ? epoll_ctl(t->poller, EPOLL_CTL_MOD, fd, &ev) : -1;
+#else
+	// separately, so a failed delete doesn't stop the add
+	struct kevent ev;
+	if (had != SIO_NONE) {
+		EV_SET(&ev, fd, had == SIO_IN ? EVFILT_READ : EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+		kevent(t->poller, &ev, 1, NULL, 0, NULL);
+	}
+	if (want == SIO_NONE) return 0;
+	EV_SET(&ev, fd, want == SIO_IN ? EVFILT_READ : EVFILT_WRITE, EV_ADD, 0, 0, udata);
+	return kevent(t->poller, &ev, 1, NULL, 0, NULL);
+#endif
+}
+
+static void sio_set_interest(sio_thread *t, sio_channel *ch, int want)
+{
+	if (ch->interest == want) return;
+	// deleting fails harmlessly if the socket has already been closed
+	sio_watch(t, ch->fd, want, ch->interest, ch);
+	ch->interest = want;
+}
+
+static void sio_finish(sio_request *r, int status, sio_request **finished)
+{
+	r->status = status;
+	r->next = *finished;
+	*finished = r;
+}
+
+// Take the head request off ch and finish it.  If it was part way through, the
+// connection can't be used any more.
+static void sio_pop(sio_channel *ch, int status, sio_request **finished)
+{
+	sio_request *r = ch->head;
+	ch->head = r->next;
+	if (!ch->head) ch->tail = NULL;
+	if (status && (r->sent || r->got)) ch->failed = status;
+	sio_finish(r, status, finished);
+}
+
+// Move the head request of ch along as far as the socket allows.  Returns 0 if
+// it is waiting for the socket, otherwise 1, with the request finished (status
+// 0) or failed (an errno).
+static int sio_pump(sio_channel *ch, int *status)
+{
+	sio_request *r = ch->head;
+	ssize_t rc;
+
+	while (r->sent < r->to_send) {
+		struct iovec iov[2];
+		struct msghdr msg;
+		int n = 0;
+		memset(&msg, 0, sizeof(msg));
+		if (r->sent < 4) {
+			iov[n].iov_base = r->hdr + r->sent;
+			iov[n++].iov_len = 4 - r->sent;
+		}
+		size_t body = r->sent < 4 ? 0 : r->sent - 4;
+		if (r->out_len > body) {
+			iov[n].iov_base = (void*)(r->out + body);
+			iov[n++].iov_len = r->out_len - body;
+		}
+		msg.msg_iov = iov;
+		msg.msg_iovlen = n;
+		rc = sendmsg(ch->fd, &msg, SIO_SEND_FLAGS);
+		if (rc < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			*status = errno;
+			return 1;
+		}
+		r->sent += rc;
+	}
+
+	while (r->reply) {
+		if (r->got < 4) {
+			rc = recv(ch->fd, r->hdr + r->got, 4 - r->got, MSG_DONTWAIT);
+		} else if (r->got - 4 < r->in_len) {
+			rc = recv(ch->fd, r->in + r->got - 4, r->in_len - (r->got - 4), MSG_DONTWAIT);
+		} else {
+			break;
+		}
+		if (rc == 0) {
+			*status = EPIPE;
+			return 1;
+		}
+		if (rc < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			*status = errno;
+			return 1;
+		}
+		r->got += rc;
+		if (r->got == 4) {
+			r->in_len = ntohl(*(uint32_t*)r->hdr);
+			if (!(r->in = malloc(r->in_len ? r->in_len : 1))) {
+				*status = ENOMEM;
+				return 1;
+			}
+		}
+	}
+	*status = 0;
+	return 1;
+}
+
+// Get every channel ready for the next wait: finish requests which were
+// cancelled, have timed out or can't be carried out, register for whatever the
+// head requests need next and free channels which are finished with.  Returns
+// the nearest deadline, or 0 if there isn't one.
+static double sio_arm(sio_thread *t, double now, sio_request **finished)
+{
+	sio_channel **link = &t->channels;
+	double next = 0;
+
+	while (*link) {
+		sio_channel *ch = *link;
+		sio_request **rp = &ch->head, *prev = NULL;
+
+		while (*rp) {
+			sio_request *r = *rp;
+			int status = 0;
+			if (ch->failed) status = ch->failed;
+			else if (r->cancelled || ch->forgotten) status = ECANCELED;
+			else if (r->deadline && r->deadline <= now) status = ETIMEDOUT;
+			if (!status) {
+				if (r->deadline && (!next || r->deadline < next)) next = r->deadline;
+				prev = r;
+				rp = &r->next;
+			} else if (r == ch->head) {
+				sio_pop(ch, status, finished);
+			} else {
+				*rp = r->next;
+				if (ch->tail == r) ch->tail = prev;
+				sio_finish(r, status, finished);
+			}
+		}
+
+		if (ch->head) {
+			sio_set_interest(t, ch, ch->head->sent < ch->head->to_send ? SIO_OUT : SIO_IN);
+			link = &ch->next;
+		} else {
+			if (ch->forgotten) {
+				// the socket may already have been closed and its number reused
+				// by a new channel - don't unregister that one
+				sio_channel *other;
+				for (other = t->channels; other; other = other->next) {
+					if (other != ch && other->fd == ch->fd && !other->forgotten) break;
+				}
+				if (other) ch->interest = SIO_NONE;
+			}
+			sio_set_interest(t, ch, SIO_NONE);
+			if (ch->failed && !ch->forgotten) {
+				// remembered until sio_forget(), so later requests fail too
+				link = &ch->next;
+			} else {
+				*link = ch->next;
+				free(ch);
+			}
+		}
+	}
+	return next;
+}
+
+static void sio_complete(sio_request *finished)
+{
+	sio_request *reversed = NULL;
+
+	// sio_finish() pushes onto the front; call back in the order they finished
+	while (finished) {
+		sio_request *r = finished;
+		finished = r->next;
+		r->next = reversed;
+		reversed = r;
+	}
+	finished = reversed;
+	while (finished) {
+		sio_request *r = finished;
+		finished = r->next;
+		if (r->status) {
+			free(r->in);
+			r->in = NULL;
+			r->in_len = 0;
+		}
+		r->done(r->ctx, r->status, r->in, r->in_len);
+		free(r);
+	}
+}
+
+static void *sio_run(void *arg)
+{
+	sio_thread *t = arg;
+#ifdef __linux__
+	struct epoll_event events[SIO_MAX_EVENTS];
+#else
+	struct kevent events[SIO_MAX_EVENTS];
+#endif
+	int i, n;
+
+	for (;;) {
+		sio_request *finished = NULL;
+		double now = sio_now(), next;
+
+		pthread_mutex_lock(&t->lock);
+		if (t->stop) {
+			pthread_mutex_unlock(&t->lock);
+			break;
+		}
+		next = sio_arm(t, now, &finished);
+		pthread_mutex_unlock(&t->lock);
+		sio_complete(finished);
+		finished = NULL;
+
+		// wait for a socket, a wake-up or the next deadline
+		double wait = next ? next - now : -1;
+		if (next && wait < 0) wait = 0;
+#ifdef __linux__
+		n = epoll_wait(t->poller, events, SIO_MAX_EVENTS, wait < 0 ? -1 : (int)(wait * 1000) + 1);
+#else
+		struct timespec ts;
+		ts.tv_sec = (time_t)wait;
+		ts.tv_nsec = (long)((wait - ts.tv_sec) * 1e9);
+		n = kevent(t->poller, NULL, 0, events, SIO_MAX_EVENTS, wait < 0 ? NULL : &ts);
+#endif
+		if (n < 0) n = 0;
+
+		pthread_mutex_lock(&t->lock);
+		for (i = 0; i < n; i++) {
+#ifdef __linux__
+			sio_channel *ch = events[i].data.ptr;
+#else
+			sio_channel *ch = events[i].udata;
+#endif
+			if (!ch) {
+				char buf[64];
+				while (read(t->wake[0], buf, sizeof(buf)) > 0) ;
+				continue;
+			}
+			// carry on down the queue while the socket keeps up
+			int status;
+			while (ch->head && !ch->failed && !ch->forgotten && !ch->head->cancelled && sio_pump(ch, &status)) {
+				sio_pop(ch, status, &finished);
+			}
+		}
+		pthread_mutex_unlock(&t->lock);
+		sio_complete(finished);
+	}
+	return NULL;
+}
+
+sio_loop *sio_loop_create(unsigned threads)
+{
+	sio_loop *loop = calloc(1, sizeof(*loop));
+	unsigned i;
+
+	if (!loop) return NULL;
+	if (threads == 0) threads = 1;
+	loop->threads = calloc(threads, sizeof(sio_thread));
+	if (!loop->threads) {
+		free(loop);
+		return NULL;
+	}
+	pthread_mutex_init(&loop->id_lock, NULL);
+	loop->next_id = 1;
+
+	for (i = 0; i < threads; i++) {
+		sio_thread *t = &loop->threads[i];
+		t->loop = loop;
+		pthread_mutex_init(&t->lock, NULL);
+#ifdef __linux__
+		t->poller = epoll_create(16);
+#else
+		t->poller = kqueue();
+#endif
+		if (t->poller < 0 || pipe(t->wake) != 0) break;
+		fcntl(t->wake[0], F_SETFL, O_NONBLOCK);
+		fcntl(t->wake[1], F_SETFL, O_NONBLOCK);
+		if (sio_watch(t, t->wake[0], SIO_IN, SIO_NONE, NULL) != 0) break;
+		if (pthread_create(&t->thread, NULL, sio_run, t) != 0) break;
+		loop->count++;
+	}
+	if (loop->count < threads) {
+		sio_thread *t = &loop->threads[loop->count];
+		if (t->poller > 0) close(t->poller);
+		if (t->wake[0] > 0) {
+			close(t->wake[0]);
+			close(t->wake[1]);
+		}
+		sio_loop_destroy(loop);
+		return NULL;
+	}
+	return loop;
+}
+
+void sio_loop_destroy(sio_loop *loop)
+{
+	unsigned i;
+
+	for (i = 0; i < loop->count; i++) {
+		sio_thread *t = &loop->threads[i];
+		pthread_mutex_lock(&t->lock);
+		t->stop = 1;
+		pthread_mutex_unlock(&t->lock);
+		sio_wake(t);
+		pthread_join(t->thread, NULL);
+
+		sio_request *finished = NULL;
+		while (t->channels) {
+			sio_channel *ch = t->channels;
+			t->channels = ch->next;
+			while (ch->head) sio_pop(ch, ECANCELED, &finished);
+			free(ch);
+		}
+		sio_complete(finished);
+		close(t->poller);
+		close(t->wake[0]);
+		close(t->wake[1]);
+		pthread_mutex_destroy(&t->lock);
+	}
+	pthread_mutex_destroy(&loop->id_lock);
+	free(loop->threads);
+	free(loop);
+}
+
+uint64_t sio_submit(sio_loop *loop, int fd, const void *msg, uint32_t len, int reply,
+					double timeout, sio_done done, void *ctx)
+{
+	sio_thread *t = &loop->threads[(unsigned)fd % loop->count];
+	sio_request *r = calloc(1, sizeof(*r));
+	sio_channel *ch;
+
+	pthread_mutex_lock(&loop->id_lock);
+	uint64_t id = loop->next_id++;
+	pthread_mutex_unlock(&loop->id_lock);
+
+	if (!r) {
+		done(ctx, ENOMEM, NULL, 0);
+		return id;
+	}
+	r->id = id;
+	r->out = msg;
+	r->out_len = len;
+	r->to_send = msg ? 4 + (size_t)len : 0;
+	*(uint32_t*)r->hdr = htonl(len);
+	r->reply = reply;
+	r->deadline = timeout > 0 ? sio_now() + timeout : 0;
+	r->done = done;
+	r->ctx = ctx;
+
+	pthread_mutex_lock(&t->lock);
+	for (ch = t->channels; ch; ch = ch->next) {
+		if (ch->fd == fd && !ch->forgotten) break;
+	}
+	if (!ch && (ch = calloc(1, sizeof(*ch)))) {
+		ch->fd = fd;
+		ch->next = t->channels;
+		t->channels = ch;
+	}
+	if (ch) {
+		if (ch->tail) ch->tail->next = r;
+		else ch->head = r;
+		ch->tail = r;
+	}
+	pthread_mutex_unlock(&t->lock);
+
+	if (!ch) {
+		free(r);
+		done(ctx, ENOMEM, NULL, 0);
+	} else {
+		sio_wake(t);
+	}
+	return id;
+}
+
+void sio_cancel(sio_loop *loop, uint64_t id)
+{
+	unsigned i;
+
+	for (i = 0; i < loop->count; i++) {
+		sio_thread *t = &loop->threads[i];
+		sio_channel *ch;
+		sio_request *r = NULL;
+		pthread_mutex_lock(&t->lock);
+		for (ch = t->channels; ch && !r; ch = ch->next) {
+			for (r = ch->head; r && r->id != id; r = r->next) ;
+		}
+		if (r) r->cancelled = 1;
+		pthread_mutex_unlock(&t->lock);
+		if (r) {
+			sio_wake(t);
+			break;
+		}
+	}
+}
+
+void sio_forget(sio_loop *loop, int fd)
+{
+	sio_thread *t = &loop->threads[(unsigned)fd % loop->count];
+	sio_channel *ch;
+	int found = 0;
+
+	pthread_mutex_lock(&t->lock);
+	for (ch = t->channels; ch; ch = ch->next) {
+		if (ch->fd == fd && !ch->forgotten) {
+			ch->forgotten = 1;
+			found = 1;
+		}
+	}
+	pthread_mutex_unlock(&t->lock);
+	if (found) sio_wake(t);
+}
@@ -0,0 +1,66 @@
+//
+//  service_io.h
+//  mobileDeviceManager
+//
+//  Event-driven I/O for lockdown service connections.  Every message on a
+//  service socket is a 32 bit big-endian length followed by that many bytes;
+//  this runs the sends and receives for any number of sockets on a few threads,
+//  using kqueue (or epoll on Linux), instead of a thread blocked in send() or
+//  recv() per socket.
+//
+//  Requests on the same socket are carried out in the order they were
+//  submitted; requests on different sockets proceed independently.  Each
+//  request may have a deadline and may be cancelled.  Once a request has been
+//  cut off part way through (by failing, timing out or being cancelled), the
+//  socket's message stream is out of step, so every later request on it fails
+//  with the same error until it is forgotten with sio_forget().
+//
+//  The sockets are never made non-blocking (the blocking send()/recv() path can
+//  still use them, though not at the same time), MSG_DONTWAIT is used instead.
+//
+
+#ifndef SERVICE_IO_H
+#define SERVICE_IO_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct sio_loop sio_loop;
+
+/// Called on one of the loop's threads when a request finishes.  \p status is 0
+/// on success, otherwise an errno value - ETIMEDOUT, ECANCELED, EPIPE if the
+/// other end closed the connection, or whatever send()/recv() failed with.
+/// \p reply is the body of the reply, if one was asked for, and must be freed by
+/// the callback; it is NULL if there was no reply.
+typedef void (*sio_done)(void *ctx, int status, uint8_t *reply, uint32_t len);
+
+/// Start a loop with \p threads threads.  Returns NULL on failure.
+sio_loop *sio_loop_create(unsigned threads);
+
+/// Stop the loop.  Requests still outstanding finish with ECANCELED, on the
+/// calling thread.
+void sio_loop_destroy(sio_loop *loop);
+
+/// Queue a request on socket \p fd: send \p len bytes of \p msg as one message
+/// (if \p msg isn't NULL), then, if \p reply is set, receive one message.
+/// \p msg must stay valid until \p done is called.  \p timeout is in seconds
+/// from now, 0 for none.  Returns an id for sio_cancel(), never 0.
+uint64_t sio_submit(sio_loop *loop, int fd, const void *msg, uint32_t len, int reply,
+					double timeout, sio_done done, void *ctx);
+
+/// Cancel a request.  If it hasn't already finished, it finishes with ECANCELED
+/// shortly afterwards.
+void sio_cancel(sio_loop *loop, uint64_t id);
+
+/// Stop tracking socket \p fd, cancelling any requests still queued for it.
+/// Call this before the socket is closed.
+void sio_forget(sio_loop *loop, int fd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,174 @@
+//
+//  service_standin.c
+//  mobileDeviceManager
+//
+//  See service_standin.h.
+//
+
+#include "service_standin.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+// a message bigger than this is taken to mean the stream is out of step
+#define STANDIN_MAX_MESSAGE		(64*1024*1024)
+
+struct service_standin {
+	int							fd;				// our end of the socketpair
+	service_standin_handler		handler;
+	void						*ctx;
+	volatile unsigned			latency_us;
+	volatile unsigned			bandwidth;		// bytes per second, 0 for unlimited
+	uint64_t					link_free;		// when the simulated link is next idle, in us
+	volatile uint64_t			requests;
+	int							replied;		// the message being handled has had a reply
+	pthread_t					thread;
+	unsigned char				*buf;			// the message being handled
+	size_t						cap;
+};
+
+#pragma mark I/O
+
+static int read_full(int fd, void *buf, size_t len)
+{
+	unsigned char *p = buf;
+	while (len) {
+		ssize_t n = read(fd, p, len);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return 0;
+		p += n;
+		len -= n;
+	}
+	return 1;
+}
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	while (len) {
+		ssize_t n = write(fd, p, len);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return 0;
+		p += n;
+		len -= n;
+	}
+	return 1;
+}
+
+static uint64_t now_us(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+// as in afc_standin, the link is busy until link_free and transfers queue
+// behind one another
+static void pace(service_standin *s, size_t len)
+{
+	unsigned bandwidth = s->bandwidth;
+	if (!bandwidth) return;
+	uint64_t now = now_us();
+	if (s->link_free < now) s->link_free = now;
+	s->link_free += (uint64_t)len * 1000000 / bandwidth;
+	if (s->link_free > now + 1000) usleep((useconds_t)(s->link_free - now));
+}
+
+#pragma mark server
+
+static void *serve(void *arg)
+{
+	service_standin *s = arg;
+	unsigned char raw[4];
+
+	for (;;) {
+		if (!read_full(s->fd, raw, sizeof(raw))) break;
+		size_t len = ((size_t)raw[0] << 24) | ((size_t)raw[1] << 16) | ((size_t)raw[2] << 8) | raw[3];
+		if (len > STANDIN_MAX_MESSAGE) break;
+		if (len > s->cap) {
+			unsigned char *n = realloc(s->buf, len);
+			if (!n) break;
+			s->buf = n;
+			s->cap = len;
+		}
+		if (!read_full(s->fd, s->buf, len)) break;
+		pace(s, sizeof(raw) + len);
+		__sync_fetch_and_add(&s->requests, 1);
+		s->replied = 0;
+		if (!s->handler(s->ctx, s, s->buf, len)) break;
+	}
+	return NULL;
+}
+
+int service_standin_reply(service_standin *s, const void *msg, size_t len)
+{
+	unsigned char raw[4];
+	if (len > 0xffffffffu) return 0;
+	raw[0] = (unsigned char)(len >> 24);
+	raw[1] = (unsigned char)(len >> 16);
+	raw[2] = (unsigned char)(len >> 8);
+	raw[3] = (unsigned char)len;
+
+	if (!s->replied && s->latency_us) usleep(s->latency_us);
+	s->replied = 1;
+	pace(s, sizeof(raw) + len);
+	return write_full(s->fd, raw, sizeof(raw)) && write_full(s->fd, msg, len);
+}
+
+int service_standin_start(service_standin_handler handler, void *ctx, unsigned latency_us,
+						  service_standin **server, int *client_fd)
+{
+	int fds[2];
+	service_standin *s = calloc(1, sizeof(*s));
+	if (!s) return ENOMEM;
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+		int e = errno;
+		free(s);
+		return e;
+	}
+	s->fd = fds[0];
+	s->handler = handler;
+	s->ctx = ctx;
+	s->latency_us = latency_us;
+	int rc = pthread_create(&s->thread, NULL, serve, s);
+	if (rc != 0) {
+		close(fds[0]);
+		close(fds[1]);
+		free(s);
+		return rc;
+	}
+	*server = s;
+	*client_fd = fds[1];
+	return 0;
+}
+
+void service_standin_set_latency(service_standin *s, unsigned latency_us)
+{
+	s->latency_us = latency_us;
+}
+
+void service_standin_set_bandwidth(service_standin *s, unsigned bytes_per_second)
+{
+	s->bandwidth = bytes_per_second;
+}
+
+uint64_t service_standin_requests(service_standin *s)
+{
+	return __sync_fetch_and_add(&s->requests, 0);
+}
+
+void service_standin_stop(service_standin *s)
+{
+	if (!s) return;
+	shutdown(s->fd, SHUT_RDWR);
+	pthread_join(s->thread, NULL);
+	close(s->fd);
+	free(s->buf);
+	free(s);
+}
@@ -0,0 +1,60 @@
+//
+//  service_standin.h
+//  mobileDeviceManager
+//
+//  The plist service counterpart of afc_standin: a server on one end of a
+//  socketpair which reads the length-prefixed messages that AMService sends and
+//  hands each one to a handler, which answers with as many replies as it likes.
+//  The other end can be used as the socket of an AMService, so the real request
+//  and reply code runs without a device.
+//
+//  The server doesn't look inside the messages - the handler decodes them and
+//  encodes its replies.  Like afc_standin, it serves one connection on its own
+//  thread, and can add latency to every request and limit the bandwidth.
+//
+
+#ifndef SERVICE_STANDIN_H
+#define SERVICE_STANDIN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct service_standin service_standin;
+
+/// Called on the server's thread with each message received.  Answer it with
+/// service_standin_reply().  Return 0 to drop the connection.
+typedef int (*service_standin_handler)(void *ctx, service_standin *server, const void *msg, size_t len);
+
+/// Start serving.  On success returns 0, stores the server handle in \p server
+/// and the client end of the socketpair in \p client_fd, which the caller owns
+/// and must close before calling service_standin_stop().
+int service_standin_start(service_standin_handler handler, void *ctx, unsigned latency_us,
+						  service_standin **server, int *client_fd);
+
+/// Send \p len bytes of \p msg, with its length in front, as a reply to the
+/// message being handled.  The latency is added before the first reply to each
+/// message.  Returns 0 if the client has gone.
+int service_standin_reply(service_standin *server, const void *msg, size_t len);
+
+/// Change the latency added to every request.
+void service_standin_set_latency(service_standin *server, unsigned latency_us);
+
+/// Limit the bytes carried in both directions to \p bytes_per_second (0, the
+/// default, for no limit).
+void service_standin_set_bandwidth(service_standin *server, unsigned bytes_per_second);
+
+/// Number of messages received so far.
+uint64_t service_standin_requests(service_standin *server);
+
+/// Shut the server down and wait for its thread to exit.
+void service_standin_stop(service_standin *server);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
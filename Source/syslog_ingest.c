@@ -0,0 +1,190 @@
+//
+//  syslog_ingest.c
+//  mobileDeviceManager
+//
+//  See syslog_ingest.h.
+//
+
+#include "syslog_ingest.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#pragma mark splitting
+
+static void emit(const char *rec, size_t len, syslog_record_fn fn, void *ctx)
+{
+	while (len && *rec == '\n') {
+		rec++;
+		len--;
+	}
+	// occasionally the relay sends an empty record - no need to pass that on
+	if (len) fn(ctx, rec, len);
+}
+
+static int carry(syslog_splitter *s, const char *buf, size_t len)
+{
+	if (s->carry_len + len > s->carry_cap) {
+		size_t cap = s->carry_cap ? s->carry_cap : 1024;
+		while (cap < s->carry_len + len) cap *= 2;
+		char *p = realloc(s->carry, cap);
+		if (!p) return 0;
+		s->carry = p;
+		s->carry_cap = cap;
+	}
+	memcpy(s->carry + s->carry_len, buf, len);
+	s->carry_len += len;
+	return 1;
+}
+
+void syslog_split(syslog_splitter *s, const char *buf, size_t len, syslog_record_fn fn, void *ctx)
+{
+	const char *end = buf + len;
+
+	while (buf < end) {
+		const char *nul = memchr(buf, '\0', end - buf);
+		if (!nul) {
+			// unfinished - keep it for next time, unless it has got silly
+			size_t take = end - buf;
+			if (s->carry_len + take > SYSLOG_MAX_RECORD) take = SYSLOG_MAX_RECORD - s->carry_len;
+			if (!carry(s, buf, take)) {
+				// out of memory - pass on what there is rather than lose it
+				emit(s->carry, s->carry_len, fn, ctx);
+				s->carry_len = 0;
+				emit(buf, end - buf, fn, ctx);
+				return;
+			}
+			buf += take;
+			if (s->carry_len < SYSLOG_MAX_RECORD) return;
+			emit(s->carry, s->carry_len, fn, ctx);
+			s->carry_len = 0;
+			continue;
+		}
+		if (s->carry_len) {
+			// the end of the record started in the last read
+			if (carry(s, buf, nul - buf)) {
+				emit(s->carry, s->carry_len, fn, ctx);
+			} else {
+				emit(s->carry, s->carry_len, fn, ctx);
+				emit(buf, nul - buf, fn, ctx);
+			}
+			s->carry_len = 0;
+		} else {
+			emit(buf, nul - buf, fn, ctx);
+		}
+		buf = nul + 1;
+	}
+}
+
+void syslog_splitter_free(syslog_splitter *s)
+{
+	free(s->carry);
+	s->carry = NULL;
+	s->carry_len = s->carry_cap = 0;
+}
+
+#pragma mark ring
+
+// Records are stored as a 32 bit length followed by the text, padded to a
+// multiple of 4 bytes.  A record which would run past the end of the buffer is
+// put at the start instead, with a WRAP marker to tell the consumer.
+#define WRAP		0xFFFFFFFFu
+
+struct syslog_ring {
+	char				*buf;
+	size_t				mask;
+	size_t				head;			// written by the producer only
+	size_t				tail;			// written by the consumer only
+	size_t				pushed;
+	size_t				popped;
+	uint32_t			peeked;			// size of the record last peeked, with padding
+};
+
+static size_t padded(uint32_t len)
+{
+	return 4 + ((len + 3) & ~(size_t)3);
+}
+
+syslog_ring *syslog_ring_create(size_t capacity)
+{
+	syslog_ring *r = calloc(1, sizeof(*r));
+	size_t size = 4096;
+
+	if (!r) return NULL;
+	while (size < capacity) size *= 2;
+	if (!(r->buf = malloc(size))) {
+		free(r);
+		return NULL;
+	}
+	r->mask = size - 1;
+	return r;
+}
+
+void syslog_ring_destroy(syslog_ring *r)
+{
+	if (r) {
+		free(r->buf);
+		free(r);
+	}
+}
+
+int syslog_ring_push(syslog_ring *r, const void *head, uint32_t headlen, const char *rec, uint32_t len)
+{
+	size_t size = r->mask + 1;
+	size_t need = padded(headlen + len);
+	size_t at = r->head;
+	size_t off = at & r->mask;
+	size_t skip = (off + need > size) ? size - off : 0;
+
+	// acquire: the consumer has finished with the space it has given back
+	if (need + skip > size - (at - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE))) return 0;
+
+	if (skip) {
+		*(uint32_t*)(r->buf + off) = WRAP;
+		at += skip;
+		off = 0;
+	}
+	*(uint32_t*)(r->buf + off) = headlen + len;
+	if (headlen) memcpy(r->buf + off + 4, head, headlen);
+	memcpy(r->buf + off + 4 + headlen, rec, len);
+
+	// release: the record is in place before it is published
+	__atomic_store_n(&r->head, at + need, __ATOMIC_RELEASE);
+	__atomic_store_n(&r->pushed, r->pushed + 1, __ATOMIC_RELAXED);
+	return 1;
+}
+
+int syslog_ring_peek(syslog_ring *r, const char **rec, uint32_t *len)
+{
+	size_t tail = r->tail;
+
+	// acquire: see the producer's latest head, and its record
+	if (tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) return 0;
+
+	size_t off = tail & r->mask;
+	uint32_t n = *(uint32_t*)(r->buf + off);
+	if (n == WRAP) {
+		// the producer only wraps when there's a record at the start
+		tail += r->mask + 1 - off;
+		off = 0;
+		n = *(uint32_t*)r->buf;
+		__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+	}
+	*rec = r->buf + off + 4;
+	*len = n;
+	r->peeked = (uint32_t)padded(n);
+	return 1;
+}
+
+void syslog_ring_pop(syslog_ring *r)
+{
+	// release: finished with the record before freeing its space
+	__atomic_store_n(&r->tail, r->tail + r->peeked, __ATOMIC_RELEASE);
+	__atomic_store_n(&r->popped, r->popped + 1, __ATOMIC_RELAXED);
+	r->peeked = 0;
+}
+
+size_t syslog_ring_count(syslog_ring *r)
+{
+	return __atomic_load_n(&r->pushed, __ATOMIC_RELAXED) - __atomic_load_n(&r->popped, __ATOMIC_RELAXED);
+}
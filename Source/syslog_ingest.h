@@ -0,0 +1,71 @@
+//
+//  syslog_ingest.h
+//  mobileDeviceManager
+//
+//  Plumbing for reading the device's syslog_relay quickly.
+//
+//  The relay sends syslog records terminated by '\0', in reads of up to 16K
+//  which need not end on a record boundary.  A syslog_splitter turns those
+//  reads back into whole records; a syslog_ring carries them from the thread
+//  reading the socket to the thread delivering them, without locks.
+//
+
+#ifndef SYSLOG_INGEST_H
+#define SYSLOG_INGEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Records longer than this are passed on in pieces of this size.
+#define SYSLOG_MAX_RECORD		(64*1024)
+
+typedef void (*syslog_record_fn)(void *ctx, const char *rec, size_t len);
+
+typedef struct syslog_splitter {
+	char	*carry;			// the start of a record continued in the next read
+	size_t	carry_len;
+	size_t	carry_cap;
+} syslog_splitter;
+
+/// Split \p len bytes read from the relay into records, calling \p fn for each
+/// complete one.  Leading newlines are dropped, as are empty records.  A record
+/// left unfinished at the end of \p buf is kept until the rest arrives.
+void syslog_split(syslog_splitter *s, const char *buf, size_t len, syslog_record_fn fn, void *ctx);
+
+/// Release the splitter's memory.  Any unfinished record is lost.
+void syslog_splitter_free(syslog_splitter *s);
+
+/// A single-producer, single-consumer ring of records.  Each record is stored
+/// in one piece, so the consumer can use it in place.
+typedef struct syslog_ring syslog_ring;
+
+/// \p capacity is in bytes, and is rounded up to a power of two.
+syslog_ring *syslog_ring_create(size_t capacity);
+void syslog_ring_destroy(syslog_ring *r);
+
+/// Producer: add a record, made of \p headlen bytes from \p head (say, what
+/// the producer made of it - NULL and 0 if nothing) followed by \p len bytes
+/// from \p rec.  The head is kept 4 byte aligned.  Returns 0 if there isn't
+/// room.
+int syslog_ring_push(syslog_ring *r, const void *head, uint32_t headlen, const char *rec, uint32_t len);
+
+/// Consumer: look at the oldest record, head and all, without removing it.
+/// Returns 0 if the ring is empty.
+int syslog_ring_peek(syslog_ring *r, const char **rec, uint32_t *len);
+
+/// Consumer: remove the record returned by the last syslog_ring_peek().
+void syslog_ring_pop(syslog_ring *r);
+
+/// The number of records waiting.  Exact from either side; a snapshot from
+/// anywhere else.
+size_t syslog_ring_count(syslog_ring *r);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
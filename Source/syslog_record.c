@@ -0,0 +1,307 @@
+//
+//  syslog_record.c
+//  mobileDeviceManager
+//
+//  See syslog_record.h.
+//
+
+#include "syslog_record.h"
+
+#include <ctype.h>
+#include <regex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <syslog.h>
+
+#pragma mark parsing
+
+static const char *const months[12] = {
+	"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+};
+
+// days before the start of each month, in a leap year so that 29 Feb has a place
+static const uint16_t days_before[12] = {
+	0, 31, 60, 91, 121, 152, 182, 213, 244, 274, 305, 335
+};
+
+static const char *const levels[8] = {
+	"Emergency", "Alert", "Critical", "Error", "Warning", "Notice", "Info", "Debug"
+};
+
+static int digits(const char *p, int n)
+{
+	int v = 0;
+	while (n--) {
+		if (!isdigit((unsigned char)*p)) return -1;
+		v = v*10 + (*p++ - '0');
+	}
+	return v;
+}
+
+// "Oct 17 12:34:56" or "Oct  7 12:34:56".  Returns 0 if it isn't a timestamp.
+// Midnight on 1 January is a timestamp, though it leaves *when 0.
+static int parse_time(const char *p, uint32_t *when)
+{
+	int mon, day, h, m, s;
+
+	for (mon=0; mon<12; mon++) if (!memcmp(p, months[mon], 3)) break;
+	if (mon == 12 || p[3] != ' ' || p[6] != ' ' || p[9] != ':' || p[12] != ':') return 0;
+	day = digits(p+5, 1);
+	if (p[4] != ' ') day = digits(p+4, 2);
+	h = digits(p+7, 2);
+	m = digits(p+10, 2);
+	s = digits(p+13, 2);
+	if (day < 1 || day > 31 || h < 0 || h > 23 || m < 0 || m > 59 || s < 0 || s > 60) return 0;
+	*when = (uint32_t)(days_before[mon] + day - 1)*86400 + h*3600 + m*60 + s;
+	return 1;
+}
+
+int syslog_level_named(const char *name)
+{
+	int i;
+
+	if (isdigit((unsigned char)name[0]) && !name[1]) return name[0] <= '7' ? name[0] - '0' : SYSLOG_LEVEL_NONE;
+	for (i=0; i<8; i++) if (!strcasecmp(name, levels[i])) return i;
+	// and the abbreviations syslog.conf uses
+	if (!strcasecmp(name, "emerg")) return LOG_EMERG;
+	if (!strcasecmp(name, "crit")) return LOG_CRIT;
+	if (!strcasecmp(name, "err")) return LOG_ERR;
+	return SYSLOG_LEVEL_NONE;
+}
+
+const char *syslog_level_name(int level)
+{
+	return (level >= 0 && level < 8) ? levels[level] : "";
+}
+
+static int level_at(const char *p, size_t len)
+{
+	int i;
+	for (i=0; i<8; i++) {
+		if (strlen(levels[i]) == len && !memcmp(p, levels[i], len)) return i;
+	}
+	return SYSLOG_LEVEL_NONE;
+}
+
+int syslog_parse(const char *rec, size_t len, syslog_record *out)
+{
+	const char *p = rec, *end = rec + len, *q, *sep;
+
+	memset(out, 0, sizeof(*out));
+	out->pid = -1;
+	out->level = SYSLOG_LEVEL_NONE;
+
+	// timestamp and host
+	if (len < 17 || p[15] != ' ' || !parse_time(p, &out->when)) return 0;
+	p += 16;
+	if (!(q = memchr(p, ' ', end - p)) || q == p || q - p > 0xFFFF) goto unusual;
+	out->host = (uint32_t)(p - rec);
+	out->host_len = (uint16_t)(q - p);
+	p = q + 1;
+
+	// the process, pid and level come before the first ": " - app names can have
+	// spaces in, but not that
+	for (sep = p; sep < end; sep++) {
+		if (*sep == ':' && (sep + 1 == end || sep[1] == ' ')) break;
+	}
+	if (sep == end || sep == p) goto unusual;
+	q = sep;
+	if (q[-1] == '>') {
+		const char *lt = q - 1;
+		while (lt > p && *lt != '<') lt--;
+		if (*lt == '<' && lt > p && lt[-1] == ' ') {
+			out->level = (int8_t)level_at(lt + 1, q - lt - 2);
+			q = lt - 1;
+		}
+	}
+	if (q[-1] == ']') {
+		const char *lb = q - 1;
+		while (lb > p && isdigit((unsigned char)lb[-1])) lb--;
+		if (lb > p && lb[-1] == '[' && lb < q - 1) {
+			out->pid = digits(lb, (int)(q - 1 - lb));
+			q = lb - 1;
+		}
+	}
+	if (q[-1] == ')') {
+		const char *lp = memchr(p, '(', q - p);
+		if (lp && lp > p) q = lp;
+	}
+	if (q - p > 0xFFFF) goto unusual;
+	out->process = (uint32_t)(p - rec);
+	out->process_len = (uint16_t)(q - p);
+	out->message = (uint32_t)((sep + 1 < end ? sep + 2 : end) - rec);
+	return 1;
+
+unusual:
+	memset(out, 0, sizeof(*out));
+	out->pid = -1;
+	out->level = SYSLOG_LEVEL_NONE;
+	return 0;
+}
+
+time_t syslog_record_time(uint32_t when, time_t now)
+{
+	struct tm tm;
+	uint32_t yday = when / 86400, secs = when % 86400;
+	int mon;
+	time_t t;
+
+	localtime_r(&now, &tm);
+	for (mon=11; mon>0 && days_before[mon] > yday; mon--) ;
+	tm.tm_mon = mon;
+	tm.tm_mday = yday - days_before[mon] + 1;
+	tm.tm_hour = secs / 3600;
+	tm.tm_min = (secs / 60) % 60;
+	tm.tm_sec = secs % 60;
+	tm.tm_isdst = -1;
+	t = mktime(&tm);
+	if (t > now + 86400) {
+		// December's records, read in January
+		localtime_r(&now, &tm);
+		tm.tm_year--;
+		tm.tm_mon = mon;
+		tm.tm_mday = yday - days_before[mon] + 1;
+		tm.tm_hour = secs / 3600;
+		tm.tm_min = (secs / 60) % 60;
+		tm.tm_sec = secs % 60;
+		tm.tm_isdst = -1;
+		t = mktime(&tm);
+	}
+	return t;
+}
+
+time_t syslog_clock_time(syslog_clock *c, uint32_t when, time_t now)
+{
+	uint32_t hour = when / 3600 + 1;
+
+	if (!when) return now;
+	if (c->hour != hour || now - c->checked > 3600) {
+		c->start = syslog_record_time(when - when % 3600, now);
+		c->hour = hour;
+		c->checked = now;
+	}
+	return c->start + when % 3600;
+}
+
+#pragma mark filtering
+
+struct syslog_filter {
+	int			level;
+	size_t		nprocesses;
+	char		**processes;
+	size_t		nsubstrings;
+	char		**substrings;
+	size_t		nregexes;
+	regex_t		*regexes;
+};
+
+syslog_filter *syslog_filter_create(void)
+{
+	syslog_filter *f = calloc(1, sizeof(*f));
+	if (f) f->level = SYSLOG_LEVEL_NONE;
+	return f;
+}
+
+void syslog_filter_destroy(syslog_filter *f)
+{
+	size_t i;
+
+	if (!f) return;
+	for (i=0; i<f->nprocesses; i++) free(f->processes[i]);
+	for (i=0; i<f->nsubstrings; i++) free(f->substrings[i]);
+	for (i=0; i<f->nregexes; i++) regfree(&f->regexes[i]);
+	free(f->processes);
+	free(f->substrings);
+	free(f->regexes);
+	free(f);
+}
+
+static int add_string(char ***list, size_t *count, const char *s)
+{
+	char **grown = realloc(*list, (*count + 1) * sizeof(char*));
+	if (!grown) return 0;
+	*list = grown;
+	if (!(grown[*count] = strdup(s))) return 0;
+	(*count)++;
+	return 1;
+}
+
+int syslog_filter_add_process(syslog_filter *f, const char *process)
+{
+	return add_string(&f->processes, &f->nprocesses, process);
+}
+
+void syslog_filter_set_level(syslog_filter *f, int level)
+{
+	f->level = level;
+}
+
+int syslog_filter_add_substring(syslog_filter *f, const char *text)
+{
+	return add_string(&f->substrings, &f->nsubstrings, text);
+}
+
+int syslog_filter_add_regex(syslog_filter *f, const char *pattern, char *err, size_t errlen)
+{
+	regex_t *grown = realloc(f->regexes, (f->nregexes + 1) * sizeof(regex_t));
+	int rc;
+
+	if (!grown) {
+		if (errlen) snprintf(err, errlen, "out of memory");
+		return 0;
+	}
+	f->regexes = grown;
+	if ((rc = regcomp(&grown[f->nregexes], pattern, REG_EXTENDED | REG_NOSUB))) {
+		if (errlen) regerror(rc, &grown[f->nregexes], err, errlen);
+		return 0;
+	}
+	f->nregexes++;
+	return 1;
+}
+
+static int contains(const char *p, size_t len, const char *text)
+{
+	size_t n = strlen(text);
+	const char *end = p + len;
+
+	if (!n) return 1;
+	while ((size_t)(end - p) >= n) {
+		const char *c = memchr(p, text[0], end - p - n + 1);
+		if (!c) return 0;
+		if (!memcmp(c, text, n)) return 1;
+		p = c + 1;
+	}
+	return 0;
+}
+
+int syslog_filter_match(const syslog_filter *f, const char *rec, size_t len, const syslog_record *parsed)
+{
+	const char *msg = rec + parsed->message;
+	size_t msglen = len - parsed->message;
+	size_t i;
+
+	// cheapest first
+	if (f->level != SYSLOG_LEVEL_NONE && parsed->level != SYSLOG_LEVEL_NONE && parsed->level > f->level) return 0;
+	if (f->nprocesses) {
+		for (i=0; i<f->nprocesses; i++) {
+			const char *name = f->processes[i];
+			if (strlen(name) == parsed->process_len && !memcmp(rec + parsed->process, name, parsed->process_len)) break;
+		}
+		if (i == f->nprocesses) return 0;
+	}
+	for (i=0; i<f->nsubstrings; i++) {
+		if (!contains(msg, msglen, f->substrings[i])) return 0;
+	}
+	for (i=0; i<f->nregexes; i++) {
+		// the record isn't terminated, so give regexec() its bounds - from the
+		// start of the message, which is where glibc and the BSDs both let ^
+		// match
+		regmatch_t bounds;
+		bounds.rm_so = 0;
+		bounds.rm_eo = msglen;
+		if (regexec(&f->regexes[i], msg, 1, &bounds, REG_STARTEND)) return 0;
+	}
+	return 1;
+}
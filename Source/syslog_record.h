@@ -0,0 +1,94 @@
+//
+//  syslog_record.h
+//  mobileDeviceManager
+//
+//  Parsing and filtering of the records sent by the device's syslog_relay,
+//  without copying or allocating anything per record.  A record looks like
+//
+//    Oct 17 12:34:56 Johns-iPhone MobileMail[123] <Warning>: some message
+//
+//  although older firmware leaves out the <Level>, and some processes log as
+//  "name(library)[pid]".
+//
+
+#ifndef SYSLOG_RECORD_H
+#define SYSLOG_RECORD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// The level of a record without one.  The others are LOG_EMERG to LOG_DEBUG.
+#define SYSLOG_LEVEL_NONE	(-1)
+
+/// Where the parts of one record are.  Offsets are from the start of the record.
+typedef struct syslog_record {
+	uint32_t	when;			// seconds since 00:00 on 1 January, 0 if there is no timestamp
+	int32_t		pid;			// -1 if there isn't one
+	uint32_t	host;
+	uint32_t	process;		// just the name, without any "(library)"
+	uint32_t	message;		// the text after the "<Level>: "
+	uint16_t	host_len;
+	uint16_t	process_len;
+	int8_t		level;
+} syslog_record;
+
+/// Find the parts of \p rec.  Returns 0 if it isn't in the usual form, in which
+/// case the whole record is the message.
+int syslog_parse(const char *rec, size_t len, syslog_record *out);
+
+/// The level named \p name ("Error", "warning", "7"...), or SYSLOG_LEVEL_NONE.
+int syslog_level_named(const char *name);
+
+/// The name of \p level, eg "Warning".
+const char *syslog_level_name(int level);
+
+/// Timestamps don't say which year they're in.  Take the latest which isn't
+/// more than a day after \p now (allowing for the device's clock).
+time_t syslog_record_time(uint32_t when, time_t now);
+
+/// Remembers the work done by syslog_clock_time() for the hour last asked about.
+typedef struct syslog_clock {
+	uint32_t	hour;			// when / 3600, plus 1 - 0 if nothing is remembered
+	time_t		start;
+	time_t		checked;
+} syslog_clock;
+
+/// syslog_record_time(), but cheap for a run of records from the same hour.
+/// Records without a timestamp (\p when of 0) are given \p now.  \p c should
+/// start zeroed.
+time_t syslog_clock_time(syslog_clock *c, uint32_t when, time_t now);
+
+/// A compiled set of conditions, all of which a record must meet.
+typedef struct syslog_filter syslog_filter;
+
+syslog_filter *syslog_filter_create(void);
+void syslog_filter_destroy(syslog_filter *f);
+
+/// Only pass records from \p process.  Called more than once, records from any
+/// of the processes pass.  Returns 0 if out of memory.
+int syslog_filter_add_process(syslog_filter *f, const char *process);
+
+/// Only pass records at least as severe as \p level (LOG_ERR lets through
+/// errors, criticals, alerts and emergencies).  Records without a level pass.
+void syslog_filter_set_level(syslog_filter *f, int level);
+
+/// Only pass records whose message contains \p text.  Returns 0 if out of memory.
+int syslog_filter_add_substring(syslog_filter *f, const char *text);
+
+/// Only pass records whose message matches the extended regular expression
+/// \p pattern.  Returns 0 if it doesn't compile, with the reason in \p err.
+int syslog_filter_add_regex(syslog_filter *f, const char *pattern, char *err, size_t errlen);
+
+/// Does the record pass?  \p parsed is the result of syslog_parse() on it.
+int syslog_filter_match(const syslog_filter *f, const char *rec, size_t len, const syslog_record *parsed);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
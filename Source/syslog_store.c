@@ -0,0 +1,505 @@
+//
+//  syslog_store.c
+//  mobileDeviceManager
+//
+//  See syslog_store.h.
+//
+
+#include "syslog_store.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define BLOCK_MAGIC		"SLB1"
+#define HEADER_SIZE		64			// magic, raw, packed, count, first, last, bloom
+#define INDEX_SIZE		(8 + HEADER_SIZE)
+#define RECORD_HEAD		12			// length, time
+
+typedef struct block_header {
+	uint32_t	raw;				// uncompressed length
+	uint32_t	packed;				// length of the zlib data which follows
+	uint32_t	count;
+	int64_t		first, last;		// earliest and latest record times
+	uint8_t		bloom[32];			// processes
+} block_header;
+
+struct syslog_store {
+	char			*dir;
+	uint64_t		segment_size;
+	unsigned		segment;
+	int				fd, idx;
+	uint64_t		offset;				// bytes in the current segment
+	unsigned char	*raw;
+	size_t			raw_len, raw_cap;
+	unsigned char	*packed;
+	size_t			packed_cap;
+	block_header	block;
+	time_t			started;			// time of the block's first record
+	time_t			arrived;			// and when it was appended, by our clock
+};
+
+#pragma mark encoding
+
+static void put32(unsigned char *p, uint32_t v)
+{
+	p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+static void put64(unsigned char *p, uint64_t v)
+{
+	put32(p, (uint32_t)v);
+	put32(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t get64(const unsigned char *p)
+{
+	return get32(p) | ((uint64_t)get32(p + 4) << 32);
+}
+
+static void encode_header(unsigned char *p, const block_header *h)
+{
+	memcpy(p, BLOCK_MAGIC, 4);
+	put32(p + 4, h->raw);
+	put32(p + 8, h->packed);
+	put32(p + 12, h->count);
+	put64(p + 16, (uint64_t)h->first);
+	put64(p + 24, (uint64_t)h->last);
+	memcpy(p + 32, h->bloom, 32);
+}
+
+static int decode_header(const unsigned char *p, block_header *h)
+{
+	if (memcmp(p, BLOCK_MAGIC, 4)) return 0;
+	h->raw = get32(p + 4);
+	h->packed = get32(p + 8);
+	h->count = get32(p + 12);
+	h->first = (int64_t)get64(p + 16);
+	h->last = (int64_t)get64(p + 24);
+	memcpy(h->bloom, p + 32, 32);
+	return 1;
+}
+
+// two bits of the 256 for each process name
+static void bloom_bits(const char *name, size_t len, unsigned *a, unsigned *b)
+{
+	uint32_t h = 2166136261u;
+	size_t i;
+	for (i=0; i<len; i++) h = (h ^ (unsigned char)name[i]) * 16777619u;
+	*a = h & 255;
+	*b = (h >> 8) & 255;
+}
+
+static void bloom_add(uint8_t *bloom, const char *name, size_t len)
+{
+	unsigned a, b;
+	bloom_bits(name, len, &a, &b);
+	bloom[a >> 3] |= 1 << (a & 7);
+	bloom[b >> 3] |= 1 << (b & 7);
+}
+
+static int bloom_has(const uint8_t *bloom, const char *name, size_t len)
+{
+	unsigned a, b;
+	bloom_bits(name, len, &a, &b);
+	return (bloom[a >> 3] & (1 << (a & 7))) && (bloom[b >> 3] & (1 << (b & 7)));
+}
+
+#pragma mark segments
+
+static char *segment_path(const char *dir, unsigned n, const char *ext)
+{
+	size_t len = strlen(dir) + 32;
+	char *path = malloc(len);
+	if (path) snprintf(path, len, "%s/seg-%06u.%s", dir, n, ext);
+	return path;
+}
+
+static int is_segment(const char *name, unsigned *n)
+{
+	size_t len = strlen(name);
+	char *end;
+	if (len != 15 || strncmp(name, "seg-", 4) || strcmp(name + 10, ".slog")) return 0;
+	*n = (unsigned)strtoul(name + 4, &end, 10);
+	return end == name + 10;
+}
+
+static int compare_unsigned(const void *a, const void *b)
+{
+	unsigned x = *(const unsigned*)a, y = *(const unsigned*)b;
+	return x < y ? -1 : x > y;
+}
+
+// The numbers of the segments in dir, in order.
+static unsigned *list_segments(const char *dir, size_t *count)
+{
+	DIR *d = opendir(dir);
+	struct dirent *e;
+	unsigned *list = NULL, n;
+	size_t cap = 0;
+
+	*count = 0;
+	if (!d) return NULL;
+	while ((e = readdir(d))) {
+		if (!is_segment(e->d_name, &n)) continue;
+		if (*count == cap) {
+			unsigned *grown = realloc(list, (cap = cap ? cap*2 : 16) * sizeof(unsigned));
+			if (!grown) break;
+			list = grown;
+		}
+		list[(*count)++] = n;
+	}
+	closedir(d);
+	if (*count) qsort(list, *count, sizeof(unsigned), compare_unsigned);
+	return list;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	while (len) {
+		ssize_t n = write(fd, p, len);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return 0;
+		p += n;
+		len -= n;
+	}
+	return 1;
+}
+
+static int read_all(int fd, void *buf, size_t len, off_t at)
+{
+	char *p = buf;
+	while (len) {
+		ssize_t n = pread(fd, p, len, at);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return 0;
+		p += n;
+		at += n;
+		len -= n;
+	}
+	return 1;
+}
+
+static void close_segment(syslog_store *s)
+{
+	if (s->fd >= 0) close(s->fd);
+	if (s->idx >= 0) close(s->idx);
+	s->fd = s->idx = -1;
+}
+
+static int open_segment(syslog_store *s)
+{
+	char *path = segment_path(s->dir, s->segment, "slog");
+	char *idx = segment_path(s->dir, s->segment, "idx");
+
+	if (path && idx) {
+		s->fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+		if (s->fd >= 0) s->idx = open(idx, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	}
+	free(path);
+	free(idx);
+	s->offset = 0;
+	if (s->fd < 0 || s->idx < 0) {
+		close_segment(s);
+		return 0;
+	}
+	return 1;
+}
+
+static int make_dirs(const char *dir)
+{
+	char *path = strdup(dir), *p;
+	int ok = 1;
+
+	if (!path) return 0;
+	for (p = path + 1; ok && *p; p++) {
+		if (*p != '/') continue;
+		*p = '\0';
+		if (mkdir(path, 0755) < 0 && errno != EEXIST) ok = 0;
+		*p = '/';
+	}
+	if (ok && mkdir(path, 0755) < 0 && errno != EEXIST) ok = 0;
+	free(path);
+	return ok;
+}
+
+#pragma mark writing
+
+syslog_store *syslog_store_open(const char *dir, uint64_t segment_size)
+{
+	syslog_store *s = calloc(1, sizeof(*s));
+	unsigned *segments;
+	size_t count;
+
+	if (!s) return NULL;
+	s->fd = s->idx = -1;
+	s->segment_size = segment_size ? segment_size : 64*1024*1024;
+	if (!(s->dir = strdup(dir)) || !make_dirs(dir)) goto fail;
+
+	segments = list_segments(dir, &count);
+	s->segment = count ? segments[count - 1] + 1 : 1;
+	free(segments);
+
+	s->raw_cap = SYSLOG_STORE_BLOCK;
+	s->packed_cap = compressBound(SYSLOG_STORE_BLOCK);
+	if (!(s->raw = malloc(s->raw_cap)) || !(s->packed = malloc(s->packed_cap))) goto fail;
+	if (!open_segment(s)) goto fail;
+	return s;
+
+fail:
+	{
+		int err = errno;
+		free(s->raw);
+		free(s->packed);
+		free(s->dir);
+		free(s);
+		errno = err;
+	}
+	return NULL;
+}
+
+int syslog_store_flush(syslog_store *s)
+{
+	unsigned char head[INDEX_SIZE];
+	uLongf packed;
+
+	if (!s->raw_len) return 1;
+	if (s->fd < 0 && !open_segment(s)) return 0;
+
+	packed = compressBound(s->raw_len);
+	if (packed > s->packed_cap) {
+		unsigned char *grown = realloc(s->packed, packed);
+		if (!grown) return 0;
+		s->packed = grown;
+		s->packed_cap = packed;
+	}
+	if (compress2(s->packed, &packed, s->raw, s->raw_len, Z_DEFAULT_COMPRESSION) != Z_OK) {
+		errno = ENOMEM;
+		return 0;
+	}
+	s->block.raw = (uint32_t)s->raw_len;
+	s->block.packed = (uint32_t)packed;
+
+	// the index entry only goes in once the block is safely in the segment
+	put64(head, s->offset);
+	encode_header(head + 8, &s->block);
+	if (!write_all(s->fd, head + 8, HEADER_SIZE) || !write_all(s->fd, s->packed, packed)) return 0;
+	if (!write_all(s->idx, head, INDEX_SIZE)) return 0;
+	s->offset += HEADER_SIZE + packed;
+
+	s->raw_len = 0;
+	memset(&s->block, 0, sizeof(s->block));
+	if (s->offset >= s->segment_size) {
+		close_segment(s);
+		s->segment++;
+		// the next segment is opened when there's something to put in it
+	}
+	return 1;
+}
+
+int syslog_store_append(syslog_store *s, time_t when, const char *rec, size_t len, const syslog_record *parsed)
+{
+	size_t need = RECORD_HEAD + len;
+	unsigned char *p;
+
+	if (s->raw_len && (s->raw_len + need > SYSLOG_STORE_BLOCK || when - s->started >= SYSLOG_STORE_FLUSH)) {
+		if (!syslog_store_flush(s)) return 0;
+	}
+	if (need > s->raw_cap) {
+		// a record bigger than a block gets a block to itself
+		unsigned char *grown = realloc(s->raw, need);
+		if (!grown) return 0;
+		s->raw = grown;
+		s->raw_cap = need;
+	}
+
+	p = s->raw + s->raw_len;
+	put32(p, (uint32_t)len);
+	put64(p + 4, (uint64_t)(int64_t)when);
+	memcpy(p + RECORD_HEAD, rec, len);
+	s->raw_len += need;
+
+	if (!s->block.count++) {
+		s->block.first = s->block.last = when;
+		s->started = when;
+		s->arrived = time(NULL);
+	}
+	if (when < s->block.first) s->block.first = when;
+	if (when > s->block.last) s->block.last = when;
+	if (parsed->process_len) bloom_add(s->block.bloom, rec + parsed->process, parsed->process_len);
+	return 1;
+}
+
+int syslog_store_idle(syslog_store *s, time_t now)
+{
+	if (s->raw_len && now - s->arrived >= SYSLOG_STORE_FLUSH) return syslog_store_flush(s);
+	return 1;
+}
+
+int syslog_store_close(syslog_store *s)
+{
+	int ok;
+
+	if (!s) return 1;
+	ok = syslog_store_flush(s);
+	close_segment(s);
+	free(s->raw);
+	free(s->packed);
+	free(s->dir);
+	free(s);
+	return ok;
+}
+
+#pragma mark querying
+
+typedef struct query {
+	time_t					from, to;
+	const char				*process;
+	size_t					process_len;
+	const syslog_filter		*filter;
+	syslog_store_fn			fn;
+	void					*ctx;
+	syslog_store_stats		*stats;
+	unsigned char			*raw, *packed;
+	size_t					raw_cap, packed_cap;
+} query;
+
+static int wanted(const query *q, const block_header *h)
+{
+	if (q->from && h->last < q->from) return 0;
+	if (q->to && h->first > q->to) return 0;
+	if (q->process && !bloom_has(h->bloom, q->process, q->process_len)) return 0;
+	return 1;
+}
+
+static int grow(unsigned char **buf, size_t *cap, size_t need)
+{
+	if (need > *cap) {
+		unsigned char *grown = realloc(*buf, need);
+		if (!grown) return 0;
+		*buf = grown;
+		*cap = need;
+	}
+	return 1;
+}
+
+// Returns 0 if the caller's function asked to stop.
+static int query_block(query *q, int fd, uint64_t offset, const block_header *h)
+{
+	uLongf raw = h->raw;
+	const unsigned char *p, *end;
+
+	if (!grow(&q->packed, &q->packed_cap, h->packed) || !grow(&q->raw, &q->raw_cap, h->raw)) return 1;
+	if (!read_all(fd, q->packed, h->packed, (off_t)(offset + HEADER_SIZE))) return 1;
+	if (uncompress(q->raw, &raw, q->packed, h->packed) != Z_OK || raw != h->raw) return 1;
+	q->stats->blocks_read++;
+
+	for (p = q->raw, end = q->raw + raw; end - p >= RECORD_HEAD; ) {
+		uint32_t len = get32(p);
+		time_t when = (time_t)(int64_t)get64(p + 4);
+		const char *rec = (const char*)p + RECORD_HEAD;
+		syslog_record parsed;
+
+		if (len > (size_t)(end - p) - RECORD_HEAD) break;
+		p += RECORD_HEAD + len;
+		q->stats->records_read++;
+
+		if (q->from && when < q->from) continue;
+		if (q->to && when > q->to) continue;
+		syslog_parse(rec, len, &parsed);
+		if (q->process && (parsed.process_len != q->process_len ||
+						   memcmp(rec + parsed.process, q->process, q->process_len))) continue;
+		if (q->filter && !syslog_filter_match(q->filter, rec, len, &parsed)) continue;
+		q->stats->records_matched++;
+		if (q->fn(q->ctx, when, rec, len)) return 0;
+	}
+	return 1;
+}
+
+// Returns 0 if the caller's function asked to stop.
+static int query_segment(query *q, const char *dir, unsigned n)
+{
+	char *path = segment_path(dir, n, "slog");
+	char *idxpath = segment_path(dir, n, "idx");
+	int fd = path ? open(path, O_RDONLY) : -1;
+	int idx = idxpath ? open(idxpath, O_RDONLY) : -1;
+	unsigned char head[INDEX_SIZE];
+	block_header h;
+	struct stat st;
+	uint64_t offset = 0;
+	off_t at = 0;
+	int more = 1;
+
+	free(path);
+	free(idxpath);
+	if (fd < 0 || fstat(fd, &st) < 0) goto done;
+
+	while (more) {
+		if (idx >= 0) {
+			if (!read_all(idx, head, INDEX_SIZE, at)) break;
+			at += INDEX_SIZE;
+			offset = get64(head);
+			if (!decode_header(head + 8, &h)) break;
+		} else {
+			// no index - walk the headers in the segment
+			if (!read_all(fd, head + 8, HEADER_SIZE, (off_t)offset) || !decode_header(head + 8, &h)) break;
+		}
+		if (offset + HEADER_SIZE + h.packed > (uint64_t)st.st_size) break;
+		q->stats->blocks++;
+		if (wanted(q, &h)) more = query_block(q, fd, offset, &h);
+		if (idx < 0) offset += HEADER_SIZE + h.packed;
+	}
+
+done:
+	if (fd >= 0) close(fd);
+	if (idx >= 0) close(idx);
+	return more;
+}
+
+int syslog_store_query(const char *dir, time_t from, time_t to, const char *process,
+					   const syslog_filter *filter, syslog_store_fn fn, void *ctx, syslog_store_stats *stats)
+{
+	syslog_store_stats ignored;
+	query q;
+	unsigned *segments;
+	size_t count, i;
+	struct stat st;
+
+	if (stat(dir, &st) < 0) return 0;
+	if (!S_ISDIR(st.st_mode)) {
+		errno = ENOTDIR;
+		return 0;
+	}
+
+	memset(&q, 0, sizeof(q));
+	memset(&ignored, 0, sizeof(ignored));
+	q.from = from;
+	q.to = to;
+	q.process = process;
+	q.process_len = process ? strlen(process) : 0;
+	q.filter = filter;
+	q.fn = fn;
+	q.ctx = ctx;
+	q.stats = stats ? stats : &ignored;
+
+	segments = list_segments(dir, &count);
+	for (i=0; i<count; i++) {
+		if (!query_segment(&q, dir, segments[i])) break;
+	}
+	free(segments);
+	free(q.raw);
+	free(q.packed);
+	return 1;
+}
@@ -0,0 +1,86 @@
+//
+//  syslog_store.h
+//  mobileDeviceManager
+//
+//  An on-disk store for syslog captures, which can be searched by time and
+//  process without decompressing all of it.
+//
+//  A store is a directory of segments, seg-000001.slog, seg-000002.slog...
+//  Each segment is a run of blocks, each holding up to SYSLOG_STORE_BLOCK
+//  bytes of records compressed with zlib behind a header saying when its
+//  first and last records were logged, and which processes logged them (as a
+//  bloom filter).  seg-NNNNNN.idx repeats the headers, with where each block
+//  starts, so a query reads the index and then only the blocks which might
+//  hold what it's looking for.  If the index is missing the headers are read
+//  from the segment itself.
+//
+//  Within a block each record is a 32 bit length, a 64 bit time and the text.
+//  All integers are little endian.
+//
+
+#ifndef SYSLOG_STORE_H
+#define SYSLOG_STORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include "syslog_record.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Bytes of records collected before they are compressed and written out.
+#define SYSLOG_STORE_BLOCK		(128*1024)
+
+/// A block is also written once it holds records this many seconds apart, or
+/// once its first record has waited this long for the next (see
+/// syslog_store_idle()), so a quiet device's records still reach the disk.
+#define SYSLOG_STORE_FLUSH		5
+
+typedef struct syslog_store syslog_store;
+
+/// Open the store in \p dir for adding to, creating it if need be.  Records go
+/// in a new segment after any already there; another is started whenever the
+/// current one reaches \p segment_size bytes.  Returns NULL, with errno set,
+/// on failure.
+syslog_store *syslog_store_open(const char *dir, uint64_t segment_size);
+
+/// Add a record logged at \p when.  \p parsed is the result of syslog_parse()
+/// on it.  Returns 0, with errno set, if writing a block failed.
+int syslog_store_append(syslog_store *s, time_t when, const char *rec, size_t len, const syslog_record *parsed);
+
+/// Write out the records collected so far.
+int syslog_store_flush(syslog_store *s);
+
+/// For a reader which has had nothing to append for a while: write out the
+/// records collected so far if the first of them was appended SYSLOG_STORE_FLUSH
+/// or more seconds before \p now.  Returns 0, with errno set, if that failed.
+int syslog_store_idle(syslog_store *s, time_t now);
+
+/// Flush and close.  Returns 0 if the flush failed.
+int syslog_store_close(syslog_store *s);
+
+typedef struct syslog_store_stats {
+	uint64_t	blocks;			// in the store
+	uint64_t	blocks_read;	// decompressed by the query
+	uint64_t	records_read;
+	uint64_t	records_matched;
+} syslog_store_stats;
+
+/// Called for each record found.  Return non-zero to stop the query.
+typedef int (*syslog_store_fn)(void *ctx, time_t when, const char *rec, size_t len);
+
+/// Find the records in the store in \p dir logged between \p from and \p to
+/// inclusive (0 for no limit), from \p process (NULL for any) and passing
+/// \p filter (NULL for any), and call \p fn for each in the order they were
+/// added.  \p stats (which may be NULL) is added to.  Returns 0, with errno
+/// set, if the store can't be read; a damaged block is skipped.
+int syslog_store_query(const char *dir, time_t from, time_t to, const char *process,
+					   const syslog_filter *filter, syslog_store_fn fn, void *ctx, syslog_store_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
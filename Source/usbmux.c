@@ -0,0 +1,227 @@
+//
+//  usbmux.c
+//  mobileDeviceManager
+//
+//  See usbmux.h.
+//
+
+#include "usbmux.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define USBMUX_HEADER_SIZE		16
+#define USBMUX_VERSION			1
+#define USBMUX_MESSAGE_PLIST	8
+#define USBMUX_MAX_MESSAGE		(16*1024*1024)
+
+// as in afc_client.c
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS	MSG_NOSIGNAL
+#else
+#define SEND_FLAGS	0
+#endif
+
+#pragma mark I/O
+
+static int read_full(int fd, void *buf, size_t len)
+{
+	unsigned char *p = buf;
+	while (len) {
+		ssize_t n = read(fd, p, len);
+		if (n < 0 && errno == EINTR) continue;
+		if (n == 0) return EPIPE;
+		if (n < 0) return errno;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	while (len) {
+		ssize_t n = send(fd, p, len, SEND_FLAGS);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return n < 0 ? errno : EPIPE;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static void put_le32(unsigned char *p, uint32_t v)
+{
+	p[0] = (unsigned char)v;
+	p[1] = (unsigned char)(v >> 8);
+	p[2] = (unsigned char)(v >> 16);
+	p[3] = (unsigned char)(v >> 24);
+}
+
+static uint32_t get_le32(const unsigned char *p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+#pragma mark connecting
+
+static int open_unix(const char *path)
+{
+	struct sockaddr_un sun;
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) return -1;
+	if (connect(fd, (struct sockaddr*)&sun, sizeof(sun)) != 0) {
+		int e = errno;
+		close(fd);
+		errno = e;
+		return -1;
+	}
+	return fd;
+}
+
+static int open_tcp(const char *host, const char *port)
+{
+	struct addrinfo hints, *res, *ai;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &res) != 0) {
+		errno = EHOSTUNREACH;
+		return -1;
+	}
+	int fd = -1, e = ECONNREFUSED;
+	for (ai = res; ai && fd < 0; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0) {
+			e = errno;
+		} else if (connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+			e = errno;
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(res);
+	if (fd < 0) errno = e;
+	return fd;
+}
+
+int usbmux_open(const char *address)
+{
+	if (!address) address = getenv("USBMUXD_SOCKET_ADDRESS");
+	if (!address || !*address) address = USBMUX_DEFAULT_ADDRESS;
+
+	int fd;
+	const char *colon = strrchr(address, ':');
+	if (strncmp(address, "UNIX:", 5) == 0) {
+		fd = open_unix(address + 5);
+	} else if (address[0] == '/' || !colon) {
+		fd = open_unix(address);
+	} else {
+		char host[256];
+		size_t n = (size_t)(colon - address);
+		if (n >= sizeof(host)) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		memcpy(host, address, n);
+		host[n] = '\0';
+		fd = open_tcp(host, colon + 1);
+	}
+#ifdef SO_NOSIGPIPE
+	if (fd >= 0) {
+		int on = 1;
+		setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+	}
+#endif
+	return fd;
+}
+
+uint32_t usbmux_port_number(uint16_t port)
+{
+	return (uint32_t)(((port & 0xff) << 8) | (port >> 8));
+}
+
+#pragma mark messages
+
+int usbmux_send(int fd, uint32_t tag, const void *plist, uint32_t len)
+{
+	unsigned char h[USBMUX_HEADER_SIZE];
+	if (len > USBMUX_MAX_MESSAGE) return EMSGSIZE;
+	put_le32(h, USBMUX_HEADER_SIZE + len);
+	put_le32(h+4, USBMUX_VERSION);
+	put_le32(h+8, USBMUX_MESSAGE_PLIST);
+	put_le32(h+12, tag);
+	int e = write_full(fd, h, sizeof(h));
+	return e ? e : write_full(fd, plist, len);
+}
+
+int usbmux_recv(int fd, uint32_t *tag, uint8_t **plist, uint32_t *len)
+{
+	unsigned char h[USBMUX_HEADER_SIZE];
+	int e = read_full(fd, h, sizeof(h));
+	if (e) return e;
+
+	uint32_t total = get_le32(h);
+	if (total < USBMUX_HEADER_SIZE || total - USBMUX_HEADER_SIZE > USBMUX_MAX_MESSAGE) return EPROTO;
+	if (get_le32(h+4) != USBMUX_VERSION || get_le32(h+8) != USBMUX_MESSAGE_PLIST) return EPROTO;
+
+	uint32_t n = total - USBMUX_HEADER_SIZE;
+	uint8_t *buf = malloc(n ? n : 1);
+	if (!buf) return ENOMEM;
+	e = read_full(fd, buf, n);
+	if (e) {
+		free(buf);
+		return e;
+	}
+	*tag = get_le32(h+12);
+	*plist = buf;
+	*len = n;
+	return 0;
+}
+
+int usbmux_send_message(int fd, const void *msg, uint32_t len)
+{
+	unsigned char h[4];
+	h[0] = (unsigned char)(len >> 24);
+	h[1] = (unsigned char)(len >> 16);
+	h[2] = (unsigned char)(len >> 8);
+	h[3] = (unsigned char)len;
+	int e = write_full(fd, h, sizeof(h));
+	return e ? e : write_full(fd, msg, len);
+}
+
+int usbmux_recv_message(int fd, uint8_t **msg, uint32_t *len)
+{
+	unsigned char h[4];
+	int e = read_full(fd, h, sizeof(h));
+	if (e) return e;
+
+	uint32_t n = ((uint32_t)h[0] << 24) | ((uint32_t)h[1] << 16) | ((uint32_t)h[2] << 8) | h[3];
+	if (n > USBMUX_MAX_MESSAGE) return EPROTO;
+	uint8_t *buf = malloc(n ? n : 1);
+	if (!buf) return ENOMEM;
+	e = read_full(fd, buf, n);
+	if (e) {
+		free(buf);
+		return e;
+	}
+	*msg = buf;
+	*len = n;
+	return 0;
+}
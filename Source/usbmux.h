@@ -0,0 +1,62 @@
+//
+//  usbmux.h
+//  mobileDeviceManager
+//
+//  The wire format of usbmuxd, which multiplexes TCP-like connections to the
+//  ports of USB attached devices over a local socket, and of the length-prefixed
+//  messages that lockdown and its services exchange over those connections.
+//
+//  A usbmuxd message is a 16 byte little-endian header (total length, protocol
+//  version 1, message type 8 for a property list, and a tag the reply echoes)
+//  followed by an XML property list.  Once a "Connect" has succeeded, the
+//  socket it was sent on is a raw connection to the device port.  The property
+//  lists themselves are left to the caller.
+//
+//  See also: http://www.libimobiledevice.org (libusbmuxd)
+//
+
+#ifndef USBMUX_H
+#define USBMUX_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Where usbmuxd listens, if neither the caller nor USBMUXD_SOCKET_ADDRESS says.
+#define USBMUX_DEFAULT_ADDRESS	"/var/run/usbmuxd"
+
+/// lockdownd's port on the device.
+#define USBMUX_LOCKDOWN_PORT	62078
+
+/// Connect to usbmuxd at \p address - a socket path (optionally "UNIX:path"),
+/// or "host:port" for one reached over TCP.  NULL means $USBMUXD_SOCKET_ADDRESS,
+/// or failing that USBMUX_DEFAULT_ADDRESS.  Returns the socket, or -1 with errno
+/// set.
+int usbmux_open(const char *address);
+
+/// Send the \p len bytes of XML property list \p plist, tagged with \p tag.
+/// Returns 0 on success, else an errno value.
+int usbmux_send(int fd, uint32_t tag, const void *plist, uint32_t len);
+
+/// Receive one message from usbmuxd.  On success returns 0 and stores its tag,
+/// and its property list in a malloc()ed buffer (which the caller must free),
+/// else returns an errno value.
+int usbmux_recv(int fd, uint32_t *tag, uint8_t **plist, uint32_t *len);
+
+/// The value of "PortNumber" in a Connect request for device port \p port -
+/// usbmuxd wants it in network byte order.
+uint32_t usbmux_port_number(uint16_t port);
+
+/// Send one lockdown message: a 32 bit big-endian length, then \p msg.
+int usbmux_send_message(int fd, const void *msg, uint32_t len);
+
+/// Receive one lockdown message into a malloc()ed buffer.
+int usbmux_recv_message(int fd, uint8_t **msg, uint32_t *len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
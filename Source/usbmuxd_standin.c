@@ -0,0 +1,269 @@
+//
+//  usbmuxd_standin.c
+//  mobileDeviceManager
+//
+//  See usbmuxd_standin.h.
+//
+
+#include "usbmuxd_standin.h"
+#include "usbmux.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// as in usbmux.c
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS	MSG_NOSIGNAL
+#else
+#define SEND_FLAGS	0
+#endif
+
+#define RELAY_BUFFER	(64*1024)
+
+struct usbmuxd_standin_client {
+	usbmuxd_standin					*server;
+	int								fd;			// the client's connection
+	int								relay;		// the device port it was joined to, else -1
+	pthread_t						thread;
+	struct usbmuxd_standin_client	*next;
+};
+
+struct usbmuxd_standin {
+	int							listener;
+	int							wake[2];		// written to when it's time to stop accepting
+	char						path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+	usbmuxd_standin_handler		handler;
+	void						*ctx;
+	volatile uint64_t			requests;
+	pthread_t					thread;
+	pthread_mutex_t				lock;			// clients, and their relay
+	usbmuxd_standin_client		*clients;
+};
+
+#pragma mark I/O
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	while (len) {
+		ssize_t n = send(fd, p, len, SEND_FLAGS);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return 0;
+		p += n;
+		len -= n;
+	}
+	return 1;
+}
+
+static void no_sigpipe(int fd)
+{
+#ifdef SO_NOSIGPIPE
+	int on = 1;
+	setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#else
+	(void)fd;		// MSG_NOSIGNAL does the job instead
+#endif
+}
+
+// Pass bytes both ways until either end closes.
+static void relay(usbmuxd_standin_client *c)
+{
+	unsigned char *buf = malloc(RELAY_BUFFER);
+	struct pollfd fds[2];
+	if (!buf) return;
+	fds[0].fd = c->fd;
+	fds[1].fd = c->relay;
+	fds[0].events = fds[1].events = POLLIN;
+
+	for (;;) {
+		int i;
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		for (i = 0; i < 2; i++) {
+			if (!fds[i].revents) continue;
+			ssize_t n = read(fds[i].fd, buf, RELAY_BUFFER);
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0 || !write_full(fds[1-i].fd, buf, (size_t)n)) goto done;
+		}
+	}
+done:
+	free(buf);
+}
+
+#pragma mark server
+
+static void *serve_client(void *arg)
+{
+	usbmuxd_standin_client *c = arg;
+	usbmuxd_standin *s = c->server;
+
+	for (;;) {
+		uint8_t *plist;
+		uint32_t tag, len;
+		if (usbmux_recv(c->fd, &tag, &plist, &len) != 0) break;
+		__sync_fetch_and_add(&s->requests, 1);
+		int ok = s->handler(s->ctx, c, tag, plist, len);
+		free(plist);
+		if (!ok) break;
+		if (c->relay >= 0) {
+			relay(c);
+			break;
+		}
+	}
+
+	// the descriptors are closed by usbmuxd_standin_stop(), so it can't shut
+	// down one whose number has been reused; shutting them down here is
+	// enough for both ends to see the connection close
+	pthread_mutex_lock(&s->lock);
+	shutdown(c->fd, SHUT_RDWR);
+	if (c->relay >= 0) shutdown(c->relay, SHUT_RDWR);
+	pthread_mutex_unlock(&s->lock);
+	return NULL;
+}
+
+static void *accept_clients(void *arg)
+{
+	usbmuxd_standin *s = arg;
+	struct pollfd fds[2];
+	fds[0].fd = s->listener;
+	fds[1].fd = s->wake[0];
+	fds[0].events = fds[1].events = POLLIN;
+
+	for (;;) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		if (fds[1].revents) break;
+		if (!fds[0].revents) continue;
+
+		int fd = accept(s->listener, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			break;
+		}
+		usbmuxd_standin_client *c = calloc(1, sizeof(*c));
+		if (!c) {
+			close(fd);
+			continue;
+		}
+		no_sigpipe(fd);
+		c->server = s;
+		c->fd = fd;
+		c->relay = -1;
+		if (pthread_create(&c->thread, NULL, serve_client, c) != 0) {
+			close(fd);
+			free(c);
+			continue;
+		}
+		pthread_mutex_lock(&s->lock);
+		c->next = s->clients;
+		s->clients = c;
+		pthread_mutex_unlock(&s->lock);
+	}
+	return NULL;
+}
+
+int usbmuxd_standin_reply(usbmuxd_standin_client *c, uint32_t tag, const void *plist, size_t len)
+{
+	if (len > 0xffffffffu) return 0;
+	return usbmux_send(c->fd, tag, plist, (uint32_t)len) == 0;
+}
+
+void usbmuxd_standin_relay(usbmuxd_standin_client *c, int fd)
+{
+	no_sigpipe(fd);
+	pthread_mutex_lock(&c->server->lock);
+	if (c->relay >= 0) close(c->relay);
+	c->relay = fd;
+	pthread_mutex_unlock(&c->server->lock);
+}
+
+int usbmuxd_standin_start(const char *path, usbmuxd_standin_handler handler, void *ctx,
+						  usbmuxd_standin **server)
+{
+	struct sockaddr_un sun;
+	if (strlen(path) >= sizeof(sun.sun_path)) return ENAMETOOLONG;
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+
+	usbmuxd_standin *s = calloc(1, sizeof(*s));
+	if (!s) return ENOMEM;
+	strcpy(s->path, path);
+	s->handler = handler;
+	s->ctx = ctx;
+	s->listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (s->listener < 0) {
+		int e = errno;
+		free(s);
+		return e;
+	}
+	if (bind(s->listener, (struct sockaddr*)&sun, sizeof(sun)) != 0 || listen(s->listener, 8) != 0) {
+		int e = errno;
+		close(s->listener);
+		free(s);
+		return e;
+	}
+	if (pipe(s->wake) != 0) {
+		int e = errno;
+		close(s->listener);
+		unlink(path);
+		free(s);
+		return e;
+	}
+	pthread_mutex_init(&s->lock, NULL);
+	int rc = pthread_create(&s->thread, NULL, accept_clients, s);
+	if (rc != 0) {
+		close(s->wake[0]);
+		close(s->wake[1]);
+		close(s->listener);
+		unlink(path);
+		pthread_mutex_destroy(&s->lock);
+		free(s);
+		return rc;
+	}
+	*server = s;
+	return 0;
+}
+
+uint64_t usbmuxd_standin_requests(usbmuxd_standin *s)
+{
+	return __sync_fetch_and_add(&s->requests, 0);
+}
+
+void usbmuxd_standin_stop(usbmuxd_standin *s)
+{
+	if (!s) return;
+	// no more clients once the acceptor has gone
+	while (write(s->wake[1], "", 1) < 0 && errno == EINTR) ;
+	pthread_join(s->thread, NULL);
+	close(s->listener);
+	unlink(s->path);
+	close(s->wake[0]);
+	close(s->wake[1]);
+
+	while (s->clients) {
+		usbmuxd_standin_client *c = s->clients;
+		pthread_mutex_lock(&s->lock);
+		shutdown(c->fd, SHUT_RDWR);
+		if (c->relay >= 0) shutdown(c->relay, SHUT_RDWR);
+		pthread_mutex_unlock(&s->lock);
+		pthread_join(c->thread, NULL);
+		close(c->fd);
+		if (c->relay >= 0) close(c->relay);
+		s->clients = c->next;
+		free(c);
+	}
+	pthread_mutex_destroy(&s->lock);
+	free(s);
+}
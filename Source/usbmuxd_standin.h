@@ -0,0 +1,65 @@
+//
+//  usbmuxd_standin.h
+//  mobileDeviceManager
+//
+//  The usbmuxd counterpart of service_standin: a server listening on a local
+//  socket path, as usbmuxd does, which reads the messages of usbmux.h from each
+//  client that connects and hands them to a handler.  That is enough to point
+//  the native backend (md_native_set_usbmux_address()) at it and exercise the
+//  whole of it - device notifications, lockdown and services - without a device.
+//
+//  As with the other stand-ins the server doesn't look inside the messages; the
+//  handler decodes them and encodes its replies.  What it does provide is the
+//  one thing usbmuxd does besides messages: once a Connect has been answered,
+//  the client's socket is joined to whatever is playing the device port.
+//
+//  Each client is served on its own thread.
+//
+
+#ifndef USBMUXD_STANDIN_H
+#define USBMUXD_STANDIN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct usbmuxd_standin usbmuxd_standin;
+typedef struct usbmuxd_standin_client usbmuxd_standin_client;
+
+/// Called on the client's thread with each message it sends.  Answer it with
+/// usbmuxd_standin_reply(), carrying the message's \p tag.  Return 0 to drop
+/// the client.
+typedef int (*usbmuxd_standin_handler)(void *ctx, usbmuxd_standin_client *client, uint32_t tag,
+									   const void *plist, size_t len);
+
+/// Start listening on the socket \p path, which mustn't exist yet.  On success
+/// returns 0 and stores the server handle in \p server, else returns an errno
+/// value.
+int usbmuxd_standin_start(const char *path, usbmuxd_standin_handler handler, void *ctx,
+						  usbmuxd_standin **server);
+
+/// Send the \p len bytes of XML property list \p plist to \p client, tagged
+/// with \p tag (0 for the device announcements a Listen asks for).  Returns 0
+/// if the client has gone.
+int usbmuxd_standin_reply(usbmuxd_standin_client *client, uint32_t tag, const void *plist, size_t len);
+
+/// Having answered a Connect, join \p client to \p fd: once the handler
+/// returns, what either sends is passed on to the other until one of them
+/// closes.  The server owns \p fd from now on.
+void usbmuxd_standin_relay(usbmuxd_standin_client *client, int fd);
+
+/// Number of messages received so far, from all clients.
+uint64_t usbmuxd_standin_requests(usbmuxd_standin *server);
+
+/// Stop listening, drop every client (including any Listen and relayed
+/// connections), wait for their threads to exit and remove the socket.
+void usbmuxd_standin_stop(usbmuxd_standin *server);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
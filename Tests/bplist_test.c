@@ -0,0 +1,228 @@
+//
+//  bplist_test.c
+//  mobileDeviceManager
+//
+//  bplist.c: what is encoded decodes to the same tree, equal values are
+//  written once, and no damaged or hostile input - truncated, bytes changed,
+//  objects which contain themselves - is read outside the buffer or decoded.
+//
+
+#include "test.h"
+#include "bplist.h"
+
+#include <stdint.h>
+
+static int same_tree(const bplist_node *a, const bplist_node *b)
+{
+	size_t i, slots;
+	if (!a || !b || a->type != b->type) return 0;
+	switch (a->type) {
+		case BPLIST_NULL:
+			return 1;
+		case BPLIST_BOOL:
+		case BPLIST_INT:
+		case BPLIST_UID:
+			return a->v.integer == b->v.integer;
+		case BPLIST_REAL:
+		case BPLIST_DATE:
+			return a->v.real == b->v.real;
+		case BPLIST_DATA:
+		case BPLIST_STRING:
+			return a->count == b->count && memcmp(a->v.data, b->v.data, a->count) == 0;
+		case BPLIST_ARRAY:
+		case BPLIST_DICT:
+			if (a->count != b->count) return 0;
+			slots = a->type == BPLIST_DICT ? a->count * 2 : a->count;
+			for (i = 0; i < slots; i++) {
+				if (!same_tree(a->v.items[i], b->v.items[i])) return 0;
+			}
+			return 1;
+	}
+	return 0;
+}
+
+static bplist_node *str(bplist_arena *a, const char *s)
+{
+	return bplist_new_string(a, s, strlen(s));
+}
+
+static bplist_node *real(bplist_arena *a, bplist_type type, double v)
+{
+	bplist_node *n = bplist_new(a, type);
+	n->v.real = v;
+	return n;
+}
+
+// A dictionary with one of everything
+static bplist_node *sample(bplist_arena *a)
+{
+	static const uint8_t bytes[] = { 0, 1, 2, 0xfe, 0xff };
+	bplist_node *yes = bplist_new(a, BPLIST_BOOL), *no = bplist_new(a, BPLIST_BOOL);
+	bplist_node *data = bplist_new(a, BPLIST_DATA), *uid = bplist_new(a, BPLIST_UID);
+	yes->v.integer = 1;
+	data->v.data = bytes;
+	data->count = sizeof(bytes);
+	uid->v.integer = 300;
+
+	bplist_node *ints = bplist_new_container(a, BPLIST_ARRAY, 6);
+	ints->v.items[0] = bplist_new_int(a, 0);
+	ints->v.items[1] = bplist_new_int(a, 255);
+	ints->v.items[2] = bplist_new_int(a, 65535);
+	ints->v.items[3] = bplist_new_int(a, 1ll << 40);
+	ints->v.items[4] = bplist_new_int(a, -1);
+	ints->v.items[5] = bplist_new_int(a, INT64_MIN);
+
+	bplist_node *inner = bplist_new_container(a, BPLIST_DICT, 1);
+	inner->v.items[0] = str(a, "empty");
+	inner->v.items[1] = bplist_new_container(a, BPLIST_ARRAY, 0);
+
+	const char *keys[] = { "null", "yes", "no", "ints", "real", "date", "data", "ascii", "unicode", "uid", "inner" };
+	bplist_node *values[] = { bplist_new(a, BPLIST_NULL), yes, no, ints, real(a, BPLIST_REAL, 3.5),
+							  real(a, BPLIST_DATE, 341234567.25), data, str(a, "CurrentList"),
+							  str(a, "caf\xc3\xa9 \xe2\x98\x83 \xf0\x9f\x98\x80"), uid, inner };
+	size_t n = sizeof(keys) / sizeof(keys[0]), i;
+	bplist_node *dict = bplist_new_container(a, BPLIST_DICT, n);
+	for (i = 0; i < n; i++) {
+		dict->v.items[i] = str(a, keys[i]);
+		dict->v.items[n + i] = values[i];
+	}
+	return dict;
+}
+
+static void test_round_trip(void)
+{
+	bplist_arena a = { NULL }, b = { NULL };
+	uint8_t *out = NULL;
+	size_t len = 0;
+	bplist_node *root = sample(&a);
+	CHECK(bplist_encode(root, &out, &len) == 0);
+	CHECK(bplist_is_binary(out, len));
+	const bplist_node *back = bplist_decode(out, len, &b);
+	CHECK(back != NULL);
+	CHECK(same_tree(root, back));
+	CHECK(bplist_dict_get(back, "ascii") && strcmp(bplist_dict_get(back, "ascii")->v.string, "CurrentList") == 0);
+	CHECK(bplist_dict_get(back, "missing") == NULL);
+	free(out);
+	bplist_arena_free(&a);
+	bplist_arena_free(&b);
+}
+
+// Equal strings are written once however many nodes hold them, which is most
+// of what makes a Browse reply small
+static void test_shared_values(void)
+{
+	bplist_arena a = { NULL }, b = { NULL };
+	const char *s = "com.apple.mobile.installation_proxy";
+	size_t i, n = 1000, len = 0;
+	uint8_t *out = NULL;
+	bplist_node *array = bplist_new_container(&a, BPLIST_ARRAY, n);
+	for (i = 0; i < n; i++) array->v.items[i] = str(&a, s);
+	CHECK(bplist_encode(array, &out, &len) == 0);
+	CHECK(len < n * 4);
+	const bplist_node *back = bplist_decode(out, len, &b);
+	CHECK(same_tree(array, back));
+	free(out);
+	bplist_arena_free(&a);
+	bplist_arena_free(&b);
+}
+
+// More than 65535 objects needs wider references and offsets
+static void test_many_objects(void)
+{
+	bplist_arena a = { NULL }, b = { NULL };
+	size_t i, n = 70000, len = 0;
+	uint8_t *out = NULL;
+	bplist_node *array = bplist_new_container(&a, BPLIST_ARRAY, n);
+	for (i = 0; i < n; i++) array->v.items[i] = bplist_new_int(&a, (int64_t)i * 7919);
+	CHECK(bplist_encode(array, &out, &len) == 0);
+	const bplist_node *back = bplist_decode(out, len, &b);
+	CHECK(back && back->count == n);
+	CHECK(same_tree(array, back));
+	free(out);
+	bplist_arena_free(&a);
+	bplist_arena_free(&b);
+}
+
+// Every truncation is refused, and no change to a single byte makes the
+// decoder read outside the buffer (which ASan would catch)
+static void test_damaged(void)
+{
+	bplist_arena a = { NULL };
+	uint8_t *out = NULL;
+	size_t len = 0, i;
+	CHECK(bplist_encode(sample(&a), &out, &len) == 0);
+	bplist_arena_free(&a);
+
+	int truncated = 0;
+	for (i = 0; i < len; i++) {
+		uint8_t *copy = malloc(i ? i : 1);
+		memcpy(copy, out, i);
+		if (bplist_decode(copy, i, &a)) truncated++;
+		bplist_arena_free(&a);
+		free(copy);
+	}
+	CHECK(truncated == 0);
+
+	uint8_t *copy = malloc(len);
+	for (i = 0; i < len; i++) {
+		static const uint8_t values[] = { 0x00, 0x0f, 0x7f, 0xff };
+		size_t k;
+		for (k = 0; k < sizeof(values); k++) {
+			memcpy(copy, out, len);
+			copy[i] = values[k];
+			bplist_decode(copy, len, &a);
+			bplist_arena_free(&a);
+		}
+	}
+	free(copy);
+	free(out);
+}
+
+// An array which contains itself, directly or through another
+static void test_cycles(void)
+{
+	static const uint8_t self[] = {
+		'b','p','l','i','s','t','0','0',
+		0xA1, 0x00,							// object 0: [ object 0 ]
+		0x08,								// offset table
+		0,0,0,0,0,0, 1, 1,					// trailer: offset and ref sizes
+		0,0,0,0,0,0,0,1,					// 1 object
+		0,0,0,0,0,0,0,0,					// top is object 0
+		0,0,0,0,0,0,0,10					// offset table at 10
+	};
+	static const uint8_t pair[] = {
+		'b','p','l','i','s','t','0','0',
+		0xA1, 0x01,							// object 0: [ object 1 ]
+		0xA1, 0x00,							// object 1: [ object 0 ]
+		0x08, 0x0A,
+		0,0,0,0,0,0, 1, 1,
+		0,0,0,0,0,0,0,2,
+		0,0,0,0,0,0,0,0,
+		0,0,0,0,0,0,0,12
+	};
+	bplist_arena a = { NULL };
+	CHECK(bplist_decode(self, sizeof(self), &a) == NULL);
+	CHECK(bplist_decode(pair, sizeof(pair), &a) == NULL);
+	bplist_arena_free(&a);
+}
+
+static void test_not_binary(void)
+{
+	const char *xml = "<?xml version=\"1.0\" encoding=\"UTF-8\"?><plist version=\"1.0\"><dict/></plist>";
+	bplist_arena a = { NULL };
+	CHECK(!bplist_is_binary(xml, strlen(xml)));
+	CHECK(!bplist_is_binary("bplist0", 7));
+	CHECK(bplist_decode(xml, strlen(xml), &a) == NULL);
+	bplist_arena_free(&a);
+}
+
+int main(void)
+{
+	RUN(test_round_trip);
+	RUN(test_shared_values);
+	RUN(test_many_objects);
+	RUN(test_damaged);
+	RUN(test_cycles);
+	RUN(test_not_binary);
+	return TEST_STATUS();
+}
@@ -0,0 +1,416 @@
+//
+//  cpio_stream_test.c
+//  mobileDeviceManager
+//
+//  cpio_stream.c: odc and newc archives, plain and gzip'd (in one member or
+//  several), decode to the same entries however they are cut up on the way
+//  in; damaged archives fail with a reason; and extracting to a directory
+//  writes what it should and nothing outside it.
+//
+
+#include "test.h"
+#include "cpio_stream.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#pragma mark making archives
+
+typedef struct {
+	unsigned char	*p;
+	size_t			len, cap;
+} buffer;
+
+static void put(buffer *b, const void *p, size_t len)
+{
+	if (b->len + len > b->cap) {
+		while (b->len + len > b->cap) b->cap = b->cap ? b->cap * 2 : 4096;
+		b->p = realloc(b->p, b->cap);
+	}
+	if (len) memcpy(b->p + b->len, p, len);
+	b->len += len;
+}
+
+static void pad(buffer *b, size_t to)
+{
+	static const char zeros[4] = { 0 };
+	put(b, zeros, (to - b->len % to) % to);
+}
+
+static void add_entry(buffer *b, int newc, const char *name, unsigned mode, unsigned mtime,
+					  const void *data, size_t len)
+{
+	char h[128];
+	size_t namesize = strlen(name) + 1;
+	if (newc) {
+		snprintf(h, sizeof(h), "070701%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X",
+				 1u, mode, 0u, 0u, 1u, mtime, (unsigned)len, 0u, 0u, 0u, 0u, (unsigned)namesize, 0u);
+		put(b, h, 110);
+		put(b, name, namesize);
+		pad(b, 4);
+		put(b, data, len);
+		pad(b, 4);
+	} else {
+		snprintf(h, sizeof(h), "070707%06o%06o%06o%06o%06o%06o%06o%011o%06o%011o",
+				 0u, 1u, mode, 0u, 0u, 1u, 0u, mtime, (unsigned)namesize, (unsigned)len);
+		put(b, h, 76);
+		put(b, name, namesize);
+		put(b, data, len);
+	}
+}
+
+static void add_trailer(buffer *b, int newc)
+{
+	add_entry(b, newc, "TRAILER!!!", 0, 0, NULL, 0);
+}
+
+static buffer gzip(const unsigned char *p, size_t len)
+{
+	buffer out = { NULL, 0, 0 };
+	z_stream z;
+	unsigned char chunk[16384];
+	memset(&z, 0, sizeof(z));
+	deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+	z.next_in = (Bytef*)p;
+	z.avail_in = (uInt)len;
+	int rc;
+	do {
+		z.next_out = chunk;
+		z.avail_out = sizeof(chunk);
+		rc = deflate(&z, Z_FINISH);
+		put(&out, chunk, sizeof(chunk) - z.avail_out);
+	} while (rc == Z_OK);
+	deflateEnd(&z);
+	return out;
+}
+
+// A bit of everything, and one file much bigger than the inflate buffer
+static buffer sample(int newc, size_t *big_size)
+{
+	buffer b = { NULL, 0, 0 };
+	size_t big = 600 * 1024 + 3, i;
+	unsigned char *data = malloc(big);
+	for (i = 0; i < big; i++) data[i] = (unsigned char)(i * 2654435761u >> 13);
+	add_entry(&b, newc, ".", 040755, 1700000000, NULL, 0);
+	add_entry(&b, newc, "./var/mobile/Library/Logs", 040755, 1700000000, NULL, 0);
+	add_entry(&b, newc, "./var/mobile/Library/Logs/a.log", 0100644, 1700000001, "hello\n", 6);
+	add_entry(&b, newc, "./var/mobile/Library/Logs/empty", 0100600, 1700000002, NULL, 0);
+	add_entry(&b, newc, "./var/mobile/Library/Logs/odd", 0100644, 1700000003, "abc", 3);
+	add_entry(&b, newc, "./var/mobile/Library/Logs/big.bin", 0100644, 1700000004, data, big);
+	add_entry(&b, newc, "./var/mobile/Library/Logs/latest", 0120777, 1700000005, "a.log", 5);
+	add_trailer(&b, newc);
+	free(data);
+	*big_size = big;
+	return b;
+}
+
+#pragma mark recording the entries
+
+typedef struct {
+	char		log[2048];		// "name mode size|" per entry
+	uint64_t	bytes;
+	uint32_t	sum;			// of the contents
+	unsigned	entries, ends;
+	unsigned	stop_at;		// entry to fail in begin, 0 for none
+} recorder;
+
+static int rec_begin(void *ctx, const cpio_entry *e)
+{
+	recorder *r = ctx;
+	char line[256];
+	if (++r->entries == r->stop_at) return 1;
+	snprintf(line, sizeof(line), "%s %o %llu|", e->name, (unsigned)e->mode, (unsigned long long)e->size);
+	if (strlen(r->log) + strlen(line) < sizeof(r->log)) strcat(r->log, line);
+	return 0;
+}
+
+static int rec_data(void *ctx, const void *buf, size_t len)
+{
+	recorder *r = ctx;
+	const unsigned char *p = buf;
+	size_t i;
+	for (i = 0; i < len; i++) r->sum = r->sum * 31 + p[i];
+	r->bytes += len;
+	return 0;
+}
+
+static int rec_end(void *ctx)
+{
+	recorder *r = ctx;
+	r->ends++;
+	return 0;
+}
+
+static const cpio_callbacks recording = { rec_begin, rec_data, rec_end };
+
+// Feed the archive in pieces of \p piece bytes; returns the last result
+static int decode(const unsigned char *p, size_t len, size_t piece, recorder *r, char *error, size_t errlen)
+{
+	cpio_stream *s = cpio_stream_create(&recording, r);
+	int rc = CPIO_MORE;
+	size_t at;
+	memset(r->log, 0, sizeof(r->log));
+	r->bytes = r->sum = r->entries = r->ends = 0;
+	for (at = 0; at < len && rc == CPIO_MORE; at += piece) rc = cpio_stream_feed(s, p + at, at + piece > len ? len - at : piece);
+	if (error) snprintf(error, errlen, "%s", cpio_stream_error(s) ? cpio_stream_error(s) : "");
+	// anything after the end is ignored
+	if (rc == CPIO_DONE) rc = cpio_stream_feed(s, "junk", 4);
+	cpio_stream_destroy(s);
+	return rc;
+}
+
+#pragma mark decoding
+
+static void test_formats(void)
+{
+	static const size_t pieces[] = { 1, 3, 64, 4096, 1 << 30 };
+	int newc, zipped, wrong = 0;
+	size_t big, i;
+
+	for (newc = 0; newc < 2; newc++) {
+		buffer plain = sample(newc, &big);
+		recorder whole = { { 0 } };
+		CHECK(decode(plain.p, plain.len, plain.len, &whole, NULL, 0) == CPIO_DONE);
+		CHECK(whole.entries == 7 && whole.ends == 7);
+		CHECK(whole.bytes == 6 + 3 + big + 5);
+		CHECK(strstr(whole.log, "./var/mobile/Library/Logs/a.log 100644 6|") != NULL);
+		CHECK(strstr(whole.log, "./var/mobile/Library/Logs/latest 120777 5|") != NULL);
+
+		for (zipped = 0; zipped < 2; zipped++) {
+			buffer in = zipped ? gzip(plain.p, plain.len) : plain;
+			for (i = 0; i < sizeof(pieces) / sizeof(pieces[0]); i++) {
+				recorder r = { { 0 } };
+				// byte at a time through the big file is slow and proves nothing more
+				if (pieces[i] == 1 && !zipped) continue;
+				if (decode(in.p, in.len, pieces[i], &r, NULL, 0) != CPIO_DONE || strcmp(r.log, whole.log) ||
+					r.sum != whole.sum || r.bytes != whole.bytes) {
+					fprintf(stderr, "%s%s in pieces of %zu decoded differently\n", newc ? "newc" : "odc",
+							zipped ? ".gz" : "", pieces[i]);
+					wrong++;
+				}
+			}
+			if (zipped) free(in.p);
+		}
+		free(plain.p);
+	}
+	CHECK(wrong == 0);
+}
+
+// gzip allows members one after another, which is how some relays send it
+static void test_gzip_members(void)
+{
+	buffer plain = { NULL, 0, 0 }, joined = { NULL, 0, 0 };
+	recorder r = { { 0 } };
+	add_entry(&plain, 1, "one", 0100644, 0, "first", 5);
+	size_t half = plain.len;
+	add_entry(&plain, 1, "two", 0100644, 0, "second", 6);
+	add_trailer(&plain, 1);
+
+	buffer a = gzip(plain.p, half), b = gzip(plain.p + half, plain.len - half);
+	put(&joined, a.p, a.len);
+	put(&joined, b.p, b.len);
+	CHECK(decode(joined.p, joined.len, joined.len, &r, NULL, 0) == CPIO_DONE);
+	CHECK(r.entries == 2 && r.bytes == 11);
+	// with the second member arriving in a later piece
+	CHECK(decode(joined.p, joined.len, a.len, &r, NULL, 0) == CPIO_DONE);
+	CHECK(r.entries == 2 && r.bytes == 11);
+	free(a.p);
+	free(b.p);
+	free(joined.p);
+	free(plain.p);
+}
+
+static void test_damaged(void)
+{
+	buffer b = { NULL, 0, 0 };
+	recorder r = { { 0 } };
+	char error[128];
+	size_t big, at;
+
+	CHECK(decode((const unsigned char*)"PK\3\4 not cpio at all", 21, 21, &r, error, sizeof(error)) == CPIO_ERROR);
+	CHECK(strcmp(error, "not a cpio archive") == 0);
+
+	add_entry(&b, 1, "file", 0100644, 0, "x", 1);
+	b.p[20] = 'g';						// in the mode
+	CHECK(decode(b.p, b.len, b.len, &r, error, sizeof(error)) == CPIO_ERROR);
+	CHECK(strcmp(error, "bad newc header") == 0);
+	free(b.p);
+
+	b.p = NULL;
+	b.len = b.cap = 0;
+	add_entry(&b, 0, "file", 0100644, 0, "x", 1);
+	memcpy(b.p + 59, "000000", 6);		// no name
+	CHECK(decode(b.p, b.len, b.len, &r, error, sizeof(error)) == CPIO_ERROR);
+	CHECK(strcmp(error, "bad name length") == 0);
+	free(b.p);
+
+	// gzip data gone bad
+	buffer plain = sample(1, &big);
+	buffer zipped = gzip(plain.p, plain.len);
+	for (at = 100; at < 200; at++) zipped.p[at] ^= 0x5a;
+	CHECK(decode(zipped.p, zipped.len, 4096, &r, error, sizeof(error)) == CPIO_ERROR && error[0]);
+
+	// cut short: never done, never an error either - more may be coming
+	CHECK(decode(plain.p, plain.len / 2, 4096, &r, NULL, 0) == CPIO_MORE);
+
+	// a handler can stop it
+	r.stop_at = 3;
+	CHECK(decode(plain.p, plain.len, plain.len, &r, error, sizeof(error)) == CPIO_ERROR);
+	CHECK(strcmp(error, "stopped by handler") == 0 && r.entries == 3);
+	free(zipped.p);
+	free(plain.p);
+}
+
+#pragma mark extracting
+
+static char *make_dir(void)
+{
+	static char dir[64];
+	strcpy(dir, "/tmp/cpio_stream_test.XXXXXX");
+	return mkdtemp(dir);
+}
+
+static void remove_tree(const char *path)
+{
+	struct stat st;
+	if (lstat(path, &st) != 0) return;
+	if (S_ISDIR(st.st_mode)) {
+		DIR *d = opendir(path);
+		struct dirent *e;
+		char child[PATH_MAX];
+		while (d && (e = readdir(d))) {
+			if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..")) continue;
+			snprintf(child, sizeof(child), "%s/%s", path, e->d_name);
+			remove_tree(child);
+		}
+		if (d) closedir(d);
+		rmdir(path);
+	} else {
+		unlink(path);
+	}
+}
+
+static int file_is(const char *path, const char *contents)
+{
+	char buf[256];
+	FILE *f = fopen(path, "r");
+	if (!f) return 0;
+	size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+	fclose(f);
+	buf[n] = 0;
+	return strcmp(buf, contents) == 0;
+}
+
+static void test_extract(void)
+{
+	char *base = make_dir(), root[PATH_MAX], path[PATH_MAX + 64], link[64];
+	buffer b = { NULL, 0, 0 };
+	uint64_t files, bytes;
+	struct stat st;
+	ssize_t n;
+	CHECK(base != NULL);
+	if (!base) return;
+	snprintf(root, sizeof(root), "%s/out/device", base);
+
+	// something already there which a link could be written through
+	snprintf(path, sizeof(path), "%s/outside", base);
+	FILE *f = fopen(path, "w");
+	fputs("untouched", f);
+	fclose(f);
+	snprintf(path, sizeof(path), "%s/out", base);
+	mkdir(path, 0755);
+	mkdir(root, 0755);
+	snprintf(path, sizeof(path), "%s/trap", root);
+	CHECK(symlink("../../outside", path) == 0);
+
+	add_entry(&b, 1, "./Logs", 040755, 1700000000, NULL, 0);
+	add_entry(&b, 1, "./Logs/a.log", 0100640, 1700000001, "hello\n", 6);
+	add_entry(&b, 1, "Logs//./deep/er/b.log", 0100644, 1700000002, "deeper", 6);
+	add_entry(&b, 1, "/etc/absolute", 0100644, 0, "made relative", 13);
+	add_entry(&b, 1, "../escaped", 0100644, 0, "no", 2);
+	add_entry(&b, 1, "Logs/../../escaped", 0100644, 0, "no", 2);
+	add_entry(&b, 1, "Logs/latest", 0120777, 0, "a.log", 5);
+	add_entry(&b, 1, "Logs/out", 0120777, 0, "../../../outside", 16);
+	add_entry(&b, 1, "Logs/abs", 0120777, 0, "/etc/passwd", 11);
+	add_entry(&b, 1, "trap", 0100644, 0, "replaced", 8);
+	add_entry(&b, 1, "fifo", 010644, 0, NULL, 0);
+	add_entry(&b, 1, ".", 040755, 0, NULL, 0);
+	add_trailer(&b, 1);
+
+	cpio_dir *d = cpio_dir_open(root);
+	cpio_stream *s = cpio_stream_create(&cpio_dir_callbacks, d);
+	CHECK(cpio_stream_feed(s, b.p, b.len) == CPIO_DONE);
+	CHECK(cpio_dir_error(d) == NULL);
+	cpio_stream_destroy(s);
+	cpio_dir_close(d, &files, &bytes);
+	CHECK(files == 5);					// a.log, b.log, absolute, latest, trap
+	CHECK(bytes == 6 + 6 + 13 + 8);
+
+	snprintf(path, sizeof(path), "%s/Logs/a.log", root);
+	CHECK(file_is(path, "hello\n"));
+	CHECK(stat(path, &st) == 0 && (st.st_mode & 07777) == 0640 && st.st_mtime == 1700000001);
+	snprintf(path, sizeof(path), "%s/Logs/deep/er/b.log", root);
+	CHECK(file_is(path, "deeper"));
+	snprintf(path, sizeof(path), "%s/etc/absolute", root);
+	CHECK(file_is(path, "made relative"));
+	snprintf(path, sizeof(path), "%s/Logs/latest", root);
+	CHECK((n = readlink(path, link, sizeof(link) - 1)) == 5 && memcmp(link, "a.log", 5) == 0);
+	CHECK(file_is(path, "hello\n"));
+
+	// nothing got out
+	snprintf(path, sizeof(path), "%s/out/escaped", base);
+	CHECK(access(path, F_OK) != 0);
+	snprintf(path, sizeof(path), "%s/escaped", base);
+	CHECK(access(path, F_OK) != 0);
+	snprintf(path, sizeof(path), "%s/Logs/out", root);
+	CHECK(lstat(path, &st) != 0);
+	snprintf(path, sizeof(path), "%s/Logs/abs", root);
+	CHECK(lstat(path, &st) != 0);
+	snprintf(path, sizeof(path), "%s/outside", base);
+	CHECK(file_is(path, "untouched"));
+	snprintf(path, sizeof(path), "%s/trap", root);
+	CHECK(lstat(path, &st) == 0 && S_ISREG(st.st_mode) && file_is(path, "replaced"));
+	snprintf(path, sizeof(path), "%s/fifo", root);
+	CHECK(lstat(path, &st) != 0);
+
+	free(b.p);
+	remove_tree(base);
+}
+
+// A directory that can't be made is an error the caller can see
+static void test_extract_fails(void)
+{
+	char *base = make_dir(), root[PATH_MAX];
+	buffer b = { NULL, 0, 0 };
+	CHECK(base != NULL);
+	if (!base) return;
+	snprintf(root, sizeof(root), "%s/file", base);
+	FILE *f = fopen(root, "w");
+	fclose(f);
+
+	add_entry(&b, 0, "Logs/a.log", 0100644, 0, "x", 1);
+	add_trailer(&b, 0);
+	cpio_dir *d = cpio_dir_open(root);
+	cpio_stream *s = cpio_stream_create(&cpio_dir_callbacks, d);
+	CHECK(cpio_dir_error(d) != NULL || cpio_stream_feed(s, b.p, b.len) == CPIO_ERROR);
+	CHECK(cpio_dir_error(d) != NULL);
+	cpio_stream_destroy(s);
+	cpio_dir_close(d, NULL, NULL);
+	free(b.p);
+	remove_tree(base);
+}
+
+int main(void)
+{
+	RUN(test_formats);
+	RUN(test_gzip_members);
+	RUN(test_damaged);
+	RUN(test_extract);
+	RUN(test_extract_fails);
+	return TEST_STATUS();
+}
@@ -0,0 +1,321 @@
+//
+//  service_io_test.c
+//  mobileDeviceManager
+//
+//  service_io.c against service_standin: thousands of requests interleaved over
+//  hundreds of sockets each come back whole and in their socket's order, and
+//  timeouts, cancelling, forgetting, a closed peer and a message of megabytes
+//  each finish the way service_io.h says.
+//
+
+#include "test.h"
+#include "service_io.h"
+#include "service_standin.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#define SOCKETS		200
+#define PER_SOCKET	40
+
+// The first byte of each message says what the stand-in does with it: 'e'
+// echoes it, 'm' reads it and says nothing.
+static int handler(void *ctx, service_standin *server, const void *msg, size_t len)
+{
+	if (len && *(const char*)msg == 'm') return 1;
+	return service_standin_reply(server, msg, len);
+}
+
+static double now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+#pragma mark waiting for callbacks
+
+typedef struct {
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	unsigned		done;
+} counter;
+
+static void counter_bump(counter *c)
+{
+	pthread_mutex_lock(&c->lock);
+	c->done++;
+	pthread_cond_broadcast(&c->cond);
+	pthread_mutex_unlock(&c->lock);
+}
+
+// Returns 0 if fewer than n arrived within timeout seconds
+static int counter_wait(counter *c, unsigned n, double timeout)
+{
+	double until = now() + timeout;
+	int ok;
+	pthread_mutex_lock(&c->lock);
+	while (c->done < n && now() < until) {
+		struct timespec ts = { time(NULL) + 1, 0 };
+		pthread_cond_timedwait(&c->cond, &c->lock, &ts);
+	}
+	ok = c->done >= n;
+	pthread_mutex_unlock(&c->lock);
+	return ok;
+}
+
+#pragma mark interleaved
+
+typedef struct {
+	unsigned	next;			// sequence number of the reply expected next
+	unsigned	bad;
+	char		msgs[PER_SOCKET][16];
+} socket_state;
+
+typedef struct {
+	socket_state	*socket;
+	unsigned		seq;
+	counter			*counter;
+} request_ctx;
+
+static void interleaved_done(void *ctx, int status, uint8_t *reply, uint32_t len)
+{
+	request_ctx *r = ctx;
+	socket_state *s = r->socket;
+	const char *sent = s->msgs[r->seq];
+	// callbacks for one socket come in order, so this needs no lock
+	if (status || !reply || len != strlen(sent) || memcmp(reply, sent, len) != 0 || r->seq != s->next) s->bad++;
+	s->next++;
+	free(reply);
+	counter_bump(r->counter);
+}
+
+static void test_interleaved(void)
+{
+	static socket_state sockets[SOCKETS];
+	static request_ctx requests[SOCKETS][PER_SOCKET];
+	service_standin *servers[SOCKETS];
+	int fds[SOCKETS], i, k, started = 0;
+	counter c = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0 };
+	sio_loop *loop = sio_loop_create(4);
+	CHECK(loop != NULL);
+	if (!loop) return;
+
+	for (i = 0; i < SOCKETS; i++) {
+		if (service_standin_start(handler, NULL, 0, &servers[i], &fds[i]) != 0) break;
+		started++;
+	}
+	CHECK(started == SOCKETS);
+
+	// round robin over the sockets, so each thread juggles many at once
+	memset(sockets, 0, sizeof(sockets));
+	for (k = 0; k < PER_SOCKET; k++) {
+		for (i = 0; i < started; i++) {
+			socket_state *s = &sockets[i];
+			request_ctx *r = &requests[i][k];
+			snprintf(s->msgs[k], sizeof(s->msgs[k]), "e%d.%d", i, k);
+			r->socket = s;
+			r->seq = k;
+			r->counter = &c;
+			sio_submit(loop, fds[i], s->msgs[k], (uint32_t)strlen(s->msgs[k]), 1, 10, interleaved_done, r);
+		}
+	}
+	CHECK(counter_wait(&c, started * PER_SOCKET, 30));
+
+	unsigned bad = 0;
+	for (i = 0; i < started; i++) bad += sockets[i].bad + (sockets[i].next != PER_SOCKET);
+	CHECK(bad == 0);
+
+	for (i = 0; i < started; i++) {
+		sio_forget(loop, fds[i]);
+		close(fds[i]);
+		service_standin_stop(servers[i]);
+	}
+	sio_loop_destroy(loop);
+}
+
+#pragma mark failures
+
+typedef struct {
+	counter		counter;
+	int			status[8];
+	uint32_t	len[8];
+	double		at[8];
+} results;
+
+typedef struct {
+	results		*results;
+	unsigned	slot;
+} result_ctx;
+
+static void record_done(void *ctx, int status, uint8_t *reply, uint32_t len)
+{
+	result_ctx *r = ctx;
+	r->results->status[r->slot] = status;
+	r->results->len[r->slot] = len;
+	r->results->at[r->slot] = now();
+	free(reply);
+	counter_bump(&r->results->counter);
+}
+
+static void results_init(results *r)
+{
+	memset(r, 0, sizeof(*r));
+	pthread_mutex_init(&r->counter.lock, NULL);
+	pthread_cond_init(&r->counter.cond, NULL);
+	for (unsigned i = 0; i < 8; i++) r->status[i] = -1;
+}
+
+// A request which times out waiting for its reply has left the stream out of
+// step, so the one queued behind it fails the same way
+static void test_timeout(void)
+{
+	results res;
+	result_ctx ctx[2] = { { &res, 0 }, { &res, 1 } };
+	service_standin *server;
+	int fd;
+	sio_loop *loop = sio_loop_create(1);
+	results_init(&res);
+	CHECK(service_standin_start(handler, NULL, 0, &server, &fd) == 0);
+
+	double start = now();
+	sio_submit(loop, fd, "mute", 4, 1, 0.2, record_done, &ctx[0]);
+	sio_submit(loop, fd, "echo", 4, 1, 5, record_done, &ctx[1]);
+	CHECK(counter_wait(&res.counter, 2, 5));
+	CHECK(res.status[0] == ETIMEDOUT);
+	CHECK(res.at[0] - start >= 0.2 && res.at[0] - start < 2);
+	CHECK(res.status[1] == ETIMEDOUT);
+
+	// and so does anything submitted later, until the socket is forgotten
+	sio_submit(loop, fd, "echo", 4, 1, 5, record_done, &ctx[0]);
+	CHECK(counter_wait(&res.counter, 3, 5));
+	CHECK(res.status[0] == ETIMEDOUT);
+
+	sio_forget(loop, fd);
+	sio_loop_destroy(loop);
+	close(fd);
+	service_standin_stop(server);
+}
+
+static void test_cancel_and_forget(void)
+{
+	results res;
+	result_ctx ctx[3] = { { &res, 0 }, { &res, 1 }, { &res, 2 } };
+	service_standin *server;
+	int fd;
+	sio_loop *loop = sio_loop_create(2);
+	results_init(&res);
+	CHECK(service_standin_start(handler, NULL, 0, &server, &fd) == 0);
+
+	uint64_t id = sio_submit(loop, fd, "mute", 4, 1, 0, record_done, &ctx[0]);
+	CHECK(id != 0);
+	usleep(50000);
+	sio_cancel(loop, id);
+	CHECK(counter_wait(&res.counter, 1, 5));
+	CHECK(res.status[0] == ECANCELED);
+
+	// cancelling one that has finished does nothing
+	sio_cancel(loop, id);
+	sio_forget(loop, fd);
+	usleep(50000);
+
+	// a fresh start on the same socket after forgetting it; requests still
+	// queued when it is forgotten again are cancelled
+	sio_submit(loop, fd, "echo", 4, 1, 5, record_done, &ctx[0]);
+	CHECK(counter_wait(&res.counter, 2, 5));
+	CHECK(res.status[0] == 0 && res.len[0] == 4);
+	sio_submit(loop, fd, "mute", 4, 1, 0, record_done, &ctx[1]);
+	sio_submit(loop, fd, "echo", 4, 1, 0, record_done, &ctx[2]);
+	usleep(50000);
+	sio_forget(loop, fd);
+	CHECK(counter_wait(&res.counter, 4, 5));
+	CHECK(res.status[1] == ECANCELED && res.status[2] == ECANCELED);
+
+	sio_loop_destroy(loop);
+	close(fd);
+	service_standin_stop(server);
+}
+
+static void test_peer_closed(void)
+{
+	results res;
+	result_ctx ctx = { &res, 0 };
+	int fds[2];
+	sio_loop *loop = sio_loop_create(1);
+	results_init(&res);
+	CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+
+	sio_submit(loop, fds[1], NULL, 0, 1, 5, record_done, &ctx);
+	usleep(50000);
+	close(fds[0]);
+	CHECK(counter_wait(&res.counter, 1, 5));
+	CHECK(res.status[0] == EPIPE);
+
+	sio_forget(loop, fds[1]);
+	sio_loop_destroy(loop);
+	close(fds[1]);
+}
+
+// Far more than a socket buffer each way, so both directions take many events
+static void test_large_message(void)
+{
+	results res;
+	result_ctx ctx = { &res, 0 };
+	service_standin *server;
+	int fd;
+	uint32_t len = 5 * 1024 * 1024, i;
+	uint8_t *msg = malloc(len);
+	sio_loop *loop = sio_loop_create(1);
+	results_init(&res);
+	for (i = 0; i < len; i++) msg[i] = (uint8_t)(i * 31 + 7);
+	msg[0] = 'e';
+	CHECK(service_standin_start(handler, NULL, 0, &server, &fd) == 0);
+
+	sio_submit(loop, fd, msg, len, 1, 30, record_done, &ctx);
+	CHECK(counter_wait(&res.counter, 1, 30));
+	CHECK(res.status[0] == 0 && res.len[0] == len);
+
+	sio_forget(loop, fd);
+	sio_loop_destroy(loop);
+	close(fd);
+	service_standin_stop(server);
+	free(msg);
+}
+
+// Whatever is outstanding when the loop goes finishes with ECANCELED
+static void test_destroy(void)
+{
+	results res;
+	result_ctx ctx[2] = { { &res, 0 }, { &res, 1 } };
+	service_standin *server;
+	int fd;
+	sio_loop *loop = sio_loop_create(2);
+	results_init(&res);
+	CHECK(service_standin_start(handler, NULL, 0, &server, &fd) == 0);
+
+	sio_submit(loop, fd, "mute", 4, 1, 0, record_done, &ctx[0]);
+	sio_submit(loop, fd, "echo", 4, 1, 0, record_done, &ctx[1]);
+	usleep(50000);
+	sio_loop_destroy(loop);
+	CHECK(res.counter.done == 2);
+	CHECK(res.status[0] == ECANCELED && res.status[1] == ECANCELED);
+
+	close(fd);
+	service_standin_stop(server);
+}
+
+int main(void)
+{
+	RUN(test_interleaved);
+	RUN(test_timeout);
+	RUN(test_cancel_and_forget);
+	RUN(test_peer_closed);
+	RUN(test_large_message);
+	RUN(test_destroy);
+	return TEST_STATUS();
+}
@@ -0,0 +1,229 @@
+//
+//  syslog_ingest_test.c
+//  mobileDeviceManager
+//
+//  syslog_ingest.c: the splitter gives the same records however the relay's
+//  reads happen to be cut, and the ring hands records from one thread to
+//  another whole and in order, wrapping round its buffer many times.
+//
+
+#include "test.h"
+#include "syslog_ingest.h"
+
+#include <pthread.h>
+#include <stdint.h>
+
+#pragma mark splitting
+
+typedef struct {
+	char	text[4096];
+	size_t	len;
+	size_t	count;
+	size_t	longest;
+} collected;
+
+// Records one after another, each followed by '|'
+static void collect(void *ctx, const char *rec, size_t len)
+{
+	collected *c = ctx;
+	if (len > c->longest) c->longest = len;
+	c->count++;
+	if (c->len + len + 1 > sizeof(c->text)) return;
+	memcpy(c->text + c->len, rec, len);
+	c->len += len;
+	c->text[c->len++] = '|';
+	c->text[c->len] = 0;
+}
+
+static const char stream[] =
+	"Oct 17 10:00:01 iPhone kernel[0] <Notice>: one\0"
+	"\nOct 17 10:00:02 iPhone SpringBoard[58] <Warning>: two\0"
+	"\0"
+	"\n\0"
+	"Oct 17 10:00:03 iPhone backboardd[63] <Error>: three\nand a second line\0";
+
+static const char *expected =
+	"Oct 17 10:00:01 iPhone kernel[0] <Notice>: one|"
+	"Oct 17 10:00:02 iPhone SpringBoard[58] <Warning>: two|"
+	"Oct 17 10:00:03 iPhone backboardd[63] <Error>: three\nand a second line|";
+
+static void test_split_whole(void)
+{
+	syslog_splitter s = { NULL };
+	collected c = { { 0 } };
+	syslog_split(&s, stream, sizeof(stream) - 1, collect, &c);
+	CHECK(c.count == 3);
+	CHECK(strcmp(c.text, expected) == 0);
+	CHECK(s.carry_len == 0);
+	syslog_splitter_free(&s);
+}
+
+// Cut into two reads at every offset, and into reads of every size
+static void test_split_anywhere(void)
+{
+	size_t len = sizeof(stream) - 1, cut, size, at;
+	int wrong = 0;
+
+	for (cut = 0; cut <= len; cut++) {
+		syslog_splitter s = { NULL };
+		collected c = { { 0 } };
+		syslog_split(&s, stream, cut, collect, &c);
+		syslog_split(&s, stream + cut, len - cut, collect, &c);
+		if (strcmp(c.text, expected) != 0) wrong++;
+		syslog_splitter_free(&s);
+	}
+	for (size = 1; size <= 64; size++) {
+		syslog_splitter s = { NULL };
+		collected c = { { 0 } };
+		for (at = 0; at < len; at += size) syslog_split(&s, stream + at, at + size > len ? len - at : size, collect, &c);
+		if (strcmp(c.text, expected) != 0) wrong++;
+		syslog_splitter_free(&s);
+	}
+	CHECK(wrong == 0);
+}
+
+// A record with no end in sight is passed on in pieces rather than kept
+// growing
+static void test_split_runaway(void)
+{
+	syslog_splitter s = { NULL };
+	collected c = { { 0 } };
+	size_t chunk = 16 * 1024, i, total = SYSLOG_MAX_RECORD * 3 + 100;
+	char *buf = malloc(chunk);
+	memset(buf, 'x', chunk);
+	for (i = 0; i < total; i += chunk) syslog_split(&s, buf, i + chunk > total ? total - i : chunk, collect, &c);
+	CHECK(c.count == 3);
+	CHECK(c.longest == SYSLOG_MAX_RECORD);
+	CHECK(s.carry_len == 100);
+	syslog_split(&s, "\0", 1, collect, &c);
+	CHECK(c.count == 4);
+	CHECK(s.carry_len == 0);
+	syslog_splitter_free(&s);
+	free(buf);
+}
+
+#pragma mark ring
+
+static void test_ring_fifo(void)
+{
+	syslog_ring *r = syslog_ring_create(100);		// rounded up to 4096
+	const char *rec;
+	uint32_t len, head = 0x01020304;
+	int pushed = 0;
+
+	CHECK(r != NULL);
+	CHECK(!syslog_ring_peek(r, &rec, &len));
+
+	// 8 bytes a record, 4096 bytes in all
+	while (syslog_ring_push(r, NULL, 0, "abcd", 4)) pushed++;
+	CHECK(pushed == 4096 / 8);
+	CHECK(syslog_ring_count(r) == (size_t)pushed);
+	CHECK(syslog_ring_peek(r, &rec, &len));
+	CHECK(len == 4 && memcmp(rec, "abcd", 4) == 0);
+	syslog_ring_pop(r);
+	CHECK(syslog_ring_count(r) == (size_t)pushed - 1);
+
+	// room for exactly one more
+	CHECK(syslog_ring_push(r, NULL, 0, "1234567", 7) == 0);
+	CHECK(syslog_ring_push(r, NULL, 0, "123", 3) == 1);
+	CHECK(syslog_ring_push(r, NULL, 0, "", 0) == 0);
+
+	while (syslog_ring_peek(r, &rec, &len)) syslog_ring_pop(r);
+	CHECK(syslog_ring_count(r) == 0);
+
+	// the head comes first, aligned
+	CHECK(syslog_ring_push(r, &head, sizeof(head), "abc", 3));
+	CHECK(syslog_ring_peek(r, &rec, &len));
+	CHECK(len == 7 && memcmp(rec, &head, 4) == 0 && memcmp(rec + 4, "abc", 3) == 0);
+	CHECK(((uintptr_t)rec & 3) == 0);
+	syslog_ring_pop(r);
+	syslog_ring_destroy(r);
+}
+
+// Records of awkward sizes, so every so often one doesn't fit before the end
+// of the buffer and goes at the start
+static void test_ring_wrap(void)
+{
+	syslog_ring *r = syslog_ring_create(4096);
+	char rec[1000];
+	const char *got;
+	uint32_t len, i, popped = 0, bad = 0;
+
+	for (i = 0; i < 20000; i++) {
+		uint32_t n = 1 + (i * 37) % 997;
+		memset(rec, 'a' + i % 26, n);
+		if (!syslog_ring_push(r, &i, sizeof(i), rec, n)) {
+			// full: drain half, then the push must fit
+			size_t k, half = syslog_ring_count(r) / 2 + 1;
+			for (k = 0; k < half && syslog_ring_peek(r, &got, &len); k++) {
+				uint32_t seq;
+				memcpy(&seq, got, sizeof(seq));
+				if (seq != popped || len != 4 + 1 + (seq * 37) % 997 || got[4] != 'a' + seq % 26) bad++;
+				syslog_ring_pop(r);
+				popped++;
+			}
+			if (!syslog_ring_push(r, &i, sizeof(i), rec, n)) bad++;
+		}
+	}
+	while (syslog_ring_peek(r, &got, &len)) {
+		uint32_t seq;
+		memcpy(&seq, got, sizeof(seq));
+		if (seq != popped) bad++;
+		syslog_ring_pop(r);
+		popped++;
+	}
+	CHECK(bad == 0);
+	CHECK(popped == 20000);
+	syslog_ring_destroy(r);
+}
+
+#define THREADED_RECORDS	500000
+
+static void *producer(void *arg)
+{
+	syslog_ring *r = arg;
+	char rec[64];
+	uint32_t i;
+	for (i = 0; i < THREADED_RECORDS; i++) {
+		uint32_t n = 1 + i % 61;
+		memset(rec, '0' + i % 10, n);
+		while (!syslog_ring_push(r, &i, sizeof(i), rec, n)) ;
+	}
+	return NULL;
+}
+
+// One thread pushing while another pops, as the relay's reader and the main
+// thread do
+static void test_ring_threads(void)
+{
+	syslog_ring *r = syslog_ring_create(16 * 1024);
+	pthread_t thread;
+	const char *got;
+	uint32_t len, next = 0, bad = 0;
+
+	CHECK(pthread_create(&thread, NULL, producer, r) == 0);
+	while (next < THREADED_RECORDS) {
+		if (!syslog_ring_peek(r, &got, &len)) continue;
+		uint32_t seq, n;
+		memcpy(&seq, got, sizeof(seq));
+		n = 1 + seq % 61;
+		if (seq != next || len != 4 + n || got[4] != '0' + seq % 10 || got[3 + n] != '0' + seq % 10) bad++;
+		syslog_ring_pop(r);
+		next++;
+	}
+	pthread_join(thread, NULL);
+	CHECK(bad == 0);
+	CHECK(syslog_ring_count(r) == 0);
+	syslog_ring_destroy(r);
+}
+
+int main(void)
+{
+	RUN(test_split_whole);
+	RUN(test_split_anywhere);
+	RUN(test_split_runaway);
+	RUN(test_ring_fifo);
+	RUN(test_ring_wrap);
+	RUN(test_ring_threads);
+	return TEST_STATUS();
+}
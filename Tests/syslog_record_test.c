@@ -0,0 +1,267 @@
+//
+//  syslog_record_test.c
+//  mobileDeviceManager
+//
+//  syslog_record.c: the parts of the forms of record the relay sends, what it
+//  makes of records in no usual form (or cut short), the year it gives a
+//  timestamp, and each kind of filter alone and together.
+//
+
+#include "test.h"
+#include "syslog_record.h"
+
+#include <syslog.h>
+
+// A copy of exactly len bytes, so ASan notices a read past the end
+static char *exact(const char *rec, size_t len)
+{
+	char *copy = malloc(len ? len : 1);
+	memcpy(copy, rec, len);
+	return copy;
+}
+
+static int part_is(const char *rec, uint32_t at, size_t len, const char *expected)
+{
+	return len == strlen(expected) && memcmp(rec + at, expected, len) == 0;
+}
+
+static void test_parse(void)
+{
+	static const struct {
+		const char	*rec, *host, *process, *message;
+		int			pid, level;
+	} cases[] = {
+		{ "Oct 17 12:34:56 Johns-iPhone MobileMail[123] <Warning>: some message",
+		  "Johns-iPhone", "MobileMail", "some message", 123, LOG_WARNING },
+		// older firmware, without the level
+		{ "Oct 17 12:34:56 iPad kernel[0]: AppleKeyStore: operation failed",
+		  "iPad", "kernel", "AppleKeyStore: operation failed", 0, SYSLOG_LEVEL_NONE },
+		{ "Oct  7 01:02:03 iPhone locationd(CoreLocation)[60] <Error>: no fix",
+		  "iPhone", "locationd", "no fix", 60, LOG_ERR },
+		{ "Jan  1 00:00:00 iPhone Some App[4410] <Notice>: started: ok",
+		  "iPhone", "Some App", "started: ok", 4410, LOG_NOTICE },
+		{ "Dec 31 23:59:60 iPhone configd <Debug>: leap second",
+		  "iPhone", "configd", "leap second", -1, LOG_DEBUG },
+		{ "Feb 29 10:00:00 iPhone mDNSResponder[41] <Quiet>: unknown level",
+		  "iPhone", "mDNSResponder", "unknown level", 41, SYSLOG_LEVEL_NONE },
+		{ "Mar  3 10:00:00 iPhone backupd[12]:",
+		  "iPhone", "backupd", "", 12, SYSLOG_LEVEL_NONE },
+	};
+	size_t i;
+
+	for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		size_t len = strlen(cases[i].rec);
+		char *rec = exact(cases[i].rec, len);
+		syslog_record r;
+		int ok = syslog_parse(rec, len, &r);
+		if (!ok || !part_is(rec, r.host, r.host_len, cases[i].host) ||
+			!part_is(rec, r.process, r.process_len, cases[i].process) ||
+			!part_is(rec, r.message, len - r.message, cases[i].message) ||
+			r.pid != cases[i].pid || r.level != cases[i].level) {
+			fprintf(stderr, "parsed wrongly: %s\n", cases[i].rec);
+			test_failures++;
+		}
+		free(rec);
+	}
+}
+
+static void test_timestamp(void)
+{
+	static const struct {
+		const char	*rec;
+		uint32_t	when;
+	} cases[] = {
+		{ "Oct 17 12:34:56 h p: m", (274 + 16) * 86400 + 12 * 3600 + 34 * 60 + 56 },
+		{ "Dec 31 23:59:59 h p: m", (335 + 30) * 86400 + 23 * 3600 + 59 * 60 + 59 },
+		{ "Mar  1 00:00:00 h p: m", 60 * 86400 },
+		// a timestamp of 0, but a timestamp - the rest is still found
+		{ "Jan  1 00:00:00 h p: m", 0 },
+	};
+	size_t i;
+
+	for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		syslog_record r;
+		size_t len = strlen(cases[i].rec);
+		if (!syslog_parse(cases[i].rec, len, &r) || r.when != cases[i].when || !part_is(cases[i].rec, r.process, r.process_len, "p")) {
+			fprintf(stderr, "wrong time: %s\n", cases[i].rec);
+			test_failures++;
+		}
+	}
+}
+
+// Not in the usual form: the whole record is the message, and nothing else
+// is claimed
+static void test_unusual(void)
+{
+	static const char *cases[] = {
+		"",
+		"hello",
+		"Oct 17 12:34:56",
+		"Oct 17 12:34:56 ",
+		"Foo 17 12:34:56 iPhone kernel[0]: no such month",
+		"Oct 32 12:34:56 iPhone kernel[0]: no such day",
+		"Oct 17 24:34:56 iPhone kernel[0]: no such hour",
+		"Oct 17 12-34-56 iPhone kernel[0]: not a time",
+		"Oct 17 12:34:56 iPhone no separator at all",
+		"Oct 17 12:34:56 iPhone : no process",
+		"Oct 17 12:34:56 iPhone",
+	};
+	size_t i;
+
+	for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		size_t len = strlen(cases[i]);
+		char *rec = exact(cases[i], len);
+		syslog_record r;
+		if (syslog_parse(rec, len, &r) || r.message != 0 || r.pid != -1 || r.level != SYSLOG_LEVEL_NONE ||
+			r.process_len || r.host_len) {
+			fprintf(stderr, "parsed when it shouldn't have been: \"%s\"\n", cases[i]);
+			test_failures++;
+		}
+		free(rec);
+	}
+}
+
+// Cut short anywhere, a record is still only read within its length
+static void test_truncated(void)
+{
+	const char *full = "Oct  7 01:02:03 iPhone locationd(CoreLocation)[60] <Error>: no fix";
+	size_t len = strlen(full), i;
+	int bad = 0;
+
+	for (i = 0; i <= len; i++) {
+		char *rec = exact(full, i);
+		syslog_record r;
+		syslog_parse(rec, i, &r);
+		if (r.message > i || r.host + r.host_len > i || r.process + r.process_len > i) bad++;
+		free(rec);
+	}
+	CHECK(bad == 0);
+}
+
+static void test_levels(void)
+{
+	CHECK(syslog_level_named("Error") == LOG_ERR);
+	CHECK(syslog_level_named("warning") == LOG_WARNING);
+	CHECK(syslog_level_named("crit") == LOG_CRIT);
+	CHECK(syslog_level_named("emerg") == LOG_EMERG);
+	CHECK(syslog_level_named("7") == LOG_DEBUG);
+	CHECK(syslog_level_named("8") == SYSLOG_LEVEL_NONE);
+	CHECK(syslog_level_named("loud") == SYSLOG_LEVEL_NONE);
+	CHECK(strcmp(syslog_level_name(LOG_NOTICE), "Notice") == 0);
+	CHECK(strcmp(syslog_level_name(SYSLOG_LEVEL_NONE), "") == 0);
+}
+
+static time_t utc(int year, int mon, int day, int h, int m, int s)
+{
+	struct tm tm;
+	memset(&tm, 0, sizeof(tm));
+	tm.tm_year = year - 1900;
+	tm.tm_mon = mon - 1;
+	tm.tm_mday = day;
+	tm.tm_hour = h;
+	tm.tm_min = m;
+	tm.tm_sec = s;
+	tm.tm_isdst = -1;
+	return mktime(&tm);
+}
+
+static uint32_t when(int mon, int day, int h, int m, int s)
+{
+	static const uint16_t days_before[12] = { 0, 31, 60, 91, 121, 152, 182, 213, 244, 274, 305, 335 };
+	return (uint32_t)(days_before[mon - 1] + day - 1) * 86400 + h * 3600 + m * 60 + s;
+}
+
+// The year is the latest which doesn't put the record more than a day ahead
+static void test_year(void)
+{
+	time_t now = utc(2026, 1, 2, 9, 0, 0);
+	CHECK(syslog_record_time(when(1, 2, 8, 0, 0), now) == utc(2026, 1, 2, 8, 0, 0));
+	CHECK(syslog_record_time(when(1, 3, 8, 0, 0), now) == utc(2026, 1, 3, 8, 0, 0));
+	CHECK(syslog_record_time(when(12, 31, 23, 0, 0), now) == utc(2025, 12, 31, 23, 0, 0));
+	CHECK(syslog_record_time(when(10, 17, 12, 34, 56), utc(2026, 10, 17, 13, 0, 0)) == utc(2026, 10, 17, 12, 34, 56));
+
+	// the clock gives the same answers, however the records come
+	syslog_clock c;
+	uint32_t w;
+	int wrong = 0;
+	memset(&c, 0, sizeof(c));
+	now = utc(2026, 10, 17, 13, 0, 0);
+	for (w = when(10, 17, 9, 0, 0); w < when(10, 17, 12, 0, 0); w += 37) {
+		if (syslog_clock_time(&c, w, now) != syslog_record_time(w, now)) wrong++;
+	}
+	CHECK(wrong == 0);
+	CHECK(syslog_clock_time(&c, 0, now) == now);
+}
+
+// With its NUL: ASan's regexec() looks for one whatever REG_STARTEND says
+static int matches(const syslog_filter *f, const char *text)
+{
+	size_t len = strlen(text);
+	char *rec = exact(text, len + 1);
+	syslog_record r;
+	syslog_parse(rec, len, &r);
+	int m = syslog_filter_match(f, rec, len, &r);
+	free(rec);
+	return m;
+}
+
+static void test_filter(void)
+{
+	const char *mail = "Oct 17 12:34:56 iPhone MobileMail[123] <Warning>: fetch failed: timeout";
+	const char *kernel = "Oct 17 12:34:57 iPhone kernel[0] <Notice>: wifi: link up";
+	const char *old = "Oct 17 12:34:58 iPhone MobileMail[123]: fetch failed without a level";
+	const char *odd = "no usual form, but MobileMail fetch failed";
+	char err[128];
+
+	syslog_filter *f = syslog_filter_create();
+	CHECK(matches(f, mail) && matches(f, kernel) && matches(f, odd));
+
+	syslog_filter_set_level(f, LOG_WARNING);
+	CHECK(matches(f, mail) && !matches(f, kernel));
+	CHECK(matches(f, old));							// no level passes
+
+	CHECK(syslog_filter_add_process(f, "MobileMail"));
+	CHECK(syslog_filter_add_process(f, "SpringBoard"));
+	CHECK(matches(f, mail) && !matches(f, odd));
+
+	CHECK(syslog_filter_add_substring(f, "failed"));
+	CHECK(matches(f, mail) && matches(f, old));
+	CHECK(syslog_filter_add_substring(f, "timeout"));
+	CHECK(matches(f, mail) && !matches(f, old));
+	syslog_filter_destroy(f);
+
+	// a regex is matched against the message alone, and not beyond the
+	// record's length
+	f = syslog_filter_create();
+	CHECK(syslog_filter_add_regex(f, "^fetch (failed|done)", err, sizeof(err)));
+	CHECK(matches(f, mail) && !matches(f, kernel));
+	CHECK(!syslog_filter_add_regex(f, "(unclosed", err, sizeof(err)) && err[0]);
+	CHECK(matches(f, mail));
+
+	const char *buf = "Oct 17 12:34:56 iPhone kernel[0] <Notice>: link upXYZ";
+	size_t len = strlen(buf) - 3;
+	syslog_filter *g = syslog_filter_create();
+	syslog_record r;
+	CHECK(syslog_filter_add_regex(g, "upX", err, sizeof(err)));
+	syslog_parse(buf, len, &r);
+	CHECK(!syslog_filter_match(g, buf, len, &r));
+	CHECK(syslog_filter_match(g, buf, len + 1, &r));
+	syslog_filter_destroy(g);
+	syslog_filter_destroy(f);
+}
+
+int main(void)
+{
+	// record times are local; make local the same everywhere
+	setenv("TZ", "UTC", 1);
+	tzset();
+
+	RUN(test_parse);
+	RUN(test_timestamp);
+	RUN(test_unusual);
+	RUN(test_truncated);
+	RUN(test_levels);
+	RUN(test_year);
+	RUN(test_filter);
+	return TEST_STATUS();
+}
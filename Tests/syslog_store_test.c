@@ -0,0 +1,358 @@
+//
+//  syslog_store_test.c
+//  mobileDeviceManager
+//
+//  syslog_store.c over eleven hours of synthetic records: a query finds just
+//  what it asks for, in order, while decompressing only the blocks which could
+//  hold it; with the index gone or a block damaged it still finds the rest;
+//  and records reach the disk when a quiet device leaves them waiting.
+//
+
+#include "test.h"
+#include "syslog_store.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define RECORDS		80000
+#define BASE_TIME	1760700000
+#define RARE_EVERY	1000
+
+// eleven hours of a fairly quiet device, unless a test says otherwise
+static unsigned per_second = 2;
+
+static const char *const processes[] = {
+	"kernel", "SpringBoard", "MobileMail", "locationd", "backboardd", "wifid", "mDNSResponder", "Some App"
+};
+#define PROCESSES	(sizeof(processes) / sizeof(processes[0]))
+
+static time_t record_time(unsigned i)
+{
+	return BASE_TIME + i / per_second;
+}
+
+static const char *record_process(unsigned i)
+{
+	return i % RARE_EVERY == RARE_EVERY / 2 ? "backupd" : processes[i % PROCESSES];
+}
+
+static size_t make_record(unsigned i, char *buf, size_t size)
+{
+	time_t when = record_time(i);
+	struct tm tm;
+	char stamp[32];
+	gmtime_r(&when, &tm);
+	strftime(stamp, sizeof(stamp), "%b %e %H:%M:%S", &tm);
+	return (size_t)snprintf(buf, size, "%s iPhone %s[%u] <Notice>: event %u of the capture, status %s",
+							stamp, record_process(i), (unsigned)(40 + i % PROCESSES), i, i % 7 ? "ok" : "retrying");
+}
+
+static char *make_store_dir(void)
+{
+	static char dir[64];
+	strcpy(dir, "/tmp/syslog_store_test.XXXXXX");
+	return mkdtemp(dir);
+}
+
+static void remove_store(const char *dir)
+{
+	DIR *d = opendir(dir);
+	struct dirent *e;
+	char path[512];
+	while (d && (e = readdir(d))) {
+		if (e->d_name[0] == '.') continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+		unlink(path);
+	}
+	if (d) closedir(d);
+	rmdir(dir);
+}
+
+static uint64_t store_size(const char *dir, const char *ext)
+{
+	DIR *d = opendir(dir);
+	struct dirent *e;
+	char path[512];
+	struct stat st;
+	uint64_t total = 0;
+	while (d && (e = readdir(d))) {
+		const char *dot = strrchr(e->d_name, '.');
+		if (!dot || (ext && strcmp(dot + 1, ext))) continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+		if (stat(path, &st) == 0) total += (uint64_t)st.st_size;
+	}
+	if (d) closedir(d);
+	return total;
+}
+
+// Writes the capture, returning how many bytes of records went in
+static uint64_t write_capture(const char *dir, uint64_t segment_size)
+{
+	syslog_store *s = syslog_store_open(dir, segment_size);
+	char rec[256];
+	uint64_t bytes = 0;
+	unsigned i;
+	int ok = s != NULL;
+
+	for (i = 0; ok && i < RECORDS; i++) {
+		size_t len = make_record(i, rec, sizeof(rec));
+		syslog_record parsed;
+		syslog_parse(rec, len, &parsed);
+		ok = syslog_store_append(s, record_time(i), rec, len, &parsed);
+		bytes += len;
+	}
+	CHECK(ok);
+	CHECK(syslog_store_close(s));
+	return bytes;
+}
+
+#pragma mark checking what a query finds
+
+typedef struct {
+	unsigned	found;
+	unsigned	out_of_order;
+	unsigned	wrong;			// doesn't meet the query
+	time_t		last;
+	time_t		from, to;
+	const char	*process;
+	const char	*containing;
+	unsigned	stop_after;
+} found;
+
+static int check_record(void *ctx, time_t when, const char *rec, size_t len)
+{
+	found *f = ctx;
+	syslog_record parsed;
+	syslog_parse(rec, len, &parsed);
+	if (when < f->last) f->out_of_order++;
+	f->last = when;
+	if ((f->from && when < f->from) || (f->to && when > f->to)) f->wrong++;
+	if (f->process && (parsed.process_len != strlen(f->process) || memcmp(rec + parsed.process, f->process, parsed.process_len)))
+		f->wrong++;
+	if (f->containing) {
+		char *text = malloc(len + 1);
+		memcpy(text, rec, len);
+		text[len] = 0;
+		if (!strstr(text + parsed.message, f->containing)) f->wrong++;
+		free(text);
+	}
+	return ++f->found == f->stop_after;
+}
+
+// How many records the capture has that meet the query
+static unsigned expected(time_t from, time_t to, const char *process, const char *containing)
+{
+	char rec[256];
+	unsigned i, n = 0;
+	for (i = 0; i < RECORDS; i++) {
+		time_t when = record_time(i);
+		if ((from && when < from) || (to && when > to)) continue;
+		if (process && strcmp(record_process(i), process)) continue;
+		make_record(i, rec, sizeof(rec));
+		if (containing && !strstr(strstr(rec, ">: ") + 3, containing)) continue;
+		n++;
+	}
+	return n;
+}
+
+static int query(const char *dir, found *f, const syslog_filter *filter, syslog_store_stats *stats)
+{
+	f->found = f->out_of_order = f->wrong = 0;
+	f->last = 0;
+	memset(stats, 0, sizeof(*stats));
+	return syslog_store_query(dir, f->from, f->to, f->process, filter, check_record, f, stats);
+}
+
+#pragma mark tests
+
+static void test_capture(void)
+{
+	char *dir = make_store_dir();
+	syslog_store_stats stats;
+	found f;
+	CHECK(dir != NULL);
+	if (!dir) return;
+
+	write_capture(dir, 0);
+
+	// everything, in order
+	memset(&f, 0, sizeof(f));
+	CHECK(query(dir, &f, NULL, &stats));
+	CHECK(f.found == RECORDS && f.out_of_order == 0);
+	// a block every SYSLOG_STORE_FLUSH seconds of records
+	CHECK(stats.blocks == RECORDS / per_second / SYSLOG_STORE_FLUSH);
+	CHECK(stats.blocks_read == stats.blocks);
+
+	// ten minutes out of eleven hours reads only the blocks in it
+	f.from = BASE_TIME + 5 * 3600;
+	f.to = f.from + 600;
+	CHECK(query(dir, &f, NULL, &stats));
+	CHECK(f.found == expected(f.from, f.to, NULL, NULL) && f.wrong == 0 && f.out_of_order == 0);
+	printf("    10 minutes read %llu of %llu blocks\n", (unsigned long long)stats.blocks_read,
+		   (unsigned long long)stats.blocks);
+	CHECK(stats.blocks_read <= 600 / SYSLOG_STORE_FLUSH + 2);
+
+	// a process which rarely logs is skipped over by the bloom filters
+	memset(&f, 0, sizeof(f));
+	f.process = "backupd";
+	CHECK(query(dir, &f, NULL, &stats));
+	CHECK(f.found == expected(0, 0, "backupd", NULL) && f.wrong == 0);
+	CHECK(stats.blocks_read < stats.blocks / 4);
+
+	// and a filter, with the rest
+	syslog_filter *filter = syslog_filter_create();
+	syslog_filter_add_substring(filter, "retrying");
+	memset(&f, 0, sizeof(f));
+	f.from = BASE_TIME + 3600;
+	f.to = BASE_TIME + 7200;
+	f.process = "MobileMail";
+	f.containing = "retrying";
+	CHECK(query(dir, &f, filter, &stats));
+	CHECK(f.found == expected(f.from, f.to, "MobileMail", "retrying") && f.found > 0 && f.wrong == 0);
+	syslog_filter_destroy(filter);
+
+	// the function can stop the query
+	memset(&f, 0, sizeof(f));
+	f.stop_after = 10;
+	CHECK(query(dir, &f, NULL, &stats));
+	CHECK(f.found == 10);
+
+	remove_store(dir);
+}
+
+static unsigned count_records(const char *dir)
+{
+	found f;
+	syslog_store_stats stats;
+	memset(&f, 0, sizeof(f));
+	query(dir, &f, NULL, &stats);
+	return f.found;
+}
+
+// A busy device fills blocks, which is where the compression pays
+static void test_compression(void)
+{
+	char *dir = make_store_dir();
+	CHECK(dir != NULL);
+	if (!dir) return;
+
+	per_second = 400;
+	uint64_t bytes = write_capture(dir, 0);
+	uint64_t stored = store_size(dir, NULL);
+	printf("    %llu bytes of records stored in %llu\n", (unsigned long long)bytes, (unsigned long long)stored);
+	CHECK(stored * 5 < bytes);
+	CHECK(count_records(dir) == RECORDS);
+	per_second = 2;
+
+	remove_store(dir);
+}
+
+// Segments roll over at their size, a reopened store adds to the end, and a
+// query without the indexes (or with a block damaged) finds the same
+static void test_segments(void)
+{
+	char *dir = make_store_dir(), path[512];
+	syslog_store_stats stats, indexed;
+	found f;
+	CHECK(dir != NULL);
+	if (!dir) return;
+
+	write_capture(dir, 256 * 1024);
+	write_capture(dir, 256 * 1024);
+	memset(&f, 0, sizeof(f));
+	CHECK(query(dir, &f, NULL, &indexed));
+	CHECK(f.found == 2 * RECORDS && f.wrong == 0);
+	CHECK(store_size(dir, "idx") > 0);
+
+	f.from = BASE_TIME + 600;
+	f.to = BASE_TIME + 1200;
+	CHECK(query(dir, &f, NULL, &indexed));
+	unsigned window = f.found;
+	CHECK(window == 2 * expected(f.from, f.to, NULL, NULL));
+
+	// without the indexes the headers in the segments are walked instead
+	DIR *d = opendir(dir);
+	struct dirent *e;
+	unsigned segments = 0;
+	while (d && (e = readdir(d))) {
+		const char *dot = strrchr(e->d_name, '.');
+		if (!dot) continue;
+		if (!strcmp(dot, ".slog")) segments++;
+		if (strcmp(dot, ".idx")) continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+		unlink(path);
+	}
+	if (d) closedir(d);
+	CHECK(segments > 2);
+	CHECK(query(dir, &f, NULL, &stats));
+	CHECK(f.found == window && stats.blocks_read == indexed.blocks_read);
+
+	// damage the compressed data of the first block of the first segment, and
+	// cut the last segment off part way through a block
+	snprintf(path, sizeof(path), "%s/seg-000001.slog", dir);
+	int fd = open(path, O_RDWR);
+	CHECK(fd >= 0);
+	CHECK(pwrite(fd, "garbage", 7, 64 + 20) == 7);
+	close(fd);
+	snprintf(path, sizeof(path), "%s/seg-%06u.slog", dir, segments);
+	struct stat st;
+	CHECK(stat(path, &st) == 0 && truncate(path, st.st_size - 100) == 0);
+
+	memset(&f, 0, sizeof(f));
+	CHECK(query(dir, &f, NULL, &stats));
+	CHECK(f.found < 2 * RECORDS && f.found > 2 * RECORDS - 40 && f.wrong == 0);
+
+	remove_store(dir);
+}
+
+// What a quiet device logged is written out once it has waited long enough,
+// by our clock rather than the records' timestamps
+static void test_idle(void)
+{
+	char *dir = make_store_dir(), rec[256];
+	syslog_record parsed;
+	CHECK(dir != NULL);
+	if (!dir) return;
+
+	syslog_store *s = syslog_store_open(dir, 0);
+	size_t len = make_record(0, rec, sizeof(rec));
+	syslog_parse(rec, len, &parsed);
+	CHECK(syslog_store_append(s, record_time(0), rec, len, &parsed));
+	time_t now = time(NULL);
+
+	CHECK(syslog_store_idle(s, now));
+	CHECK(count_records(dir) == 0);
+	CHECK(syslog_store_idle(s, now + SYSLOG_STORE_FLUSH + 1));
+	CHECK(count_records(dir) == 1);
+	// nothing more to write
+	CHECK(syslog_store_idle(s, now + 2 * SYSLOG_STORE_FLUSH + 2));
+	CHECK(count_records(dir) == 1);
+
+	CHECK(syslog_store_close(s));
+	CHECK(count_records(dir) == 1);
+	remove_store(dir);
+}
+
+static void test_not_a_store(void)
+{
+	found f;
+	syslog_store_stats stats;
+	memset(&f, 0, sizeof(f));
+	errno = 0;
+	CHECK(!query("/nonexistent/syslog store", &f, NULL, &stats) && errno == ENOENT);
+	CHECK(!query("/etc/passwd", &f, NULL, &stats) && errno == ENOTDIR);
+}
+
+int main(void)
+{
+	RUN(test_capture);
+	RUN(test_compression);
+	RUN(test_segments);
+	RUN(test_idle);
+	RUN(test_not_a_store);
+	return TEST_STATUS();
+}
@@ -0,0 +1,37 @@
+//
+//  test.h
+//  mobileDeviceManager
+//
+//  What the test programs in this directory share.  Each is a plain C program
+//  built by `make test`, linked with only the sources it exercises, and exits
+//  non-zero if anything failed.  CHECK() reports a failure and carries on, so
+//  one run shows everything that is wrong.
+//
+
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int test_failures = 0;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+		test_failures++; \
+	} \
+} while (0)
+
+/// Run one test function, saying which, and whether it passed.
+#define RUN(test) do { \
+	int before = test_failures; \
+	test(); \
+	printf("%-40s %s\n", #test, test_failures == before ? "ok" : "FAILED"); \
+} while (0)
+
+/// What main returns.
+#define TEST_STATUS()	(test_failures ? 1 : 0)
+
+#endif